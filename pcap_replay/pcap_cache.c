@@ -0,0 +1,77 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* The captures are shared by all the instances which see these globals : each file
+ * is parsed and kept in memory only once. Shadow gives each plugin host its own copy
+ * of the globals, so the cache is per host there; the replay files (pcap_format.c)
+ * are what shares a parsed capture across the hosts. A capture is read only once loaded,
+ * so the instances only need their own cursors (Pcap_Flow) to replay it.
+ * The captures depend on the filter, which is part of the key with the path. */
+
+G_LOCK_DEFINE_STATIC(pcap_cache);
+static GHashTable* _pcap_cache = NULL; /* cache key -> Pcap_Capture* */
+
+static gchar* _pcap_cache_key(const gchar* path, Pcap_Flow_Filter* filter) {
+	/* The ports are not used to select the packets of a single flow */
+	return g_strdup_printf("%s|%s|%08x:%u|%08x:%u", path, filter->allFlows ? "all" : "single",
+			(guint) filter->key.clientIP.s_addr, filter->allFlows ? filter->key.clientPort : 0,
+			(guint) filter->key.serverIP.s_addr, filter->allFlows ? filter->key.serverPort : 0);
+}
+
+/* Returns the capture of the pcap file, loaded by this call or by a previous
+ * instance. Every capture acquired must be released with pcap_capture_release(). */
+Pcap_Capture* pcap_capture_acquire(const gchar* path, Pcap_Flow_Filter* filter, PcapReplayLogFunc slogf) {
+	gchar* key = _pcap_cache_key(path, filter);
+
+	/* The lock is kept while loading, so that a file is never parsed twice */
+	guint refcount = 0; /* read under the lock, for the log */
+	G_LOCK(pcap_cache);
+	if(_pcap_cache == NULL) {
+		_pcap_cache = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	Pcap_Capture* capture = g_hash_table_lookup(_pcap_cache, key);
+	if(capture) {
+		capture->refcount++;
+		g_free(key);
+	} else {
+		capture = pcap_capture_load(path, filter, slogf);
+		if(capture) {
+			capture->cacheKey = key;
+			capture->refcount = 1;
+			g_hash_table_insert(_pcap_cache, capture->cacheKey, capture);
+		} else {
+			g_free(key);
+		}
+	}
+	if(capture) {
+		refcount = capture->refcount;
+	}
+	G_UNLOCK(pcap_cache);
+
+	if(refcount > 1) {
+		slogf(G_LOG_LEVEL_INFO, __FUNCTION__,
+				"Pcap file %s already loaded, shared by %u instances", path, refcount);
+	}
+	return capture;
+}
+
+/* The capture is freed when the last instance using it releases it */
+void pcap_capture_release(Pcap_Capture* capture) {
+	if(!capture) {
+		return;
+	}
+
+	G_LOCK(pcap_cache);
+	gboolean isUnused = (--capture->refcount == 0);
+	if(isUnused && capture->cacheKey) {
+		g_hash_table_remove(_pcap_cache, capture->cacheKey);
+	}
+	G_UNLOCK(pcap_cache);
+
+	if(isUnused) {
+		pcap_capture_free(capture);
+	}
+}
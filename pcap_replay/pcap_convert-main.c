@@ -0,0 +1,48 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* pcap_replay-convert indexes a pcap file once, offline, and writes it in the
+ * replay format : pcap_replay then maps it instead of parsing the capture. */
+
+static void _pcapconvert_log(GLogLevelFlags level, const gchar* functionName, const gchar* format, ...) {
+    if(level > G_LOG_LEVEL_INFO) {
+        return;
+    }
+    va_list vargs;
+    va_start(vargs, format);
+    GString* message = g_string_new(NULL);
+    g_string_append_printf(message, "[%s] ", functionName);
+    g_string_append_vprintf(message, format, vargs);
+    va_end(vargs);
+
+    if(level <= G_LOG_LEVEL_WARNING) {
+        g_printerr("%s\n", message->str);
+    } else {
+        g_print("%s\n", message->str);
+    }
+    g_string_free(message, TRUE);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        g_printerr("USAGE: %s capture.pcap output.replay\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Every TCP & UDP flow of the capture is kept : the filter is applied when the file is loaded */
+    Pcap_Flow_Filter filter;
+    memset(&filter, 0, sizeof(Pcap_Flow_Filter));
+    filter.allFlows = TRUE;
+
+    Pcap_Capture* capture = pcap_capture_load(argv[1], &filter, _pcapconvert_log);
+    if(capture == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    gboolean isWritten = pcap_format_write(capture, argv[2], _pcapconvert_log);
+    pcap_capture_free(capture);
+    return isWritten ? EXIT_SUCCESS : EXIT_FAILURE;
+}
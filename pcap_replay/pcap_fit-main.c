@@ -0,0 +1,228 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* pcap_replay-fit reads the pcap (or replay) files once, offline, and writes the
+ * distributions of their TCP flows, which pcap_replay --synthetic draws its flows from
+ * (see pcap_synth.c). Each distribution is a CDF file in the format of the filetransfer
+ * plugin : "value cumulative_fraction" lines, sorted by value.
+ * A flow is cut into exchanges : each client turn (consecutive client packets) is a
+ * request, the following server turn is its response. */
+
+/* Largest number of lines of a CDF file : the quantiles of the samples */
+#define PCAP_FIT_POINTS 1000
+
+typedef struct _Pcap_Fit {
+    GArray* requestSizes; /* gdouble, bytes */
+    GArray* responseSizes; /* bytes */
+    GArray* responseTimes; /* msec */
+    GArray* exchanges;
+    GArray* durations; /* msec */
+    GArray* interarrivals; /* msec */
+} Pcap_Fit;
+
+static void _pcapfit_log(GLogLevelFlags level, const gchar* functionName, const gchar* format, ...) {
+    if(level > G_LOG_LEVEL_INFO) {
+        return;
+    }
+    va_list vargs;
+    va_start(vargs, format);
+    GString* message = g_string_new(NULL);
+    g_string_append_printf(message, "[%s] ", functionName);
+    g_string_append_vprintf(message, format, vargs);
+    va_end(vargs);
+
+    if(level <= G_LOG_LEVEL_WARNING) {
+        g_printerr("%s\n", message->str);
+    } else {
+        g_print("%s\n", message->str);
+    }
+    g_string_free(message, TRUE);
+}
+
+static void _pcapfit_add(GArray* samples, gdouble value) {
+    g_array_append_val(samples, value);
+}
+
+static gint64 _pcapfit_usec(struct timeval* tv) {
+    return (gint64)tv->tv_sec * G_USEC_PER_SEC + tv->tv_usec;
+}
+
+static gint _pcapfit_compare(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble*)a, y = *(const gdouble*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Cuts a TCP flow into exchanges */
+static void _pcapfit_flow(Pcap_Fit* fit, Pcap_Flow_Index* index) {
+    Pcap_Timeline* timelines = index->timeline;
+    guint cursor[PCAP_DIR_COUNT] = {0, 0};
+    gint64 time[PCAP_DIR_COUNT] = {_pcapfit_usec(&timelines[0].start), _pcapfit_usec(&timelines[1].start)};
+
+    guint exchanges = 0;
+    gboolean isExchange = FALSE, hasResponse = FALSE;
+    guint64 requestSize = 0, responseSize = 0;
+    gint64 requestEnd = 0, firstRequest = 0, lastRequest = 0;
+
+    while(TRUE) {
+        /* next packet of the flow, in any direction (the client first on ties) */
+        gboolean hasClient = cursor[PCAP_DIR_CLIENT] < timelines[PCAP_DIR_CLIENT].length;
+        gboolean hasServer = cursor[PCAP_DIR_SERVER] < timelines[PCAP_DIR_SERVER].length;
+        Pcap_Direction dir;
+        if(hasClient && hasServer) {
+            gint64 client = time[PCAP_DIR_CLIENT] + timelines[PCAP_DIR_CLIENT].delta[cursor[PCAP_DIR_CLIENT]];
+            gint64 server = time[PCAP_DIR_SERVER] + timelines[PCAP_DIR_SERVER].delta[cursor[PCAP_DIR_SERVER]];
+            dir = client <= server ? PCAP_DIR_CLIENT : PCAP_DIR_SERVER;
+        } else if(hasClient || hasServer) {
+            dir = hasClient ? PCAP_DIR_CLIENT : PCAP_DIR_SERVER;
+        } else {
+            break;
+        }
+        time[dir] += timelines[dir].delta[cursor[dir]];
+        guint32 size = timelines[dir].size[cursor[dir]];
+        cursor[dir]++;
+
+        /* a client packet after a response, or a server packet first (banner), starts an exchange */
+        if(!isExchange || (dir == PCAP_DIR_CLIENT && hasResponse)) {
+            if(isExchange) {
+                _pcapfit_add(fit->requestSizes, (gdouble) requestSize);
+                _pcapfit_add(fit->responseSizes, (gdouble) responseSize);
+            }
+            if(exchanges == 0) {
+                firstRequest = time[dir];
+            }
+            exchanges++;
+            isExchange = TRUE;
+            hasResponse = FALSE;
+            requestSize = responseSize = 0;
+            lastRequest = requestEnd = time[dir];
+        }
+
+        if(dir == PCAP_DIR_CLIENT) {
+            requestSize += size;
+            requestEnd = time[dir];
+        } else {
+            if(!hasResponse) {
+                _pcapfit_add(fit->responseTimes, (gdouble) (time[dir] - requestEnd) / 1000);
+                hasResponse = TRUE;
+            }
+            responseSize += size;
+        }
+    }
+    if(isExchange) {
+        _pcapfit_add(fit->requestSizes, (gdouble) requestSize);
+        _pcapfit_add(fit->responseSizes, (gdouble) responseSize);
+    }
+
+    if(exchanges > 0) {
+        _pcapfit_add(fit->exchanges, (gdouble) exchanges);
+    }
+    /* the duration spreads the exchanges : it is only known for the flows with several of them */
+    if(exchanges > 1) {
+        _pcapfit_add(fit->durations, (gdouble) (lastRequest - firstRequest) / 1000);
+    }
+}
+
+static void _pcapfit_capture(Pcap_Fit* fit, Pcap_Capture* capture) {
+    gint64 previous = -1;
+    for(guint i = 0; i < capture->flows->len; i++) {
+        Pcap_Flow_Index* index = g_ptr_array_index(capture->flows, i);
+        if(index->protocol != IPPROTO_TCP) {
+            /* the synthetic flows are TCP flows */
+            continue;
+        }
+        /* the flows are in the order they started */
+        gint64 first = _pcapfit_usec(&index->first);
+        if(previous >= 0) {
+            _pcapfit_add(fit->interarrivals, (gdouble) (first - previous) / 1000);
+        }
+        previous = first;
+        _pcapfit_flow(fit, index);
+    }
+}
+
+/* Writes the quantiles of the samples, a line per distinct value (the last fraction is 1) */
+static gboolean _pcapfit_write(const gchar* dir, const gchar* name, GArray* samples) {
+    gchar* path = g_build_filename(dir, name, NULL);
+    FILE* file = fopen(path, "w");
+    if(file == NULL) {
+        _pcapfit_log(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Cannot write %s : %s", path, g_strerror(errno));
+        g_free(path);
+        return FALSE;
+    }
+
+    if(samples->len == 0) {
+        _pcapfit_log(G_LOG_LEVEL_WARNING, __FUNCTION__, "No sample for %s, using 0", path);
+        _pcapfit_add(samples, 0);
+    }
+    g_array_sort(samples, _pcapfit_compare);
+
+    guint points = MIN(samples->len, PCAP_FIT_POINTS);
+    gdouble value = 0, fraction = -1;
+    for(guint k = 1; k <= points; k++) {
+        guint i = (guint) (((guint64)k * samples->len + points - 1) / points) - 1;
+        gdouble next = g_array_index(samples, gdouble, i);
+        if(fraction >= 0 && next != value) {
+            fprintf(file, "%.3f %.10f\n", value, fraction);
+        }
+        value = next;
+        fraction = (gdouble) k / points;
+    }
+    fprintf(file, "%.3f %.10f\n", value, fraction);
+
+    gboolean isWritten = !ferror(file);
+    if(fclose(file) != 0 || !isWritten) {
+        _pcapfit_log(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Cannot write %s", path);
+        isWritten = FALSE;
+    } else {
+        _pcapfit_log(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "%s : %u samples", path, samples->len);
+    }
+    g_free(path);
+    return isWritten;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 3) {
+        g_printerr("USAGE: %s output-directory capture.pcap [capture2.pcap ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(g_mkdir_with_parents(argv[1], 0755) != 0) {
+        g_printerr("Cannot create the directory %s : %s\n", argv[1], g_strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    Pcap_Fit fit;
+    GArray** samples[] = {&fit.requestSizes, &fit.responseSizes, &fit.responseTimes,
+            &fit.exchanges, &fit.durations, &fit.interarrivals};
+    const gchar* names[] = {PCAP_SYNTH_REQUEST_SIZES, PCAP_SYNTH_RESPONSE_SIZES, PCAP_SYNTH_RESPONSE_TIMES,
+            PCAP_SYNTH_EXCHANGES, PCAP_SYNTH_DURATIONS, PCAP_SYNTH_INTERARRIVALS};
+    for(guint i = 0; i < G_N_ELEMENTS(samples); i++) {
+        *samples[i] = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    }
+
+    /* Every flow of the captures */
+    Pcap_Flow_Filter filter;
+    memset(&filter, 0, sizeof(Pcap_Flow_Filter));
+    filter.allFlows = TRUE;
+
+    gboolean isFitted = TRUE;
+    for(gint i = 2; i < argc; i++) {
+        Pcap_Capture* capture = pcap_capture_load(argv[i], &filter, _pcapfit_log);
+        if(capture == NULL) {
+            isFitted = FALSE;
+            break;
+        }
+        _pcapfit_capture(&fit, capture);
+        pcap_capture_free(capture);
+    }
+
+    for(guint i = 0; i < G_N_ELEMENTS(samples); i++) {
+        if(isFitted) {
+            isFitted = _pcapfit_write(argv[1], names[i], *samples[i]);
+        }
+        g_array_free(*samples[i], TRUE);
+    }
+    return isFitted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,656 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* A flow replays one connection of a capture on its own socket.
+ * The flows of an instance share the pacing timer : they are kept in
+ * Pcap_Replay.schedule, ordered by the time at which they need to be activated. */
+
+Pcap_Flow* pcap_flow_new(Pcap_Replay* pcapReplay, Pcap_Capture* capture, Pcap_Flow_Index* index, gint sd) {
+	Pcap_Flow* flow = g_new0(Pcap_Flow, 1);
+	flow->dir = pcapReplay->isClient ? PCAP_DIR_CLIENT : PCAP_DIR_SERVER;
+	flow->state = pcapReplay->isClient ? PCAP_FLOW_IDLE : PCAP_FLOW_HANDSHAKE;
+	flow->sd = -1;
+	pcap_flow_set_index(flow, capture, index);
+	if(sd > 0) {
+		pcap_flow_set_socket(pcapReplay, flow, sd, EPOLLIN);
+	}
+	return flow;
+}
+
+void pcap_flow_free(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	if(flow->index) {
+		gchar* name = g_strdup_printf("flow %u of %s", flow->index->id, flow->capture->path->str);
+		pcap_stats_log(&flow->stats, pcapReplay->slogf, G_LOG_LEVEL_INFO, name);
+		g_free(name);
+		if(flow->isIndexOwned) {
+			pcap_flow_index_free(flow->index);
+		}
+	}
+	if(flow->scheduled) {
+		g_sequence_remove(flow->scheduled);
+		flow->scheduled = NULL;
+	}
+	if(flow->sd > 0) {
+		g_hash_table_remove(pcapReplay->flows, GINT_TO_POINTER(flow->sd));
+		epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, flow->sd, NULL);
+		close(flow->sd);
+	} else if(pcapReplay->udpPeers && g_hash_table_lookup(pcapReplay->udpPeers, &flow->peer) == flow) {
+		/* UDP flow of the server : the socket is shared */
+		g_hash_table_remove(pcapReplay->udpPeers, &flow->peer);
+	}
+	g_free(flow);
+}
+
+/* Registers the socket of the flow on our epoll descriptor */
+void pcap_flow_set_socket(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint sd, guint32 events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = events;
+	ev.data.fd = sd;
+	if(epoll_ctl(pcapReplay->ed, EPOLL_CTL_ADD, sd, &ev) == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "error in flow epoll_ctl");
+	}
+	flow->sd = sd;
+	flow->events = events;
+	flow->isWaitingOut = (events & EPOLLOUT) ? TRUE : FALSE;
+	g_hash_table_insert(pcapReplay->flows, GINT_TO_POINTER(sd), flow);
+}
+
+/* Watch (or stop watching) EPOLLOUT on the socket of the flow.
+ * Once the peer closed the connection, the socket stays readable : stop watching EPOLLIN. */
+void pcap_flow_watch(Pcap_Replay* pcapReplay, Pcap_Flow* flow, guint32 events) {
+	if(flow->sd <= 0) {
+		/* no socket of its own (UDP flow of the server) */
+		return;
+	}
+	if(flow->isPeerClosed) {
+		events &= ~EPOLLIN;
+	}
+	if(flow->events == events) {
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = events;
+	ev.data.fd = flow->sd;
+	epoll_ctl(pcapReplay->ed, EPOLL_CTL_MOD, flow->sd, &ev);
+	flow->events = events;
+	flow->isWaitingOut = (events & EPOLLOUT) ? TRUE : FALSE;
+}
+
+/* Attach the flow to the packets it replays and rewind it */
+void pcap_flow_set_index(Pcap_Flow* flow, Pcap_Capture* capture, Pcap_Flow_Index* index) {
+	flow->capture = capture;
+	flow->index = index;
+	flow->isDatagram = index && index->protocol == IPPROTO_UDP;
+	flow->cursor = 0;
+	flow->ringHead = 0;
+	flow->ringLength = 0;
+	flow->nextPacket = NULL;
+	flow->sendOffset = 0;
+	flow->peerCursor = 0;
+	flow->peerBytes = 0;
+	flow->received = 0;
+	flow->gateBytes = 0;
+	flow->gateTime = 0;
+}
+
+static gint _pcap_flow_compare(gconstpointer a, gconstpointer b, gpointer data) {
+	const Pcap_Flow* fa = a;
+	const Pcap_Flow* fb = b;
+	if(fa->dueTime != fb->dueTime) {
+		return fa->dueTime < fb->dueTime ? -1 : 1;
+	}
+	return fa < fb ? -1 : (fa > fb ? 1 : 0);
+}
+
+/* _pcap_timer_arm() sets the pacing timer to expire when the first flow of the schedule is due.
+ * The timer is registered on our epoll descriptor, so the plugin is activated
+ * when it is time to send, without ever sleeping.
+ * It also expires at the timeout, so that we exit even if nothing happens. */
+static void _pcap_timer_arm(Pcap_Replay* pcapReplay) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(struct itimerspec));
+
+	gint64 when = pcapReplay->timeoutTime;
+	GSequenceIter* first = g_sequence_get_begin_iter(pcapReplay->schedule);
+	if(!g_sequence_iter_is_end(first)) {
+		Pcap_Flow* flow = g_sequence_get(first);
+		when = MIN(when, flow->dueTime);
+	}
+	/* a zero it_value would disarm the timer */
+	when = MAX(when, 1);
+	its.it_value.tv_sec = when / 1000000;
+	its.it_value.tv_nsec = (when % 1000000) * 1000;
+
+	if(timerfd_settime(pcapReplay->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "error in timerfd_settime");
+	}
+}
+
+/* pcap_flow_schedule() activates the flow at the given monotonic time (in usec) */
+void pcap_flow_schedule(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint64 when) {
+	if(flow->scheduled) {
+		g_sequence_remove(flow->scheduled);
+	}
+	flow->dueTime = when;
+	flow->scheduled = g_sequence_insert_sorted(pcapReplay->schedule, flow, _pcap_flow_compare, NULL);
+
+	/* only re-arm the timer if this flow is now the first one */
+	if(g_sequence_iter_is_begin(flow->scheduled)) {
+		_pcap_timer_arm(pcapReplay);
+	}
+}
+
+static void _pcap_flow_unschedule(Pcap_Flow* flow) {
+	if(flow->scheduled) {
+		g_sequence_remove(flow->scheduled);
+		flow->scheduled = NULL;
+	}
+}
+
+/* Converts an offset (usec) in the pcap file to the replay time scale :
+ * the offset is divided by the speed multiplier, and is 0 in max-rate mode */
+gint64 pcap_replay_scale_time(Pcap_Replay* pcapReplay, gint64 offset) {
+	if(pcapReplay->isMaxRate || offset <= 0) {
+		return 0;
+	}
+	if(pcapReplay->speed == 1.0) {
+		return offset;
+	}
+	return (gint64)((gdouble)offset / pcapReplay->speed);
+}
+
+/* Returned by _pcap_flow_packet_time() while the packet waits for the peer (--causal) */
+#define PCAP_FLOW_BLOCKED G_MAXINT64
+
+/* Time at which a packet of the flow must be sent (monotonic clock, in usec).
+ * Packets keep their offset to the first payload of the flow (in any direction),
+ * so that the client & server sides stay aligned.
+ * With --causal, a packet answering the peer is sent once we received everything
+ * the peer sent before it in the pcap file, after the same think time. */
+static gint64 _pcap_flow_packet_time(Pcap_Replay* pcapReplay, Pcap_Flow* flow, Custom_Packet_t* cp) {
+	if(pcapReplay->isCausal && cp->thinkTime >= 0) {
+		/* if the peer is gone, what is missing will never come : don't wait for it */
+		if(flow->received < cp->awaitBytes && !flow->isPeerClosed) {
+			return PCAP_FLOW_BLOCKED;
+		}
+		if(flow->gateBytes < cp->awaitBytes) {
+			/* first time we see the response is complete */
+			flow->gateBytes = cp->awaitBytes;
+			flow->gateTime = g_get_monotonic_time();
+		}
+		return flow->gateTime + pcap_replay_scale_time(pcapReplay, cp->thinkTime);
+	}
+
+	struct timeval* start = &flow->index->start;
+	struct timeval* ts = &cp->timestamp;
+
+	gint64 offset = ((gint64)ts->tv_sec - (gint64)start->tv_sec) * 1000000
+			+ ((gint64)ts->tv_usec - (gint64)start->tv_usec);
+	return flow->replayStart + pcap_replay_scale_time(pcapReplay, offset);
+}
+
+/* pcap_flow_start() (re)starts the replay of the timeline of the flow.
+ * The replay starts after delay usec. */
+void pcap_flow_start(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint64 delay) {
+	/* what we should send & receive until the end of the flow */
+	Pcap_Timeline* sent = &flow->index->timeline[flow->dir];
+	Pcap_Timeline* received = &flow->index->timeline[flow->dir == PCAP_DIR_CLIENT ? PCAP_DIR_SERVER : PCAP_DIR_CLIENT];
+	pcap_stats_expect(&flow->stats, sent, received);
+	pcap_stats_expect(&pcapReplay->stats, sent, received);
+
+	flow->replayStart = g_get_monotonic_time() + delay;
+	flow->state = PCAP_FLOW_REPLAYING;
+	if(!flow->nextPacket && !get_next_packet(flow)) {
+		/* nothing to send in our direction */
+		flow->state = PCAP_FLOW_FINISHED;
+		if(flow->isDatagram) {
+			pcap_flow_linger(pcapReplay, flow);
+		}
+		return;
+	}
+	gint64 sendTime = _pcap_flow_packet_time(pcapReplay, flow, flow->nextPacket);
+	if(sendTime != PCAP_FLOW_BLOCKED) {
+		pcap_flow_schedule(pcapReplay, flow, sendTime);
+	}
+}
+
+static gboolean _pcap_timeval_before(const struct timeval* a, const struct timeval* b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* Moves the cursor in the timeline of the peer up to the packet cp (loaded at cursorTimestamp) :
+ * cp waits for what the peer sent before it */
+static void _pcap_flow_peer_before(Pcap_Flow* flow, Custom_Packet_t* cp) {
+	Pcap_Timeline* peer = &flow->index->timeline[flow->dir == PCAP_DIR_CLIENT ? PCAP_DIR_SERVER : PCAP_DIR_CLIENT];
+
+	while(flow->peerCursor < peer->length) {
+		struct timeval ts = peer->start;
+		if(flow->peerCursor > 0) {
+			guint64 usec = (guint64)flow->peerTimestamp.tv_usec + peer->delta[flow->peerCursor];
+			ts.tv_sec = flow->peerTimestamp.tv_sec + usec / 1000000;
+			ts.tv_usec = usec % 1000000;
+		}
+		if(!_pcap_timeval_before(&ts, &flow->cursorTimestamp)) {
+			break;
+		}
+		flow->peerTimestamp = ts;
+		flow->peerBytes += peer->size[flow->peerCursor];
+		flow->peerCursor++;
+	}
+
+	cp->awaitBytes = flow->peerBytes;
+	cp->thinkTime = -1;
+	if(flow->peerCursor > 0) {
+		cp->thinkTime = ((gint64)flow->cursorTimestamp.tv_sec - (gint64)flow->peerTimestamp.tv_sec) * 1000000
+				+ ((gint64)flow->cursorTimestamp.tv_usec - (gint64)flow->peerTimestamp.tv_usec);
+	}
+}
+
+/* Loads the packets following the ones in the ring, until the ring is full
+ * or the timeline of our direction is over */
+static void _pcap_flow_fill_ring(Pcap_Flow* flow) {
+	Pcap_Timeline* timeline = &flow->index->timeline[flow->dir];
+
+	while(flow->ringLength < PCAP_PACKET_RING_SIZE && flow->cursor < timeline->length) {
+		guint idx = flow->cursor++;
+
+		/* Rebuild the timestamp of the packet from the deltas */
+		if(idx == 0) {
+			flow->cursorTimestamp = timeline->start;
+		} else {
+			guint64 usec = (guint64)flow->cursorTimestamp.tv_usec + timeline->delta[idx];
+			flow->cursorTimestamp.tv_sec += usec / 1000000;
+			flow->cursorTimestamp.tv_usec = usec % 1000000;
+		}
+
+		Custom_Packet_t* cp = &flow->ring[(flow->ringHead + flow->ringLength) % PCAP_PACKET_RING_SIZE];
+		cp->timestamp = flow->cursorTimestamp;
+		cp->payload_size = timeline->size[idx];
+		cp->payload = (char*) &flow->capture->payloadData[timeline->offset[idx]];
+		_pcap_flow_peer_before(flow, cp);
+		flow->ringLength++;
+	}
+}
+
+gboolean get_next_packet(Pcap_Flow* flow) {
+	/* Get the next packet of the flow in the direction we replay.
+	 * Example :
+	 * If in the pcap file the client have the IP:Port address 192.168.1.2:5555
+	 * and the server have the IP:Port address 192.168.1.3:80.
+	 * Then, if the plugin is instanciated as a client, the client needs to resend
+	 * the packet with ip.source=192.168.1.2 & ip.destination=192.168.1.3 & port.dest=80
+	 * to the remote server.
+	 * On the contrary, if the plugin is instanciated as a server, the server needs to wait
+	 * for a client connection. When the a client is connected, it starts to resend packets
+	 * with ip.source=192.168.1.3 & ip.dest=192.168.1.2 & port.dest=5555
+	 *
+	 * The packets have been indexed by pcap_capture_load(), the next packets
+	 * are thus found by stepping in the timeline of our direction.
+	 * The packet previously returned (if any) is released. */
+	if(flow->nextPacket) {
+		flow->ringHead = (flow->ringHead + 1) % PCAP_PACKET_RING_SIZE;
+		flow->ringLength--;
+		flow->nextPacket = NULL;
+		flow->sendOffset = 0;
+	}
+	_pcap_flow_fill_ring(flow);
+
+	if(flow->ringLength == 0) {
+		return FALSE;
+	}
+	flow->nextPacket = &flow->ring[flow->ringHead];
+	return TRUE;
+}
+
+/* Returns the n-th packet loaded ahead without consuming it (0 is nextPacket),
+ * or NULL if the timeline ends before (n must be lower than PCAP_PACKET_RING_SIZE) */
+Custom_Packet_t* pcap_flow_peek_packet(Pcap_Flow* flow, guint n) {
+	if(n >= flow->ringLength) {
+		return NULL;
+	}
+	return &flow->ring[(flow->ringHead + n) % PCAP_PACKET_RING_SIZE];
+}
+
+ssize_t send_packets(Custom_Packet_t* cps[], guint count, gint sd, gint offset) {
+	// Send the payloads of the custom packets through the socket sd with a single call,
+	// starting at offset in the first one if it has been partially sent
+	struct iovec iov[PCAP_PACKET_RING_SIZE];
+	count = MIN(count, PCAP_PACKET_RING_SIZE);
+	for(guint i = 0; i < count; i++) {
+		gint skip = (i == 0) ? MIN(offset, cps[0]->payload_size) : 0;
+		iov[i].iov_base = cps[i]->payload + skip;
+		iov[i].iov_len = (size_t)(cps[i]->payload_size - skip);
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	return sendmsg(sd, &msg, MSG_NOSIGNAL);
+}
+
+/* Sends what remains of the flow identifier.
+ * Returns 1 once it is sent, 0 if we need to wait for EPOLLOUT, -1 if the connection failed */
+static gint _pcap_flow_send_preamble(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	while(flow->preambleLength < PCAP_FLOW_PREAMBLE_SIZE) {
+		ssize_t numBytes = send(flow->sd, &flow->preamble[flow->preambleLength],
+				PCAP_FLOW_PREAMBLE_SIZE - flow->preambleLength, MSG_NOSIGNAL);
+		if(numBytes < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+					"Unable to send the identifier of flow %u : %s", flow->index->id, g_strerror(errno));
+			return -1;
+		}
+		flow->preambleLength += numBytes;
+	}
+	return 1;
+}
+
+/* Fills batch with nextPacket and the following packets that are due
+ * before the end of the coalescing window, returns the number of packets */
+static guint _pcap_flow_batch(Pcap_Replay* pcapReplay, Pcap_Flow* flow, Custom_Packet_t* batch[], gint64 now) {
+	guint count = 0;
+	batch[count++] = flow->nextPacket;
+	/* In max-rate mode, all the packets are due : send as many as we can at once.
+	 * The datagrams due are always sent together, they keep their boundaries. */
+	if(pcapReplay->coalesceWindow <= 0 && !pcapReplay->isMaxRate && !flow->isDatagram) {
+		return count;
+	}
+	while(count < PCAP_PACKET_RING_SIZE) {
+		Custom_Packet_t* cp = pcap_flow_peek_packet(flow, count);
+		if(cp == NULL || _pcap_flow_packet_time(pcapReplay, flow, cp) > now + pcapReplay->coalesceWindow) {
+			break;
+		}
+		batch[count++] = cp;
+	}
+	return count;
+}
+
+/* Accounts nextPacket, which has been entirely given to the kernel */
+static void _pcap_flow_packet_sent(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint64 now) {
+	Custom_Packet_t* cp = flow->nextPacket;
+	gint64 lateness = now - _pcap_flow_packet_time(pcapReplay, flow, cp);
+	pcap_stats_packet_sent(&flow->stats, cp->payload_size, lateness);
+	pcap_stats_packet_sent(&pcapReplay->stats, cp->payload_size, lateness);
+	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+				"Successfully sent a '%d' (bytes) packet", cp->payload_size);
+}
+
+/* Called when the last packet of the flow has been sent */
+static void _pcap_flow_last_packet_sent(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	pcapReplay->slogf(G_LOG_LEVEL_INFO, __FUNCTION__,
+				"Sent last packet of flow %u", flow->index->id);
+	if(!pcapReplay->filter.allFlows) {
+		/* No more packet to send !
+		 * Then restart with the next pcap file to send */
+		gboolean restarted = pcapReplay->isClient ?
+				restart_client(pcapReplay, flow) : restart_server(pcapReplay, flow);
+		if(restarted) {
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Successfully restarted the replay !");
+		} else {
+			deinstanciate(pcapReplay);
+		}
+		return;
+	}
+	flow->state = PCAP_FLOW_FINISHED;
+	if(flow->isDatagram) {
+		pcap_flow_linger(pcapReplay, flow);
+		return;
+	}
+	/* Tell the peer we are done, it will close the connection when it is done too */
+	shutdown(flow->sd, SHUT_WR);
+}
+
+/* pcap_flow_linger() is called when a UDP flow sent everything, and each time it receives
+ * data afterwards. There is no FIN in UDP : the flow is over once we received everything
+ * the peer sent in the pcap file, or when nothing came for PCAP_UDP_LINGER (lost datagrams).
+ * The flow is freed by the pacing timer, never while its caller still uses it. */
+void pcap_flow_linger(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	Pcap_Timeline* peer = &flow->index->timeline[flow->dir == PCAP_DIR_CLIENT ? PCAP_DIR_SERVER : PCAP_DIR_CLIENT];
+	gint64 when = g_get_monotonic_time();
+	if(flow->received < peer->bytes) {
+		when += PCAP_UDP_LINGER;
+	}
+	pcap_flow_schedule(pcapReplay, flow, when);
+}
+
+/* Sends the datagrams of a UDP flow whose time has come, with a single sendmmsg() per batch.
+ * The server sends them through its shared socket, to the address of the client. */
+static void _pcap_flow_send_due_datagrams(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	gint sd = flow->sd > 0 ? flow->sd : pcapReplay->server.udpSd;
+	struct sockaddr_in* peer = flow->sd > 0 ? NULL : &flow->peer;
+
+	while(flow->state == PCAP_FLOW_REPLAYING && flow->nextPacket) {
+		gint64 now = g_get_monotonic_time();
+		gint64 sendTime = _pcap_flow_packet_time(pcapReplay, flow, flow->nextPacket);
+		if(sendTime == PCAP_FLOW_BLOCKED) {
+			_pcap_flow_unschedule(flow);
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+			return;
+		}
+		if(sendTime > now) {
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+			pcap_flow_schedule(pcapReplay, flow, sendTime);
+			return;
+		}
+
+		Custom_Packet_t* batch[PCAP_PACKET_RING_SIZE];
+		guint count = _pcap_flow_batch(pcapReplay, flow, batch, now);
+		gint sent = pcap_udp_send(batch, count, sd, peer);
+		gboolean isDropped = FALSE;
+		if(sent < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* The kernel buffer is full : the shared socket of the server
+				 * can't wait for EPOLLOUT on behalf of each flow, try again later */
+				if(flow->sd > 0) {
+					pcap_flow_watch(pcapReplay, flow, EPOLLIN|EPOLLOUT);
+				} else {
+					pcap_flow_schedule(pcapReplay, flow, now + PCAP_UDP_RETRY);
+				}
+				return;
+			}
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+						"Unable to send datagram");
+			/* drop the datagram */
+			sent = 1;
+			isDropped = TRUE;
+		} else if(sent > 1) {
+			pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+						"Sent %d datagrams in a single call", sent);
+		}
+
+		for(gint i = 0; i < sent; i++) {
+			if(!isDropped) {
+				_pcap_flow_packet_sent(pcapReplay, flow, now);
+			}
+			if(!get_next_packet(flow)) {
+				pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+				_pcap_flow_last_packet_sent(pcapReplay, flow);
+				return;
+			}
+		}
+		pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+	}
+}
+
+/* pcap_flow_send_due_packets() sends all the packets whose time has come,
+ * then schedules the flow for the next one.
+ * The packets due within the coalescing window are sent with a single sendmsg(). */
+void pcap_flow_send_due_packets(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	if(flow->state == PCAP_FLOW_FAILED) {
+		return;
+	}
+	if(pcapReplay->filter.allFlows && pcapReplay->isClient) {
+		gint res = _pcap_flow_send_preamble(pcapReplay, flow);
+		if(res == 0) {
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN|EPOLLOUT);
+			return;
+		} else if(res < 0) {
+			/* our callers still use the flow : the pacing timer frees it right away */
+			flow->state = PCAP_FLOW_FAILED;
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+			pcap_flow_schedule(pcapReplay, flow, g_get_monotonic_time());
+			return;
+		}
+	}
+	if(flow->state != PCAP_FLOW_REPLAYING) {
+		pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+		return;
+	}
+	if(flow->isDatagram) {
+		_pcap_flow_send_due_datagrams(pcapReplay, flow);
+		return;
+	}
+
+	while(flow->state == PCAP_FLOW_REPLAYING && flow->nextPacket) {
+		gint64 now = g_get_monotonic_time();
+		gint64 sendTime = _pcap_flow_packet_time(pcapReplay, flow, flow->nextPacket);
+		if(sendTime == PCAP_FLOW_BLOCKED) {
+			/* --causal : wait for the peer, the flow is resumed when we receive data */
+			_pcap_flow_unschedule(flow);
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+			return;
+		}
+		if(sendTime > now) {
+			/* Too early : wake up when the packet is due */
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+			pcap_flow_schedule(pcapReplay, flow, sendTime);
+			return;
+		}
+
+		/* send the next pcap packet (or what remains of it) */
+		Custom_Packet_t* batch[PCAP_PACKET_RING_SIZE];
+		guint count = _pcap_flow_batch(pcapReplay, flow, batch, now);
+		ssize_t numBytes = send_packets(batch, count, flow->sd, flow->sendOffset);
+		gboolean isDropped = FALSE;
+		if(numBytes < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* The kernel buffer is full, wait for EPOLLOUT */
+				pcap_flow_watch(pcapReplay, flow, EPOLLIN|EPOLLOUT);
+				return;
+			}
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+						"Unable to send message");
+			/* drop the packet */
+			numBytes = flow->nextPacket->payload_size - flow->sendOffset;
+			isDropped = TRUE;
+		} else if(count > 1) {
+			pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+						"Coalesced %u packets in a single send", count);
+		}
+
+		/* Account the bytes sent to the packets of the batch */
+		gssize remaining = flow->sendOffset + numBytes;
+		while(remaining >= flow->nextPacket->payload_size) {
+			remaining -= flow->nextPacket->payload_size;
+			if(isDropped) {
+				isDropped = FALSE;
+			} else {
+				_pcap_flow_packet_sent(pcapReplay, flow, now);
+			}
+
+			/* Get the next packet of the pcap file */
+			if(!get_next_packet(flow)) {
+				pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+				_pcap_flow_last_packet_sent(pcapReplay, flow);
+				return;
+			}
+			if(remaining == 0) {
+				break;
+			}
+		}
+		if(remaining > 0) {
+			/* The kernel took part of the batch, wait for EPOLLOUT to send the rest */
+			flow->sendOffset = remaining;
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN|EPOLLOUT);
+			return;
+		}
+		pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+	}
+}
+
+/* pcap_flow_drain() reads everything the peer sent us on the socket of the flow.
+ * The received data is dropped, we only replay our side of the connection.
+ * Returns the number of bytes read, or -1 if the peer closed the connection. */
+gssize pcap_flow_drain(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	char receivedPacket[MTU];
+	gssize total = 0;
+
+	while(1) {
+		ssize_t numBytes = recv(flow->sd, receivedPacket, (size_t)MTU, 0);
+		if(numBytes > 0) {
+			total += numBytes;
+		} else if(numBytes == 0) {
+			/* The connection have been closed by the distant peer */
+			flow->isPeerClosed = TRUE;
+			break;
+		} else {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+						"Unable to receive message");
+			}
+			break;
+		}
+	}
+
+	if(total > 0) {
+		flow->received += total;
+		pcap_stats_received(&flow->stats, total);
+		pcap_stats_received(&pcapReplay->stats, total);
+		pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+				"Successfully received %"G_GSSIZE_FORMAT" (bytes) from the remote peer", total);
+	}
+	return flow->isPeerClosed ? -1 : total;
+}
+
+/* _pcap_activateTimer() is called when the pacing timer expired : some flows are due */
+void _pcap_activateTimer(Pcap_Replay* pcapReplay) {
+	/* acknowledge the expiration */
+	guint64 expirations = 0;
+	if(read(pcapReplay->timerfd, &expirations, sizeof(guint64)) < 0 && errno != EAGAIN) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "error while reading the pacing timer");
+	}
+
+	gint64 now = g_get_monotonic_time();
+	while(!pcapReplay->isDone) {
+		GSequenceIter* first = g_sequence_get_begin_iter(pcapReplay->schedule);
+		if(g_sequence_iter_is_end(first)) {
+			break;
+		}
+		Pcap_Flow* flow = g_sequence_get(first);
+		if(flow->dueTime > now) {
+			break;
+		}
+		_pcap_flow_unschedule(flow);
+
+		if(flow->state == PCAP_FLOW_IDLE) {
+			if(pcapReplay->synth) {
+				/* the synthetic flows never end : draw the next one */
+				pcap_synth_schedule_next(pcapReplay, flow->dueTime);
+			}
+			/* time to open the connection of this flow */
+			if(!pcap_flow_connect(pcapReplay, flow)) {
+				pcap_replay_flow_done(pcapReplay, flow);
+			}
+		} else if(flow->state == PCAP_FLOW_REPLAYING && !flow->isWaitingOut) {
+			pcap_flow_send_due_packets(pcapReplay, flow);
+		} else if(flow->state == PCAP_FLOW_FINISHED && flow->isDatagram) {
+			/* UDP flow : nothing more to receive (see pcap_flow_linger()) */
+			pcap_replay_flow_done(pcapReplay, flow);
+		} else if(flow->state == PCAP_FLOW_FAILED) {
+			/* the other flows go on */
+			pcap_replay_flow_done(pcapReplay, flow);
+		}
+	}
+
+	if(!pcapReplay->isDone) {
+		_pcap_timer_arm(pcapReplay);
+	}
+}
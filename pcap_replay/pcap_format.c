@@ -0,0 +1,399 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* A replay file is a capture already indexed by pcap_capture_load(), written by
+ * the pcap_replay-convert tool. It is mapped in memory instead of being parsed :
+ * the timelines & payloads are used in place, and the hosts replaying the same
+ * file share the same pages.
+ *
+ * Layout (host byte order, every section is aligned on 8 bytes) :
+ *  - Pcap_Format_Header
+ *  - Pcap_Format_Flow[flowCount], in the order the flows started
+ *  - for each flow & direction : delta (guint32[]), offset (guint64[]), size (guint32[])
+ *  - payloads */
+
+#define PCAP_FORMAT_MAGIC "PCAPRPL"
+#define PCAP_FORMAT_VERSION 1
+#define PCAP_FORMAT_BYTE_ORDER 0x01020304
+
+typedef struct _Pcap_Format_Header {
+	gchar magic[8];
+	guint32 version;
+	guint32 byteOrder; /* PCAP_FORMAT_BYTE_ORDER in the byte order of the writer */
+	guint32 flowCount;
+	guint32 reserved;
+	gint64 startSec;
+	gint64 startUsec;
+	guint64 payloadOffset;
+	guint64 payloadLength;
+} Pcap_Format_Header;
+
+typedef struct _Pcap_Format_Timeline {
+	guint32 length;
+	guint32 reserved;
+	gint64 startSec;
+	gint64 startUsec;
+	guint64 bytes;
+	/* position of the arrays in the file */
+	guint64 deltaOffset;
+	guint64 offsetOffset;
+	guint64 sizeOffset;
+} Pcap_Format_Timeline;
+
+typedef struct _Pcap_Format_Flow {
+	guint32 clientIP; /* network order */
+	guint32 serverIP; /* network order */
+	guint16 clientPort;
+	guint16 serverPort;
+	guint32 protocol; /* IPPROTO_TCP or IPPROTO_UDP, 0 (TCP) in older files */
+	gint64 firstSec;
+	gint64 firstUsec;
+	gint64 startSec;
+	gint64 startUsec;
+	Pcap_Format_Timeline timeline[PCAP_DIR_COUNT];
+} Pcap_Format_Flow;
+
+/* A packet of a timeline, used to merge timelines */
+typedef struct _Pcap_Format_Packet {
+	struct timeval ts;
+	guint64 offset;
+	guint32 size;
+	guint order;
+} Pcap_Format_Packet;
+
+#define PCAP_FORMAT_ALIGN(x) (((x) + 7) & ~((guint64)7))
+
+gboolean pcap_format_is_replay_file(const gchar* path) {
+	gchar magic[8];
+	FILE* file = fopen(path, "rb");
+	if(file == NULL) {
+		return FALSE;
+	}
+	gboolean isReplayFile = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+			memcmp(magic, PCAP_FORMAT_MAGIC, sizeof(magic)) == 0;
+	fclose(file);
+	return isReplayFile;
+}
+
+/* Writes len bytes and pads them with zeros up to the next 8 bytes boundary */
+static gboolean _pcap_format_write_aligned(FILE* file, gconstpointer data, guint64 len) {
+	static const gchar zeros[8];
+	guint64 padding = PCAP_FORMAT_ALIGN(len) - len;
+	return (len == 0 || fwrite(data, 1, len, file) == len) &&
+			(padding == 0 || fwrite(zeros, 1, padding, file) == padding);
+}
+
+gboolean pcap_format_write(Pcap_Capture* capture, const gchar* path, PcapReplayLogFunc slogf) {
+	FILE* file = fopen(path, "wb");
+	if(file == NULL) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to create the replay file (%s)", path);
+		return FALSE;
+	}
+
+	guint nFlows = capture->flows->len;
+	Pcap_Format_Header header;
+	memset(&header, 0, sizeof(Pcap_Format_Header));
+	memcpy(header.magic, PCAP_FORMAT_MAGIC, sizeof(header.magic));
+	header.version = PCAP_FORMAT_VERSION;
+	header.byteOrder = PCAP_FORMAT_BYTE_ORDER;
+	header.flowCount = nFlows;
+	header.startSec = capture->start.tv_sec;
+	header.startUsec = capture->start.tv_usec;
+
+	/* Place the arrays after the flow table, then the payloads */
+	Pcap_Format_Flow* records = g_new0(Pcap_Format_Flow, nFlows);
+	guint64 position = sizeof(Pcap_Format_Header) + (guint64)nFlows * sizeof(Pcap_Format_Flow);
+	for(guint i = 0; i < nFlows; i++) {
+		Pcap_Flow_Index* index = g_ptr_array_index(capture->flows, i);
+		Pcap_Format_Flow* record = &records[i];
+		record->clientIP = index->key.clientIP.s_addr;
+		record->serverIP = index->key.serverIP.s_addr;
+		record->clientPort = index->key.clientPort;
+		record->serverPort = index->key.serverPort;
+		record->protocol = index->protocol;
+		record->firstSec = index->first.tv_sec;
+		record->firstUsec = index->first.tv_usec;
+		record->startSec = index->start.tv_sec;
+		record->startUsec = index->start.tv_usec;
+		for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+			Pcap_Timeline* timeline = &index->timeline[dir];
+			Pcap_Format_Timeline* tl = &record->timeline[dir];
+			tl->length = timeline->length;
+			tl->startSec = timeline->start.tv_sec;
+			tl->startUsec = timeline->start.tv_usec;
+			tl->bytes = timeline->bytes;
+			tl->deltaOffset = position;
+			position += PCAP_FORMAT_ALIGN((guint64)timeline->length * sizeof(guint32));
+			tl->offsetOffset = position;
+			position += PCAP_FORMAT_ALIGN((guint64)timeline->length * sizeof(guint64));
+			tl->sizeOffset = position;
+			position += PCAP_FORMAT_ALIGN((guint64)timeline->length * sizeof(guint32));
+		}
+	}
+	header.payloadOffset = position;
+	header.payloadLength = capture->payloadLength;
+
+	gboolean isWritten = _pcap_format_write_aligned(file, &header, sizeof(Pcap_Format_Header)) &&
+			_pcap_format_write_aligned(file, records, (guint64)nFlows * sizeof(Pcap_Format_Flow));
+	for(guint i = 0; i < nFlows && isWritten; i++) {
+		Pcap_Flow_Index* index = g_ptr_array_index(capture->flows, i);
+		for(gint dir = 0; dir < PCAP_DIR_COUNT && isWritten; dir++) {
+			Pcap_Timeline* timeline = &index->timeline[dir];
+			isWritten = _pcap_format_write_aligned(file, timeline->delta, (guint64)timeline->length * sizeof(guint32)) &&
+					_pcap_format_write_aligned(file, timeline->offset, (guint64)timeline->length * sizeof(guint64)) &&
+					_pcap_format_write_aligned(file, timeline->size, (guint64)timeline->length * sizeof(guint32));
+		}
+	}
+	isWritten = isWritten && _pcap_format_write_aligned(file, capture->payloadData, capture->payloadLength);
+	isWritten = (fclose(file) == 0) && isWritten;
+	g_free(records);
+
+	if(!isWritten) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to write the replay file (%s)", path);
+		return FALSE;
+	}
+	slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"Replay file written (%s) : %u flows, %"G_GUINT64_FORMAT" payload bytes",
+			path, nFlows, capture->payloadLength);
+	return TRUE;
+}
+
+/* Is the section [offset, offset + length[ inside the mapped file ? */
+static gboolean _pcap_format_in_map(Pcap_Capture* capture, guint64 offset, guint64 length) {
+	return offset % 8 == 0 && offset <= capture->mapLength && length <= capture->mapLength - offset;
+}
+
+/* Points the timeline to its arrays in the mapped file.
+ * Every payload must be inside the payload section : the replay never checks them again */
+static gboolean _pcap_format_map_timeline(Pcap_Capture* capture, Pcap_Timeline* timeline,
+		const Pcap_Format_Timeline* tl) {
+	guchar* map = capture->map;
+	if(!_pcap_format_in_map(capture, tl->deltaOffset, (guint64)tl->length * sizeof(guint32)) ||
+			!_pcap_format_in_map(capture, tl->offsetOffset, (guint64)tl->length * sizeof(guint64)) ||
+			!_pcap_format_in_map(capture, tl->sizeOffset, (guint64)tl->length * sizeof(guint32))) {
+		return FALSE;
+	}
+	const guint64* offset = (const guint64*) &map[tl->offsetOffset];
+	const guint32* size = (const guint32*) &map[tl->sizeOffset];
+	guint64 bytes = 0;
+	for(guint i = 0; i < tl->length; i++) {
+		if(offset[i] > capture->payloadLength || size[i] > capture->payloadLength - offset[i] ||
+				size[i] > G_MAXINT) {
+			return FALSE;
+		}
+		bytes += size[i];
+	}
+	if(bytes != tl->bytes) {
+		return FALSE;
+	}
+	timeline->length = tl->length;
+	timeline->start.tv_sec = tl->startSec;
+	timeline->start.tv_usec = tl->startUsec;
+	timeline->bytes = tl->bytes;
+	timeline->delta = (guint32*) &map[tl->deltaOffset];
+	timeline->offset = (guint64*) &map[tl->offsetOffset];
+	timeline->size = (guint32*) &map[tl->sizeOffset];
+	return TRUE;
+}
+
+/* Appends the packets of the timeline, with their absolute timestamps */
+static void _pcap_format_collect(GArray* packets, Pcap_Timeline* timeline) {
+	struct timeval ts = timeline->start;
+	for(guint i = 0; i < timeline->length; i++) {
+		if(i > 0) {
+			guint64 usec = (guint64)ts.tv_usec + timeline->delta[i];
+			ts.tv_sec += usec / 1000000;
+			ts.tv_usec = usec % 1000000;
+		}
+		Pcap_Format_Packet packet;
+		packet.ts = ts;
+		packet.offset = timeline->offset[i];
+		packet.size = timeline->size[i];
+		packet.order = packets->len;
+		g_array_append_val(packets, packet);
+	}
+}
+
+static gint _pcap_format_packet_compare(gconstpointer a, gconstpointer b) {
+	const Pcap_Format_Packet* pa = a;
+	const Pcap_Format_Packet* pb = b;
+	if(pa->ts.tv_sec != pb->ts.tv_sec) {
+		return pa->ts.tv_sec < pb->ts.tv_sec ? -1 : 1;
+	}
+	if(pa->ts.tv_usec != pb->ts.tv_usec) {
+		return pa->ts.tv_usec < pb->ts.tv_usec ? -1 : 1;
+	}
+	return pa->order < pb->order ? -1 : (pa->order > pb->order ? 1 : 0);
+}
+
+/* Builds a timeline (allocated) from the packets, in the order of their timestamps */
+static void _pcap_format_build_timeline(Pcap_Timeline* timeline, GArray* packets) {
+	g_array_sort(packets, _pcap_format_packet_compare);
+	timeline->length = packets->len;
+	timeline->bytes = 0;
+	timeline->delta = g_new0(guint32, packets->len);
+	timeline->offset = g_new0(guint64, packets->len);
+	timeline->size = g_new0(guint32, packets->len);
+	for(guint i = 0; i < packets->len; i++) {
+		Pcap_Format_Packet* packet = &g_array_index(packets, Pcap_Format_Packet, i);
+		if(i == 0) {
+			timeline->start = packet->ts;
+		} else {
+			Pcap_Format_Packet* previous = &g_array_index(packets, Pcap_Format_Packet, i - 1);
+			gint64 elapsed = ((gint64)packet->ts.tv_sec - (gint64)previous->ts.tv_sec) * 1000000
+					+ ((gint64)packet->ts.tv_usec - (gint64)previous->ts.tv_usec);
+			timeline->delta[i] = (guint32) MIN(elapsed, (gint64)G_MAXUINT32);
+		}
+		timeline->offset[i] = packet->offset;
+		timeline->size[i] = packet->size;
+		timeline->bytes += packet->size;
+	}
+}
+
+static gboolean _pcap_timeval_before(const struct timeval* a, const struct timeval* b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* pcap_format_load() maps a replay file and selects the flows matching the filter.
+ * With --all-flows, the timelines are used in place. Otherwise, the flows exchanged
+ * between the two IPs are merged in a single flow, as pcap_capture_load() does. */
+Pcap_Capture* pcap_format_load(const gchar* path, Pcap_Flow_Filter* filter, PcapReplayLogFunc slogf) {
+	gint fd = open(path, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Pcap_Format_Header)) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to open the replay file (%s)", path);
+		if(fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	/* shared & read only : the pages are shared by all the hosts replaying this file */
+	gpointer map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to map the replay file (%s)", path);
+		return NULL;
+	}
+
+	Pcap_Capture* capture = g_new0(Pcap_Capture, 1);
+	capture->path = g_string_new(path);
+	capture->flows = g_ptr_array_new();
+	capture->map = map;
+	capture->mapLength = (gsize)st.st_size;
+
+	const Pcap_Format_Header* header = map;
+	const Pcap_Format_Flow* records = (const Pcap_Format_Flow*) &header[1];
+	if(memcmp(header->magic, PCAP_FORMAT_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != PCAP_FORMAT_VERSION || header->byteOrder != PCAP_FORMAT_BYTE_ORDER ||
+			!_pcap_format_in_map(capture, sizeof(Pcap_Format_Header), (guint64)header->flowCount * sizeof(Pcap_Format_Flow)) ||
+			!_pcap_format_in_map(capture, header->payloadOffset, header->payloadLength)) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+				"Invalid replay file (%s) : corrupted, or written by another version/architecture", path);
+		pcap_capture_free(capture);
+		return NULL;
+	}
+	capture->payloadData = &((const guchar*)map)[header->payloadOffset];
+	capture->payloadLength = header->payloadLength;
+
+	/* In single flow mode, the flows between the two IPs are merged */
+	Pcap_Flow_Index* merged = NULL;
+	GArray* packets[PCAP_DIR_COUNT] = {NULL, NULL};
+	if(!filter->allFlows) {
+		merged = g_new0(Pcap_Flow_Index, 1);
+		merged->key.clientIP = filter->key.clientIP;
+		merged->key.serverIP = filter->key.serverIP;
+		merged->protocol = IPPROTO_TCP;
+		for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+			packets[dir] = g_array_new(FALSE, FALSE, sizeof(Pcap_Format_Packet));
+		}
+	}
+
+	for(guint i = 0; i < header->flowCount; i++) {
+		const Pcap_Format_Flow* record = &records[i];
+		Pcap_Flow_Index* index = g_new0(Pcap_Flow_Index, 1);
+		index->key.clientIP.s_addr = record->clientIP;
+		index->key.serverIP.s_addr = record->serverIP;
+		index->key.clientPort = record->clientPort;
+		index->key.serverPort = record->serverPort;
+		index->protocol = record->protocol ? (guint8) record->protocol : IPPROTO_TCP;
+		index->first.tv_sec = record->firstSec;
+		index->first.tv_usec = record->firstUsec;
+		index->start.tv_sec = record->startSec;
+		index->start.tv_usec = record->startUsec;
+		index->isMapped = TRUE;
+
+		gboolean isValid = TRUE;
+		for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+			isValid = isValid && _pcap_format_map_timeline(capture, &index->timeline[dir], &record->timeline[dir]);
+		}
+		if(!isValid) {
+			slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Invalid replay file (%s) : flow %u is corrupted", path, i);
+			g_free(index);
+			continue;
+		}
+
+		if(filter->allFlows) {
+			if(pcap_flow_filter_match(filter, &index->key)) {
+				index->id = capture->flows->len;
+				g_ptr_array_add(capture->flows, index);
+			} else {
+				g_free(index);
+			}
+			continue;
+		}
+
+		/* Only the TCP packets are replayed in single flow mode */
+		if(index->protocol != IPPROTO_TCP) {
+			g_free(index);
+			continue;
+		}
+		/* The client is the one given in arguments */
+		gboolean isSwapped;
+		if(record->clientIP == filter->key.clientIP.s_addr && record->serverIP == filter->key.serverIP.s_addr) {
+			isSwapped = FALSE;
+		} else if(record->clientIP == filter->key.serverIP.s_addr && record->serverIP == filter->key.clientIP.s_addr) {
+			isSwapped = TRUE;
+		} else {
+			g_free(index);
+			continue;
+		}
+		if(packets[PCAP_DIR_CLIENT]->len + packets[PCAP_DIR_SERVER]->len == 0 ||
+				_pcap_timeval_before(&index->first, &merged->first)) {
+			merged->first = index->first;
+		}
+		if(packets[PCAP_DIR_CLIENT]->len + packets[PCAP_DIR_SERVER]->len == 0 ||
+				_pcap_timeval_before(&index->start, &merged->start)) {
+			merged->start = index->start;
+		}
+		_pcap_format_collect(packets[PCAP_DIR_CLIENT], &index->timeline[isSwapped ? PCAP_DIR_SERVER : PCAP_DIR_CLIENT]);
+		_pcap_format_collect(packets[PCAP_DIR_SERVER], &index->timeline[isSwapped ? PCAP_DIR_CLIENT : PCAP_DIR_SERVER]);
+		g_free(index);
+	}
+
+	if(merged) {
+		if(packets[PCAP_DIR_CLIENT]->len + packets[PCAP_DIR_SERVER]->len > 0) {
+			for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+				_pcap_format_build_timeline(&merged->timeline[dir], packets[dir]);
+			}
+			g_ptr_array_add(capture->flows, merged);
+		} else {
+			g_free(merged);
+		}
+		for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+			g_array_free(packets[dir], TRUE);
+		}
+	}
+
+	if(capture->flows->len > 0) {
+		Pcap_Flow_Index* first = g_ptr_array_index(capture->flows, 0);
+		capture->start = first->first;
+	}
+
+	slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"Replay file mapped (%s) : %u flows, %"G_GUINT64_FORMAT" payload bytes",
+			path, capture->flows->len, capture->payloadLength);
+	return capture;
+}
@@ -0,0 +1,786 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* Arrays used while building the timeline of one direction */
+typedef struct _Pcap_Timeline_Builder {
+	GArray* delta;
+	GArray* offset;
+	GArray* size;
+	struct timeval last;
+} Pcap_Timeline_Builder;
+
+/* A TCP connection (or UDP flow) seen in the pcap file, whatever the direction of its packets.
+ * The endpoint with the lowest (IP, port) is stored first. */
+typedef struct _Pcap_Conn_Key {
+	guint32 ipA;
+	guint32 ipB;
+	guint16 portA;
+	guint16 portB;
+	guint32 protocol;
+} Pcap_Conn_Key;
+
+/* A flow being built while parsing the pcap file */
+typedef struct _Pcap_Flow_Builder {
+	Pcap_Conn_Key conn;
+	gboolean isSelected; /* does the flow match the filter ? */
+	guint order; /* order of appearance in the pcap file */
+	Pcap_Flow_Index* index;
+	Pcap_Timeline_Builder timeline[PCAP_DIR_COUNT];
+	gboolean hasPayload;
+} Pcap_Flow_Builder;
+
+/* TCP sequence numbers comparison (modulo 2^32) */
+#define SEQ_LT(a, b) ((gint32)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((gint32)((a) - (b)) <= 0)
+
+/* Maximum amount of out of order data kept while waiting for a missing segment.
+ * If it is reached, the missing bytes are considered lost by the capture. */
+#define PCAP_REASSEMBLY_MAX_PENDING (4 * 1024 * 1024)
+
+/* A segment received before the bytes preceding it */
+typedef struct _Pcap_Segment {
+	guint32 seq;
+	struct timeval ts;
+	guint32 size; /* captured bytes */
+	guint32 length; /* bytes of the segment on the wire (can be more than size with a snaplen) */
+	guchar* payload;
+} Pcap_Segment;
+
+/* Reassembly state of one direction of one TCP connection (exact 4-tuple).
+ * In single flow mode, several connections can feed the same flow. */
+typedef struct _Pcap_Stream {
+	guint32 src;
+	guint32 dst;
+	guint16 sport;
+	guint16 dport;
+	Pcap_Flow_Builder* builder;
+	Pcap_Direction dir;
+	gboolean hasSeq;
+	guint32 nextSeq; /* sequence number of the next byte of the application stream */
+	GList* pending; /* Pcap_Segment*, ordered by seq */
+	guint pendingBytes;
+} Pcap_Stream;
+
+/* Counters reported once the capture is loaded */
+typedef struct _Pcap_Reassembly_Stats {
+	guint64 duplicateBytes; /* retransmitted or overlapping bytes dropped */
+	guint reordered; /* segments received out of order */
+	guint holes; /* missing data never seen in the capture */
+} Pcap_Reassembly_Stats;
+
+static guint _pcap_conn_key_hash(gconstpointer key) {
+	const Pcap_Conn_Key* conn = key;
+	guint h = conn->ipA;
+	h = h * 31 + conn->ipB;
+	h = h * 31 + ((guint)conn->portA << 16 | conn->portB);
+	h = h * 31 + conn->protocol;
+	return h;
+}
+
+static gboolean _pcap_conn_key_equal(gconstpointer a, gconstpointer b) {
+	return memcmp(a, b, sizeof(Pcap_Conn_Key)) == 0;
+}
+
+static guint _pcap_stream_hash(gconstpointer key) {
+	const Pcap_Stream* stream = key;
+	guint h = stream->src;
+	h = h * 31 + stream->dst;
+	h = h * 31 + ((guint)stream->sport << 16 | stream->dport);
+	return h;
+}
+
+static gboolean _pcap_stream_equal(gconstpointer a, gconstpointer b) {
+	const Pcap_Stream* sa = a;
+	const Pcap_Stream* sb = b;
+	return sa->src == sb->src && sa->dst == sb->dst && sa->sport == sb->sport && sa->dport == sb->dport;
+}
+
+static void _pcap_segment_free(gpointer data) {
+	Pcap_Segment* segment = data;
+	g_free(segment->payload);
+	g_free(segment);
+}
+
+static void _pcap_stream_free(gpointer data) {
+	Pcap_Stream* stream = data;
+	g_list_free_full(stream->pending, _pcap_segment_free);
+	g_free(stream);
+}
+
+static guint32 _pcap_index_elapsed(struct timeval* from, const struct timeval* to) {
+	gint64 elapsed = ((gint64)to->tv_sec - (gint64)from->tv_sec) * 1000000
+			+ ((gint64)to->tv_usec - (gint64)from->tv_usec);
+	/* pcap files are not always ordered, never go back in time */
+	if(elapsed < 0) {
+		return 0;
+	}
+	return (guint32) MIN(elapsed, (gint64)G_MAXUINT32);
+}
+
+static gboolean _pcap_timeval_before(const struct timeval* a, const struct timeval* b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* Does the flow key match the filter (0 means any IP/port) ? */
+gboolean pcap_flow_filter_match(Pcap_Flow_Filter* filter, Pcap_Flow_Key* key) {
+	return (!filter->key.clientIP.s_addr || filter->key.clientIP.s_addr == key->clientIP.s_addr) &&
+			(!filter->key.serverIP.s_addr || filter->key.serverIP.s_addr == key->serverIP.s_addr) &&
+			(!filter->key.clientPort || filter->key.clientPort == key->clientPort) &&
+			(!filter->key.serverPort || filter->key.serverPort == key->serverPort);
+}
+
+static Pcap_Flow_Builder* _pcap_flow_builder_new(Pcap_Conn_Key* conn, guint order) {
+	Pcap_Flow_Builder* builder = g_new0(Pcap_Flow_Builder, 1);
+	builder->conn = *conn;
+	builder->order = order;
+	builder->index = g_new0(Pcap_Flow_Index, 1);
+	builder->index->protocol = (guint8) conn->protocol;
+	for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+		builder->timeline[dir].delta = g_array_new(FALSE, FALSE, sizeof(guint32));
+		builder->timeline[dir].offset = g_array_new(FALSE, FALSE, sizeof(guint64));
+		builder->timeline[dir].size = g_array_new(FALSE, FALSE, sizeof(guint32));
+	}
+	return builder;
+}
+
+void pcap_flow_index_free(Pcap_Flow_Index* index) {
+	for(gint dir = 0; dir < PCAP_DIR_COUNT && !index->isMapped; dir++) {
+		g_free(index->timeline[dir].delta);
+		g_free(index->timeline[dir].offset);
+		g_free(index->timeline[dir].size);
+	}
+	g_free(index);
+}
+
+static void _pcap_flow_builder_free(gpointer data) {
+	Pcap_Flow_Builder* builder = data;
+	for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+		if(builder->timeline[dir].delta) {
+			g_array_free(builder->timeline[dir].delta, TRUE);
+			g_array_free(builder->timeline[dir].offset, TRUE);
+			g_array_free(builder->timeline[dir].size, TRUE);
+		}
+	}
+	if(builder->index) {
+		pcap_flow_index_free(builder->index);
+	}
+	g_free(builder);
+}
+
+/* Moves the arrays of the builder to the timeline */
+static void _pcap_timeline_finish(Pcap_Timeline* timeline, Pcap_Timeline_Builder* builder) {
+	timeline->length = builder->delta->len;
+	for(guint i = 0; i < builder->size->len; i++) {
+		timeline->bytes += g_array_index(builder->size, guint32, i);
+	}
+	timeline->delta = (guint32*) g_array_free(builder->delta, FALSE);
+	timeline->offset = (guint64*) g_array_free(builder->offset, FALSE);
+	timeline->size = (guint32*) g_array_free(builder->size, FALSE);
+	builder->delta = builder->offset = builder->size = NULL;
+}
+
+/* Copies a payload at the end of the payloads of the capture, and returns its offset */
+static guint64 _pcap_capture_append_payload(Pcap_Capture* capture, const u_char* payload, guint32 size) {
+	guint64 offset = capture->payloadLength;
+	if(offset + size > capture->payloadsAllocated) {
+		capture->payloadsAllocated = MAX(capture->payloadsAllocated * 2, offset + size);
+		capture->payloads = g_realloc(capture->payloads, capture->payloadsAllocated);
+	}
+	memcpy(&capture->payloads[offset], payload, size);
+	capture->payloadLength += size;
+	return offset;
+}
+
+static void _pcap_timeline_append(Pcap_Capture* capture, Pcap_Timeline* timeline, Pcap_Timeline_Builder* builder,
+		const struct timeval* ts, const u_char* payload, guint32 size) {
+	guint32 delta = 0;
+
+	if(builder->delta->len > 0) {
+		delta = _pcap_index_elapsed(&builder->last, ts);
+		/* reordered segments are sent right after the bytes preceding them */
+		if(delta > 0) {
+			builder->last = *ts;
+		}
+	} else {
+		timeline->start = *ts;
+		builder->last = *ts;
+	}
+
+	guint64 offset = _pcap_capture_append_payload(capture, payload, size);
+	g_array_append_val(builder->delta, delta);
+	g_array_append_val(builder->offset, offset);
+	g_array_append_val(builder->size, size);
+}
+
+/* Appends a payload of the application stream to the timeline of its flow */
+static void _pcap_flow_append(Pcap_Capture* capture, Pcap_Flow_Builder* builder, Pcap_Direction dir,
+		const struct timeval* ts, const u_char* payload, guint32 size) {
+	if(size == 0) {
+		return;
+	}
+	if(!builder->hasPayload) {
+		builder->index->start = *ts;
+		builder->hasPayload = TRUE;
+	}
+	_pcap_timeline_append(capture, &builder->index->timeline[dir], &builder->timeline[dir],
+			ts, payload, size);
+}
+
+/* Appends the bytes of the segment that follow the stream, dropping the ones already appended.
+ * Returns FALSE if the segment starts after the next expected byte. */
+static gboolean _pcap_stream_deliver(Pcap_Capture* capture, Pcap_Stream* stream, Pcap_Reassembly_Stats* stats,
+		guint32 seq, const struct timeval* ts, const u_char* payload, guint32 size, guint32 length) {
+	guint32 end = seq + length;
+	if(SEQ_LEQ(end, stream->nextSeq)) {
+		/* retransmission : all the bytes have already been appended */
+		stats->duplicateBytes += length;
+		return TRUE;
+	}
+	if(SEQ_LT(stream->nextSeq, seq)) {
+		return FALSE;
+	}
+	/* overlap : skip the bytes already appended */
+	guint32 skip = stream->nextSeq - seq;
+	stats->duplicateBytes += skip;
+	if(skip < size) {
+		_pcap_flow_append(capture, stream->builder, stream->dir, ts, payload + skip, size - skip);
+	}
+	stream->nextSeq = end;
+	return TRUE;
+}
+
+/* Appends the pending segments that follow the stream.
+ * If force is TRUE, the missing bytes preceding them are considered lost. */
+static void _pcap_stream_flush(Pcap_Capture* capture, Pcap_Stream* stream, Pcap_Reassembly_Stats* stats,
+		gboolean force) {
+	while(stream->pending) {
+		Pcap_Segment* segment = stream->pending->data;
+		if(!_pcap_stream_deliver(capture, stream, stats, segment->seq, &segment->ts,
+				segment->payload, segment->size, segment->length)) {
+			if(!force) {
+				return;
+			}
+			stats->holes++;
+			stream->nextSeq = segment->seq;
+			continue;
+		}
+		stream->pendingBytes -= segment->size;
+		stream->pending = g_list_delete_link(stream->pending, stream->pending);
+		_pcap_segment_free(segment);
+	}
+}
+
+static gint _pcap_segment_compare(gconstpointer a, gconstpointer b) {
+	const Pcap_Segment* sa = a;
+	const Pcap_Segment* sb = b;
+	return SEQ_LT(sa->seq, sb->seq) ? -1 : (sa->seq == sb->seq ? 0 : 1);
+}
+
+/* Reassembles the payload of a segment into the application stream :
+ * payloads are ordered by sequence number and retransmitted bytes are dropped.
+ * The bytes keep the timestamp of their first transmission in the pcap file. */
+static void _pcap_stream_push(Pcap_Capture* capture, Pcap_Stream* stream, Pcap_Reassembly_Stats* stats,
+		guint32 seq, const struct timeval* ts, const u_char* payload, guint32 size, guint32 length) {
+	if(!stream->hasSeq) {
+		/* the handshake is not in the pcap file */
+		stream->nextSeq = seq;
+		stream->hasSeq = TRUE;
+	}
+
+	if(_pcap_stream_deliver(capture, stream, stats, seq, ts, payload, size, length)) {
+		_pcap_stream_flush(capture, stream, stats, FALSE);
+		return;
+	}
+
+	/* Some bytes are missing : keep the segment until they are received */
+	stats->reordered++;
+	Pcap_Segment* segment = g_new0(Pcap_Segment, 1);
+	segment->seq = seq;
+	segment->ts = *ts;
+	segment->size = size;
+	segment->length = length;
+	segment->payload = g_malloc(size);
+	memcpy(segment->payload, payload, size);
+	stream->pending = g_list_insert_sorted(stream->pending, segment, _pcap_segment_compare);
+	stream->pendingBytes += size;
+
+	if(stream->pendingBytes > PCAP_REASSEMBLY_MAX_PENDING) {
+		_pcap_stream_flush(capture, stream, stats, TRUE);
+	}
+}
+
+/* Finds the reassembly state of the direction of the connection of the packet */
+static Pcap_Stream* _pcap_stream_lookup(GHashTable* streams, Pcap_Flow_Builder* builder, Pcap_Direction dir,
+		const struct sniff_ip* ip, const struct sniff_tcp* tcp) {
+	Pcap_Stream key;
+	memset(&key, 0, sizeof(Pcap_Stream));
+	key.src = ip->ip_src.s_addr;
+	key.dst = ip->ip_dst.s_addr;
+	key.sport = tcp->th_sport;
+	key.dport = tcp->th_dport;
+
+	Pcap_Stream* stream = g_hash_table_lookup(streams, &key);
+	if(stream == NULL) {
+		stream = g_new0(Pcap_Stream, 1);
+		*stream = key;
+		stream->builder = builder;
+		stream->dir = dir;
+		g_hash_table_insert(streams, stream, stream);
+	}
+	return stream;
+}
+
+/* Finds the flow of the packet, creating it when the packet is the first of its flow.
+ * The ports are in network order. srcIsClient tells who opened the flow if this packet is its first one.
+ * Returns NULL if the packet does not belong to a flow we replay. */
+static Pcap_Flow_Builder* _pcap_flow_lookup(GHashTable* builders, Pcap_Flow_Filter* filter,
+		const struct sniff_ip* ip, u_short th_sport, u_short th_dport, gboolean srcIsClient) {
+	Pcap_Conn_Key conn;
+	memset(&conn, 0, sizeof(Pcap_Conn_Key));
+
+	guint32 src = ip->ip_src.s_addr, dst = ip->ip_dst.s_addr;
+	/* in single flow mode, ports are ignored */
+	guint16 sport = filter->allFlows ? ntohs(th_sport) : 0;
+	guint16 dport = filter->allFlows ? ntohs(th_dport) : 0;
+	conn.protocol = ip->ip_p;
+	gboolean srcIsA = (ntohl(src) < ntohl(dst)) || (src == dst && sport <= dport);
+	conn.ipA = srcIsA ? src : dst;
+	conn.portA = srcIsA ? sport : dport;
+	conn.ipB = srcIsA ? dst : src;
+	conn.portB = srcIsA ? dport : sport;
+
+	Pcap_Flow_Builder* builder = g_hash_table_lookup(builders, &conn);
+	if(builder) {
+		return builder->isSelected ? builder : NULL;
+	}
+
+	builder = _pcap_flow_builder_new(&conn, g_hash_table_size(builders));
+	g_hash_table_insert(builders, &builder->conn, builder);
+	Pcap_Flow_Key* key = &builder->index->key;
+
+	if(!filter->allFlows) {
+		/* The client is the one given in arguments */
+		if(src == filter->key.clientIP.s_addr && dst == filter->key.serverIP.s_addr) {
+			builder->isSelected = TRUE;
+		} else if(src == filter->key.serverIP.s_addr && dst == filter->key.clientIP.s_addr) {
+			builder->isSelected = TRUE;
+		}
+		key->clientIP = filter->key.clientIP;
+		key->serverIP = filter->key.serverIP;
+		return builder->isSelected ? builder : NULL;
+	}
+
+	key->clientIP.s_addr = srcIsClient ? src : dst;
+	key->clientPort = srcIsClient ? sport : dport;
+	key->serverIP.s_addr = srcIsClient ? dst : src;
+	key->serverPort = srcIsClient ? dport : sport;
+
+	builder->isSelected = pcap_flow_filter_match(filter, key);
+	return builder->isSelected ? builder : NULL;
+}
+
+static gint _pcap_flow_builder_compare(gconstpointer a, gconstpointer b) {
+	const Pcap_Flow_Builder* fa = *(Pcap_Flow_Builder* const*) a;
+	const Pcap_Flow_Builder* fb = *(Pcap_Flow_Builder* const*) b;
+	if(_pcap_timeval_before(&fa->index->first, &fb->index->first)) {
+		return -1;
+	}
+	if(_pcap_timeval_before(&fb->index->first, &fa->index->first)) {
+		return 1;
+	}
+	return fa->order < fb->order ? -1 : (fa->order > fb->order ? 1 : 0);
+}
+
+/* Link layers : each decoder returns the offset of the IPv4 header in the packet,
+ * or -1 if the packet does not carry IPv4 */
+typedef gint (*Pcap_Link_Decoder)(const u_char* data, bpf_u_int32 caplen);
+
+/* Skips the VLAN tags (802.1Q, 802.1ad) following an ether type at offset */
+static gint _pcap_link_ethertype(const u_char* data, bpf_u_int32 caplen, guint offset) {
+	while(offset + 2 <= caplen) {
+		guint16 type = (guint16)(data[offset] << 8 | data[offset + 1]);
+		if(type == ETHERTYPE_IPV4) {
+			return (gint)(offset + 2);
+		}
+		if(type != ETHERTYPE_VLAN && type != ETHERTYPE_QINQ && type != ETHERTYPE_QINQ_OLD) {
+			return -1;
+		}
+		/* the encapsulated ether type follows the TCI */
+		offset += SIZE_VLAN;
+	}
+	return -1;
+}
+
+static gint _pcap_link_ethernet(const u_char* data, bpf_u_int32 caplen) {
+	return _pcap_link_ethertype(data, caplen, SIZE_ETHERNET - 2);
+}
+
+/* The VLAN tags of the cooked captures are not skipped : the BPF filter built for them
+ * ("ip and tcp") would drop the tagged packets anyway */
+static gint _pcap_link_sll(const u_char* data, bpf_u_int32 caplen) {
+	if(caplen < SIZE_LINUX_SLL || data[SIZE_LINUX_SLL - 2] != 0x08 || data[SIZE_LINUX_SLL - 1] != 0x00) {
+		return -1;
+	}
+	return SIZE_LINUX_SLL;
+}
+
+#ifdef DLT_LINUX_SLL2
+static gint _pcap_link_sll2(const u_char* data, bpf_u_int32 caplen) {
+	if(caplen < SIZE_LINUX_SLL2 || data[0] != 0x08 || data[1] != 0x00) {
+		return -1;
+	}
+	return SIZE_LINUX_SLL2;
+}
+#endif
+
+static gint _pcap_link_raw(const u_char* data, bpf_u_int32 caplen) {
+	return (caplen > 0 && (data[0] >> 4) == 4) ? 0 : -1;
+}
+
+static gint _pcap_link_loopback(const u_char* data, bpf_u_int32 caplen) {
+	/* AF_INET is 2 everywhere, in the byte order of the host which captured (or network order) */
+	if(caplen < SIZE_LOOPBACK) {
+		return -1;
+	}
+	guint32 family;
+	memcpy(&family, data, sizeof(guint32));
+	return (family == 2 || family == 0x02000000) ? SIZE_LOOPBACK : -1;
+}
+
+static const struct {
+	gint linkType;
+	Pcap_Link_Decoder decode;
+	gboolean hasVlan; /* can be filtered with the "vlan" BPF keyword */
+} _pcap_link_types[] = {
+	{DLT_EN10MB, _pcap_link_ethernet, TRUE},
+	{DLT_LINUX_SLL, _pcap_link_sll, FALSE},
+#ifdef DLT_LINUX_SLL2
+	{DLT_LINUX_SLL2, _pcap_link_sll2, FALSE},
+#endif
+	{DLT_RAW, _pcap_link_raw, FALSE},
+#ifdef DLT_IPV4
+	{DLT_IPV4, _pcap_link_raw, FALSE},
+#endif
+	{DLT_NULL, _pcap_link_loopback, FALSE},
+	{DLT_LOOP, _pcap_link_loopback, FALSE},
+};
+
+/* Builds the BPF expression selecting the TCP (and UDP with --all-flows) packets which can
+ * belong to the flows of the filter. The directions are checked when the packets are parsed. */
+static gchar* _pcap_filter_expression(Pcap_Flow_Filter* filter, gboolean hasVlan) {
+	GString* match = g_string_new(filter->allFlows ? "(tcp or udp)" : "tcp");
+	char ip[INET_ADDRSTRLEN];
+	if(filter->key.clientIP.s_addr) {
+		inet_ntop(AF_INET, &filter->key.clientIP, ip, INET_ADDRSTRLEN);
+		g_string_append_printf(match, " and host %s", ip);
+	}
+	if(filter->key.serverIP.s_addr) {
+		inet_ntop(AF_INET, &filter->key.serverIP, ip, INET_ADDRSTRLEN);
+		g_string_append_printf(match, " and host %s", ip);
+	}
+	/* in single flow mode, ports are ignored */
+	if(filter->allFlows && filter->key.clientPort) {
+		g_string_append_printf(match, " and port %u", filter->key.clientPort);
+	}
+	if(filter->allFlows && filter->key.serverPort) {
+		g_string_append_printf(match, " and port %u", filter->key.serverPort);
+	}
+
+	/* Each "vlan" moves the offsets of what follows by one tag : the untagged,
+	 * single tagged and double tagged (QinQ) cases are nested, each one after the
+	 * "vlan" matching its outer tag */
+	if(hasVlan) {
+		gchar* expression = g_strdup_printf("(%s) or (vlan and ((%s) or (vlan and %s)))",
+				match->str, match->str, match->str);
+		g_string_free(match, TRUE);
+		return expression;
+	}
+	return g_string_free(match, FALSE);
+}
+
+/* Lets libpcap drop the packets we can't replay before they are returned to us.
+ * This is only an optimization : if the filter can't be set, all the packets are parsed. */
+static void _pcap_set_filter(pcap_t* pcap, const gchar* path, Pcap_Flow_Filter* filter, gboolean hasVlan,
+		PcapReplayLogFunc slogf) {
+	gchar* expression = _pcap_filter_expression(filter, hasVlan);
+	struct bpf_program program;
+	if(pcap_compile(pcap, &program, expression, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+		slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+				"Unable to compile the filter '%s' for %s : %s", expression, path, pcap_geterr(pcap));
+	} else {
+		if(pcap_setfilter(pcap, &program) != 0) {
+			slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"Unable to set the filter '%s' for %s : %s", expression, path, pcap_geterr(pcap));
+		} else {
+			slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Filter of %s : %s", path, expression);
+		}
+		pcap_freecode(&program);
+	}
+	g_free(expression);
+}
+
+/* pcap_capture_load() parses the pcap file once and keeps, for each direction
+ * of each flow selected by the filter, the timestamps and payloads of the packets
+ * carrying data. TCP control messages (empty payloads) are skipped:
+ * their inter-arrival time is accumulated in the delta of the next packet.
+ * With --all-flows, the UDP flows are kept too : each datagram is a packet of the timeline. */
+Pcap_Capture* pcap_capture_load(const gchar* path, Pcap_Flow_Filter* filter, PcapReplayLogFunc slogf) {
+	/* The file has been converted already, nothing to parse */
+	if(pcap_format_is_replay_file(path)) {
+		return pcap_format_load(path, filter, slogf);
+	}
+
+	char ebuf[PCAP_ERRBUF_SIZE];
+	pcap_t* pcap = NULL;
+	gboolean isCompressed = pcap_stream_is_compressed(path);
+	if(isCompressed) {
+		/* libpcap reads the decompressed bytes as they are decoded */
+		FILE* stream = pcap_stream_open(path, slogf);
+		if(stream == NULL) {
+			return NULL;
+		}
+		pcap = pcap_fopen_offline(stream, ebuf);
+		if(pcap == NULL) {
+			fclose(stream);
+		}
+	} else {
+		pcap = pcap_open_offline(path, ebuf);
+	}
+	if(pcap == NULL) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+				"Unable to open the pcap file (%s) : %s", path, ebuf);
+		return NULL;
+	}
+
+	/* Find how to get to the IP header */
+	gint linkType = pcap_datalink(pcap);
+	Pcap_Link_Decoder decode = NULL;
+	gboolean hasVlan = FALSE;
+	for(guint i = 0; i < G_N_ELEMENTS(_pcap_link_types); i++) {
+		if(_pcap_link_types[i].linkType == linkType) {
+			decode = _pcap_link_types[i].decode;
+			hasVlan = _pcap_link_types[i].hasVlan;
+			break;
+		}
+	}
+	if(decode == NULL) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+				"Unsupported link type %s (%d) in the pcap file (%s)",
+				pcap_datalink_val_to_name(linkType), linkType, path);
+		pcap_close(pcap);
+		return NULL;
+	}
+	_pcap_set_filter(pcap, path, filter, hasVlan, slogf);
+
+	Pcap_Capture* capture = g_new0(Pcap_Capture, 1);
+	capture->path = g_string_new(path);
+	/* The payloads can't be bigger than the file : reserve the space once,
+	 * so that appending them never reallocates (and copies) the buffer.
+	 * Only the pages written are backed by memory, and the space left when
+	 * the headers and the packets filtered out are skipped is given back
+	 * once the file is indexed.
+	 * The size of a compressed capture is unknown until it is read. */
+	struct stat st;
+	if(!isCompressed && stat(path, &st) == 0 && st.st_size > 0) {
+		capture->payloadsAllocated = (guint64) st.st_size;
+		capture->payloads = g_malloc(capture->payloadsAllocated);
+	}
+	capture->flows = g_ptr_array_new();
+
+	GHashTable* builders = g_hash_table_new_full(_pcap_conn_key_hash, _pcap_conn_key_equal,
+			NULL, _pcap_flow_builder_free);
+	GHashTable* streams = g_hash_table_new_full(_pcap_stream_hash, _pcap_stream_equal,
+			NULL, _pcap_stream_free);
+	Pcap_Reassembly_Stats stats;
+	memset(&stats, 0, sizeof(Pcap_Reassembly_Stats));
+
+	struct pcap_pkthdr *header;
+	const u_char *pkt_data;
+
+	//tcp info
+	const struct sniff_ip *ip; /* The IP header */
+	const struct sniff_tcp *tcp; /* The TCP header */
+	const struct sniff_udp *udp; /* The UDP header */
+	u_int size_ip_header;
+	u_int size_tcp_header;
+	u_int size_payload;
+
+	while(pcap_next_ex(pcap, &header, &pkt_data) > 0) {
+		// ensure we are dealing with an ipv4 packet.
+		// The BPF filter dropped most of the others already, the headers are still checked
+		// in case it could not be set (and to never read past the captured bytes)
+		gint ipOffset = decode(pkt_data, header->caplen);
+		if(ipOffset < 0 || header->caplen < ipOffset + sizeof(struct sniff_ip)) {
+			continue;
+		}
+
+		ip = (struct sniff_ip*)(pkt_data + ipOffset);
+		size_ip_header = IP_HL(ip)*4;
+		if(size_ip_header < 20) {
+			continue;
+		}
+
+		if(ip->ip_p == IPPROTO_UDP && filter->allFlows) {
+			// the UDP header is only in the first fragment of a datagram
+			if((ntohs(ip->ip_off) & IP_OFFMASK) != 0 ||
+					header->caplen < ipOffset + size_ip_header + SIZE_UDP) {
+				continue;
+			}
+			udp = (struct sniff_udp*)(pkt_data + ipOffset + size_ip_header);
+
+			// without handshake, the client is the one sending the first datagram
+			Pcap_Flow_Builder* builder = _pcap_flow_lookup(builders, filter, ip,
+					udp->uh_sport, udp->uh_dport, TRUE);
+			if(builder == NULL) {
+				continue;
+			}
+			Pcap_Flow_Index* index = builder->index;
+			Pcap_Direction dir = (ip->ip_src.s_addr == index->key.clientIP.s_addr &&
+					ntohs(udp->uh_sport) == index->key.clientPort) ? PCAP_DIR_CLIENT : PCAP_DIR_SERVER;
+			if(index->first.tv_sec == 0 && index->first.tv_usec == 0) {
+				index->first = header->ts;
+			}
+
+			u_int payload_start = ipOffset + size_ip_header + SIZE_UDP;
+			if(ntohs(udp->uh_ulen) <= SIZE_UDP || header->caplen <= payload_start) {
+				continue;
+			}
+			/* never read past the captured bytes (snaplen) */
+			size_payload = MIN((u_int)ntohs(udp->uh_ulen) - SIZE_UDP, header->caplen - payload_start);
+			_pcap_flow_append(capture, builder, dir, &header->ts, pkt_data + payload_start, size_payload);
+			continue;
+		}
+
+		// ensure that we are dealing with tcp
+		if (ip->ip_p != IPPROTO_TCP ||
+				header->caplen < ipOffset + size_ip_header + sizeof(struct sniff_tcp)) {
+			continue;
+		}
+		tcp = (struct sniff_tcp*)(pkt_data + ipOffset + size_ip_header);
+
+		/* The client is the one opening the connection. If the handshake is not
+		 * in the pcap file, we guess that the client uses the highest (ephemeral) port */
+		gboolean srcIsClient = (tcp->th_flags & TH_SYN) ? !(tcp->th_flags & TH_ACK) :
+				ntohs(tcp->th_sport) >= ntohs(tcp->th_dport);
+		Pcap_Flow_Builder* builder = _pcap_flow_lookup(builders, filter, ip,
+				tcp->th_sport, tcp->th_dport, srcIsClient);
+		if(builder == NULL) {
+			continue;
+		}
+		Pcap_Flow_Index* index = builder->index;
+		Pcap_Direction dir = (ip->ip_src.s_addr == index->key.clientIP.s_addr &&
+				(!index->key.clientPort || ntohs(tcp->th_sport) == index->key.clientPort)) ?
+				PCAP_DIR_CLIENT : PCAP_DIR_SERVER;
+
+		if(index->first.tv_sec == 0 && index->first.tv_usec == 0) {
+			index->first = header->ts;
+		}
+
+		Pcap_Stream* stream = _pcap_stream_lookup(streams, builder, dir, ip, tcp);
+		if(tcp->th_flags & TH_SYN) {
+			/* (new) connection : the stream starts after the SYN */
+			_pcap_stream_flush(capture, stream, &stats, TRUE);
+			stream->nextSeq = ntohl(tcp->th_seq) + 1;
+			stream->hasSeq = TRUE;
+		}
+
+		size_tcp_header = TH_OFF(tcp)*4;
+		u_int payload_start = ipOffset + size_ip_header + size_tcp_header;
+		if(ntohs(ip->ip_len) <= size_ip_header + size_tcp_header || header->caplen <= payload_start) {
+			/* TCP control message : nothing to replay */
+			continue;
+		}
+		u_int length_payload = ntohs(ip->ip_len) - (size_ip_header + size_tcp_header);
+		/* never read past the captured bytes (snaplen) */
+		size_payload = MIN(length_payload, header->caplen - payload_start);
+
+		_pcap_stream_push(capture, stream, &stats, ntohl(tcp->th_seq), &header->ts,
+				pkt_data + payload_start, size_payload, length_payload);
+	}
+	pcap_close(pcap);
+
+	/* Append what is still waiting for missing bytes */
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, streams);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		_pcap_stream_flush(capture, value, &stats, TRUE);
+	}
+	g_hash_table_destroy(streams);
+
+	/* Keep the flows carrying data, in the order they started */
+	GPtrArray* selected = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, builders);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		Pcap_Flow_Builder* builder = value;
+		if(builder->isSelected && builder->hasPayload) {
+			g_ptr_array_add(selected, builder);
+		}
+	}
+	g_ptr_array_sort(selected, _pcap_flow_builder_compare);
+
+	for(guint i = 0; i < selected->len; i++) {
+		Pcap_Flow_Builder* builder = g_ptr_array_index(selected, i);
+		Pcap_Flow_Index* index = builder->index;
+		for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+			_pcap_timeline_finish(&index->timeline[dir], &builder->timeline[dir]);
+		}
+		index->id = capture->flows->len;
+		g_ptr_array_add(capture->flows, index);
+		builder->index = NULL;
+
+		if(i == 0) {
+			capture->start = index->first;
+		}
+	}
+	g_ptr_array_free(selected, TRUE);
+	g_hash_table_destroy(builders);
+	if(capture->payloadsAllocated > capture->payloadLength) {
+		capture->payloads = g_realloc(capture->payloads, capture->payloadLength);
+		capture->payloadsAllocated = capture->payloadLength;
+	}
+	capture->payloadData = capture->payloads;
+
+	slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"Pcap file indexed (%s) : %u flows, %"G_GUINT64_FORMAT" payload bytes",
+			path, capture->flows->len, capture->payloadLength);
+	slogf(G_LOG_LEVEL_INFO, __FUNCTION__,
+			"Reassembly of %s : %"G_GUINT64_FORMAT" retransmitted bytes dropped, "
+			"%u segments out of order, %u holes", path, stats.duplicateBytes, stats.reordered, stats.holes);
+	for(guint i = 0; i < capture->flows->len; i++) {
+		Pcap_Flow_Index* index = g_ptr_array_index(capture->flows, i);
+		char client[INET_ADDRSTRLEN], server[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &index->key.clientIP, client, INET_ADDRSTRLEN);
+		inet_ntop(AF_INET, &index->key.serverIP, server, INET_ADDRSTRLEN);
+		slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+				"Flow %u (%s) : %s:%u -> %s:%u, %u client packets, %u server packets", index->id,
+				index->protocol == IPPROTO_UDP ? "udp" : "tcp",
+				client, index->key.clientPort, server, index->key.serverPort,
+				index->timeline[PCAP_DIR_CLIENT].length, index->timeline[PCAP_DIR_SERVER].length);
+	}
+	return capture;
+}
+
+void pcap_capture_free(Pcap_Capture* capture) {
+	if(!capture) {
+		return;
+	}
+	if(capture->flows) {
+		for(guint i = 0; i < capture->flows->len; i++) {
+			pcap_flow_index_free(g_ptr_array_index(capture->flows, i));
+		}
+		g_ptr_array_free(capture->flows, TRUE);
+	}
+	g_free(capture->payloads);
+	if(capture->map) {
+		munmap(capture->map, capture->mapLength);
+	}
+	if(capture->path) {
+		g_string_free(capture->path, TRUE);
+	}
+	g_free(capture->cacheKey);
+	g_free(capture);
+}
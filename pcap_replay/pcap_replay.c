@@ -6,383 +6,335 @@
 
 #define MAGIC 0xFFEEDDCC
 
-const gchar* USAGE = "USAGE: 'client'|'client-tor|'server' [SocksPort] serverHostName serverPort IP_client_in_pcap Port_client IP_server_in_pcap Port_server timeout [file.pcap,...]\n";
-
-/* pcap_activateClient() is called when the epoll descriptor has an event for the client */
-void _pcap_activateClient(Pcap_Replay* pcapReplay, gint sd, uint32_t events) {
-	assert(pcapReplay->client.sd == sd);
-	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, 
-				"Activate client : An event is available for the client to process");
- 
-	/* Function vars*/
-	struct timespec timeToWait;
-	ssize_t numBytes = 0;
-	char receivedPacket[MTU];
-
-	/* Save a pointer to the packet to send */
-	Custom_Packet_t *pckt_to_send = pcapReplay->nextPacket;
-
-
-	/* Get the next packet of the pcap file for the client */
-	if(!get_next_packet(pcapReplay)) {
-		/* No more packet to send ! 
-		 * Then restart client with the next pcap file to send */
-		pcapReplay->slogf(G_LOG_LEVEL_INFO, __FUNCTION__, 
-					"Send last pcap of the current file : open next pcap file to send !");
-		// Send last packet to the remote server
-		send_packet(pckt_to_send,sd);
-		free(pckt_to_send);
-
-		/* Now, we need to restart the client.
-		 * The client will close its socket to the proxy
-		 * and the proxy will close the connection to the remote host.
-		 * Then the client will wait for an arbitrary time before trying to reconnnect to the proxy & remote server */
-		if(restart_client(pcapReplay)==TRUE) {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Successfully restarted the client !");
-			return;
-		} else{
-			deinstanciate(pcapReplay,sd);
-			return;
+const gchar* USAGE = "USAGE: [--all-flows] [--coalesce=usec] [--speed=x|--max-rate] [--causal] [--stats-interval=sec] [--synthetic=dir [--seed=n]] 'client'|'client-tor|'server' [SocksPort] serverHostName serverPort IP_client_in_pcap Port_client IP_server_in_pcap Port_server timeout [file.pcap,...] (no file with --synthetic)\n";
+
+/* _pcap_timer_init() creates the pacing timer. The packets are sent when it expires.
+ * The timer is watched by our epoll descriptor along with our sockets. */
+static gboolean _pcap_timer_init(Pcap_Replay* pcapReplay) {
+	pcapReplay->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if(pcapReplay->timerfd == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Error in timerfd_create");
+		return FALSE;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = pcapReplay->timerfd;
+	epoll_ctl(pcapReplay->ed, EPOLL_CTL_ADD, pcapReplay->timerfd, &ev);
+
+	/* Until a flow is scheduled, the timer only expires at the timeout */
+	struct itimerspec timeout;
+	memset(&timeout, 0, sizeof(struct itimerspec));
+	timeout.it_value.tv_sec = pcapReplay->timeoutTime / 1000000;
+	timeout.it_value.tv_nsec = (pcapReplay->timeoutTime % 1000000) * 1000;
+	timerfd_settime(pcapReplay->timerfd, TFD_TIMER_ABSTIME, &timeout, NULL);
+
+	/* The statistics are logged periodically by a second timer */
+	if(pcapReplay->statsInterval > 0) {
+		pcapReplay->statsTimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if(pcapReplay->statsTimerfd == -1) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Error in timerfd_create");
+			return FALSE;
 		}
+		struct itimerspec its;
+		memset(&its, 0, sizeof(struct itimerspec));
+		its.it_value.tv_sec = pcapReplay->statsInterval;
+		its.it_interval.tv_sec = pcapReplay->statsInterval;
+		timerfd_settime(pcapReplay->statsTimerfd, 0, &its, NULL);
+
+		ev.data.fd = pcapReplay->statsTimerfd;
+		epoll_ctl(pcapReplay->ed, EPOLL_CTL_ADD, pcapReplay->statsTimerfd, &ev);
 	}
+	return TRUE;
+}
 
-	/* Compute waiting time before sending next packet.
-	 * The wait time is equal to the difference of the timestamp of the two next packet to send  */
-	timeval_subtract(&timeToWait, &pckt_to_send->timestamp,&pcapReplay->nextPacket->timestamp);
-	
-	/* LOG event */
-	if(events & EPOLLOUT) {
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client EPOLLOUT is set");
+/* _pcap_activateStats() is called every statsInterval sec to log the replay statistics */
+void _pcap_activateStats(Pcap_Replay* pcapReplay) {
+	guint64 expirations = 0;
+	if(read(pcapReplay->statsTimerfd, &expirations, sizeof(guint64)) < 0 && errno != EAGAIN) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "error while reading the statistics timer");
 	}
-	if(events & EPOLLIN) {
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client EPOLLIN is set");
+	pcap_stats_log(&pcapReplay->stats, pcapReplay->slogf, G_LOG_LEVEL_MESSAGE, "all flows");
+}
+
+static Pcap_Capture* _pcap_find_capture(Pcap_Replay* pcapReplay, guint id) {
+	return id < pcapReplay->captures->len ? g_ptr_array_index(pcapReplay->captures, id) : NULL;
+}
+
+/* _pcap_start_capture() schedules the connections of all the flows of the current capture.
+ * Each flow connects at the time it started in the pcap file, relatively to the first one. */
+static void _pcap_start_capture(Pcap_Replay* pcapReplay, gint64 delay) {
+	Pcap_Capture* capture = pcapReplay->capture;
+	gint64 captureStart = g_get_monotonic_time() + delay;
+
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"Replaying %u flows of pcap file %s", capture->flows->len, capture->path->str);
+
+	for(guint i = 0; i < capture->flows->len; i++) {
+		Pcap_Flow_Index* index = g_ptr_array_index(capture->flows, i);
+		Pcap_Flow* flow = pcap_flow_new(pcapReplay, capture, index, -1);
+
+		/* the flow identifier the server needs to pick the same flow */
+		guint32 ids[2] = {htonl(pcapReplay->captureId), htonl(index->id)};
+		memcpy(flow->preamble, ids, PCAP_FLOW_PREAMBLE_SIZE);
+
+		gint64 offset = ((gint64)index->first.tv_sec - (gint64)capture->start.tv_sec) * 1000000
+				+ ((gint64)index->first.tv_usec - (gint64)capture->start.tv_usec);
+		pcap_flow_schedule(pcapReplay, flow, captureStart + pcap_replay_scale_time(pcapReplay, offset));
 	}
-	if((events & EPOLLIN) && (events & EPOLLOUT)) {
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client EPOLLIN & EPOLLOUT are set");
+	pcapReplay->activeFlows = capture->flows->len;
+}
+
+/* pcap_flow_connect() opens the connection of a flow to the remote server.
+ * A client-tor connects to the Tor proxy, which connects to the server (see pcap_socks.c) */
+gboolean pcap_flow_connect(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	if(flow->isDatagram) {
+		return pcap_udp_connect(pcapReplay, flow);
 	}
 
-	/* Process events */ 
-	if((events & EPOLLIN) && (events & EPOLLOUT)) {
-		/* EPOLLIN && EPOLLOUT activated :
-		 * The client have packets to send and receive */
+	/* create the client socket and get a socket descriptor */
+	gint sd = socket(AF_INET, (SOCK_STREAM | SOCK_NONBLOCK), 0);
+	if(sd == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
+					"Unable to start control socket: error in socket");
+		return FALSE;
+	}
 
-		/* send the next pcap packet */
-		numBytes = send_packet(pckt_to_send, sd);
-		
-		/* log result */
-		if(numBytes > 0) {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Successfully sent a %d (bytes) packet to the server.", numBytes);
-		} else if(numBytes == 0) {
-			/* The client doesn't recreate TCP control message */
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"The last packet to send was an ACK. Skipped sending.", numBytes);
-		} else {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Unable to send message");
-		}
+	/* Set TCP_NODELAY option to avoid Nagle algo */
+	int optval = 1;
+	if(setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (char *) &optval, sizeof(optval)) == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+					"Unable to set options to the socket !");
+	}
 
-		/* prepare to accept the incoming message */
-		memset(receivedPacket, 0, (size_t)MTU);
-		numBytes = recv(sd, receivedPacket, (size_t)MTU, 0);
+	/* our client socket address information for connecting to the server */
+	struct sockaddr_in serverAddress;
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_addr.s_addr = pcapReplay->isTorClient ? pcapReplay->proxyIP : pcapReplay->serverIP;
+	serverAddress.sin_port = pcapReplay->isTorClient ? pcapReplay->proxyPort : pcapReplay->serverPort;
 
-		/* log result */
-		if(numBytes > 0) {
-			// Drop message and log event 
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Successfully received a packet from the server");
-		} else if(numBytes==0) {
-			/* The connection have been closed by the distant peer
-			 * The client need to close and restart after a given time */
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Server closed connection? Restarting..");
-			if(restart_client(pcapReplay)) {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, 
-							"Successfully restarted the server !");
-				return;
-			} else{
-				deinstanciate(pcapReplay,sd);
-				return;
-			}
-		} else {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"Unable to receive message");
-		}
-	} else if(events & EPOLLOUT) {
-		/* The kernel can accept data from us,
-		 * and we care because we registered EPOLLOUT on sd with epoll */
-
-		/* send the next pcap packet */
-		numBytes = send_packet(pckt_to_send, sd);
-	
-		/* log result */
-		if(numBytes>0) {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"Successfully sent a '%d' (bytes) packet to the server.", numBytes);
-		} else if(numBytes == 0) {
-			/* The client doesn't recreate TCP control messages */
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"The last packet to send was an ACK. Skipped sending.", numBytes);
-		} else {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"Unable to send message");
-		}
-		/* tell epoll we care about reading and writing now */
-		struct epoll_event ev;
-		memset(&ev, 0, sizeof(struct epoll_event));
-		ev.events = EPOLLIN|EPOLLOUT;
-		ev.data.fd = sd;
-		epoll_ctl(pcapReplay->ed, EPOLL_CTL_MOD, sd, &ev);
-
-	} else if(events & EPOLLIN) {
-		/* There is data available to read from the kernel,
-		 * and we care because we registered EPOLLIN on sd with epoll */
-
-		/* prepare to accept the message */
-		memset(receivedPacket, 0, (size_t)MTU);
-		/* receive the packet */
-		numBytes = recv(sd, receivedPacket, (size_t)MTU, 0);
-
-		/* log result */
-		if(numBytes > 0) {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Successfully received a packet from server.", numBytes);
-		} else if(numBytes==0) {
-			/* The connection have been closed by the distant peer.
-			 * The client need to close the connection and restart (or quit because of timeout */
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Server closed connection? Restarting..");
-			if(restart_client(pcapReplay)) {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, 
-							"Successfully restarted the client !");
-				return;
-			} else{
-				deinstanciate(pcapReplay,sd);
-				return;
-			}
-		} else{
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Unable to receive message");
-		}
+	/* connect to server. since we are non-blocking, we expect this to return EINPROGRESS */
+	gint res = connect(sd, (struct sockaddr *) &serverAddress, sizeof(serverAddress));
+	if (res == -1 && errno != EINPROGRESS) {
+		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
+					"Unable to start control socket: error in connect");
+		close(sd);
+		return FALSE;
 	}
 
-	free(pckt_to_send);
-	/* Sleep waitingTime before reentering in this function. */
-	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, 
-				"The client will now sleep for %d.%.9ld second(s)",timeToWait.tv_sec,timeToWait.tv_nsec);	
-	nanosleep((const struct timespec*)&timeToWait,NULL); 
+	/* specify the events to watch for on this socket.
+	 * to start out, the client wants to know when it can send a message. */
+	pcap_flow_set_socket(pcapReplay, flow, sd, EPOLLOUT);
+	flow->state = PCAP_FLOW_CONNECTING;
+	return TRUE;
+}
 
-	/*  If the timeout is reached, close the plugin ! */
-	GDateTime* dt = g_date_time_new_now_local();
-	if(g_date_time_to_unix(dt) >= pcapReplay->timeout) {
-		/* tell epoll we no longer want to watch this socket */
-		pcapReplay->slogf(G_LOG_LEVEL_INFO, __FUNCTION__,  "Timeout reached!");
-		deinstanciate(pcapReplay,sd);
+/* pcap_replay_flow_done() is called when a flow has been entirely replayed */
+void pcap_replay_flow_done(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	pcapReplay->slogf(G_LOG_LEVEL_INFO, __FUNCTION__, "Flow %u of pcap file %s is over",
+			flow->index ? flow->index->id : 0, flow->capture ? flow->capture->path->str : "?");
+	pcap_flow_free(pcapReplay, flow);
+
+	if(pcapReplay->isClient && pcapReplay->activeFlows > 0 && --pcapReplay->activeFlows == 0) {
+		/* All the flows of the current pcap file are over :
+		 * wait before replaying the flows of the next pcap file (see restart_client()) */
+		change_pcap_file_to_send(pcapReplay);
+		_pcap_start_capture(pcapReplay, 60 * G_USEC_PER_SEC);
 	}
 }
 
-/* pcap_activateServer() is called when the epoll descriptor has an event for the server */
-void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t events) {
-	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Activate server !");
-
-	/* Function vars */
-	struct timespec timeToWait;
-	ssize_t numBytes = 0;
-	char receivedPacket[MTU];
-	struct epoll_event ev;
-
-	/* Save a pointer to the next packet to send */
-	Custom_Packet_t* pckt_to_send = pcapReplay->nextPacket;
-
-	/* When the server has changed its pcap file (restart()),
-	 * it needs to wait for the client to send the first packet.
-	 * This keeps the exchange of packets synchronized. */
-	if((events & EPOLLIN) || ((events & EPOLLIN) && (events & EPOLLOUT))) {
-		if(pcapReplay->isAllowedToSend==FALSE) {
-			memset(receivedPacket, 0, (size_t)MTU);
-			while( (numBytes = recv(sd, receivedPacket, (size_t)MTU, 0)) >= 0) {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Receiving pending packet to empty serve buffer !");
-				memset(receivedPacket, 0, (size_t)MTU);
-			}
-			pcapReplay->isAllowedToSend=TRUE;
-			return;
+/* Reads the flow identifier sent by the client at the beginning of the connection.
+ * Returns 1 once it is complete, 0 if we need to wait for more data, -1 on error */
+static gint _pcap_flow_recv_preamble(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	while(flow->preambleLength < PCAP_FLOW_PREAMBLE_SIZE) {
+		ssize_t numBytes = recv(flow->sd, &flow->preamble[flow->preambleLength],
+				PCAP_FLOW_PREAMBLE_SIZE - flow->preambleLength, 0);
+		if(numBytes == 0) {
+			return -1;
+		} else if(numBytes < 0) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
 		}
-		
-	} else{
-		if(pcapReplay->isFirstPacketReceived==FALSE) {
-			timeToWait.tv_sec=0;
-			timeToWait.tv_nsec=500000000; // sleep 0.5 sec
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client still not connected after changing pcap. Wait 0.5sec !");
-			nanosleep((const struct timespec*)&timeToWait,NULL); 
-			return;
+		flow->preambleLength += numBytes;
+	}
+	return pcap_replay_identify_flow(pcapReplay, flow, IPPROTO_TCP) ? 1 : -1;
+}
+
+/* pcap_replay_identify_flow() attaches the flow to the one of the client, given by
+ * the flow identifier it received (flow->preamble). The flow must use this protocol. */
+gboolean pcap_replay_identify_flow(Pcap_Replay* pcapReplay, Pcap_Flow* flow, guint8 protocol) {
+	guint32 ids[2];
+	memcpy(ids, flow->preamble, PCAP_FLOW_PREAMBLE_SIZE);
+	if(pcapReplay->synth) {
+		/* the synthetic flows are TCP flows, drawn again from their id */
+		if(ntohl(ids[0]) != 0 || protocol != IPPROTO_TCP) {
+			pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"Unknown synthetic flow %u, closing the connection", ntohl(ids[1]));
+			return FALSE;
 		}
+		pcap_flow_set_index(flow, pcap_synth_get_capture(pcapReplay->synth),
+				pcap_synth_flow_index(pcapReplay->synth, ntohl(ids[1])));
+		flow->isIndexOwned = TRUE;
+		return TRUE;
+	}
+	Pcap_Capture* capture = _pcap_find_capture(pcapReplay, ntohl(ids[0]));
+	guint flowId = ntohl(ids[1]);
+	if(capture == NULL || flowId >= capture->flows->len ||
+			((Pcap_Flow_Index*)g_ptr_array_index(capture->flows, flowId))->protocol != protocol) {
+		pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+				"Unknown %s flow %u of pcap file %u, closing the connection",
+				protocol == IPPROTO_UDP ? "UDP" : "TCP", flowId, ntohl(ids[0]));
+		return FALSE;
 	}
+	pcap_flow_set_index(flow, capture, g_ptr_array_index(capture->flows, flowId));
+	return TRUE;
+}
 
-	if(!get_next_packet(pcapReplay)) {
-		/* No more packet to send ! */
-		pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Send last pcap of the current file : open next pcap file to send !");
-		/* Send last packet and restart */
-		send_packet(pckt_to_send,sd);
-		free(pckt_to_send);
-		/* Restart server (after 10secs (new bind)) */
-		if(restart_server(pcapReplay)) {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Successfully restarted the server !");
-			return;
-		} else{
-			deinstanciate(pcapReplay,sd);
-			return;
-		}	
+/* The connection of the flow cannot be established */
+static void _pcap_flow_failed(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	if(pcapReplay->filter.allFlows) {
+		/* the other flows go on */
+		pcap_replay_flow_done(pcapReplay, flow);
+	} else {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+					"Unable to connect to the server through the Tor proxy ! Exiting ");
+		deinstanciate(pcapReplay);
 	}
+}
 
-	/* Compute waiting time */
-	timeval_subtract (&timeToWait, &pckt_to_send->timestamp,&pcapReplay->nextPacket->timestamp);
-	
-	/* LOG event */
-	if(events & EPOLLOUT) {
-		pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Server EPOLLOUT is set");
+/* _pcap_activateFlow() is called when the epoll descriptor has an event for the socket of a flow.
+ * The packets are sent when the pacing timer expires (see _pcap_activateTimer()),
+ * here we only complete the connection, receive data and finish partial sends. */
+void _pcap_activateFlow(Pcap_Replay* pcapReplay, Pcap_Flow* flow, uint32_t events) {
+	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, 
+				"Activate flow : An event is available for the flow to process");
+
+	if(flow->state == PCAP_FLOW_FAILED) {
+		/* freed by the pacing timer */
+		return;
 	}
-	if(events & EPOLLIN) {
-		pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Server EPOLLIN is set");
+	if(flow->isDatagram) {
+		pcap_udp_activate_flow(pcapReplay, flow, events);
+		return;
 	}
-	if((events & EPOLLIN) && (events & EPOLLOUT)) {
-		pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Server EPOLLIN & EPOLLOUT are set");
+
+	if(flow->state == PCAP_FLOW_PROXY ||
+			(flow->state == PCAP_FLOW_CONNECTING && pcapReplay->isTorClient && (events & EPOLLOUT))) {
+		/* client-tor : once connected to the Tor proxy, it connects to the server for us */
+		gint res = (flow->state == PCAP_FLOW_PROXY) ?
+				pcap_socks_continue(pcapReplay, flow) : pcap_socks_start(pcapReplay, flow);
+		if(res < 0) {
+			_pcap_flow_failed(pcapReplay, flow);
+		} else if(res > 0) {
+			/* as if we were connected to the server */
+			pcap_flow_start(pcapReplay, flow, 0);
+			pcap_flow_send_due_packets(pcapReplay, flow);
+		}
+		return;
 	}
 
-	/* Process events */
-	if(sd == pcapReplay->server.sd) {
-		/* data on a listening socket means a new client connection */
-		assert(events & EPOLLIN);
+	if(events & EPOLLIN) {
+		if(flow->state == PCAP_FLOW_HANDSHAKE) {
+			gint res = _pcap_flow_recv_preamble(pcapReplay, flow);
+			if(res < 0) {
+				pcap_replay_flow_done(pcapReplay, flow);
+				return;
+			} else if(res == 0) {
+				return;
+			}
+			/* We know which flow the client replays, start replaying ours */
+			pcap_flow_start(pcapReplay, flow, 0);
+		}
 
-		/* accept new connection from a remote client */
-		struct sockaddr_in clientaddr;
-    	socklen_t clientaddr_size = sizeof(clientaddr);
-		int newClientSD = accept(sd,  (struct sockaddr *)&clientaddr, &clientaddr_size);
+		gssize numBytes = pcap_flow_drain(pcapReplay, flow);
+		if(numBytes < 0 && !pcapReplay->filter.allFlows) {
+			/* The connection have been closed by the distant peer.
+			 * Restart (or quit because of timeout) */
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+						"Remote peer closed connection? Restarting..");
+			gboolean restarted = pcapReplay->isClient ?
+					restart_client(pcapReplay, flow) : restart_server(pcapReplay, flow);
+			if(restarted) {
+				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, 
+							"Successfully restarted the replay !");
+			} else{
+				deinstanciate(pcapReplay);
+			}
+			return;
+		}
+		if(numBytes < 0) {
+			/* keep replaying our side, the socket is still writable */
+			pcap_flow_watch(pcapReplay, flow, flow->events);
+		}
 
-			
-		int len=20;
-		char ip_add[len];
+		/* When the server has changed its pcap file (restart()),
+		 * it needs to wait for the client to send the first packet.
+		 * This keeps the exchange of packets synchronized. */
+		if(numBytes > 0 && flow->state == PCAP_FLOW_WAITING) {
+			pcapReplay->isAllowedToSend=TRUE;
+			pcap_flow_start(pcapReplay, flow, 0);
+		}
 
-		inet_ntop(AF_INET, &(clientaddr.sin_addr), ip_add, len);
+		/* --causal : the next packet may have been waiting for this data (or for the peer to close) */
+		if(numBytes != 0 && pcapReplay->isCausal && flow->state == PCAP_FLOW_REPLAYING && !flow->isWaitingOut) {
+			pcap_flow_send_due_packets(pcapReplay, flow);
+		}
+	}
 
+	if(events & EPOLLOUT) {
+		if(flow->state == PCAP_FLOW_CONNECTING) {
+			/* We are now connected to the server : start replaying the flow.
+			 * From now on, we only need EPOLLOUT when a send would block. */
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client connected, start replaying");
+			pcap_flow_start(pcapReplay, flow, 0);
+		}
+		/* The kernel can accept data from us */
+		pcap_flow_send_due_packets(pcapReplay, flow);
+	}
 
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Client connected on server with address : %s ", ip_add	);
+	if(pcapReplay->filter.allFlows && flow->isPeerClosed &&
+			(flow->state == PCAP_FLOW_FINISHED || flow->state == PCAP_FLOW_HANDSHAKE)) {
+		/* both sides are done */
+		pcap_replay_flow_done(pcapReplay, flow);
+	}
+}
 
+/* pcap_activateServer() is called when the epoll descriptor has an event for the listening socket */
+void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t events) {
+	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Activate server !");
 
-		/* now register this new socket so we know when its ready */
-		memset(&ev, 0, sizeof(struct epoll_event));
-		ev.events = EPOLLIN|EPOLLOUT;
-		ev.data.fd = newClientSD;
-		epoll_ctl(pcapReplay->ed, EPOLL_CTL_ADD, newClientSD, &ev);
+	/* data on a listening socket means a new client connection */
+	assert(events & EPOLLIN);
 
-	} else {
-		/* A client is communicating with us over an existing connection */
-		if((events & EPOLLIN) && (events & EPOLLOUT)) {
-			/* EPOLLIN && EPOLLOUT activated :
-		 	 * The server have packets to send and receive */
-			numBytes = send_packet(pckt_to_send, sd);
-
-			/* log result */
-			if(numBytes > 0) {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Successfully sent a '%d' (bytes) packet to the client", numBytes);
-			} else if(numBytes == 0) {
-			/* The client doesn't recreate TCP ACK messages */
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"The last packet to send was an ACK. Skipped sending.", numBytes);
-			} else {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-							"Unable to send message");
-			}
+	/* accept new connection from a remote client */
+	struct sockaddr_in clientaddr;
+	socklen_t clientaddr_size = sizeof(clientaddr);
+	int newClientSD = accept(sd, (struct sockaddr *)&clientaddr, &clientaddr_size);
+	if(newClientSD < 0) {
+		return;
+	}
+	/* we drain the socket until EAGAIN, it must not block */
+	fcntl(newClientSD, F_SETFL, fcntl(newClientSD, F_GETFL) | O_NONBLOCK);
 
-			/*  Prepare to receive message */
-			memset(receivedPacket, 0, (size_t)MTU);
-			numBytes = recv(sd, receivedPacket, (size_t)MTU, 0);
-			pcapReplay->isFirstPacketReceived=TRUE;
-			/* log result */
-			if(numBytes > 0) {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-							"Successfully received a packet from the client", numBytes);
-			} else if(numBytes == 0) {
-				/* Client closed the remote connection
-				 * Restart the server & wait for a new connection */
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Client closed connection? Restarting..");
-				if(restart_server(pcapReplay)) {
-					pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, 
-								"Successfully restarted the server !");
-					return;
-				} else{
-					deinstanciate(pcapReplay,sd);
-					return;
-				}
-			} else {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Unable to receive message");
-			}
-		/* End EPOLLIN & EPOLLOUT */
-		} else if(events & EPOLLIN) {
-			/* A message is ready to be received */
-			memset(receivedPacket, 0, (size_t)MTU);
-			numBytes = recv(sd, receivedPacket, (size_t)MTU, 0);
-
-			/* log result */
-			if(numBytes > 0) {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Successfully received a message for the client", numBytes);
-			} else if(numBytes == 0) {
-				/* Client closed the remote connection
-				 * Restart the server & wait for a new connection */
-				if(restart_server(pcapReplay)) {
-					pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Successfully restarted the server !");
-					return;
-				} else{
-					deinstanciate(pcapReplay,sd);
-					return;
-				}
-			} else {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"Unable to receive message");
-			}
-			pcapReplay->isFirstPacketReceived=TRUE;
-			/* tell epoll we want to read/write now */
-			memset(&ev, 0, sizeof(struct epoll_event));
-			ev.events = EPOLLIN|EPOLLOUT;
-			ev.data.fd = sd;
-			epoll_ctl(pcapReplay->ed, EPOLL_CTL_MOD, sd, &ev);
-		/* End EPOLLIN */
-		} else if(events & EPOLLOUT) {
-			/* The server can send packet to the client */
-			/* send the pcap packet */
-			numBytes = send_packet(pckt_to_send, sd);
-
-			/* log result */
-			if(numBytes >= 0) {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-							"Successfully sent a '%d' (bytes) packet to the client", numBytes);
-			} else if(numBytes == 0) {
-				/* The client doesn't recreate TCP control messages */
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-							"The last packet to send was an ACK. Skipped sending.", numBytes);
-			} else {
-				pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-							"Unable to send message");
-			}
-		} /* End EPOLLOUT */
-	} /* End process events */
+	int len=20;
+	char ip_add[len];
+	inet_ntop(AF_INET, &(clientaddr.sin_addr), ip_add, len);
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+					"Client connected on server with address : %s ", ip_add	);
 
-	free(pckt_to_send);
-	/* Sleep timetowait */
-	pcapReplay->slogf(G_LOG_LEVEL_INFO, __FUNCTION__, 
-				"The server is gonna sleep before sending the next packet : Sleep time : %d.%.9ld",timeToWait.tv_sec,timeToWait.tv_nsec);
-	nanosleep((const struct timespec*)&timeToWait,NULL); 
+	/* now register this new socket so we know when data is received */
+	if(pcapReplay->filter.allFlows) {
+		/* the client first tells us which flow it replays */
+		pcap_flow_new(pcapReplay, NULL, NULL, newClientSD);
+		return;
+	}
 
-	/* If timeout expired, close connection and exit plugin */
-	GDateTime* dt = g_date_time_new_now_local();
-	if(g_date_time_to_unix(dt) >= pcapReplay->timeout) {
-		/* tell epoll we want to write the response now */
-		pcapReplay->slogf(G_LOG_LEVEL_INFO, __FUNCTION__,  "Timeout reached!");
-		deinstanciate(pcapReplay,sd);
+	Pcap_Flow* flow = pcap_flow_new(pcapReplay, pcapReplay->capture,
+			g_ptr_array_index(pcapReplay->capture->flows, 0), newClientSD);
+	if(pcapReplay->isAllowedToSend) {
+		pcap_flow_start(pcapReplay, flow, 0);
+	} else {
+		flow->state = PCAP_FLOW_WAITING;
 	}
 }
 
@@ -398,24 +350,11 @@ gboolean pcap_StartClient(Pcap_Replay* pcapReplay) {
 			close(pcapReplay->ed);
 			return FALSE;
 		}
+		if(!_pcap_timer_init(pcapReplay)) {
+			return FALSE;
+		}
 	}
 
-	/* create the client socket and get a socket descriptor */
-	pcapReplay->client.sd = socket(AF_INET, (SOCK_STREAM | SOCK_NONBLOCK), 0);
-	if(pcapReplay->client.sd == -1) {
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-					"Unable to start control socket: error in socket");
-		return FALSE;
-	}
-
-	/* Set TCP_NODELAY option to avoid Nagle algo */
-	int optval = 1;
-	setsockopt(pcapReplay->server.sd, IPPROTO_TCP, TCP_NODELAY, (char *) &optval, sizeof(optval));
-	if(pcapReplay->client.sd == -1){
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-					"Unable to set options to the socket !");
-		return FALSE;
-	}
 	/* get the server ip address */
 	if(g_ascii_strncasecmp(pcapReplay->serverHostName->str, "localhost", 9) == 0) {
 		pcapReplay->serverIP = htonl(INADDR_LOOPBACK);
@@ -432,91 +371,50 @@ gboolean pcap_StartClient(Pcap_Replay* pcapReplay) {
 		freeaddrinfo(info);
 	}
 
-	/* our client socket address information for connecting to the server */
-	struct sockaddr_in serverAddress;
-	memset(&serverAddress, 0, sizeof(serverAddress));
-	serverAddress.sin_family = AF_INET;
-	serverAddress.sin_addr.s_addr = pcapReplay->serverIP;
-	
 	int new_port = pcapReplay->serverPortInt + pcapReplay->nmb_conn;
 	pcapReplay->serverPort = (in_port_t) htons(new_port) ;
-	serverAddress.sin_port =pcapReplay->serverPort;
 	pcapReplay->nmb_conn = pcapReplay->nmb_conn+1;
 
-	/* connect to server. since we are non-blocking, we expect this to return EINPROGRESS */
-	gint res = connect(pcapReplay->client.sd, (struct sockaddr *) &serverAddress, sizeof(serverAddress));
-	if (res == -1 && errno != EINPROGRESS) {
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-					"Unable to start control socket: error in connect");
-		return FALSE;
+	if(pcapReplay->filter.allFlows) {
+		/* each flow connects to the server at its own time */
+		if(pcapReplay->synth) {
+			pcap_synth_schedule_next(pcapReplay, g_get_monotonic_time());
+		} else {
+			_pcap_start_capture(pcapReplay, 0);
+		}
+		return TRUE;
 	}
 
-	/* specify the events to watch for on this socket.
-	 * to start out, the client wants to know when it can send a message. */
-	_pcap_client_epoll(pcapReplay, EPOLL_CTL_ADD, EPOLLOUT);
-
+	Pcap_Flow* flow = pcap_flow_new(pcapReplay, pcapReplay->capture,
+			g_ptr_array_index(pcapReplay->capture->flows, 0), -1);
+	if(!pcap_flow_connect(pcapReplay, flow)) {
+		pcap_flow_free(pcapReplay, flow);
+		return FALSE;
+	}
+	pcapReplay->client.sd = flow->sd;
 	return TRUE;
 }
 
 gboolean pcap_StartClientTor(Pcap_Replay* pcapReplay) {
 	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
 
-	/* use epoll to asynchronously watch events for all of our sockets */
-	if(pcapReplay->isRestarting==FALSE) {
-		pcapReplay->ed = epoll_create(1);
-		if(pcapReplay->ed == -1) {
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Error in main epoll_create");
-			close(pcapReplay->ed);
-			return FALSE;
-		}
-	}
-	
-	/* create the client socket and get a socket descriptor */
-	pcapReplay->client.sd = socket(AF_INET, SOCK_STREAM, 0);
-	if(pcapReplay->client.sd == -1) {
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-				"unable to start control socket: error in socket");
-		return FALSE;
-	}
-
-	/* Set TCP_NODELAY option to avoid Nagle algo */
-	int optval = 1;
-	setsockopt(pcapReplay->client.sd, IPPROTO_TCP, TCP_NODELAY, (char *) &optval, sizeof(optval));
-	if(pcapReplay->server.sd == -1){
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-					"Unable to set options to the socket !");
-		return FALSE;
-	}
-
-	/* our client socket address information for connecting to the Tor proxy */
-	struct sockaddr_in proxyAddress;
-	memset(&proxyAddress, 0, sizeof(proxyAddress));
-	proxyAddress.sin_family = AF_INET;
-	proxyAddress.sin_addr.s_addr = pcapReplay->proxyIP;
-	proxyAddress.sin_port = pcapReplay->proxyPort;
-
-	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Trying to connect to Tor socket (port 9000)");
-	/* connect to server. since we are non-blocking, we expect this to return EINPROGRESS */
-	gint res = connect(pcapReplay->client.sd, (struct sockaddr *) &proxyAddress, sizeof(proxyAddress));
-	if (res == -1 && errno != EINPROGRESS) {
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-				"unable to start control socket: error in connect");
-		return FALSE;
-	}	
+	/* The flows connect to the Tor SocksPort instead of the server (see pcap_flow_connect()),
+	 * the Socks5 negotiation is driven by epoll like the replay itself */
 	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Connected to Tor socket port 9000 !");
-
-	/* Initiate the connection to the Tor proxy.
-	 * The client needs to do the Socks5 handshake to communicate
-	 * through Tor using the proxy */
-	initiate_conn_to_proxy(pcapReplay);
-
-	/* specify the events to watch for on this socket.
-	 * to start out, the client wants to know when it can send a message. */
-	_pcap_client_epoll(pcapReplay, EPOLL_CTL_ADD, EPOLLOUT);
+				"Connecting to the server through the Tor proxy (port %d)", (gint) ntohs(pcapReplay->proxyPort));
+	return pcap_StartClient(pcapReplay);
+}
 
-	return TRUE;
+static gboolean _pcap_has_udp_flows(Pcap_Replay* pcapReplay) {
+	for(guint i = 0; i < pcapReplay->captures->len; i++) {
+		Pcap_Capture* capture = g_ptr_array_index(pcapReplay->captures, i);
+		for(guint j = 0; j < capture->flows->len; j++) {
+			if(((Pcap_Flow_Index*)g_ptr_array_index(capture->flows, j))->protocol == IPPROTO_UDP) {
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
 }
 
 gboolean pcap_StartServer(Pcap_Replay* pcapReplay) {
@@ -531,6 +429,9 @@ gboolean pcap_StartServer(Pcap_Replay* pcapReplay) {
 			close(pcapReplay->ed);
 			return FALSE;
 		}
+		if(!_pcap_timer_init(pcapReplay)) {
+			return FALSE;
+		}
 	}
 
 	/* Create the server socket and get a socket descriptor */
@@ -590,6 +491,54 @@ gboolean pcap_StartServer(Pcap_Replay* pcapReplay) {
 	 * To start out, the server wants to know when a client is connecting. */
 	_pcap_server_epoll(pcapReplay, EPOLL_CTL_ADD, EPOLLIN);
 
+	/* The datagrams of the UDP flows are received on the same port */
+	if(pcapReplay->filter.allFlows && _pcap_has_udp_flows(pcapReplay) && !pcap_udp_listen(pcapReplay)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Parses an option given before the positional arguments.
+ * value is NULL if the option has no value. Returns FALSE if the option is invalid. */
+static gboolean _pcap_parse_option(Pcap_Replay* pcapReplay, const gchar* name, const gchar* value) {
+	if(g_strcmp0(name, "all-flows") == 0 && value == NULL) {
+		/* Replay all the TCP flows matching the IPs/ports instead of a single connection */
+		pcapReplay->filter.allFlows = TRUE;
+	} else if(g_strcmp0(name, "coalesce") == 0 && value != NULL) {
+		/* Send the packets due within this window (usec) with a single call */
+		gchar* end = NULL;
+		pcapReplay->coalesceWindow = g_ascii_strtoll(value, &end, 10);
+		return *end == '\0' && pcapReplay->coalesceWindow >= 0;
+	} else if(g_strcmp0(name, "speed") == 0 && value != NULL) {
+		/* Replay faster (or slower) than the capture, e.g. 10 for 10x */
+		gchar* end = NULL;
+		pcapReplay->speed = g_ascii_strtod(value, &end);
+		return *end == '\0' && pcapReplay->speed > 0;
+	} else if(g_strcmp0(name, "stats-interval") == 0 && value != NULL) {
+		/* Log the replay statistics every stats-interval sec */
+		gchar* end = NULL;
+		pcapReplay->statsInterval = (gint) g_ascii_strtoll(value, &end, 10);
+		return *end == '\0' && pcapReplay->statsInterval >= 0;
+	} else if(g_strcmp0(name, "max-rate") == 0 && value == NULL) {
+		/* Ignore the timestamps : send as fast as possible, keeping the order of each flow */
+		pcapReplay->isMaxRate = TRUE;
+	} else if(g_strcmp0(name, "causal") == 0 && value == NULL) {
+		/* Send each packet once the data it answers has been received */
+		pcapReplay->isCausal = TRUE;
+	} else if(g_strcmp0(name, "synthetic") == 0 && value != NULL && *value != '\0') {
+		/* Generate flows from the distributions fitted by pcap_replay-fit instead of replaying pcap files */
+		g_free(pcapReplay->synthDir);
+		pcapReplay->synthDir = g_strdup(value);
+		pcapReplay->filter.allFlows = TRUE;
+	} else if(g_strcmp0(name, "seed") == 0 && value != NULL) {
+		/* Seed of the synthetic flows, the same on the client and the server */
+		gchar* end = NULL;
+		pcapReplay->synthSeed = (guint32) g_ascii_strtoull(value, &end, 10);
+		return *end == '\0';
+	} else {
+		return FALSE;
+	}
 	return TRUE;
 }
 
@@ -606,7 +555,30 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 	pcapReplay->slogf = slogf;
 	pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
 					"Creating a new instance of the pcap replayer plugin:");
-	
+	pcapReplay->speed = 1.0;
+	pcapReplay->synthSeed = 1;
+	pcapReplay->flows = g_hash_table_new(g_direct_hash, g_direct_equal);
+	pcapReplay->schedule = g_sequence_new(NULL);
+
+	/* Options (--name or --name=value) are given before the positional arguments */
+	while(arg_idx < argc && g_str_has_prefix(argv[arg_idx], "--")) {
+		gchar** option = g_strsplit(argv[arg_idx] + 2, "=", 2);
+		gboolean isValid = _pcap_parse_option(pcapReplay, option[0], option[1]);
+		g_strfreev(option);
+		if(!isValid) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Invalid option %s", argv[arg_idx]);
+			pcap_replay_free(pcapReplay);
+			return NULL;
+		}
+		arg_idx++;
+	}
+	/* the synthetic flows replace the pcap files */
+	if(pcapReplay->synthDir ? argc - arg_idx != 8 : argc - arg_idx < 9) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, USAGE);
+		pcap_replay_free(pcapReplay);
+		return NULL;
+	}
+
 
 	const GString* nodeType = g_string_new(argv[arg_idx++]); // client or server ?
 	const GString* client_str = g_string_new("client");
@@ -628,11 +600,13 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 	pcapReplay->nmb_conn = 0;
 
 	pcapReplay->isAllowedToSend = TRUE;
-	pcapReplay->isFirstPacketReceived=TRUE;
 	pcapReplay->isRestarting = FALSE;
 
-	// Get client IP addr used in the pcap file
-	if(inet_aton(argv[arg_idx++], &pcapReplay->client_IP_in_pcap) == 0) {
+	// Get client IP addr used in the pcap file ('*' matches any IP with --all-flows)
+	if(pcapReplay->filter.allFlows && g_strcmp0(argv[arg_idx], "*") == 0) {
+		pcapReplay->client_IP_in_pcap.s_addr = 0;
+		arg_idx++;
+	} else if(inet_aton(argv[arg_idx++], &pcapReplay->client_IP_in_pcap) == 0) {
 		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
 					"Cannot get the client IP used in pcap file : Err in the arguments ");
 		pcap_replay_free(pcapReplay);
@@ -641,8 +615,11 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 	// Get client port used in pcap file
 	pcapReplay->client_port_in_pcap = (gushort) atoi(argv[arg_idx++]);
 
-	// Get server IP addr used in the pcap file
-	if(inet_aton(argv[arg_idx++], &pcapReplay->server_IP_in_pcap) == 0) {
+	// Get server IP addr used in the pcap file ('*' matches any IP with --all-flows)
+	if(pcapReplay->filter.allFlows && g_strcmp0(argv[arg_idx], "*") == 0) {
+		pcapReplay->server_IP_in_pcap.s_addr = 0;
+		arg_idx++;
+	} else if(inet_aton(argv[arg_idx++], &pcapReplay->server_IP_in_pcap) == 0) {
 		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
 					"Cannot get the server IP used in pcap file : Err in the arguments ");
 		pcap_replay_free(pcapReplay);
@@ -651,38 +628,69 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 	// Get server port used in pcap file
 	pcapReplay->server_port_in_pcap = (gushort) atoi(argv[arg_idx++]);
 
+	/* Ports are only used to select the flows with --all-flows ('*' or 0 match any port) */
+	pcapReplay->filter.key.clientIP = pcapReplay->client_IP_in_pcap;
+	pcapReplay->filter.key.serverIP = pcapReplay->server_IP_in_pcap;
+	pcapReplay->filter.key.clientPort = pcapReplay->client_port_in_pcap;
+	pcapReplay->filter.key.serverPort = pcapReplay->server_port_in_pcap;
+
 	// Get the timeout of the experiment
 	GDateTime* dt = g_date_time_new_now_local();
-	pcapReplay->timeout = atoi(argv[arg_idx++]) + g_date_time_to_unix(dt);
+	gint timeout = atoi(argv[arg_idx++]);
+	pcapReplay->timeout = timeout + g_date_time_to_unix(dt);
+	pcapReplay->timeoutTime = g_get_monotonic_time() + (gint64)timeout * G_USEC_PER_SEC;
+	g_date_time_unref(dt);
 
-	// Get pcap paths and then open the file using pcap_open()
+	// Get pcap paths and then parse the files.
 	pcapReplay->nmb_pcap_file = argc-arg_idx;
-	// We open all the pcap file here in order to know directly if there is an error ;)
-	// The paths of the pcap file are stored in a queue as well as the pcap_t pointers.
-	// Path & pcap_t pointers are stored in the same order !
-	pcapReplay->pcapFilePathQueue = g_queue_new();
-	pcapReplay->pcapStructQueue = g_queue_new();
+	// We parse all the pcap files here in order to know directly if there is an error ;)
+	// Each file is read only once : the packets matching the IPs received in argument
+	// (or the flows matching the IPs/ports with --all-flows)
+	// are stored in a capture index which is then used for the whole experiment.
+	// The captures are shared with the other instances replaying the same files,
+	// and stored in the order they appear in arguments.
+	pcapReplay->captures = g_ptr_array_new();
+
+	if(pcapReplay->synthDir) {
+		pcapReplay->synth = pcap_synth_new(pcapReplay->synthDir, pcapReplay->synthSeed, pcapReplay->slogf);
+		if(pcapReplay->synth == NULL) {
+			pcap_replay_free(pcapReplay);
+			return NULL;
+		}
+	}
 
 	for(gint i=arg_idx; i < arg_idx+pcapReplay->nmb_pcap_file ;i++) {
-		// Open the pcap file 
-		pcap_t *pcap = NULL;
-		char ebuf[PCAP_ERRBUF_SIZE];
-		if ((pcap = pcap_open_offline(argv[i], ebuf)) == NULL) {
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
-					"Unable to open the pcap file :");
+		Pcap_Capture* capture = pcap_capture_acquire(argv[i], &pcapReplay->filter, pcapReplay->slogf);
+		if(capture == NULL) {
+			pcap_replay_free(pcapReplay);
 			return NULL;
-		} else {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"Pcap file opened (%s) ",argv[i]);
 		}
-		//Add the file paths & pcap_t pointer to the queues
-		g_queue_push_tail(pcapReplay->pcapFilePathQueue, g_string_new(argv[i]));
-		g_queue_push_tail(pcapReplay->pcapStructQueue, pcap);
+		g_ptr_array_add(pcapReplay->captures, capture);
 	}
 
-	// Attach the first pcap_t struct to the instance state
+	// Attach the first capture to the instance state
 	// The pcap files are used in the order the appear in arguments
-	pcapReplay->pcap = (pcap_t*) g_queue_peek_head(pcapReplay->pcapStructQueue);
+	pcapReplay->captureId = 0;
+	pcapReplay->capture = pcapReplay->synth ? pcap_synth_get_capture(pcapReplay->synth) :
+			g_ptr_array_index(pcapReplay->captures, 0);
+
+	/* Get first the first flow matching the IP:PORT received in argv 
+	 * Example : 
+	 * If in the pcap file the client have the IP:Port address 192.168.1.2:5555 
+	 * and the server have the IP:Port address 192.168.1.3:80. 
+	 * Then, if the plugin is instanciated as a client, the client needs to resend
+	 * the packet with ip.source=192.168.1.2 & ip.destination=192.168.1.3 & port.dest=80
+	 * to the remote server.
+	 * On the contrary, if the plugin is instanciated as a server, the server needs to wait
+	 * for a client connection. When the a client is connected, it starts to resend packets 
+	 * with ip.source=192.168.1.3 & ip.dest=192.168.1.2 & port.dest=5555 */
+	if(!pcapReplay->synth && (pcapReplay->capture == NULL || pcapReplay->capture->flows->len == 0)) {
+		// If there is no packet matching the IP.source & IP.dest & port.dest, then exits !
+		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+				"Cannot find one packet (in the pcap file) matching the IPs/Ports arguments ");
+		pcap_replay_free(pcapReplay);
+		return NULL;
+	}
 
 	/* If the first argument is equal to "client" 
 	 * Then create a new client instance of the  pcap replayer plugin */
@@ -723,28 +731,10 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 	}
 	is_instanciation_done = TRUE;
 
-	/* Get first the first pcap packet matching the IP:PORT received in argv 
-	 * Example : 
-	 * If in the pcap file the client have the IP:Port address 192.168.1.2:5555 
-	 * and the server have the IP:Port address 192.168.1.3:80. 
-	 * Then, if the plugin is instanciated as a client, the client needs to resend
-	 * the packet with ip.source=192.168.1.2 & ip.destination=192.168.1.3 & port.dest=80
-	 * to the remote server.
-	 * On the contrary, if the plugin is instanciated as a server, the server needs to wait
-	 * for a client connection. When the a client is connected, it starts to resend packets 
-	 * with ip.source=192.168.1.3 & ip.dest=192.168.1.2 & port.dest=5555 */
-	if(get_next_packet(pcapReplay)==FALSE) {
-		// If there is no packet matching the IP.source & IP.dest & port.dest, then exits !
-		is_instanciation_done=FALSE;
-		pcap_replay_free(pcapReplay);
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Cannot find one packet (in the pcap file) matching the IPs/Ports arguments ");
-		return NULL;
-	}
-
 	// Free the Strings used for comparaison
 	g_string_free((GString*)nodeType, TRUE);
 	g_string_free((GString*)client_str, TRUE);
+	g_string_free((GString*)clientTor_str, TRUE);
 	g_string_free((GString*)server_str, TRUE);
 
 	if(!is_instanciation_done) {
@@ -773,27 +763,34 @@ void pcap_replay_ready(Pcap_Replay* pcapReplay) {
 		for(gint i = 0; i < nfds; i++) {
 			gint d = epevs[i].data.fd;
 			uint32_t e = epevs[i].events;
-			if(d == pcapReplay->client.sd) {
-				_pcap_activateClient(pcapReplay, d, e);
-			} else {
+			if(d == pcapReplay->timerfd) {
+				_pcap_activateTimer(pcapReplay);
+			} else if(pcapReplay->statsTimerfd > 0 && d == pcapReplay->statsTimerfd) {
+				_pcap_activateStats(pcapReplay);
+			} else if(!pcapReplay->isClient && d == pcapReplay->server.sd) {
 				_pcap_activateServer(pcapReplay, d, e);
+			} else if(!pcapReplay->isClient && pcapReplay->server.udpSd > 0 && d == pcapReplay->server.udpSd) {
+				_pcap_activateUdpServer(pcapReplay);
+			} else {
+				/* the flow may have been freed by a previous event */
+				Pcap_Flow* flow = g_hash_table_lookup(pcapReplay->flows, GINT_TO_POINTER(d));
+				if(flow) {
+					_pcap_activateFlow(pcapReplay, flow, e);
+				}
+			}
+			if(pcapReplay->isDone) {
+				return;
 			}
 		}
 	}
-}
-
-void _pcap_client_epoll(Pcap_Replay* pcapReplay, gint operation, guint32 events) {
-	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
 
-	struct epoll_event ev;
-	memset(&ev, 0, sizeof(struct epoll_event));
-	ev.events = events;
-	ev.data.fd = pcapReplay->client.sd;
-
-	gint res = epoll_ctl(pcapReplay->ed, operation, pcapReplay->client.sd, &ev);
-	if(res == -1) {
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__, "error in client_epoll_ctl");
+	/*  If the timeout is reached, close the plugin ! */
+	GDateTime* dt = g_date_time_new_now_local();
+	if(g_date_time_to_unix(dt) >= pcapReplay->timeout) {
+		pcapReplay->slogf(G_LOG_LEVEL_INFO, __FUNCTION__,  "Timeout reached!");
+		deinstanciate(pcapReplay);
 	}
+	g_date_time_unref(dt);
 }
 
 void _pcap_server_epoll(Pcap_Replay* pcapReplay, gint operation, guint32 events) {
@@ -820,131 +817,95 @@ gboolean pcap_replay_isDone(Pcap_Replay* pcapReplay) {
 	return pcapReplay->isDone;
 }
 
+/* Frees all the flows, whether they have a socket, share the UDP socket of the server,
+ * or are waiting to connect (a flow can be in several of these tables) */
+static void _pcap_free_flows(Pcap_Replay* pcapReplay) {
+	GHashTable* flows = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTableIter iter;
+	gpointer key, value;
+	if(pcapReplay->flows) {
+		g_hash_table_iter_init(&iter, pcapReplay->flows);
+		while(g_hash_table_iter_next(&iter, &key, &value)) {
+			g_hash_table_add(flows, value);
+		}
+	}
+	if(pcapReplay->udpPeers) {
+		g_hash_table_iter_init(&iter, pcapReplay->udpPeers);
+		while(g_hash_table_iter_next(&iter, &key, &value)) {
+			g_hash_table_add(flows, value);
+		}
+	}
+	if(pcapReplay->schedule) {
+		GSequenceIter* seqIter = g_sequence_get_begin_iter(pcapReplay->schedule);
+		for(; !g_sequence_iter_is_end(seqIter); seqIter = g_sequence_iter_next(seqIter)) {
+			g_hash_table_add(flows, g_sequence_get(seqIter));
+		}
+	}
+	GList* list = g_hash_table_get_keys(flows);
+	for(GList* l = list; l != NULL; l = l->next) {
+		pcap_flow_free(pcapReplay, l->data);
+	}
+	g_list_free(list);
+	g_hash_table_destroy(flows);
+	pcapReplay->client.sd = 0;
+}
+
 void pcap_replay_free(Pcap_Replay* pcapReplay) {
 	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
 
+	_pcap_free_flows(pcapReplay);
+	if(pcapReplay->flows) {
+		g_hash_table_destroy(pcapReplay->flows);
+	}
+	if(pcapReplay->schedule) {
+		g_sequence_free(pcapReplay->schedule);
+	}
 	if(pcapReplay->ed) {
 		close(pcapReplay->ed);
 	}
-	if(pcapReplay->client.sd) {
-		close(pcapReplay->client.sd);
-	}
 	if(pcapReplay->server.sd) {
 		close(pcapReplay->server.sd);
 	}
+	if(pcapReplay->server.udpSd > 0) {
+		close(pcapReplay->server.udpSd);
+	}
+	if(pcapReplay->udpPeers) {
+		g_hash_table_destroy(pcapReplay->udpPeers);
+	}
+	if(pcapReplay->timerfd > 0) {
+		close(pcapReplay->timerfd);
+	}
+	if(pcapReplay->statsTimerfd > 0) {
+		close(pcapReplay->statsTimerfd);
+	}
 	if(pcapReplay->serverHostName) {
 		g_string_free(pcapReplay->serverHostName, TRUE);
 	}
-	while(!g_queue_is_empty(pcapReplay->pcapStructQueue)) {
-		pcap_t * pcap = g_queue_pop_head(pcapReplay->pcapStructQueue);
-		if(pcap) {
-			pcap_close(pcap);
-		}
-	}
-	while(!g_queue_is_empty(pcapReplay->pcapFilePathQueue)) {
-		GString * s = g_queue_pop_head(pcapReplay->pcapFilePathQueue);
-		if(s) {
-			g_string_free(s,TRUE);
+	if(pcapReplay->captures) {
+		for(guint i = 0; i < pcapReplay->captures->len; i++) {
+			pcap_capture_release(g_ptr_array_index(pcapReplay->captures, i));
 		}
+		g_ptr_array_free(pcapReplay->captures, TRUE);
 	}
-	g_queue_free(pcapReplay->pcapStructQueue);
-	g_queue_free(pcapReplay->pcapFilePathQueue);
+	pcap_synth_free(pcapReplay->synth);
+	g_free(pcapReplay->synthDir);
 	pcapReplay->magic = 0;
 	g_free(pcapReplay);
 }
 
-gboolean get_next_packet(Pcap_Replay* pcapReplay) {
-	/* Get first the first pcap packet matching the IP:PORT received in argv 
-	 * Example : 
-	 * If in the pcap file the client have the IP:Port address 192.168.1.2:5555 
-	 * and the server have the IP:Port address 192.168.1.3:80. 
-	 * Then, if the plugin is instanciated as a client, the client needs to resend
-	 * the packet with ip.source=192.168.1.2 & ip.destination=192.168.1.3 & port.dest=80
-	 * to the remote server.
-	 * On the contrary, if the plugin is instanciated as a server, the server needs to wait
-	 * for a client connection. When the a client is connected, it starts to resend packets 
-	 * with ip.source=192.168.1.3 & ip.dest=192.168.1.2 & port.dest=5555 */
-
-	struct pcap_pkthdr *header;
-	const u_char *pkt_data;
-	int size = 0;
-	gboolean exists = FALSE;
-
-	//tcp info
-	const struct sniff_ethernet *ethernet; /* The ethernet header */
-	const struct sniff_ip *ip; /* The IP header */
-	const struct sniff_tcp *tcp; /* The TCP header */
-	u_int size_ip_header;
-	u_int size_tcp_header;
-	u_int size_payload;
-	char *payload;
-
-	while((size = pcap_next_ex(pcapReplay->pcap, &header, &pkt_data)) >= 0) {
-		// There exists a next packet in the pcap file
-		// Retrieve header information
-		ethernet = (struct sniff_ethernet*)(pkt_data);
-
-		// ensure we are dealing with an ipv4 packet
-		if (ethernet->ether_type != 8) {
-			continue;
-		}
-
-		ip = (struct sniff_ip*)(pkt_data + SIZE_ETHERNET);
-		size_ip_header = IP_HL(ip)*4;
-
-		// ensure that we are dealing with tcp
-		if (ip->ip_p != '\x06') {
-			continue;
-		}
-
-		tcp = (struct sniff_tcp*)(pkt_data + SIZE_ETHERNET + size_ip_header);
-		size_tcp_header = TH_OFF(tcp)*4;
-		payload = (char *)(pkt_data + SIZE_ETHERNET + size_ip_header + size_tcp_header);
-		size_payload = ntohs(ip->ip_len) - (size_ip_header + size_tcp_header);
-
-		// Client scenario
-		if(pcapReplay->isClient) {
-			// check if this packet srcIP,destIP,destPort correspond to the arguments
-			if(pcapReplay->client_IP_in_pcap.s_addr == ip->ip_src.s_addr) {
-				if(pcapReplay->server_IP_in_pcap.s_addr == ip->ip_dst.s_addr) {
-					//if((ntohs(tcp->th_dport) == pcapReplay->server_port_in_pcap)) {
-						pcapReplay->nextPacket = g_new0(Custom_Packet_t, 1);
-						pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Found at least one matching packet in next_packet");
-						exists = TRUE;
-						pcapReplay->nextPacket->timestamp.tv_sec = header->ts.tv_sec;
-						pcapReplay->nextPacket->timestamp.tv_usec = header->ts.tv_usec;
-						pcapReplay->nextPacket->payload_size = size_payload;
-						pcapReplay->nextPacket->payload = payload;
-						break;
-					//}
-				}
-			}	
-		} 
-		// Server scenario 
-		else {
-			if(pcapReplay->server_IP_in_pcap.s_addr == ip->ip_src.s_addr) {
-				if(pcapReplay->client_IP_in_pcap.s_addr == ip->ip_dst.s_addr) {
-					//if((ntohs(tcp->th_dport) == pcapReplay->client_port_in_pcap)) {
-						pcapReplay->nextPacket = g_new0(Custom_Packet_t, 1);
-						pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Found at least one matching packet in next_packet");
-						exists = TRUE;
-						pcapReplay->nextPacket->timestamp.tv_sec = header->ts.tv_sec;
-						pcapReplay->nextPacket->timestamp.tv_usec = header->ts.tv_usec;
-						pcapReplay->nextPacket->payload_size = size_payload;
-						pcapReplay->nextPacket->payload = payload;
-						break;
-					//}
-				}
-			}		
-		}
-	} 
-	return exists;
-}
-
-void deinstanciate(Pcap_Replay* pcapReplay, gint sd) {
-	epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, sd, NULL);
-	close(sd);
-	pcapReplay->client.sd = 0;
+void deinstanciate(Pcap_Replay* pcapReplay) {
+	_pcap_free_flows(pcapReplay);
+	if(pcapReplay->timerfd > 0) {
+		epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->timerfd, NULL);
+		close(pcapReplay->timerfd);
+		pcapReplay->timerfd = 0;
+	}
+	if(pcapReplay->statsTimerfd > 0) {
+		epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->statsTimerfd, NULL);
+		close(pcapReplay->statsTimerfd);
+		pcapReplay->statsTimerfd = 0;
+	}
+	pcap_stats_log(&pcapReplay->stats, pcapReplay->slogf, G_LOG_LEVEL_MESSAGE, "all flows");
 	pcapReplay->isDone = TRUE;
 	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
 					"Plugin deinstanciated, exiting plugin !");
@@ -974,40 +935,21 @@ int timeval_subtract (struct timespec *result, struct timeval *y, struct timeval
 }
 
 gboolean change_pcap_file_to_send(Pcap_Replay* pcapReplay) {
-	pcap_t * pcap = g_queue_pop_head(pcapReplay->pcapStructQueue);
-	pcap_close(pcap);
-
-	pcap= NULL;
-	char ebuf[PCAP_ERRBUF_SIZE];
-	GString * pcap_to_reset = g_queue_peek_head(pcapReplay->pcapFilePathQueue);
-
-	if ((pcap = pcap_open_offline(pcap_to_reset->str, ebuf)) == NULL) {
-		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
-				"Unable to re-open the pcap file : %s",pcap_to_reset->str);
-		return FALSE;
-	} else{
-		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
-				"Successfully reset pcap file : %s",pcap_to_reset->str);
-
-		g_queue_push_tail(pcapReplay->pcapFilePathQueue,  g_queue_pop_head(pcapReplay->pcapFilePathQueue));
-		g_queue_push_tail(pcapReplay->pcapStructQueue, pcap);																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																				
+	/* The captures have been parsed at startup :
+	 * move to the next one, after the last one comes the first one again */
+	pcapReplay->captureId = (pcapReplay->captureId + 1) % pcapReplay->captures->len;
+	pcapReplay->capture = g_ptr_array_index(pcapReplay->captures, pcapReplay->captureId);
 
-		pcapReplay->pcap =  g_queue_peek_head(pcapReplay->pcapStructQueue);
-		return TRUE;
-	}
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"Successfully reset pcap file : %s", pcapReplay->capture->path->str);
+	return TRUE;
 }
 
-gboolean restart_server(Pcap_Replay* pcapReplay) {
+gboolean restart_server(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
 	/* The remote connection has been closed OR
 	 * The server have finished sending the current pcap file.
 	 * In these two cases, the server needs to restart and bind a new port. */
 
-	/* Time to wait before the server restart sending the next pcap file */
-	struct timespec ts; 
-	ts.tv_sec=50;
-	ts.tv_nsec=0;
-
-
 	/* UNCOMMENT IF YOU WANT THE CONNECTION TO BE CLOSED 
 	 * AND RESTARTED AFTER EACH PCAP FILE */
 
@@ -1022,15 +964,16 @@ gboolean restart_server(Pcap_Replay* pcapReplay) {
 		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Cannot change pcap file to send ! Exiting");
 		return FALSE;
 	};
-	// Load the first packet into the current state
-	if(!get_next_packet(pcapReplay)) {
+	// Replay the flow of the next pcap file on the same connection
+	if(pcapReplay->capture->flows->len == 0) {
 		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Cannot find a matching packet in the pcap file ! Exiting");
 		return FALSE;
 	}
-	// Sleep for ts seconds to make sure connection/port have been released
-	nanosleep((const struct timespec*)&ts,NULL); 
+	pcap_flow_set_index(flow, pcapReplay->capture, g_ptr_array_index(pcapReplay->capture->flows, 0));
+	// Stop replaying until the client sends the first packet of its next pcap file
+	// (the client waits before restarting, see restart_client())
+	flow->state = PCAP_FLOW_WAITING;
 	pcapReplay->isAllowedToSend = FALSE; // Need to wait for the first packet of the client !
-	pcapReplay->isFirstPacketReceived=FALSE;
 
 	/* UNCOMMENT IF YOU WANT THE CONNECTION TO BE CLOSED 
 	 * AND RESTARTED AFTER SENDING EACH PCAP FILE */
@@ -1050,10 +993,8 @@ gboolean restart_server(Pcap_Replay* pcapReplay) {
 
 }
 
-gboolean restart_client(Pcap_Replay* pcapReplay) {
-	struct timespec timewait; // Time to wait before isRestarting
-	timewait.tv_sec=60;
-	timewait.tv_nsec=0;
+gboolean restart_client(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	gint64 timewait = 60 * G_USEC_PER_SEC; // Time to wait before isRestarting
 
 	/* UNCOMMENT IF YOU WANT THE CONNECTION TO BE CLOSED 
 	 * AND RESTARTED AFTER SENDING EACH PCAP FILE */
@@ -1070,13 +1011,15 @@ gboolean restart_client(Pcap_Replay* pcapReplay) {
 		return FALSE;
 	};
 
-	if(!get_next_packet(pcapReplay)) {
+	if(pcapReplay->capture->flows->len == 0) {
 		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Cannot find a matching packet in the pcap file ! Exiting");
 		return FALSE;
 	}
+	pcap_flow_set_index(flow, pcapReplay->capture, g_ptr_array_index(pcapReplay->capture->flows, 0));
 
-	// Sleep for timeToWait before isRestarting the client 
-	nanosleep((const struct timespec*)&timewait,NULL); 
+	// Wait for timewait before replaying the next file : the pacing timer
+	// wakes us up, we keep receiving data in the meantime
+	pcap_flow_start(pcapReplay, flow, timewait);
 
 	/* UNCOMMENT IF YOU WANT THE CONNECTION TO BE CLOSED 
 	 * AND RESTARTED AFTER EACH PCAP FILE */
@@ -1106,176 +1049,3 @@ gboolean restart_client(Pcap_Replay* pcapReplay) {
 
 	return TRUE;
 }
-
-gboolean initiate_conn_to_proxy(Pcap_Replay* pcapReplay) {
-	/* This function is used to connect to the Tor proxy.
-	 * The client needs to respect the Socks5 protocol to create 
-	 * a remote connection through Tor. The negociation between the client 
-	 * and the proxy is done in 4 steps (described hereafter).
-	 *
-	 * - Note that this function is called right after the client connect() 
-	 *   to the Tor proxy. Then the client is already abble to communicate with the proxy
-	 * - This function will ask the Tor proxy to create a remote connection to the server.
-	 *   When the negociation is over, the client will be able to send data to the proxy 
-	 *   and the proxy will be in charge of "forwarding" the data to the remote server.
-	 * - Also note that is a *VERY VERY BASIC* implementation of the Socks negociation protocol. 
-	 *   This means that if something goes wrong when connecting to the proxy, the shadow experiment will fail!
-	 *   See shd-tgen-transport.c for more information about the negociation protocol !
-	 **/
-
-	/* Step 1)
-	* Send authentication (5,1,0) to Tor proxy (Socks V.5) */
-	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Start Socks5 negociation protocol : Send Auth message to the Tor proxy.");
-
-	gssize bytesSent = send_to_proxy(pcapReplay, "\x05\x01\x00", 3);
-	g_assert(bytesSent == 3);
-	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Step 1 : Finished : Authentication to Tor proxy succeeded.");
-
-
-	/* Step 2) 
-	 * socks choice client <-- server
-	 *
-	 * \x05 (version 5)
-	 * \x00 (auth method choice - \xFF means none supported)
-	 */
-	gchar step2_buffer[8];
-	memset(step2_buffer, 0, 8);
-	gssize bytesReceived = recv_from_proxy(pcapReplay, step2_buffer, 2);
-	g_assert(bytesReceived == 2);
-
-	// Verify answer (2)
-	if(step2_buffer[0] == 0x05 && step2_buffer[1] == 0x00) {
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Step 2 : Finished : Socks choice supported by the proxy");
-	} else {
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-				"Step 2 : Failed :Socks choice unsupported by the proxy ! Exiting ");
-		return FALSE;
-	}
-
-	/* Step 3)
-	 * socks request sent in (1) client --> server
-	 * \x05 (version 5)
-	 * \x01 (tcp stream)
-	 * \x00 (reserved) 
-	 *
-	 *	--> the client asks the server to connect to a remote server 
-	 * 3a) ip address client --> server
-	 *  \x01 (ipv4)
-	 * in_addr_t (4 bytes)
-	 * in_port_t (2 bytes)
-
-	 * 3b) hostname client --> server
-	 * \x03 (domain name)
-	 * \x__ (1 byte name len)
-	 * (name)
-	 * in_port_t (2 bytes)
-	 * 
-	 * We use method 3a !
-	 */
-
-	struct addrinfo* info;
-	int ret = getaddrinfo(pcapReplay->serverHostName->str, NULL, NULL, &info);
-	if(ret >= 0) {
-		pcapReplay->serverIP = ((struct sockaddr_in*)(info->ai_addr))->sin_addr.s_addr;
-	}
-	freeaddrinfo(info);
-
-	/* case 3a - IPv4 */
-	in_addr_t ip = pcapReplay->serverIP;
-	int new_port = pcapReplay->serverPortInt + pcapReplay->nmb_conn;
-	in_addr_t port = htons(new_port);
-	pcapReplay->nmb_conn = pcapReplay->nmb_conn+1;
-
-	gchar step3_buffer[16];
-	memset(step3_buffer, 0, 16);
-
-	g_memmove(&step3_buffer[0], "\x05\x01\x00\x01", 4);
-	g_memmove(&step3_buffer[4], &ip, 4);
-	g_memmove(&step3_buffer[8], &port, 2);
-
-	bytesSent = send_to_proxy(pcapReplay, step3_buffer, 10);
-	g_assert(bytesSent == 10);
-
-	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Step 3 : Finished : Send TCP create connection to remote server to the proxy.");
-
-	/*
-	* Step 4 : socks response client <-- server
-	* \x05 (version 5)
-	* \x00 (request granted)
-	* \x00 (reserved)
-	*
-	* --> the server can tell us that we need to reconnect elsewhere
-	*
-	* 4a) ip address client <-- server
-	* \x01 (ipv4)
-	* in_addr_t (4 bytes)
-	* in_port_t (2 bytes)
-	*
-	* 4b hostname client <-- server
-	* \x03 (domain name)
-	* \x__ (1 byte name len)
-	* (name)
-	* in_port_t (2 bytes)
-	*/
-
-	gchar step4_buffer[256];
-	memset(step4_buffer, 0, 256);
-   	bytesReceived = recv_from_proxy(pcapReplay, step4_buffer, 256);
-	g_assert(bytesReceived >= 4);
-
-	if(step4_buffer[0] == 0x05 && step4_buffer[1] == 0x00) {
-		// Request Granted by the proxy !
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Step 4 : Finished : TCP connection to remote server created.");
- 	} else {
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Step 4 : Error : TCP connection to remote server cannot be created.");
-		return FALSE;
-	}
-	return TRUE;
-}
-
-
-ssize_t send_packet(Custom_Packet_t* cp, gint sd) {
-	// Send the payload of the custom packet through the socket sd
-	char message[cp->payload_size];
-	memcpy(message, (const char*) cp->payload, (size_t)cp->payload_size);
-	return send(sd, message, (size_t)cp->payload_size, 0);
-}
-
-gssize send_to_proxy(Pcap_Replay* pcapReplay, gpointer buffer, gsize length) {
-	/* This function is used to send commands to the proxy 
-	 * Used during the negociation phase */
-	gssize bytes = write(pcapReplay->client.sd, buffer, length);
-
-	if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"unable to send command to the Tor proxy ! Exiting");
-		return -1;
-	}
-	if(bytes >= 0) {
-		pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
-				"Command sent to proxy : %s ",buffer);
-	}
-	return bytes;
-}
-
-gssize recv_from_proxy(Pcap_Replay* pcapReplay, gpointer buffer, gsize length) {
-	/* This function is used to receive commands from the proxy 
-	 * Used during the negociation phase */
-	gssize bytes = read(pcapReplay->client.sd, buffer, length);
-
-	if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
-				"unable to receive command from the Tor proxy ! Exiting");
-	}
-	if(bytes >= 0) {
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-				"Command received from the proxy");
-	}
-	return bytes;
-}
@@ -21,18 +21,204 @@
 #include <pcap.h> 
 #include <time.h>
 #include <netinet/tcp.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #define MTU 2000 // Size of the buffer for recv() function (in bytes)
 
 typedef void (*PcapReplayLogFunc)(GLogLevelFlags level, const char* functionName, const char* format, ...);
 
-/* Custom packets are used to store the packets we read in the pacp file */
+/* Custom packets describe the packets we read in the pacp file.
+ * The payload points in Pcap_Capture.payloadData, which stays valid for the whole experiment :
+ * the descriptors are never allocated on the send path (see Pcap_Flow.ring). */
 typedef struct Custom_Packet {
 	struct timeval timestamp;
 	char* payload;
 	gint payload_size;	
+	/* --causal : bytes the peer sent before this packet in the pcap file,
+	 * and the time elapsed since the last of them (usec, -1 if none) */
+	guint64 awaitBytes;
+	gint64 thinkTime;
 } Custom_Packet_t;
 
+/* Number of packet descriptors each flow prepares ahead of the one being sent */
+#define PCAP_PACKET_RING_SIZE 32
+
+/* Direction of a payload inside the replayed connection */
+typedef enum {
+	PCAP_DIR_CLIENT = 0, /* sent by the client in the pcap file */
+	PCAP_DIR_SERVER = 1, /* sent by the server in the pcap file */
+	PCAP_DIR_COUNT = 2
+} Pcap_Direction;
+
+/* A timeline holds the packets of one direction of the replayed connection.
+ * It is built once when the pcap file is loaded and is stored as flat arrays,
+ * so that stepping to the next packet to send is a simple array access. */
+typedef struct _Pcap_Timeline {
+	guint length; /* number of packets carrying a payload */
+	struct timeval start; /* timestamp of the first packet in the pcap file */
+	guint32* delta; /* time elapsed since the previous packet (in usec) */
+	guint64* offset; /* offset of the payload in Pcap_Capture.payloadData */
+	guint32* size; /* size of the payload (in bytes) */
+	guint64 bytes; /* sum of the payload sizes */
+} Pcap_Timeline;
+
+/* Identifies a TCP or UDP flow in the pcap file.
+ * IPs are stored in network order, ports in host order (0 means any port). */
+typedef struct _Pcap_Flow_Key {
+	struct in_addr clientIP;
+	struct in_addr serverIP;
+	gushort clientPort;
+	gushort serverPort;
+} Pcap_Flow_Key;
+
+/* The packets of one flow of a capture */
+typedef struct _Pcap_Flow_Index {
+	Pcap_Flow_Key key;
+	guint id; /* position of the flow in Pcap_Capture.flows */
+	guint8 protocol; /* IPPROTO_TCP or IPPROTO_UDP (--all-flows only) */
+	struct timeval first; /* timestamp of the first packet of the flow (SYN) */
+	struct timeval start; /* timestamp of the first payload of the flow, in any direction */
+	Pcap_Timeline timeline[PCAP_DIR_COUNT];
+	gboolean isMapped; /* the timelines point in Pcap_Capture.map (replay file) */
+} Pcap_Flow_Index;
+
+/* Selects the flows to replay in the pcap files */
+typedef struct _Pcap_Flow_Filter {
+	Pcap_Flow_Key key; /* 0 IPs/ports match any flow */
+	gboolean allFlows; /* replay every matching flow (otherwise all the packets between the two IPs) */
+} Pcap_Flow_Filter;
+
+/* A capture is the pre-parsed content of one pcap file.
+ * It is read only once loaded, and shared by all the instances of the process
+ * replaying the same file with the same filter (see pcap_capture_acquire()) */
+typedef struct _Pcap_Capture {
+	GString* path;
+	gchar* cacheKey; /* path & filter, NULL if the capture is not cached */
+	guint refcount; /* instances using the capture */
+	struct timeval start; /* timestamp of the first packet of the first flow */
+	/* payloads of the selected packets, stored contiguously.
+	 * The sizes are 64 bits : the captures can hold more than 4 GiB of payloads */
+	guchar* payloads; /* built when a pcap file is parsed */
+	guint64 payloadsAllocated; /* size of the payloads buffer */
+	const guchar* payloadData; /* payloads or in map */
+	guint64 payloadLength;
+	GPtrArray* flows; /* Pcap_Flow_Index*, in the order they started */
+	/* replay file (see pcap_format.c) mapped in memory, or NULL */
+	gpointer map;
+	gsize mapLength;
+} Pcap_Capture;
+
+/* Replay fidelity counters, see pcap_stats.c */
+#define PCAP_STATS_BUCKETS 25
+typedef struct _Pcap_Stats {
+	guint64 packetsSent;
+	guint64 packetsExpected;
+	guint64 bytesSent;
+	guint64 bytesExpected;
+	guint64 bytesReceived;
+	guint64 bytesReceivedExpected;
+	guint64 early; /* packets sent before their scheduled time */
+	guint64 lateSum; /* usec */
+	gint64 lateMax; /* usec */
+	guint64 lateHistogram[PCAP_STATS_BUCKETS];
+} Pcap_Stats;
+
+/* Life cycle of a replayed flow */
+typedef enum {
+	PCAP_FLOW_IDLE, /* client : waiting for the time to connect */
+	PCAP_FLOW_CONNECTING, /* client : connect() in progress */
+	PCAP_FLOW_PROXY, /* client-tor : Socks5 negotiation with the Tor proxy in progress */
+	PCAP_FLOW_HANDSHAKE, /* server : waiting for the flow identifier */
+	PCAP_FLOW_WAITING, /* server : waiting for the client to send its first packet */
+	PCAP_FLOW_REPLAYING,
+	PCAP_FLOW_FINISHED, /* everything was sent, waiting for the peer to close */
+	PCAP_FLOW_FAILED /* client : the connection failed, the flow is freed by the pacing timer */
+} Pcap_Flow_State;
+
+/* Size of the flow identifier sent by the client on each connection in --all-flows mode :
+ * the capture id and the flow id (network order) */
+#define PCAP_FLOW_PREAMBLE_SIZE 8
+
+/* UDP flows (see pcap_udp.c) : datagrams read by a single recvmmsg(),
+ * how long a flow which sent everything waits for the datagrams of the peer,
+ * and the delay before sending again when the socket of the server is full (usec) */
+#define PCAP_UDP_BATCH 32
+#define PCAP_UDP_LINGER (10 * G_USEC_PER_SEC)
+#define PCAP_UDP_RETRY 1000
+
+/* Synthetic workload (see pcap_synth.c) : the distributions fitted on the captures by
+ * pcap_replay-fit, one CDF file each in the same directory (format of the filetransfer plugin) */
+#define PCAP_SYNTH_REQUEST_SIZES "request-sizes.cdf" /* bytes the client sends before each response */
+#define PCAP_SYNTH_RESPONSE_SIZES "response-sizes.cdf" /* bytes of each response */
+#define PCAP_SYNTH_RESPONSE_TIMES "response-times.cdf" /* msec between the end of a request and its response */
+#define PCAP_SYNTH_EXCHANGES "flow-exchanges.cdf" /* requests/responses in a flow */
+#define PCAP_SYNTH_DURATIONS "flow-durations.cdf" /* msec between the first and the last request of a flow */
+#define PCAP_SYNTH_INTERARRIVALS "flow-interarrivals.cdf" /* msec between the starts of two flows */
+/* Largest payload of a synthetic packet, and shortest time between two synthetic flows (usec) */
+#define PCAP_SYNTH_SEGMENT 16384
+#define PCAP_SYNTH_MIN_INTERARRIVAL 100
+
+typedef struct _Pcap_Synth Pcap_Synth;
+
+/* Room for the Socks5 replies of the Tor proxy, the longest response carries a domain name */
+#define PCAP_SOCKS_BUFFER_SIZE 272
+
+/* A connection replaying one flow of a capture */
+typedef struct _Pcap_Flow {
+	Pcap_Flow_State state;
+	Pcap_Capture* capture;
+	Pcap_Flow_Index* index;
+	gboolean isIndexOwned; /* synthetic flow : the index is freed with the flow */
+	Pcap_Direction dir; /* the direction we replay */
+	gint sd;
+	/* UDP flow : each payload is sent as one datagram.
+	 * On the server, the flows share server.udpSd (sd is -1) and are found by the address of the client */
+	gboolean isDatagram;
+	struct sockaddr_in peer;
+
+	/* position of the next packet to load from the timeline */
+	guint cursor;
+	struct timeval cursorTimestamp; // timestamp of the last packet loaded in the ring
+	/* Packets loaded ahead from the timeline, starting at ringHead.
+	 * The first one is nextPacket, see get_next_packet() & pcap_flow_peek_packet() */
+	Custom_Packet_t ring[PCAP_PACKET_RING_SIZE];
+	guint ringHead;
+	guint ringLength;
+	/* nextPacket is a pointer to the next packet to send (in ring) */
+	Custom_Packet_t* nextPacket;
+	gint sendOffset; /* bytes of nextPacket already sent */
+
+	/* --causal : position in the timeline of the peer, to know what each packet waits for */
+	guint peerCursor;
+	struct timeval peerTimestamp; // timestamp of the last packet of the peer before cursorTimestamp
+	guint64 peerBytes; // bytes sent by the peer before cursorTimestamp
+	guint64 received; /* bytes received since the flow was rewound */
+	guint64 gateBytes; /* awaitBytes of the last turn whose response was received ... */
+	gint64 gateTime; /* ... at this monotonic time (usec) */
+
+	gint64 replayStart; /* monotonic time (usec) at which the first payload of the flow is replayed */
+	gint64 dueTime; /* monotonic time (usec) at which the flow is activated by the pacing timer */
+	GSequenceIter* scheduled; /* position in Pcap_Replay.schedule, or NULL */
+	guint32 events; /* events watched on sd */
+	gboolean isWaitingOut; /* a send would block, we wait for EPOLLOUT */
+	gboolean isPeerClosed;
+
+	guchar preamble[PCAP_FLOW_PREAMBLE_SIZE];
+	guint preambleLength; /* bytes of the preamble already sent/received */
+
+	/* client-tor : the Socks5 request to send, then the replies received (see pcap_socks.c) */
+	guchar socks[PCAP_SOCKS_BUFFER_SIZE];
+	guint socksLength;
+	guint socksSent;
+	gboolean isSocksSending;
+
+	Pcap_Stats stats;
+} Pcap_Flow;
+
 /* all state for the pcap replayer is stored here */
 typedef struct _Pcap_Replay {
 	guint magic;
@@ -46,27 +232,54 @@ typedef struct _Pcap_Replay {
 
 	/* Timeout of the pcap replayer. Instance stops when timeout is reached */
 	guint64 timeout;
+	gint64 timeoutTime; /* the timeout on the monotonic clock (usec) */
 
 	gboolean isClient; /* client or server */
 	gboolean isTorClient; /* normal client or tor-client */
 	gboolean isAllowedToSend;
-	gboolean isFirstPacketReceived;
 	gboolean isRestarting; /* Is the server/client is in restarting state ? */
 	gboolean isDone; /* our client/server has finished or timeout occured, we can exit */
 	gint nmb_conn; /* Number of connections already made */
 
-	/* The following queues are used to keep tack of the pcap files
-	 * the plugin has to send */
-	GQueue* pcapStructQueue;
-	GQueue* pcapFilePathQueue;
-
-	/* Pcap structure that is used to progress in the pcap file */
- 	pcap_t *pcap; // Current pcap structure in use 	
+	/* The pcap files the plugin has to send, in the order they appear in arguments.
+	 * The files are parsed once at startup, the captures are shared with the other instances. */
+	GPtrArray* captures;
+	guint captureId; // Position of the current capture in captures
+	Pcap_Capture* capture; // Current capture in use
 	gint nmb_pcap_file; // nmb of pcap files received in argument
 
-	/* nextPacket is a pointer to the next packet to send 
-	 * See get_next_packet() */
-	Custom_Packet_t * nextPacket;
+	/* The flows to replay in the pcap files */
+	Pcap_Flow_Filter filter;
+
+	/* --synthetic : flows generated from the distributions of synthDir instead of the pcap files.
+	 * Both sides derive the content of each flow from the seed and its id. */
+	gchar* synthDir;
+	guint32 synthSeed;
+	Pcap_Synth* synth;
+
+	/* Flows being replayed, indexed by socket descriptor */
+	GHashTable* flows;
+	/* server : UDP flows, indexed by the address of the client (struct sockaddr_in*) */
+	GHashTable* udpPeers;
+	guint activeFlows; /* client : flows of the current capture not finished yet */
+
+	/* Packets due within coalesceWindow (usec) are sent together, 0 disables it */
+	gint64 coalesceWindow;
+	/* The packets are replayed speed times faster than in the pcap files,
+	 * or as fast as possible in max-rate mode */
+	gdouble speed;
+	gboolean isMaxRate;
+	/* Each packet waits for the bytes the peer sent before it in the pcap file */
+	gboolean isCausal;
+
+	/* Replay fidelity of all the flows, logged every statsInterval sec (0 : only at exit) */
+	Pcap_Stats stats;
+	gint statsInterval;
+	gint statsTimerfd;
+
+	/* Pacing timer (timerfd watched by ed), it expires when the first flow of schedule is due */
+	gint timerfd;
+	GSequence* schedule; /* Pcap_Flow*, ordered by dueTime */
 
 	/* Infos used by the client to connect to the Tor proxy */
 	in_addr_t proxyIP; /* stored in network order */
@@ -92,6 +305,7 @@ typedef struct _Pcap_Replay {
 	/* Infos used by the pcap server */
 	struct {
 		int sd; /* Socket descriptor to listen to connecting client */
+		int udpSd; /* --all-flows : socket receiving the datagrams of the UDP flows */
 	} server;
 } Pcap_Replay;
 
@@ -101,31 +315,86 @@ gboolean pcap_StartClient(Pcap_Replay* pcapReplay);
 gboolean pcap_StartServer(Pcap_Replay* pcapReplay);
 gboolean pcap_StartClientTor(Pcap_Replay* pcapReplay);
 
-gboolean restart_server(Pcap_Replay* pcapReplay);
-gboolean restart_client(Pcap_Replay* pcapReplay);
+gboolean restart_server(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+gboolean restart_client(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
 
-/* Tor client specific */
-gboolean initiate_conn_to_proxy(Pcap_Replay* pcapReplay);
-gssize send_to_proxy(Pcap_Replay* pcapReplay, gpointer buffer, gsize length);
-gssize recv_from_proxy(Pcap_Replay* pcapReplay, gpointer buffer, gsize length);
+/* Tor client specific, see pcap_socks.c */
+gint pcap_socks_start(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+gint pcap_socks_continue(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
 
 void pcap_replay_ready(Pcap_Replay* pcapReplay);
-void _pcap_activateClient(Pcap_Replay* pcapReplay, gint sd, uint32_t events);
+void _pcap_activateFlow(Pcap_Replay* pcapReplay, Pcap_Flow* flow, uint32_t events);
 void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t events);
+void _pcap_activateTimer(Pcap_Replay* pcapReplay);
+void _pcap_activateStats(Pcap_Replay* pcapReplay);
+void _pcap_activateUdpServer(Pcap_Replay* pcapReplay);
+gboolean pcap_replay_identify_flow(Pcap_Replay* pcapReplay, Pcap_Flow* flow, guint8 protocol);
 
 gint pcap_replay_getEpollDescriptor(Pcap_Replay* pcapReplay);
 void _pcap_server_epoll(Pcap_Replay* pcapReplay, gint operation, guint32 events);
-void _pcap_client_epoll(Pcap_Replay* pcapReplay, gint operation, guint32 events);
 
-gboolean get_next_packet(Pcap_Replay* pcapReplay);
-ssize_t send_packet(Custom_Packet_t* cp, gint sd);
 gboolean change_pcap_file_to_send(Pcap_Replay* pcapReplay);
 void compute_wait_time(struct timeval tv1, struct timeval tv2, struct timespec res);
 int timeval_subtract (struct timespec *result, struct timeval *y, struct timeval *x);
 
+/* pcap file indexing, see pcap_index.c */
+Pcap_Capture* pcap_capture_load(const gchar* path, Pcap_Flow_Filter* filter, PcapReplayLogFunc slogf);
+void pcap_capture_free(Pcap_Capture* capture);
+Pcap_Capture* pcap_capture_acquire(const gchar* path, Pcap_Flow_Filter* filter, PcapReplayLogFunc slogf);
+void pcap_capture_release(Pcap_Capture* capture);
+gboolean pcap_flow_filter_match(Pcap_Flow_Filter* filter, Pcap_Flow_Key* key);
+void pcap_flow_index_free(Pcap_Flow_Index* index);
+
+/* compressed captures (gzip, zstd), see pcap_stream.c */
+gboolean pcap_stream_is_compressed(const gchar* path);
+FILE* pcap_stream_open(const gchar* path, PcapReplayLogFunc slogf);
+
+/* replay files, see pcap_format.c */
+gboolean pcap_format_is_replay_file(const gchar* path);
+Pcap_Capture* pcap_format_load(const gchar* path, Pcap_Flow_Filter* filter, PcapReplayLogFunc slogf);
+gboolean pcap_format_write(Pcap_Capture* capture, const gchar* path, PcapReplayLogFunc slogf);
+
+/* replay of the flows, see pcap_flow.c */
+Pcap_Flow* pcap_flow_new(Pcap_Replay* pcapReplay, Pcap_Capture* capture, Pcap_Flow_Index* index, gint sd);
+void pcap_flow_free(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+void pcap_flow_set_socket(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint sd, guint32 events);
+void pcap_flow_watch(Pcap_Replay* pcapReplay, Pcap_Flow* flow, guint32 events);
+void pcap_flow_set_index(Pcap_Flow* flow, Pcap_Capture* capture, Pcap_Flow_Index* index);
+void pcap_flow_schedule(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint64 when);
+gint64 pcap_replay_scale_time(Pcap_Replay* pcapReplay, gint64 offset);
+void pcap_flow_start(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint64 delay);
+gboolean pcap_flow_connect(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+void pcap_flow_send_due_packets(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+gssize pcap_flow_drain(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+void pcap_replay_flow_done(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+void pcap_flow_linger(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+
+/* UDP flows, see pcap_udp.c */
+gboolean pcap_udp_listen(Pcap_Replay* pcapReplay);
+gboolean pcap_udp_connect(Pcap_Replay* pcapReplay, Pcap_Flow* flow);
+void pcap_udp_activate_flow(Pcap_Replay* pcapReplay, Pcap_Flow* flow, uint32_t events);
+gint pcap_udp_send(Custom_Packet_t* cps[], guint count, gint sd, struct sockaddr_in* peer);
+
+/* synthetic workload, see pcap_synth.c */
+Pcap_Synth* pcap_synth_new(const gchar* dir, guint32 seed, PcapReplayLogFunc slogf);
+void pcap_synth_free(Pcap_Synth* synth);
+Pcap_Capture* pcap_synth_get_capture(Pcap_Synth* synth);
+Pcap_Flow_Index* pcap_synth_flow_index(Pcap_Synth* synth, guint id);
+void pcap_synth_schedule_next(Pcap_Replay* pcapReplay, gint64 after);
+
+/* replay fidelity, see pcap_stats.c */
+void pcap_stats_expect(Pcap_Stats* stats, Pcap_Timeline* sent, Pcap_Timeline* received);
+void pcap_stats_packet_sent(Pcap_Stats* stats, gint size, gint64 lateness);
+void pcap_stats_received(Pcap_Stats* stats, gssize size);
+void pcap_stats_log(Pcap_Stats* stats, PcapReplayLogFunc slogf, GLogLevelFlags level, const gchar* name);
+
+gboolean get_next_packet(Pcap_Flow* flow);
+Custom_Packet_t* pcap_flow_peek_packet(Pcap_Flow* flow, guint n);
+ssize_t send_packets(Custom_Packet_t* cps[], guint count, gint sd, gint offset);
+
 gboolean pcap_replay_isDone(Pcap_Replay* h); 
 void pcap_replay_free(Pcap_Replay* h); 
-void deinstanciate(Pcap_Replay* pcapReplay, gint sd);
+void deinstanciate(Pcap_Replay* pcapReplay);
 
 
 /* The following structures are dedicated to parse the pcap file easily */
@@ -138,6 +407,16 @@ struct sniff_ethernet {
 	u_short ether_type; /* IP? ARP? RARP? etc */
 };
 
+/* Other link layers (see pcap_index.c) */
+#define SIZE_LINUX_SLL 16 /* Linux cooked capture, the protocol is in the last 2 bytes */
+#define SIZE_LINUX_SLL2 20 /* Linux cooked capture v2, the protocol is in the first 2 bytes */
+#define SIZE_LOOPBACK 4 /* BSD loopback, the address family of the packet */
+#define SIZE_VLAN 4 /* 802.1Q tag : TCI & encapsulated ether type */
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define ETHERTYPE_QINQ_OLD 0x9100
+
 /* IP header */
 struct sniff_ip {
 	u_char ip_vhl;	  /* version << 4 | header length >> 2 */
@@ -158,6 +437,15 @@ struct sniff_ip {
 #define IP_HL(ip)	   (((ip)->ip_vhl) & 0x0f)
 #define IP_V(ip)		(((ip)->ip_vhl) >> 4)
 
+/* UDP header */
+#define SIZE_UDP 8
+struct sniff_udp {
+	u_short uh_sport; /* source port */
+	u_short uh_dport; /* destination port */
+	u_short uh_ulen; /* length of the header & payload */
+	u_short uh_sum; /* checksum */
+};
+
 /* TCP header */
 struct sniff_tcp {
 	u_short th_sport;   /* source port */
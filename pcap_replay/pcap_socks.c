@@ -0,0 +1,157 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* In client-tor mode, each flow connects to the Tor SocksPort and asks the proxy
+ * to connect to the server with the Socks5 protocol (see shd-tgen-transport.c) :
+ *
+ * 1) socks greeting client --> proxy
+ *    \x05 (version 5) \x01 (1 auth method) \x00 (no auth)
+ * 2) socks choice client <-- proxy
+ *    \x05 (version 5) \x00 (auth method choice - \xFF means none supported)
+ * 3) socks request client --> proxy
+ *    \x05 (version 5) \x01 (tcp stream) \x00 (reserved)
+ *    \x01 (ipv4) in_addr_t (4 bytes) in_port_t (2 bytes)
+ * 4) socks response client <-- proxy
+ *    \x05 (version 5) \x00 (request granted) \x00 (reserved)
+ *    \x01 (ipv4) in_addr_t (4 bytes) in_port_t (2 bytes)
+ *    or \x03 (domain name) \x__ (1 byte name len) (name) in_port_t (2 bytes)
+ *    or \x04 (ipv6) (16 bytes) in_port_t (2 bytes)
+ *
+ * The negotiation never blocks : it is driven by the events of the flow socket.
+ * The greeting and the request are sent together without waiting for the choice
+ * of the proxy (we only offer "no auth"), so it takes a single round trip.
+ * The replies are read exactly, the data of the server following them is left
+ * in the socket for pcap_flow_drain(). */
+
+#define PCAP_SOCKS_GREETING_SIZE 3
+#define PCAP_SOCKS_REQUEST_SIZE 10
+#define PCAP_SOCKS_CHOICE_SIZE 2
+/* the response up to the first byte of the address */
+#define PCAP_SOCKS_RESPONSE_HEADER_SIZE 5
+
+/* Length of the replies (choice + response), once the header of the response is received */
+static guint _pcap_socks_replies_length(Pcap_Flow* flow) {
+	const guchar* response = &flow->socks[PCAP_SOCKS_CHOICE_SIZE];
+	switch(response[3]) {
+		case 0x01:
+			return PCAP_SOCKS_CHOICE_SIZE + 4 + 4 + 2;
+		case 0x03:
+			return PCAP_SOCKS_CHOICE_SIZE + 4 + 1 + response[4] + 2;
+		case 0x04:
+			return PCAP_SOCKS_CHOICE_SIZE + 4 + 16 + 2;
+		default:
+			return 0;
+	}
+}
+
+/* Sends what remains of the greeting & request, returns FALSE on error */
+static gboolean _pcap_socks_send(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	while(flow->socksSent < flow->socksLength) {
+		ssize_t numBytes = send(flow->sd, &flow->socks[flow->socksSent],
+				flow->socksLength - flow->socksSent, MSG_NOSIGNAL);
+		if(numBytes < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"Unable to send the Socks request to the Tor proxy");
+			return FALSE;
+		}
+		flow->socksSent += numBytes;
+	}
+	/* once sent, the buffer receives the replies */
+	if(flow->socksSent == flow->socksLength) {
+		flow->socksLength = 0;
+	}
+	return TRUE;
+}
+
+/* pcap_socks_start() is called when the flow is connected to the Tor proxy.
+ * It sends the greeting and the request to connect to the server at once.
+ * Returns like pcap_socks_continue(). */
+gint pcap_socks_start(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	in_addr_t ip = pcapReplay->serverIP;
+	in_port_t port = pcapReplay->serverPort;
+
+	memcpy(&flow->socks[0], "\x05\x01\x00", PCAP_SOCKS_GREETING_SIZE);
+	memcpy(&flow->socks[PCAP_SOCKS_GREETING_SIZE], "\x05\x01\x00\x01", 4);
+	memcpy(&flow->socks[PCAP_SOCKS_GREETING_SIZE + 4], &ip, 4);
+	memcpy(&flow->socks[PCAP_SOCKS_GREETING_SIZE + 8], &port, 2);
+	flow->socksLength = PCAP_SOCKS_GREETING_SIZE + PCAP_SOCKS_REQUEST_SIZE;
+	flow->socksSent = 0;
+	flow->isSocksSending = TRUE;
+	flow->state = PCAP_FLOW_PROXY;
+
+	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+			"Connected to the Tor proxy, sending the Socks5 greeting & request");
+	return pcap_socks_continue(pcapReplay, flow);
+}
+
+/* pcap_socks_continue() carries on the negotiation when the socket of the flow is ready.
+ * Returns 1 when the proxy is connected to the server, 0 if we need to wait, -1 on error. */
+gint pcap_socks_continue(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	if(flow->isSocksSending) {
+		if(!_pcap_socks_send(pcapReplay, flow)) {
+			return -1;
+		}
+		if(flow->socksLength > 0) {
+			/* the kernel buffer is full */
+			pcap_flow_watch(pcapReplay, flow, EPOLLIN|EPOLLOUT);
+			return 0;
+		}
+		flow->isSocksSending = FALSE;
+		pcap_flow_watch(pcapReplay, flow, EPOLLIN);
+	}
+
+	/* Read the choice & the response, but nothing after them */
+	while(1) {
+		guint needed = PCAP_SOCKS_CHOICE_SIZE + PCAP_SOCKS_RESPONSE_HEADER_SIZE;
+		if(flow->socksLength >= needed) {
+			needed = _pcap_socks_replies_length(flow);
+		}
+		if(needed == 0) {
+			pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"Invalid Socks response from the Tor proxy");
+			return -1;
+		}
+
+		if(flow->socksLength >= PCAP_SOCKS_CHOICE_SIZE &&
+				(flow->socks[0] != 0x05 || flow->socks[1] != 0x00)) {
+			pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"Socks choice unsupported by the Tor proxy");
+			return -1;
+		}
+		if(flow->socksLength >= PCAP_SOCKS_CHOICE_SIZE + 2 &&
+				(flow->socks[2] != 0x05 || flow->socks[3] != 0x00)) {
+			pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"TCP connection to remote server cannot be created by the Tor proxy (error %d)",
+					(gint) flow->socks[3]);
+			return -1;
+		}
+		if(flow->socksLength == needed) {
+			break;
+		}
+
+		ssize_t numBytes = recv(flow->sd, &flow->socks[flow->socksLength], needed - flow->socksLength, 0);
+		if(numBytes == 0) {
+			pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"The Tor proxy closed the connection during the Socks negotiation");
+			return -1;
+		} else if(numBytes < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+					"Unable to receive the Socks response from the Tor proxy");
+			return -1;
+		}
+		flow->socksLength += numBytes;
+	}
+
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"TCP connection to remote server created by the Tor proxy");
+	return 1;
+}
@@ -0,0 +1,79 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+
+/* The replay statistics measure how faithfully the capture is reproduced :
+ * the bytes sent & received compared to the capture, and the lateness
+ * (actual send time - scheduled send time) of the packets.
+ * The lateness histogram uses power of 2 buckets : bucket i counts the
+ * packets sent between 2^(i-1) and 2^i usec late (bucket 0 : less than 1 usec). */
+
+void pcap_stats_expect(Pcap_Stats* stats, Pcap_Timeline* sent, Pcap_Timeline* received) {
+	stats->packetsExpected += sent->length;
+	stats->bytesExpected += sent->bytes;
+	stats->bytesReceivedExpected += received->bytes;
+}
+
+void pcap_stats_packet_sent(Pcap_Stats* stats, gint size, gint64 lateness) {
+	stats->packetsSent++;
+	stats->bytesSent += size;
+
+	if(lateness < 0) {
+		/* sent ahead of time with the previous packets (coalescing window) */
+		stats->early++;
+		return;
+	}
+	stats->lateSum += lateness;
+	stats->lateMax = MAX(stats->lateMax, lateness);
+
+	guint bucket = 0;
+	while(lateness > 0 && bucket < PCAP_STATS_BUCKETS - 1) {
+		lateness >>= 1;
+		bucket++;
+	}
+	stats->lateHistogram[bucket]++;
+}
+
+void pcap_stats_received(Pcap_Stats* stats, gssize size) {
+	stats->bytesReceived += size;
+}
+
+void pcap_stats_log(Pcap_Stats* stats, PcapReplayLogFunc slogf, GLogLevelFlags level, const gchar* name) {
+	guint64 late = stats->packetsSent - stats->early;
+
+	slogf(level, __FUNCTION__,
+			"Replay stats (%s) : sent %"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT" packets, "
+			"%"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT" bytes, received %"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT" bytes, "
+			"lateness avg %"G_GUINT64_FORMAT" usec max %"G_GINT64_FORMAT" usec, %"G_GUINT64_FORMAT" sent early",
+			name, stats->packetsSent, stats->packetsExpected, stats->bytesSent, stats->bytesExpected,
+			stats->bytesReceived, stats->bytesReceivedExpected,
+			late > 0 ? stats->lateSum / late : 0, stats->lateMax, stats->early);
+
+	if(late == 0) {
+		return;
+	}
+
+	/* Only the non empty buckets, e.g. "<1us:12 <64us:3 >=8s:1" */
+	GString* histogram = g_string_new(NULL);
+	for(guint i = 0; i < PCAP_STATS_BUCKETS; i++) {
+		if(stats->lateHistogram[i] == 0) {
+			continue;
+		}
+		guint64 bound = (guint64)1 << (i == PCAP_STATS_BUCKETS - 1 ? i - 1 : i);
+		const gchar* op = (i == PCAP_STATS_BUCKETS - 1) ? ">=" : "<";
+		if(bound >= 1000000) {
+			g_string_append_printf(histogram, " %s%"G_GUINT64_FORMAT"s:%"G_GUINT64_FORMAT,
+					op, bound / 1000000, stats->lateHistogram[i]);
+		} else if(bound >= 1000) {
+			g_string_append_printf(histogram, " %s%"G_GUINT64_FORMAT"ms:%"G_GUINT64_FORMAT,
+					op, bound / 1000, stats->lateHistogram[i]);
+		} else {
+			g_string_append_printf(histogram, " %s%"G_GUINT64_FORMAT"us:%"G_GUINT64_FORMAT,
+					op, bound, stats->lateHistogram[i]);
+		}
+	}
+	slogf(level, __FUNCTION__, "Lateness histogram (%s) :%s", name, histogram->str);
+	g_string_free(histogram, TRUE);
+}
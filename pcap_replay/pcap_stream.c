@@ -0,0 +1,166 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#define _GNU_SOURCE /* fopencookie() */
+#include "pcap_replay.h"
+#include <zlib.h>
+#ifdef PCAP_REPLAY_ZSTD
+#include <zstd.h>
+#endif
+
+/* Compressed captures are decoded while libpcap reads them : pcap_stream_open() returns
+ * a FILE* whose reads decompress the next bytes of the file (see fopencookie()), so the
+ * decompressed capture is never written to disk nor held in memory, only a buffer of
+ * compressed data. gzip files are decoded with zlib, zstd files with libzstd when the
+ * plugin is built with it. The format is found from the magic bytes, not the file name. */
+
+/* Compressed bytes read from the file at once */
+#define PCAP_STREAM_BUFFER (128 * 1024)
+
+typedef enum {
+	PCAP_STREAM_PLAIN,
+	PCAP_STREAM_GZIP, /* 1f 8b */
+	PCAP_STREAM_ZSTD /* 28 b5 2f fd */
+} Pcap_Stream_Format;
+
+static Pcap_Stream_Format _pcap_stream_format(const gchar* path) {
+	guchar magic[4];
+	FILE* file = fopen(path, "rb");
+	if(file == NULL) {
+		return PCAP_STREAM_PLAIN;
+	}
+	gsize length = fread(magic, 1, sizeof(magic), file);
+	fclose(file);
+
+	if(length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+		return PCAP_STREAM_GZIP;
+	} else if(length == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+		return PCAP_STREAM_ZSTD;
+	}
+	return PCAP_STREAM_PLAIN;
+}
+
+/* TRUE if the file must be read with pcap_stream_open() */
+gboolean pcap_stream_is_compressed(const gchar* path) {
+	return _pcap_stream_format(path) != PCAP_STREAM_PLAIN;
+}
+
+static ssize_t _pcap_stream_gzip_read(void* cookie, char* buffer, size_t size) {
+	gzFile gz = cookie;
+	/* gzread() reads at most UINT_MAX bytes */
+	int length = gzread(gz, buffer, (unsigned) MIN(size, (size_t)G_MAXINT));
+	if(length < 0) {
+		errno = EIO;
+		return -1;
+	}
+	return length;
+}
+
+static int _pcap_stream_gzip_close(void* cookie) {
+	return gzclose((gzFile) cookie) == Z_OK ? 0 : EOF;
+}
+
+static FILE* _pcap_stream_gzip_open(const gchar* path, PcapReplayLogFunc slogf) {
+	gzFile gz = gzopen(path, "rb");
+	if(gz == NULL) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to open the gzip file (%s)", path);
+		return NULL;
+	}
+	gzbuffer(gz, PCAP_STREAM_BUFFER);
+
+	cookie_io_functions_t functions = {_pcap_stream_gzip_read, NULL, NULL, _pcap_stream_gzip_close};
+	FILE* stream = fopencookie(gz, "rb", functions);
+	if(stream == NULL) {
+		gzclose(gz);
+	}
+	return stream;
+}
+
+#ifdef PCAP_REPLAY_ZSTD
+typedef struct _Pcap_Zstd_Stream {
+	FILE* file;
+	ZSTD_DCtx* context;
+	ZSTD_inBuffer in; /* compressed bytes read from the file and not decoded yet */
+	guchar* data;
+	gboolean isEof;
+} Pcap_Zstd_Stream;
+
+static ssize_t _pcap_stream_zstd_read(void* cookie, char* buffer, size_t size) {
+	Pcap_Zstd_Stream* zs = cookie;
+	ZSTD_outBuffer out = {buffer, size, 0};
+
+	while(out.pos < out.size) {
+		if(zs->in.pos == zs->in.size && !zs->isEof) {
+			zs->in.size = fread(zs->data, 1, PCAP_STREAM_BUFFER, zs->file);
+			zs->in.pos = 0;
+			if(zs->in.size == 0) {
+				if(ferror(zs->file)) {
+					errno = EIO;
+					return -1;
+				}
+				zs->isEof = TRUE;
+			}
+		}
+		/* once the file is read, the decoder may still flush the bytes it holds */
+		size_t produced = out.pos;
+		size_t ret = ZSTD_decompressStream(zs->context, &out, &zs->in);
+		if(ZSTD_isError(ret)) {
+			errno = EIO;
+			return -1;
+		}
+		if(zs->isEof && out.pos == produced) {
+			break;
+		}
+	}
+	return (ssize_t) out.pos;
+}
+
+static int _pcap_stream_zstd_close(void* cookie) {
+	Pcap_Zstd_Stream* zs = cookie;
+	int ret = fclose(zs->file);
+	ZSTD_freeDCtx(zs->context);
+	g_free(zs->data);
+	g_free(zs);
+	return ret;
+}
+
+static FILE* _pcap_stream_zstd_open(const gchar* path, PcapReplayLogFunc slogf) {
+	FILE* file = fopen(path, "rb");
+	if(file == NULL) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to open the zstd file (%s)", path);
+		return NULL;
+	}
+	Pcap_Zstd_Stream* zs = g_new0(Pcap_Zstd_Stream, 1);
+	zs->file = file;
+	zs->context = ZSTD_createDCtx();
+	zs->data = g_malloc(PCAP_STREAM_BUFFER);
+	zs->in.src = zs->data;
+
+	cookie_io_functions_t functions = {_pcap_stream_zstd_read, NULL, NULL, _pcap_stream_zstd_close};
+	FILE* stream = zs->context ? fopencookie(zs, "rb", functions) : NULL;
+	if(stream == NULL) {
+		_pcap_stream_zstd_close(zs);
+	}
+	return stream;
+}
+#endif
+
+/* pcap_stream_open() opens a compressed capture : reading the stream returned gives
+ * the decompressed bytes. It is closed with fclose() (by pcap_close()). */
+FILE* pcap_stream_open(const gchar* path, PcapReplayLogFunc slogf) {
+	switch(_pcap_stream_format(path)) {
+	case PCAP_STREAM_GZIP:
+		return _pcap_stream_gzip_open(path, slogf);
+	case PCAP_STREAM_ZSTD:
+#ifdef PCAP_REPLAY_ZSTD
+		return _pcap_stream_zstd_open(path, slogf);
+#else
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+				"Unable to read %s : pcap_replay was built without zstd", path);
+		return NULL;
+#endif
+	default:
+		return fopen(path, "rb");
+	}
+}
@@ -0,0 +1,192 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_replay.h"
+#include "cdf.h"
+
+/* The synthetic workload replaces the pcap files by flows drawn from distributions
+ * fitted on them (see pcap_fit-main.c) : the experiment runs for as long as needed
+ * with a load shaped like the captures, and no payload is kept in memory.
+ * A flow is a sequence of exchanges : the client sends a request, the server answers
+ * after a response time. The requests are spread evenly over the duration of the flow.
+ * The content of a flow only depends on the seed and on its id : the client sends the
+ * id in the preamble and the server draws the same flow. The payloads are zeros. */
+
+struct _Pcap_Synth {
+	CumulativeDistribution* requestSizes;
+	CumulativeDistribution* responseSizes;
+	CumulativeDistribution* responseTimes;
+	CumulativeDistribution* exchanges;
+	CumulativeDistribution* durations;
+	CumulativeDistribution* interarrivals;
+	guint32 seed;
+	GRand* arrivals; /* client : draws the time between two flows */
+	guint nextId; /* client : id of the next flow */
+	/* the payloads of every synthetic packet point in its PCAP_SYNTH_SEGMENT zeros */
+	Pcap_Capture* capture;
+};
+
+static const guchar _pcap_synth_zeros[PCAP_SYNTH_SEGMENT];
+
+Pcap_Synth* pcap_synth_new(const gchar* dir, guint32 seed, PcapReplayLogFunc slogf) {
+	Pcap_Synth* synth = g_new0(Pcap_Synth, 1);
+	const gchar* names[] = {PCAP_SYNTH_REQUEST_SIZES, PCAP_SYNTH_RESPONSE_SIZES, PCAP_SYNTH_RESPONSE_TIMES,
+			PCAP_SYNTH_EXCHANGES, PCAP_SYNTH_DURATIONS, PCAP_SYNTH_INTERARRIVALS};
+	CumulativeDistribution** cdfs[] = {&synth->requestSizes, &synth->responseSizes, &synth->responseTimes,
+			&synth->exchanges, &synth->durations, &synth->interarrivals};
+
+	for(guint i = 0; i < G_N_ELEMENTS(names); i++) {
+		gchar* path = g_build_filename(dir, names[i], NULL);
+		*cdfs[i] = cdf_new(g_quark_from_string(path), path);
+		if(*cdfs[i] == NULL) {
+			slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+					"Cannot read the distribution %s (see pcap_replay-fit)", path);
+			g_free(path);
+			pcap_synth_free(synth);
+			return NULL;
+		}
+		g_free(path);
+	}
+
+	synth->seed = seed;
+	synth->arrivals = g_rand_new_with_seed(seed);
+	synth->capture = g_new0(Pcap_Capture, 1);
+	synth->capture->path = g_string_new(dir);
+	synth->capture->refcount = 1;
+	synth->capture->flows = g_ptr_array_new();
+	synth->capture->payloadData = _pcap_synth_zeros;
+	synth->capture->payloadLength = PCAP_SYNTH_SEGMENT;
+
+	slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"Generating synthetic flows from the distributions of %s (seed %u)", dir, seed);
+	return synth;
+}
+
+void pcap_synth_free(Pcap_Synth* synth) {
+	if(!synth) {
+		return;
+	}
+	CumulativeDistribution* cdfs[] = {synth->requestSizes, synth->responseSizes, synth->responseTimes,
+			synth->exchanges, synth->durations, synth->interarrivals};
+	for(guint i = 0; i < G_N_ELEMENTS(cdfs); i++) {
+		if(cdfs[i]) {
+			cdf_free(cdfs[i]);
+		}
+	}
+	if(synth->arrivals) {
+		g_rand_free(synth->arrivals);
+	}
+	pcap_capture_free(synth->capture);
+	g_free(synth);
+}
+
+/* The capture the synthetic flows are attached to : it has no flow of its own */
+Pcap_Capture* pcap_synth_get_capture(Pcap_Synth* synth) {
+	return synth->capture;
+}
+
+static gdouble _pcap_synth_draw(CumulativeDistribution* cdf, GRand* rand) {
+	return MAX(cdf_getValue(cdf, g_rand_double(rand)), 0.0);
+}
+
+/* Adds the packets of a payload of size bytes sent at time (usec since the start of the flow).
+ * Payloads larger than PCAP_SYNTH_SEGMENT are sent as several packets at the same time. */
+static void _pcap_synth_add(GArray* times, GArray* sizes, gint64 time, guint64 size) {
+	while(size > 0) {
+		guint32 segment = (guint32) MIN(size, PCAP_SYNTH_SEGMENT);
+		g_array_append_val(times, time);
+		g_array_append_val(sizes, segment);
+		size -= segment;
+	}
+}
+
+static struct timeval _pcap_synth_timeval(gint64 time) {
+	struct timeval tv;
+	tv.tv_sec = (time_t) (time / G_USEC_PER_SEC);
+	tv.tv_usec = (suseconds_t) (time % G_USEC_PER_SEC);
+	return tv;
+}
+
+/* pcap_synth_flow_index() draws the packets of the synthetic flow id.
+ * The index is not part of a capture : the flow using it must free it. */
+Pcap_Flow_Index* pcap_synth_flow_index(Pcap_Synth* synth, guint id) {
+	guint32 seeds[2] = {synth->seed, id};
+	GRand* rand = g_rand_new_with_seed_array(seeds, 2);
+
+	guint exchanges = (guint) MAX(_pcap_synth_draw(synth->exchanges, rand) + 0.5, 1.0);
+	gint64 duration = (gint64) (_pcap_synth_draw(synth->durations, rand) * 1000);
+
+	GArray* times[PCAP_DIR_COUNT];
+	GArray* sizes[PCAP_DIR_COUNT];
+	for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+		times[dir] = g_array_new(FALSE, FALSE, sizeof(gint64));
+		sizes[dir] = g_array_new(FALSE, FALSE, sizeof(guint32));
+	}
+
+	gint64 lastResponse = 0;
+	for(guint i = 0; i < exchanges; i++) {
+		gint64 request = exchanges > 1 ? duration * i / (exchanges - 1) : 0;
+		guint64 requestSize = (guint64) _pcap_synth_draw(synth->requestSizes, rand);
+		guint64 responseSize = (guint64) _pcap_synth_draw(synth->responseSizes, rand);
+		gint64 responseTime = (gint64) (_pcap_synth_draw(synth->responseTimes, rand) * 1000);
+
+		/* the responses stay in order when a response time is shorter than the previous one */
+		gint64 response = MAX(request + responseTime, lastResponse);
+		_pcap_synth_add(times[PCAP_DIR_CLIENT], sizes[PCAP_DIR_CLIENT], request, requestSize);
+		_pcap_synth_add(times[PCAP_DIR_SERVER], sizes[PCAP_DIR_SERVER], response, responseSize);
+		if(responseSize > 0) {
+			lastResponse = response;
+		}
+	}
+	g_rand_free(rand);
+
+	Pcap_Flow_Index* index = g_new0(Pcap_Flow_Index, 1);
+	index->id = id;
+	index->protocol = IPPROTO_TCP;
+	gint64 start = G_MAXINT64;
+	for(gint dir = 0; dir < PCAP_DIR_COUNT; dir++) {
+		Pcap_Timeline* timeline = &index->timeline[dir];
+		timeline->length = times[dir]->len;
+		timeline->delta = g_new(guint32, timeline->length);
+		timeline->offset = g_new0(guint64, timeline->length);
+		timeline->size = (guint32*) g_array_free(sizes[dir], FALSE);
+
+		gint64 previous = timeline->length > 0 ? g_array_index(times[dir], gint64, 0) : 0;
+		timeline->start = _pcap_synth_timeval(previous);
+		start = timeline->length > 0 ? MIN(start, previous) : start;
+		for(guint i = 0; i < timeline->length; i++) {
+			gint64 time = g_array_index(times[dir], gint64, i);
+			timeline->delta[i] = (guint32) (time - previous);
+			timeline->bytes += timeline->size[i];
+			previous = time;
+		}
+		g_array_free(times[dir], TRUE);
+	}
+	index->start = _pcap_synth_timeval(start == G_MAXINT64 ? 0 : start);
+	index->first = index->start;
+	return index;
+}
+
+/* pcap_synth_schedule_next() creates the client flow following the one which connects at
+ * time after, and schedules its connection. Each flow schedules the next one when it
+ * connects, so that the flows go on until the timeout. */
+void pcap_synth_schedule_next(Pcap_Replay* pcapReplay, gint64 after) {
+	Pcap_Synth* synth = pcapReplay->synth;
+	guint id = synth->nextId++;
+	Pcap_Flow* flow = pcap_flow_new(pcapReplay, synth->capture, pcap_synth_flow_index(synth, id), -1);
+	flow->isIndexOwned = TRUE;
+
+	/* the synthetic flows have no capture : the server recognizes them with the id only */
+	guint32 ids[2] = {htonl(0), htonl(id)};
+	memcpy(flow->preamble, ids, PCAP_FLOW_PREAMBLE_SIZE);
+
+	/* --max-rate sends the packets of each flow at once, but the flows still arrive at the
+	 * times drawn (scaled by --speed) : the load would otherwise grow without bound */
+	gint64 when = after;
+	if(id > 0) {
+		gdouble interarrival = _pcap_synth_draw(synth->interarrivals, synth->arrivals) * 1000 / pcapReplay->speed;
+		when += MAX((gint64) interarrival, PCAP_SYNTH_MIN_INTERARRIVAL);
+	}
+	pcap_flow_schedule(pcapReplay, flow, when);
+}
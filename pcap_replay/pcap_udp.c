@@ -0,0 +1,283 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+/* sendmmsg() & recvmmsg() */
+#define _GNU_SOURCE
+#include "pcap_replay.h"
+
+/* With --all-flows, the UDP flows of the captures are replayed along with the TCP ones.
+ *
+ * The client opens a connected UDP socket for each flow, and first sends the flow
+ * identifier in a datagram of its own. The server receives the datagrams of all the flows
+ * on a single socket bound to its port : the first datagram of an unknown client address
+ * must be the identifier, the following ones belong to the flow of this address.
+ * If the identifier is lost, the server ignores the flow.
+ *
+ * Each payload of the timeline is sent as one datagram. The datagrams due at the same
+ * time are sent with a single sendmmsg(), and received by batches with recvmmsg().
+ * The received datagrams are dropped : only their first bytes are read, MSG_TRUNC
+ * gives their real length. */
+
+/* Some platforms don't implement sendmmsg()/recvmmsg() :
+ * fall back to one call per datagram the first time they are refused */
+static gboolean _pcap_udp_isSingleCall = FALSE;
+
+static gboolean _pcap_udp_is_unsupported(gint error) {
+	return error == ENOSYS || error == EOPNOTSUPP;
+}
+
+/* The datagrams read by one call */
+typedef struct _Pcap_Udp_Batch {
+	struct mmsghdr msgs[PCAP_UDP_BATCH];
+	struct iovec iov[PCAP_UDP_BATCH];
+	guchar heads[PCAP_UDP_BATCH][PCAP_FLOW_PREAMBLE_SIZE];
+	struct sockaddr_in addrs[PCAP_UDP_BATCH];
+} Pcap_Udp_Batch;
+
+static guint _pcap_udp_peer_hash(gconstpointer key) {
+	const struct sockaddr_in* addr = key;
+	return (guint)addr->sin_addr.s_addr * 31 + addr->sin_port;
+}
+
+static gboolean _pcap_udp_peer_equal(gconstpointer a, gconstpointer b) {
+	const struct sockaddr_in* aa = a;
+	const struct sockaddr_in* ab = b;
+	return aa->sin_addr.s_addr == ab->sin_addr.s_addr && aa->sin_port == ab->sin_port;
+}
+
+/* pcap_udp_send() sends the payloads of the custom packets through the socket sd,
+ * one datagram each, with a single call. peer is NULL if the socket is connected.
+ * Returns the number of datagrams sent, or -1 if none could be sent (errno is set). */
+gint pcap_udp_send(Custom_Packet_t* cps[], guint count, gint sd, struct sockaddr_in* peer) {
+	struct mmsghdr msgs[PCAP_PACKET_RING_SIZE];
+	struct iovec iov[PCAP_PACKET_RING_SIZE];
+	count = MIN(count, PCAP_PACKET_RING_SIZE);
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for(guint i = 0; i < count; i++) {
+		iov[i].iov_base = cps[i]->payload;
+		iov[i].iov_len = (size_t)cps[i]->payload_size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if(peer) {
+			msgs[i].msg_hdr.msg_name = peer;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+	}
+
+	if(!_pcap_udp_isSingleCall) {
+		gint sent = sendmmsg(sd, msgs, count, MSG_NOSIGNAL);
+		if(sent >= 0 || !_pcap_udp_is_unsupported(errno)) {
+			return sent;
+		}
+		_pcap_udp_isSingleCall = TRUE;
+	}
+	for(guint i = 0; i < count; i++) {
+		if(sendmsg(sd, &msgs[i].msg_hdr, MSG_NOSIGNAL) < 0) {
+			return i > 0 ? (gint)i : -1;
+		}
+	}
+	return (gint)count;
+}
+
+/* Receives the datagrams waiting on sd. Returns their number, 0 if there is none, -1 on error */
+static gint _pcap_udp_recv(gint sd, Pcap_Udp_Batch* batch) {
+	memset(batch->msgs, 0, sizeof(batch->msgs));
+	for(guint i = 0; i < PCAP_UDP_BATCH; i++) {
+		batch->iov[i].iov_base = batch->heads[i];
+		batch->iov[i].iov_len = PCAP_FLOW_PREAMBLE_SIZE;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	gint count = -1;
+	if(!_pcap_udp_isSingleCall) {
+		count = recvmmsg(sd, batch->msgs, PCAP_UDP_BATCH, MSG_DONTWAIT | MSG_TRUNC, NULL);
+		if(count < 0 && _pcap_udp_is_unsupported(errno)) {
+			_pcap_udp_isSingleCall = TRUE;
+		}
+	}
+	if(_pcap_udp_isSingleCall) {
+		for(count = 0; count < PCAP_UDP_BATCH; count++) {
+			ssize_t numBytes = recvmsg(sd, &batch->msgs[count].msg_hdr, MSG_DONTWAIT | MSG_TRUNC);
+			if(numBytes < 0) {
+				break;
+			}
+			batch->msgs[count].msg_len = (guint)numBytes;
+		}
+		if(count > 0) {
+			return count;
+		}
+		count = -1;
+	}
+	if(count < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	return count;
+}
+
+/* Accounts the datagrams received by a flow */
+static void _pcap_udp_received(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gssize total) {
+	flow->received += total;
+	pcap_stats_received(&flow->stats, total);
+	pcap_stats_received(&pcapReplay->stats, total);
+	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+			"Successfully received %"G_GSSIZE_FORMAT" (bytes) from the remote peer", total);
+
+	if(flow->state == PCAP_FLOW_FINISHED) {
+		/* we may have received the last datagrams of the peer */
+		pcap_flow_linger(pcapReplay, flow);
+	} else if(pcapReplay->isCausal && flow->state == PCAP_FLOW_REPLAYING && !flow->isWaitingOut) {
+		/* --causal : the next datagram may have been waiting for this data */
+		pcap_flow_send_due_packets(pcapReplay, flow);
+	}
+}
+
+/* pcap_udp_listen() opens the socket of the server receiving the datagrams of the UDP flows */
+gboolean pcap_udp_listen(Pcap_Replay* pcapReplay) {
+	pcapReplay->server.udpSd = socket(AF_INET, (SOCK_DGRAM | SOCK_NONBLOCK), 0);
+	if(pcapReplay->server.udpSd == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
+					"Unable to start the UDP socket: error in socket");
+		pcapReplay->server.udpSd = 0;
+		return FALSE;
+	}
+
+	struct sockaddr_in bindAddress;
+	memset(&bindAddress, 0, sizeof(bindAddress));
+	bindAddress.sin_family = AF_INET;
+	bindAddress.sin_addr.s_addr = INADDR_ANY;
+	bindAddress.sin_port = pcapReplay->serverPort;
+	if(bind(pcapReplay->server.udpSd, (struct sockaddr *) &bindAddress, sizeof(bindAddress)) == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+				"unable to start the UDP server: error in bind");
+		close(pcapReplay->server.udpSd);
+		pcapReplay->server.udpSd = 0;
+		return FALSE;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = pcapReplay->server.udpSd;
+	if(epoll_ctl(pcapReplay->ed, EPOLL_CTL_ADD, pcapReplay->server.udpSd, &ev) == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__, "error in udp epoll_ctl");
+		close(pcapReplay->server.udpSd);
+		pcapReplay->server.udpSd = 0;
+		return FALSE;
+	}
+
+	pcapReplay->udpPeers = g_hash_table_new(_pcap_udp_peer_hash, _pcap_udp_peer_equal);
+	return TRUE;
+}
+
+/* pcap_udp_connect() opens the socket of a UDP flow of the client and starts replaying it.
+ * The flow identifier is the first datagram sent (see pcap_flow_send_due_packets()). */
+gboolean pcap_udp_connect(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	if(pcapReplay->isTorClient) {
+		pcapReplay->slogf(G_LOG_LEVEL_WARNING, __FUNCTION__,
+				"UDP flow %u can't go through the Tor proxy, skipping it", flow->index->id);
+		return FALSE;
+	}
+
+	gint sd = socket(AF_INET, (SOCK_DGRAM | SOCK_NONBLOCK), 0);
+	if(sd == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
+					"Unable to start the UDP socket: error in socket");
+		return FALSE;
+	}
+
+	/* the server is the only peer of the socket : send() needs no address */
+	struct sockaddr_in serverAddress;
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_addr.s_addr = pcapReplay->serverIP;
+	serverAddress.sin_port = pcapReplay->serverPort;
+	if(connect(sd, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) == -1) {
+		pcapReplay->slogf(G_LOG_LEVEL_ERROR, __FUNCTION__,
+					"Unable to start the UDP socket: error in connect");
+		close(sd);
+		return FALSE;
+	}
+
+	pcap_flow_set_socket(pcapReplay, flow, sd, EPOLLIN);
+	pcap_flow_start(pcapReplay, flow, 0);
+	pcap_flow_send_due_packets(pcapReplay, flow);
+	return TRUE;
+}
+
+/* pcap_udp_activate_flow() is called when the epoll descriptor has an event for the socket
+ * of a UDP flow of the client */
+void pcap_udp_activate_flow(Pcap_Replay* pcapReplay, Pcap_Flow* flow, uint32_t events) {
+	if(events & (EPOLLIN | EPOLLERR)) {
+		Pcap_Udp_Batch batch;
+		gssize total = 0;
+		gint count;
+		/* an error (e.g. the server is unreachable) is reported, and cleared, by the receive */
+		while((count = _pcap_udp_recv(flow->sd, &batch)) > 0) {
+			for(gint i = 0; i < count; i++) {
+				total += batch.msgs[i].msg_len;
+			}
+			if(count < PCAP_UDP_BATCH) {
+				break;
+			}
+		}
+		if(count < 0) {
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+					"Unable to receive datagram : %s", g_strerror(errno));
+		}
+		if(total > 0) {
+			_pcap_udp_received(pcapReplay, flow, total);
+		}
+	}
+
+	if(events & EPOLLOUT) {
+		/* The kernel can accept datagrams again */
+		pcap_flow_send_due_packets(pcapReplay, flow);
+	}
+}
+
+/* The first datagram of a client : the identifier of the flow it replays */
+static void _pcap_udp_new_flow(Pcap_Replay* pcapReplay, guchar* preamble, struct sockaddr_in* addr) {
+	Pcap_Flow* flow = pcap_flow_new(pcapReplay, NULL, NULL, -1);
+	memcpy(flow->preamble, preamble, PCAP_FLOW_PREAMBLE_SIZE);
+	if(!pcap_replay_identify_flow(pcapReplay, flow, IPPROTO_UDP)) {
+		pcap_flow_free(pcapReplay, flow);
+		return;
+	}
+	flow->peer = *addr;
+	g_hash_table_insert(pcapReplay->udpPeers, &flow->peer, flow);
+
+	char ip_add[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &addr->sin_addr, ip_add, INET_ADDRSTRLEN);
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+			"Client %s:%u replays UDP flow %u", ip_add, (guint) ntohs(addr->sin_port), flow->index->id);
+
+	pcap_flow_start(pcapReplay, flow, 0);
+	pcap_flow_send_due_packets(pcapReplay, flow);
+}
+
+/* _pcap_activateUdpServer() is called when datagrams are waiting on the UDP socket of the server.
+ * They are dispatched to their flow by the address of the client. */
+void _pcap_activateUdpServer(Pcap_Replay* pcapReplay) {
+	Pcap_Udp_Batch batch;
+	gint count;
+	while((count = _pcap_udp_recv(pcapReplay->server.udpSd, &batch)) > 0) {
+		for(gint i = 0; i < count && !pcapReplay->isDone; i++) {
+			Pcap_Flow* flow = g_hash_table_lookup(pcapReplay->udpPeers, &batch.addrs[i]);
+			if(flow) {
+				_pcap_udp_received(pcapReplay, flow, batch.msgs[i].msg_len);
+			} else if(batch.msgs[i].msg_len == PCAP_FLOW_PREAMBLE_SIZE) {
+				_pcap_udp_new_flow(pcapReplay, batch.heads[i], &batch.addrs[i]);
+			} else {
+				pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__,
+						"Dropping a datagram of an unknown UDP flow");
+			}
+		}
+		if(count < PCAP_UDP_BATCH) {
+			break;
+		}
+	}
+}
@@ -19,6 +19,7 @@
 #include <inttypes.h>
 
 #include <vector>
+#include <algorithm>
 
 using std::vector;
 using std::map;
@@ -92,12 +93,21 @@ notified(gpointer ptr)
 static void
 timeout_timer_fired(gpointer ptr)
 {
-    browser_t::LoadTimeoutCtx_t* ltc = (browser_t::LoadTimeoutCtx_t*)ptr;
+    browser_t *b = (browser_t*)ptr;
+    if (g_destroyed) {
+        return;
+    }
+    b->on_timeout_timer_fired();
+}
+
+static void
+delayed_load_timer_fired(gpointer ptr)
+{
+    browser_t::DelayedLoad_t* dl = (browser_t::DelayedLoad_t*)ptr;
     if (g_destroyed) {
         return;
     }
-    ltc->b_->on_timeout_timer_fired(ltc->loadnum_);
-    delete ltc;
+    dl->b_->on_delayed_load_timer_fired(dl);
 }
 } // namespace
 
@@ -109,7 +119,8 @@ printUsageAndExit(const char* prog)
 "          --page-spec <path>|none --think-times <path>|none\n"\
 "          --timeoutSecs <path>|none --mode-spec <path>|none\n"\
 "\n"\
-"  * --mode-spec is a file that specifies each client's mode, vanilla or spdy.\n"\
+"  * --mode-spec is a file that specifies each client's mode, vanilla, spdy\n"\
+"    or http2.\n"\
 "  * page spec contains specification of multiple pages to load: each page\n"\
 "    spec begins with a line \"page-url: <url>\", and the following lines should\n"\
 "    be \"objectURL | objectSize | objectMd5Sum (optional)\"\n"\
@@ -149,7 +160,9 @@ browser_t::start(int argc, char *argv[])
 
     //XXX/ getopt() doesn't seem to work in shadow.
 
-    myassert(argc == 13);
+    /* the pairs after --mode-spec, --edge-triggered,
+     * --pipeline-depth and --http2-window, are optional */
+    myassert(argc >= 13 && argc <= 19 && (argc % 2) == 1);
 
     char *socks5_host_port = argv[2];
     if (strcmp(socks5_host_port, "none")) {
@@ -288,8 +301,13 @@ browser_t::start(int argc, char *argv[])
                 logself(DEBUG, "mode: [%s]", token.c_str());
                 if (token == "vanilla") {
                     do_spdy_ = false;
+                    do_http2_ = false;
                 } else if (token == "spdy") {
                     do_spdy_ = true;
+                    do_http2_ = false;
+                } else if (token == "http2") {
+                    do_spdy_ = false;
+                    do_http2_ = true;
                 } else {
                     logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
                           "invalid mode \"%s\"in mode-spec file %s",
@@ -307,6 +325,37 @@ browser_t::start(int argc, char *argv[])
         }
     }
 
+    for (int i = 13; i < argc; i += 2) {
+        if (!strcmp(argv[i], "--edge-triggered")) {
+            const char *edge_triggered = argv[i + 1];
+            myassert(!strcmp(edge_triggered, "yes")
+                     || !strcmp(edge_triggered, "no"));
+            evbase_->set_edge_triggered(!strcmp(edge_triggered, "yes"));
+            logfn(SHADOW_LOG_LEVEL_INFO, __func__, "Edge-triggered epoll: %s",
+                  edge_triggered);
+        } else if (!strcmp(argv[i], "--pipeline-depth")) {
+            max_pipeline_depth_ = lexical_cast<int>(argv[i + 1]);
+            myassert(max_pipeline_depth_ > 0);
+            myassert(max_pipeline_depth_ <= 32);
+            logfn(SHADOW_LOG_LEVEL_INFO, __func__,
+                  "Max pipeline depth per connection: %d",
+                  max_pipeline_depth_);
+        } else if (!strcmp(argv[i], "--http2-window")) {
+            /* the session window lets 16 streams use their whole
+             * window at once */
+            const int window = lexical_cast<int>(argv[i + 1]);
+            myassert(window >= 65535);
+            Connection::h2_stream_window_size = window;
+            Connection::h2_session_window_size =
+                std::min((int64_t)window * 16, (int64_t)0x7fffffff);
+            logfn(SHADOW_LOG_LEVEL_INFO, __func__,
+                  "HTTP/2 stream window: %d bytes", window);
+        } else {
+            logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+                  "unknown option \"%s\"", argv[i]);
+            myassert(0);
+        }
+    }
 
     if (socks5_host) {
         socks5_host_ = socks5_host;
@@ -350,14 +399,15 @@ browser_t::load(const string& url)
             socks5_addr_, socks5_port_,
             boost::bind(&browser_t::response_finished_cb, this, _1, false),
             max_persist_cnx_per_srv_,
-            g_max_retries_per_resource);
+            g_max_retries_per_resource,
+            max_pipeline_depth_,
+            do_http2_,
+            boost::bind(&browser_t::pushed_request_cb, this, _1));
         myassert(connman_);
     }
 
     if (timeout_ms_ > -1) {
-        scheduleCallback(
-            &timeout_timer_fired, new LoadTimeoutCtx_t(this, loadnum_),
-            timeout_ms_);
+        load_timeout_timer_->start(timeout_ms_);
     }
 
     Request* req = new Request(
@@ -476,7 +526,11 @@ browser_t::is_page_done() const
     logself(DEBUG, "begin");
     logself(DEBUG, "num embedded_resources_ [%u], num completed [%u]",
             embedded_resources_.size(), received_resources_.size());
-    const bool done = embedded_resources_.size() == received_resources_.size();
+    /* the pushed resources can be received before they are known
+     * to be embedded */
+    const bool done = std::includes(
+        received_resources_.begin(), received_resources_.end(),
+        embedded_resources_.begin(), embedded_resources_.end());
 
     logself(DEBUG, "done, returning %u", done);
     return done;
@@ -513,7 +567,10 @@ browser_t::response_finished_cb(Request* req, bool success)
         notify();
     }
     else {
-        myassert(state == SB_FETCHING_EMBEDDED);
+        /* a pushed resource can complete while we are still getting
+         * the main doc */
+        myassert(state == SB_FETCHING_EMBEDDED
+                 || inSet(pushed_resources_, req->url_));
 
         received_resources_.insert(req->url_);
 
@@ -528,12 +585,7 @@ browser_t::response_finished_cb(Request* req, bool success)
             process_a_script(sr);
         }
 
-        if (is_page_done()) {
-            /* we only compare the number of the resources. this might
-             * miss cases where the counts equal but the two sets are
-             * not equal, but that is considered a failed load anyway
-             */
-
+        if (state == SB_FETCHING_EMBEDDED && is_page_done()) {
             logself(DEBUG,
                     "this is last embedbed resource -> transition to done");
             state = SB_DONE;
@@ -545,17 +597,6 @@ browser_t::response_finished_cb(Request* req, bool success)
     logself(DEBUG, "done");
 }
 
-static void
-delayed_load_timer_fired(gpointer ptr)
-{
-    browser_t::DelayedLoadCtx_t* ctx = (browser_t::DelayedLoadCtx_t*)ptr;
-    if (g_destroyed) {
-        return;
-    }
-    ctx->b_->on_delayed_load_timer_fired(ctx->url_);
-    delete ctx;
-}
-
 void
 browser_t::process_a_script(const ScriptResource& sr)
 {
@@ -579,29 +620,28 @@ browser_t::process_a_script(const ScriptResource& sr)
                  */
                 vector<string> parts;
                 boost::split(parts, line, boost::is_any_of(" "));
+                myassert(parts.size() >= 6);
                 myassert(parts[2] == "url=");
+                myassert(parts[4] == "delayms=");
                 const string& url_to_fetch = parts[3];
                 myassert(0 < url_to_fetch.length());
-
-#if 0
-                scheduleCallback(&delayed_load_timer_fired,
-                                 new DelayedLoadCtx_t(this, url_to_fetch),
-                                 boost::lexical_cast<uint32_t>(parts[5]));
+                const uint32_t delay_ms =
+                    boost::lexical_cast<uint32_t>(parts[5]);
 
                 /* we are scheduling the delayed load as way to
                  * simulate the script's execution time. but during
                  * the wait, the browser might finish loading
                  * everything else and have no other ones "in
-                 * progress". so we have to somehow prevent it from
-                 * thinking it's done.
+                 * progress". so the url counts as an embedded
+                 * resource from now on: the page is not done before
+                 * it's fetched.
                  */
-#else
-                /* for now, dont support delayed load. only do
-                 * immediate loads */
-                logself(DEBUG, "requesting a js-loaded resource [%s]",
-                        url_to_fetch.c_str());
-                request_one_url(url_to_fetch.c_str());
-#endif
+                logself(DEBUG, "scheduling a js-loaded resource [%s] in %u ms",
+                        url_to_fetch.c_str(), delay_ms);
+                embedded_resources_.insert(url_to_fetch);
+                DelayedLoad_t* dl = new DelayedLoad_t(this, url_to_fetch);
+                delayed_loads_.push_back(dl);
+                dl->timer_->start(delay_ms);
             }
         }
     }
@@ -643,37 +683,55 @@ browser_t::request_embedded_objects()
 void
 browser_t::request_one_url(const char* url)
 {
-    gchar* hostname = NULL;
-    gchar* path = NULL;
-    uint16_t port = 80;
-
     logself(DEBUG, "got resource, url [%s]", url);
 
     embedded_resources_.insert(string(url));
 
+    if (inSet(pushed_resources_, string(url))) {
+        logself(DEBUG, "it's been pushed -> don't request it");
+        return;
+    }
+
+    /// XXX what if the embedded resource has been already/being
+    /// requested? e.g., multiple <img> tags pointing to the same
+    /// url. for now, we don't allow that.
+    myassert(!inMap(pending_requests_, string(url)));
+    Request* req = new_request(url);
+    connman_->submit_request(req);
+}
+
+void
+browser_t::get_url_parts(const char* url, gchar** hostname, uint16_t* port,
+                         gchar** path) const
+{
+    *port = 80;
     if (url_is_absolute(url)) {
-        url_get_parts(url, &hostname, &port, &path);
+        url_get_parts(url, hostname, port, path);
     } else {
-        hostname = g_strdup(first_hostname_.c_str());
-            
+        *hostname = g_strdup(first_hostname_.c_str());
+
         if (!g_str_has_prefix(url, "/")) {
-            path = g_strconcat("/", url, (char*)NULL);
+            *path = g_strconcat("/", url, (char*)NULL);
         } else {
-            path = g_strdup(url);
+            *path = g_strdup(url);
         }
     }
+}
 
-    /// XXX what if the embedded resource has been already/being
-    /// requested? e.g., multiple <img> tags pointing to the same
-    /// url. for now, we don't allow that.
-    myassert(!inMap(pending_requests_, string(url)));
+Request*
+browser_t::new_request(const char* url)
+{
+    gchar* hostname = NULL;
+    gchar* path = NULL;
+    uint16_t port = 80;
+
+    get_url_parts(url, &hostname, &port, &path);
     Request* req = new Request(
         path, string(hostname), port, string(url), NULL,
         boost::bind(&browser_t::response_meta_cb, this, _1, _2, _3),
         boost::bind(&browser_t::response_body_data_cb, this, _1, _2, _3),
         boost::bind(&browser_t::response_finished_cb, this, _1, true)
         );
-    connman_->submit_request(req);
     pending_requests_[req->url_] = req;
 
     const size_t len = req->url_.length();
@@ -681,18 +739,80 @@ browser_t::request_one_url(const char* url)
         /* its a javascript --> need to save its body text */
         scriptReq2BodyText[req->instNum_] = "";
     }
-    
+
     g_free(path);
     g_free(hostname);
+    return req;
+}
+
+Request*
+browser_t::pushed_request_cb(const string& pushed_url)
+{
+    logself(DEBUG, "begin, pushed url [%s]", pushed_url.c_str());
 
+    if (state != SB_FETCHING_DOCUMENT && state != SB_DONE_DOCUMENT
+        && state != SB_FETCHING_EMBEDDED)
+    {
+        return NULL;
+    }
+
+    gchar* hostname = NULL;
+    gchar* path = NULL;
+    uint16_t port = 80;
+    if (url_get_parts(pushed_url.c_str(), &hostname, &port, &path)) {
+        return NULL;
+    }
+
+    /* the page refers to it by the url in the page spec, which we
+     * have not received yet */
+    Request* req = NULL;
+    map<string, ExpectedObj>::const_iterator it = expected_objects_.begin();
+    for (; it != expected_objects_.end() && !req; ++it) {
+        const string& url = it->first;
+        if (inMap(pending_requests_, url)) {
+            continue;
+        }
+        gchar* h = NULL;
+        gchar* p = NULL;
+        uint16_t po = 80;
+        get_url_parts(url.c_str(), &h, &po, &p);
+        if (po == port && !g_strcmp0(h, hostname) && !g_strcmp0(p, path)) {
+            logself(DEBUG, "it's [%s]", url.c_str());
+            req = new_request(url.c_str());
+            pushed_resources_.insert(url);
+        }
+        g_free(p);
+        g_free(h);
+    }
+
+    g_free(path);
+    g_free(hostname);
+    logself(DEBUG, "done");
+    return req;
+}
+
+browser_t::DelayedLoad_t::DelayedLoad_t(browser_t* browser, const string& url)
+    : b_(browser), url_(url)
+{
+    timer_ = new myevent_timer_t(b_->evbase_, &delayed_load_timer_fired, this);
 }
 
 void
-browser_t::on_delayed_load_timer_fired(const string& url)
+browser_t::on_delayed_load_timer_fired(DelayedLoad_t* dl)
 {
     logself(DEBUG, "begin");
 
-    request_one_url(url.c_str());
+    delayed_loads_.remove(dl);
+    logself(DEBUG, "requesting a js-loaded resource [%s]", dl->url_.c_str());
+    request_one_url(dl->url_.c_str());
+    delete dl;
+
+    /* it might have been pushed and received already */
+    if (state == SB_FETCHING_EMBEDDED && is_page_done()) {
+        logself(DEBUG, "this was the last embedded resource -> done");
+        state = SB_DONE;
+        notify();
+    }
 
     logself(DEBUG, "done");
 }
@@ -706,6 +826,8 @@ browser_t::~browser_t()
         delete (*it);
     }
     page_specs_.clear();
+    delete load_timeout_timer_;
+    delete notify_timer_;
     if (evbase_) {
         delete evbase_;
         evbase_ = NULL;
@@ -721,18 +843,23 @@ browser_t::~browser_t()
 }
 
 browser_t::browser_t()
-    : instNum_(nextInstNum), state(SB_INIT), notified_(false)
+    : instNum_(nextInstNum), state(SB_INIT)
     , think_time_rand_gen(NULL)
 {
     ++nextInstNum;
 
     evbase_ = new myevent_base(logfn);
     myassert(evbase_);
+    load_timeout_timer_ = new myevent_timer_t(
+        evbase_, &timeout_timer_fired, this);
+    notify_timer_ = new myevent_timer_t(evbase_, &notified, this);
 
     socks5_addr_ = 0;
     socks5_port_ = 0;
     do_spdy_ = false;
+    do_http2_ = false;
     max_persist_cnx_per_srv_ = 6; // default
+    max_pipeline_depth_ = 1; // default: no pipelining
     think_times_cdf = NULL;
 
     page_specs_idx_ = 0;
@@ -752,27 +879,20 @@ browser_t::browser_t()
 void
 browser_t::notify(const uint32_t delay_ms)
 {
-    myassert(!notified_);
-    notified_ = true;
-    scheduleCallback(&notified, this, delay_ms);
+    myassert(!notify_timer_->is_pending());
+    notify_timer_->start(delay_ms);
 }
 
 void
-browser_t::on_timeout_timer_fired(const uint32_t loadnum)
+browser_t::on_timeout_timer_fired()
 {
-    logself(DEBUG, "begin");
-
-    if (loadnum == loadnum_) {
-        logself(DEBUG, "cancel current load");
+    logself(DEBUG, "begin, cancel current load");
 
-        report_failed_load("timedout");
-        stop_load();
-        // immediately schedule the next load
-        ++loadnum_;
-        notify();
-    } else {
-        logself(DEBUG, "not the same loadnum -> do nothing");
-    }
+    report_failed_load("timedout");
+    stop_load();
+    // immediately schedule the next load
+    ++loadnum_;
+    notify();
 
     logself(DEBUG, "done");
 }
@@ -782,9 +902,6 @@ browser_t::on_notified()
 {
     logself(DEBUG, "begin");
 
-    myassert(notified_);
-    notified_ = false;
-
     if (state == SB_CLOSED) {
         return;
     }
@@ -921,7 +1038,7 @@ browser_t::report_failed_load(const char *reason) const
     asprintf(&s,
              "loadnum= %u, %s: FAILED: start= %" PRIu64 " reason= [%s] url= [%s] rxbytes= %zu",
              loadnum_,
-             (do_spdy_ ? "spdy" : "vanilla"),
+             (do_spdy_ ? "spdy" : (do_http2_ ? "http2" : "vanilla")),
              load_start_timepoint_,
              reason,
              page_specs_[page_specs_idx_]->url_.c_str(),
@@ -951,7 +1068,7 @@ browser_t::report_result() const
     asprintf(&s,
              "loadnum= %u, %s: %s: start= %" PRIu64 " plt= %" PRIu64 " url= [%s] ttfb= %" PRIu64 " rxbodybytes= %zu txbytes= %zu rxbytes= %zu numobjects= %u numerrorobjects= %u",
              loadnum_,
-             (do_spdy_ ? "spdy" : "vanilla"),
+             (do_spdy_ ? "spdy" : (do_http2_ ? "http2" : "vanilla")),
              (validate_result_ == VR_SUCCESS) ? "success" : "FAILED",
              load_start_timepoint_,
              (validate_result_ == VR_SUCCESS) ? (load_done_timepoint_ - load_start_timepoint_) : 0,
@@ -971,10 +1088,10 @@ browser_t::close()
 {
     logself(DEBUG, "begin");
 
-    if (evbase_) {
-        delete evbase_;
-        evbase_ = NULL;
-    }
+    /* the evbase_ is freed with us: the connections killed here
+     * still use it until they are deleted */
+    load_timeout_timer_->cancel();
+    notify_timer_->cancel();
 
     // kill all connections and requests
     connman_->reset();
@@ -1021,13 +1138,20 @@ browser_t::reset()
     doc_req_instNum_ = -1;
     doc_content.clear();
     doc_expected_len_ = 0;
-    notified_ = false;
+    load_timeout_timer_->cancel();
+    notify_timer_->cancel();
     validate_result_ = VR_NONE;
     totalnumerrorobjects_ = totalnumobjects_ = 0;
     totalbodybytes_ = 0;
     load_start_timepoint_ = load_done_timepoint_ = 0;
     received_resources_.clear();
     embedded_resources_.clear();
+    pushed_resources_.clear();
+    for (list<DelayedLoad_t*>::iterator it = delayed_loads_.begin();
+         it != delayed_loads_.end(); ++it) {
+        delete *it;
+    }
+    delayed_loads_.clear();
 }
 
 void
@@ -69,35 +69,26 @@ public:
     void start(int argc, char *argv[]);
     void activate(const bool blocking);
     void on_notified();
-    void on_timeout_timer_fired(const uint32_t loadnum);
-    void on_delayed_load_timer_fired(const std::string& url);
+    void on_timeout_timer_fired();
 
-    /* close any current/future download, to be ready for freeing */
-    void close();
-
-    const uint32_t instNum_; // monotonic id of this browser obj
-    static const EVP_MD* digest_algo_; /* which digest to use. dont free. */
-
-    /* need a load timeout context because we can't cancel a scheduled
-     * callback, so when it does get call, the callback needs to make
-     * sure it's not cancelling an incorrect page load in progress */
-    class LoadTimeoutCtx_t
-    {
-    public:
-        LoadTimeoutCtx_t(browser_t* browser, const uint32_t& loadnum)
-            : b_(browser), loadnum_(loadnum) {}
-        browser_t *b_;
-        const uint32_t loadnum_;
-    };
-
-    class DelayedLoadCtx_t
+    /* a resource that a script loads after a delay, to simulate the
+     * script's execution time */
+    class DelayedLoad_t
     {
     public:
-        DelayedLoadCtx_t(browser_t* browser, const std::string& url)
-            : b_(browser), url_(url) {}
+        DelayedLoad_t(browser_t* browser, const std::string& url);
+        ~DelayedLoad_t() { delete timer_; }
         browser_t *b_;
         const std::string url_;
+        myevent_timer_t *timer_;
     };
+    void on_delayed_load_timer_fired(DelayedLoad_t* dl);
+
+    /* close any current/future download, to be ready for freeing */
+    void close();
+
+    const uint32_t instNum_; // monotonic id of this browser obj
+    static const EVP_MD* digest_algo_; /* which digest to use. dont free. */
 
 private:
 
@@ -146,6 +137,9 @@ private:
     void response_meta_cb(const int& status, char **headers, Request* req);
     void response_body_data_cb(const uint8_t *data, const size_t& len, Request* req);
     void response_finished_cb(Request* req, bool success);
+    /* the request to deliver a pushed response to, or NULL if we
+     * don't want it */
+    Request* pushed_request_cb(const std::string& pushed_url);
 
     static uint32_t nextInstNum;
     
@@ -162,6 +156,9 @@ private:
     ConnectionManager* connman_;
 
     int max_persist_cnx_per_srv_;
+    /* max num of requests in flight on one http connection; 1 means
+     * no pipelining */
+    int max_pipeline_depth_;
 
     /* statistics */
     size_t totalbodybytes_; /* only response bodies */
@@ -184,9 +181,19 @@ private:
 
     /* urls of all known embedded resources, that will be fetched. the
      * page load is considered complete when received_resources_ set
-     * equals embedded_resources_ set  */
+     * contains embedded_resources_ set  */
     std::set<std::string> embedded_resources_;
 
+    /* the delayed loads whose timer is pending. their urls are in
+     * embedded_resources_ already, so that the page is not done
+     * while they wait */
+    std::list<DelayedLoad_t*> delayed_loads_;
+
+    /* urls of the resources the servers pushed (http2 only). they
+     * are not requested when the page refers to them, and can be
+     * received before that */
+    std::set<std::string> pushed_resources_;
+
     /* if the main doc is html, then save its content here. */
     std::string doc_content;
     /* map key is Request's instNum_ */
@@ -195,10 +202,18 @@ private:
      * script */
     std::map<uintptr_t, std::string> scriptReq2BodyText;
     bool do_spdy_;
+    bool do_http2_;
     CumulativeDistribution* think_times_cdf;
     boost::variate_generator<boost::mt19937, boost::uniform_real<> > *think_time_rand_gen;
 
     void request_one_url(const char* url);
+    /* the server, port and path of "url", relative to the main
+     * document's server if it is not absolute. free hostname and
+     * path */
+    void get_url_parts(const char* url, gchar** hostname, uint16_t* port,
+                       gchar** path) const;
+    /* create the request for "url", and track it until it's done */
+    Request* new_request(const char* url);
     void process_a_script(const ScriptResource& sr);
 
     bool is_page_done() const;
@@ -206,13 +221,11 @@ private:
     /* save this for repeated loading */
     //std::string url_;
     uint16_t page_specs_idx_; // which page we're loading
-    /* monotonic id of the page load. also used to know whether to
-     * cancel a page load. should increment this loadnum_ soon after
-     * the load is finished, so that while sleeping waiting for the
-     * _next_ page load, if the timeout timer expired for the one just
-     * finished, it will mistakenly think the load timed out.
-     */
+    /* monotonic id of the page load */
     uint32_t loadnum_;
+    /* started with each page load, cancelled when the load is
+     * reset */
+    myevent_timer_t* load_timeout_timer_;
 
     void stop_load(); // stop current page load
     int32_t timeout_ms_;
@@ -234,14 +247,11 @@ private:
     validate_result_t validate_result_;
 
     /* for "deferred" action, because sometimes we can't/don't want to
-     * do things in a callback stack.
-     *
-     * notifier should use shadow's "createcallback" to schedule only
-     * if notified_ is false. if it is true, then we are already
-     * notified but haven't gotten around to handle it, so don't
-     * schedule again.
+     * do things in a callback stack, and for the think times between
+     * page loads. on_notified() runs when the notify timer fires; it
+     * must not be pending when notify() is called.
      */
-    bool notified_;
+    myevent_timer_t* notify_timer_;
     void notify(const uint32_t delay_ms = 0);
 
     void load(const std::string& url);
@@ -42,6 +42,8 @@ extern "C" void __shadow_plugin_init__(ShadowFunctionTable* shadowlibFuncs) {
     /* save the shadow functions we will use since it will be the same for all nodes */
     logfn = shadowlibFuncs->log;
     scheduleCallback = shadowlibFuncs->createCallback;
+    /* the event bases' timers fire from a shadow callback */
+    myevent_base::shadow_create_callback = shadowlibFuncs->createCallback;
 
     browser_t::digest_algo_ = EVP_md5();
 
@@ -0,0 +1,65 @@
+# - Check for the presence of libnghttp2
+#
+# The following variables are set when NGHTTP2 is found:
+#  HAVE_NGHTTP2       = Set to true, if all components of NGHTTP2
+#                          have been found.
+#  NGHTTP2_INCLUDES   = Include path for the header files of NGHTTP2
+#  NGHTTP2_LIBRARIES  = Link these to use NGHTTP2
+
+## -----------------------------------------------------------------------------
+## Check for the header files
+
+find_path (NGHTTP2_INCLUDES nghttp2/nghttp2.h
+  PATHS ${CMAKE_EXTRA_INCLUDES} NO_DEFAULT_PATH
+  )
+if(NOT NGHTTP2_INCLUDES)
+    find_path (NGHTTP2_INCLUDES nghttp2/nghttp2.h
+      PATHS /usr/local/include /usr/include /include /sw/include ${CMAKE_EXTRA_INCLUDES}
+      )
+endif(NOT NGHTTP2_INCLUDES)
+
+## -----------------------------------------------------------------------------
+## Check for the library
+
+find_library (NGHTTP2_LIBRARIES NAMES nghttp2
+  PATHS ${CMAKE_EXTRA_LIBRARIES} PATH_SUFFIXES nghttp2/ NO_DEFAULT_PATH
+  )
+if(NOT NGHTTP2_LIBRARIES)
+    find_library (NGHTTP2_LIBRARIES NAMES nghttp2
+      PATHS /usr/local/lib /usr/lib /lib /sw/lib ${CMAKE_EXTRA_LIBRARIES} PATH_SUFFIXES nghttp2/
+      )
+endif(NOT NGHTTP2_LIBRARIES)
+
+## -----------------------------------------------------------------------------
+## Actions taken when all components have been found
+
+if (NGHTTP2_INCLUDES AND NGHTTP2_LIBRARIES)
+  set (HAVE_NGHTTP2 TRUE)
+else (NGHTTP2_INCLUDES AND NGHTTP2_LIBRARIES)
+  if (NOT NGHTTP2_FIND_QUIETLY)
+    if (NOT NGHTTP2_INCLUDES)
+      message (STATUS "Unable to find NGHTTP2 header files!")
+    endif (NOT NGHTTP2_INCLUDES)
+    if (NOT NGHTTP2_LIBRARIES)
+      message (STATUS "Unable to find NGHTTP2 library files!")
+    endif (NOT NGHTTP2_LIBRARIES)
+  endif (NOT NGHTTP2_FIND_QUIETLY)
+endif (NGHTTP2_INCLUDES AND NGHTTP2_LIBRARIES)
+
+if (HAVE_NGHTTP2)
+  if (NOT NGHTTP2_FIND_QUIETLY)
+    message (STATUS "Found components for NGHTTP2")
+    message (STATUS "NGHTTP2_INCLUDES = ${NGHTTP2_INCLUDES}")
+    message (STATUS "NGHTTP2_LIBRARIES     = ${NGHTTP2_LIBRARIES}")
+  endif (NOT NGHTTP2_FIND_QUIETLY)
+else (HAVE_NGHTTP2)
+  if (NGHTTP2_FIND_REQUIRED)
+    message (FATAL_ERROR "Could not find NGHTTP2!")
+  endif (NGHTTP2_FIND_REQUIRED)
+endif (HAVE_NGHTTP2)
+
+mark_as_advanced (
+  HAVE_NGHTTP2
+  NGHTTP2_LIBRARIES
+  NGHTTP2_INCLUDES
+  )
@@ -56,37 +56,46 @@ to_hex(const unsigned char *value,
     }
 }
 
-in_addr_t
-getaddr(const char *hostname)
+bool
+getaddr_literal(const char *hostname, in_addr_t *addr)
 {
     if (!hostname || 0 == strlen(hostname)) {
-        return htonl(INADDR_NONE);
+        *addr = htonl(INADDR_NONE);
+        return true;
     }
     /* check if we have an address as a string */
     struct in_addr in;
-    int is_ip_address = inet_aton(hostname, &in);
-
-    if(is_ip_address) {
-        return in.s_addr;
-    } else {
-        in_addr_t addr = 0;
+    if (inet_aton(hostname, &in)) {
+        *addr = in.s_addr;
+        return true;
+    }
+    if (strcmp(hostname, "none") == 0) {
+        *addr = htonl(INADDR_NONE);
+        return true;
+    }
+    if (strcmp(hostname, "localhost") == 0) {
+        *addr = htonl(INADDR_LOOPBACK);
+        return true;
+    }
+    return false;
+}
 
-        /* get the address in network order */
-        if(strcmp(hostname, "none") == 0) {
-            addr = htonl(INADDR_NONE);
-        } else if(strcmp(hostname, "localhost") == 0) {
-            addr = htonl(INADDR_LOOPBACK);
-        } else {
-            struct addrinfo* info;
-            int result = getaddrinfo(hostname, NULL, NULL, &info);
-            if(result != 0) {
-                myassert(0);
-            }
+in_addr_t
+getaddr(const char *hostname)
+{
+    in_addr_t addr = 0;
 
-            addr = ((struct sockaddr_in*)(info->ai_addr))->sin_addr.s_addr;
-            freeaddrinfo(info);
+    /* get the address in network order */
+    if (!getaddr_literal(hostname, &addr)) {
+        struct addrinfo* info;
+        int result = getaddrinfo(hostname, NULL, NULL, &info);
+        if(result != 0) {
+            myassert(0);
         }
 
-        return addr;
+        addr = ((struct sockaddr_in*)(info->ai_addr))->sin_addr.s_addr;
+        freeaddrinfo(info);
     }
+
+    return addr;
 }
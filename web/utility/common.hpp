@@ -33,6 +33,13 @@ to_hex(const unsigned char *value,
        unsigned int len,
        char *hex);
 
+/* the address, in network order, of a "hostname" that needs no
+ * resolver: an ip address string, "localhost", or "none" or the empty
+ * string, which are INADDR_NONE. returns false for the other names.
+ */
+bool
+getaddr_literal(const char *hostname, in_addr_t *addr);
+
 in_addr_t
 getaddr(const char *hostname);
 
@@ -7,6 +7,9 @@
 #include <algorithm>
 #include <vector>
 
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
 using std::vector;
 using std::string;
 using std::pair;
@@ -188,6 +191,112 @@ set_up_spdylay_session(spdylay_session **session_, void* user_data)
 #endif
 }
 
+static ssize_t
+h2_send_cb(nghttp2_session *session, const uint8_t *data,
+           size_t length, int flags, void *user_data)
+{
+    Connection *conn = reinterpret_cast<Connection*>(user_data);
+    return conn->h2_send_cb(session, data, length);
+}
+
+static ssize_t
+h2_recv_cb(nghttp2_session *session, uint8_t *buf, size_t length,
+           int flags, void *user_data)
+{
+    Connection *conn = reinterpret_cast<Connection*>(user_data);
+    return conn->h2_recv_cb(session, buf, length);
+}
+
+static int
+h2_on_begin_headers_cb(nghttp2_session *session,
+                       const nghttp2_frame *frame, void *user_data)
+{
+    Connection *conn = reinterpret_cast<Connection*>(user_data);
+    return conn->h2_on_begin_headers_cb(session, frame);
+}
+
+static int
+h2_on_header_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                const uint8_t *name, size_t namelen,
+                const uint8_t *value, size_t valuelen,
+                uint8_t flags, void *user_data)
+{
+    Connection *conn = reinterpret_cast<Connection*>(user_data);
+    return conn->h2_on_header_cb(session, frame, name, namelen,
+                                 value, valuelen);
+}
+
+static int
+h2_on_frame_recv_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                    void *user_data)
+{
+    Connection *conn = reinterpret_cast<Connection*>(user_data);
+    return conn->h2_on_frame_recv_cb(session, frame);
+}
+
+static int
+h2_on_data_chunk_recv_cb(nghttp2_session *session, uint8_t flags,
+                         int32_t stream_id, const uint8_t *data,
+                         size_t len, void *user_data)
+{
+    Connection *conn = reinterpret_cast<Connection*>(user_data);
+    return conn->h2_on_data_chunk_recv_cb(session, flags, stream_id,
+                                          data, len);
+}
+
+static int
+h2_on_stream_close_cb(nghttp2_session *session, int32_t stream_id,
+                      uint32_t error_code, void *user_data)
+{
+    Connection *conn = reinterpret_cast<Connection*>(user_data);
+    return conn->h2_on_stream_close_cb(session, stream_id, error_code);
+}
+
+int32_t Connection::h2_stream_window_size = 1 << 20;
+int32_t Connection::h2_session_window_size = 1 << 24;
+
+void
+Connection::set_up_h2_session()
+{
+    int r;
+    nghttp2_session_callbacks *callbacks = NULL;
+    myassert(0 == nghttp2_session_callbacks_new(&callbacks));
+    nghttp2_session_callbacks_set_send_callback(callbacks, ::h2_send_cb);
+    nghttp2_session_callbacks_set_recv_callback(callbacks, ::h2_recv_cb);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(
+        callbacks, ::h2_on_begin_headers_cb);
+    nghttp2_session_callbacks_set_on_header_callback(
+        callbacks, ::h2_on_header_cb);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(
+        callbacks, ::h2_on_frame_recv_cb);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(
+        callbacks, ::h2_on_data_chunk_recv_cb);
+    nghttp2_session_callbacks_set_on_stream_close_callback(
+        callbacks, ::h2_on_stream_close_cb);
+
+    r = nghttp2_session_client_new(&h2sess_, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+    myassert(0 == r);
+
+    /* queued now, sent right after the connection preface once the
+     * socket is connected */
+    nghttp2_settings_entry entry[3];
+    entry[0].settings_id = NGHTTP2_SETTINGS_ENABLE_PUSH;
+    entry[0].value = notify_pushed_meta_ ? 1 : 0;
+    entry[1].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+    entry[1].value = h2_stream_window_size;
+    entry[2].settings_id = NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    entry[2].value = 100;
+    r = nghttp2_submit_settings(h2sess_, NGHTTP2_FLAG_NONE,
+                                entry, ARRAY_LEN(entry));
+    myassert(0 == r);
+
+    /* the session window starts at 64KB whatever the settings */
+    r = nghttp2_session_set_local_window_size(
+        h2sess_, NGHTTP2_FLAG_NONE, 0, h2_session_window_size);
+    myassert(0 == r);
+}
+
 void
 Connection::http_write_to_outbuf()
 {
@@ -196,50 +305,57 @@ Connection::http_write_to_outbuf()
         logself(DEBUG, "submit queue is empty");
         return;
     }
-    Request *req = NULL;
-    const int qsize = active_req_queue_.size();
-    logself(DEBUG, "active req qsize %u", qsize);
-    if (!do_pipeline_) {
-        if (qsize > 0) {
-            logself(DEBUG, "no pipeline, and there's an active req -> wait");
-            return;
-        }
-        // else fall through to send req
-    } else {
-        // doing pipeline, but limit num of concurrent reqs
+    /* write as many requests as the pipeline depth allows: with
+     * max_pipeline_size_ 1, that's one request at a time, only once
+     * the previous response is complete.
+     */
+    bool wrote = false;
+    while (submitted_req_queue_.size() > 0) {
+        const size_t qsize = active_req_queue_.size();
+        logself(DEBUG, "active req qsize %zu", qsize);
         if (qsize >= max_pipeline_size_) {
             logself(DEBUG,
-                    "already %u reqs in active pipeline -> wait", qsize);
-            return;
+                    "already %zu reqs in active pipeline -> wait", qsize);
+            break;
         }
-        // else fall through to send req
-    }
-    logself(DEBUG, "writing a req to outbuf");
-    req = submitted_req_queue_.front();
-    myassert(req);
-    submitted_req_queue_.pop_front();
+        logself(DEBUG, "writing a req to outbuf");
+        Request *req = submitted_req_queue_.front();
+        myassert(req);
+        submitted_req_queue_.pop_front();
 
-    myassert(0 < evbuffer_add_printf(
-               outbuf_, "GET %s HTTP/1.1\r\n", req->path_.c_str()));
-    const vector<pair<string, string> >& hdrs = req->get_headers();
-    vector<pair<string, string> >::const_iterator it = hdrs.begin();
-    for (; it != hdrs.end(); ++it) {
         myassert(0 < evbuffer_add_printf(
-                   outbuf_, "%s: %s\r\n", it->first.c_str(),
-                   it->second.c_str()));
-    }
+                   outbuf_, "GET %s HTTP/1.1\r\n", req->path_.c_str()));
+        const vector<pair<string, string> >& hdrs = req->get_headers();
+        vector<pair<string, string> >::const_iterator it = hdrs.begin();
+        for (; it != hdrs.end(); ++it) {
+            myassert(0 < evbuffer_add_printf(
+                       outbuf_, "%s: %s\r\n", it->first.c_str(),
+                       it->second.c_str()));
+        }
 
-    first_byte_pos_ = req->get_first_byte_pos();
-    if (first_byte_pos_ > 0) {
-        logself(DEBUG, "adding first_byte_pos_ %zu", first_byte_pos_);
-        myassert(0 < evbuffer_add_printf(
-                     outbuf_, "Range: bytes=%zu-\r\n", first_byte_pos_));
-    }
+        /* several requests with different ranges can be in the
+         * pipeline, so the response's content-range is checked
+         * against its own request in http_parse_rsp_head()
+         */
+        const size_t first_byte_pos = req->get_first_byte_pos();
+        if (first_byte_pos > 0) {
+            logself(DEBUG, "adding first_byte_pos %zu", first_byte_pos);
+            myassert(0 < evbuffer_add_printf(
+                         outbuf_, "Range: bytes=%zu-\r\n", first_byte_pos));
+        }
 
-    myassert(2 == evbuffer_add_printf(outbuf_, "\r\n"));
-    active_req_queue_.push(req);
+        myassert(2 == evbuffer_add_printf(outbuf_, "\r\n"));
+        ActiveReqTimes_t times;
+        times.written_ms = gettimeofdayMs(NULL);
+        times.pipelined = !active_req_queue_.empty();
+        active_req_queue_.push(req);
+        active_req_times_.push(times);
+        max_active_reqs_seen_ = std::max(max_active_reqs_seen_,
+                                         active_req_queue_.size());
+        wrote = true;
+    }
 
-    if (state_ == CONNECTED) {
+    if (wrote && state_ == CONNECTED) {
         /* we might not be fully connected yet, e.g., still
          * negotiating with the socks proxy, in which case we don't
          * want to interfere.
@@ -251,6 +367,39 @@ Connection::http_write_to_outbuf()
     return;
 }
 
+void
+Connection::set_max_pipeline_size(const uint32_t& size)
+{
+    myassert(size > 0);
+    logself(DEBUG, "max pipeline size %u -> %u", max_pipeline_size_, size);
+    max_pipeline_size_ = size;
+}
+
+void
+Connection::account_hol_blocking()
+{
+    /* called when the first byte of the response at the front of
+     * active_req_queue_ arrives. if its request was pipelined behind
+     * others, it could not start before both its request was written
+     * and the response ahead of it completed: the time since then is
+     * time it was blocked.
+     */
+    myassert(!active_req_times_.empty());
+    const ActiveReqTimes_t& times = active_req_times_.front();
+    if (!times.pipelined) {
+        return;
+    }
+    const uint64_t now = gettimeofdayMs(NULL);
+    const uint64_t start = std::max(times.written_ms, last_rsp_done_ms_);
+    if (now > start) {
+        const uint64_t blocked = now - start;
+        ++num_hol_blocked_rsps_;
+        total_hol_blocking_ms_ += blocked;
+        max_hol_blocking_ms_ = std::max(max_hol_blocking_ms_, blocked);
+        logself(DEBUG, "next rsp was blocked for %" PRIu64 " ms", blocked);
+    }
+}
+
 int
 Connection::submit_request(Request* req)
 {
@@ -290,6 +439,8 @@ Connection::submit_request(Request* req)
         myassert(rv == 0);
         free(nv);
         enable_write_to_server_();
+    } else if (use_http2_) {
+        h2_submit_request(req);
     } else {
         submitted_req_queue_.push_back(req);
         /* http_write_to_outbuf() takes care of enabling the write
@@ -367,26 +518,36 @@ Connection::Connection(
     ConnectionErrorCb error_cb, ConnectionEOFCb eof_cb,
     PushedMetaCb pushed_meta_cb, PushedBodyDataCb pushed_body_data_cb,
     PushedBodyDoneCb pushed_body_done_cb,
-    void *cb_data, const bool& use_spdy
+    void *cb_data, const bool& use_spdy,
+    const uint32_t& max_pipeline_depth,
+    const bool& use_http2
     )
-    : instNum_(nextInstNum), use_spdy_(use_spdy),evbase_(evbase), ev_(NULL), fd_(-1)
+    : instNum_(nextInstNum), use_spdy_(use_spdy), use_http2_(use_http2)
+    , evbase_(evbase), ev_(NULL), fd_(-1)
     , state_(DISCONNECTED), socks5_state_(SOCKS5_NONE)
     , addr_(addr), port_(port)
     , socks5_addr_(socks5_addr), socks5_port_(socks5_port)
     , ssp_addr_(ssp_addr), ssp_port_(ssp_port)
-    , cnx_error_cb_(error_cb), cnx_eof_cb_(eof_cb)
+    , cnx_error_cb_(error_cb), cnx_eof_cb_(eof_cb), cb_data_(cb_data)
     , notify_pushed_meta_(pushed_meta_cb)
     , notify_pushed_body_data_(pushed_body_data_cb)
     , notify_pushed_body_done_(pushed_body_done_cb)
-    , spdysess_(NULL), inbuf_(NULL), outbuf_(NULL), do_pipeline_(false)
-    , max_pipeline_size_(1)
-    , http_rsp_state_(HTTP_RSP_STATE_STATUS_LINE)
+    , spdysess_(NULL), h2sess_(NULL), inbuf_(NULL), outbuf_(NULL)
+    , max_pipeline_size_(max_pipeline_depth)
+    , num_rsps_(0), num_hol_blocked_rsps_(0), total_hol_blocking_ms_(0)
+    , max_hol_blocking_ms_(0), last_rsp_done_ms_(0)
+    , max_active_reqs_seen_(0)
+    , http_rsp_state_(HTTP_RSP_STATE_HEAD), rsp_head_scanned_(0)
+    , rsp_head_eol_(0)
     , http_rsp_status_(-1), first_byte_pos_(0), body_len_(-1)
+    , rsp_chunked_(false)
     , cumulative_num_sent_bytes_(0), cumulative_num_recv_bytes_(0)
     , write_to_server_enabled_(false)
 {
     ++nextInstNum;
 
+    myassert(max_pipeline_size_ > 0);
+
     /* ssp acts as an http proxy, only it uses spdy to transport. so
      * if ssp is used, then we don't need the actual address of the
      * final site, as the ":host" header will take care of
@@ -402,7 +563,10 @@ Connection::Connection(
     if (use_spdy_) {
         /* it's ok to set up the session now even though socket is not
          * connected */
+        myassert(!use_http2_);
         set_up_spdylay_session(&spdysess_, this);
+    } else if (use_http2_) {
+        set_up_h2_session();
     } else {
         inbuf_ = evbuffer_new();
         outbuf_ = evbuffer_new();
@@ -414,6 +578,15 @@ Connection::Connection(
 Connection::~Connection()
 {
     logself(DEBUG, "begin destructor");
+    if (num_rsps_ > 0) {
+        logfn(SHADOW_LOG_LEVEL_INFO, __func__,
+              "cnx= %u: %u responses, max depth used %zu of %u, "
+              "%u blocked behind earlier responses for "
+              "%" PRIu64 " ms total, %" PRIu64 " ms max",
+              instNum_, num_rsps_, max_active_reqs_seen_,
+              max_pipeline_size_, num_hol_blocked_rsps_,
+              total_hol_blocking_ms_, max_hol_blocking_ms_);
+    }
     disconnect();
     evbase_ = NULL; // no freeing
     logself(DEBUG, "done destructor");
@@ -422,6 +595,16 @@ Connection::~Connection()
 std::queue<Request*>
 Connection::get_active_request_queue() const
 {
+    if (use_http2_) {
+        /* the streams not yet complete, in the order they were
+         * submitted */
+        std::queue<Request*> requests;
+        std::map<int32_t, Request*>::const_iterator it = sid2req_.begin();
+        for (; it != sid2req_.end(); ++it) {
+            requests.push(it->second);
+        }
+        return requests;
+    }
     return active_req_queue_;
 }
 
@@ -455,6 +638,8 @@ Connection::is_idle() const {
         if (use_spdy_) {
             return (!spdylay_session_want_read(spdysess_)
                     && !spdylay_session_want_write(spdysess_));
+        } else if (use_http2_) {
+            return sid2req_.empty() && psids_.empty();
         } else {
             const int subqsize = submitted_req_queue_.size();
             const int activeqsize = active_req_queue_.size();
@@ -496,6 +681,11 @@ Connection::disconnect()
         spdysess_ = 0;
     }
 
+    if (h2sess_) {
+        nghttp2_session_del(h2sess_);
+        h2sess_ = NULL;
+    }
+
     if (outbuf_) {
         evbuffer_free(outbuf_);
         outbuf_ = NULL;
@@ -517,7 +707,7 @@ Connection::on_socks5_proxy_connected()
     // write the client greeting
     static const char req[] = "\x05\x01\x00";
     // don't use "sizeof req", which gives you 4
-    myassert(write(fd_, req, 3) == 3);
+    myassert(ev_->socket_send(req, 3) == 3);
     conn->socks5_state_ = SOCKS5_GREETING;
     // when the proxy replies, we will handle in socks5_proxy_readcb()
     ev_->set_readcb(mev_socks5_proxy_readcb);
@@ -565,8 +755,6 @@ Connection::http_receive()
     struct evbuffer_iovec v[2];
     int n = 0, i = 0, num_to_commit = 0;
     static const size_t n_to_add = 4096 * ARRAY_LEN(v);
-    char *line = NULL;
-    bool content_range_found = false;
 
 read_more:
     n = 0;
@@ -581,7 +769,7 @@ read_more:
         if (len > n_to_add) {/* Don't write more than n_to_add bytes. */
             len = n_to_add;
         }
-        const int numread = recv(fd_, v[i].iov_base, len, 0);
+        const int numread = ev_->socket_recv(v[i].iov_base, len);
         if (numread == 0) {
             logself(DEBUG, "cnx is closed");
             reached_eof = true;
@@ -628,127 +816,86 @@ read_more:
 
     /* process it */
 handle_response:
-    line = NULL;
     switch (http_rsp_state_) {
-    case HTTP_RSP_STATE_STATUS_LINE: {
-        /* readln() does drain the buffer */
-        line = evbuffer_readln(
-            inbuf_, NULL, EVBUFFER_EOL_CRLF_STRICT);
-        if (line) {
-            logself(DEBUG, "got status line: [%s]", line);
-            const char *tmp = strchr(line, ' ');
-            myassert(tmp);
-            http_rsp_status_ = strtol(tmp + 1, NULL, 10);
-            if (http_rsp_status_ != 200 && http_rsp_status_ != 206) {
-                Request *req = active_req_queue_.front();
-                logfn(SHADOW_LOG_LEVEL_WARNING,
-                      "req [%s] got status [%d]", req->url_.c_str(), 
-                      http_rsp_status_);
-                myassert(0);
-            }
-            logself(DEBUG, "status: [%d]", http_rsp_status_);
-            http_rsp_state_ = HTTP_RSP_STATE_HEADERS;
-            content_range_found = false;
-            free(line);
-            line = NULL;
-            goto handle_response;
+    case HTTP_RSP_STATE_HEAD: {
+        if (0 == rsp_head_scanned_ && evbuffer_get_length(inbuf_) > 0
+            && !active_req_queue_.empty())
+        {
+            /* the first byte of the next response */
+            account_hol_blocking();
         }
-        /* we read only n_to_add bytes from socket. more might be
-         * available, so go try more.
-         */
-        goto read_more;
+        /* wait for the whole head, i.e., up to the empty line, then
+         * parse it where it is in inbuf_ */
+        const size_t head_len = http_scan_rsp_head();
+        if (0 == head_len) {
+            /* we read only n_to_add bytes from socket. more might be
+             * available, so go try more.
+             */
+            goto read_more;
+        }
+        http_parse_rsp_head(head_len);
+        myassert(0 == evbuffer_drain(inbuf_, head_len));
+        http_rsp_state_ =
+            rsp_chunked_ ? HTTP_RSP_STATE_CHUNK_SIZE : HTTP_RSP_STATE_BODY;
+        goto handle_response;
         break;
     }
-    case HTTP_RSP_STATE_HEADERS: {
-        logself(DEBUG, "try to get response headers");
-        while (NULL != (line = evbuffer_readln(
-                            inbuf_, NULL, EVBUFFER_EOL_CRLF_STRICT)))
-        {
-            /* a header line is assumped to be:
 
-               <name>: <value>
-
-               the "line" returned by evbuffer_readln() needs to be
-               freed, but we avoid allocating more memory by having
-               our name and value pointers point to the same
-               "line". so when we free, only free the name pointers.
-             */
-            if (line[0] == '\0') {
-                // no more hdrs
-                myassert(body_len_ >= 0);
-                myassert(0 == (rsp_hdrs_.size() % 2));
+    case HTTP_RSP_STATE_CHUNK_SIZE: {
+        /* "<hex size>[;extensions]\r\n" */
+        size_t eol_len = 0;
+        const struct evbuffer_ptr eol = evbuffer_search_eol(
+            inbuf_, NULL, &eol_len, EVBUFFER_EOL_CRLF_STRICT);
+        if (eol.pos == -1) {
+            goto read_more;
+        }
+        /* the '\r' stops strtol() */
+        const char *line =
+            (const char *)evbuffer_pullup(inbuf_, eol.pos + eol_len);
+        char *endptr = NULL;
+        body_len_ = strtol(line, &endptr, 16);
+        myassert(endptr != line && body_len_ >= 0);
+        myassert(0 == evbuffer_drain(inbuf_, eol.pos + eol_len));
+        logself(DEBUG, "chunk size %d", body_len_);
+        /* the last chunk is empty */
+        http_rsp_state_ =
+            body_len_ ? HTTP_RSP_STATE_BODY : HTTP_RSP_STATE_TRAILER;
+        goto handle_response;
+        break;
+    }
 
-                if (!content_range_found && first_byte_pos_ > 0) {
-                    logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
-                          "content-range header is missing in response.");
-                    myassert(0);
-                }
+    case HTTP_RSP_STATE_CHUNK_END: {
+        /* the "\r\n" after the chunk data */
+        char crlf[2];
+        if (evbuffer_get_length(inbuf_) < sizeof crlf) {
+            goto read_more;
+        }
+        myassert((int)sizeof crlf == evbuffer_remove(inbuf_, crlf, sizeof crlf));
+        myassert(crlf[0] == '\r' && crlf[1] == '\n');
+        http_rsp_state_ = HTTP_RSP_STATE_CHUNK_SIZE;
+        goto handle_response;
+        break;
+    }
 
-                char **nv = (char**)malloc((rsp_hdrs_.size() + 1) * sizeof (char*));
-                int j = 0;
-                for (; j < rsp_hdrs_.size(); ++j) {
-                    nv[j] = rsp_hdrs_[j];
-                    logself(DEBUG, "nv[%d] = [%s]", j, nv[j]);
-                }
-                nv[j] = NULL; /* null sentinel */
-                Request *req = active_req_queue_.front();
-                req->notify_rsp_meta(http_rsp_status_, nv);
-                free(nv);
-                for (int i = 0; i < rsp_hdrs_.size(); i += 2) {
-                    free(rsp_hdrs_[i]);
-                }
-                rsp_hdrs_.clear();
-                http_rsp_state_ = HTTP_RSP_STATE_BODY;
-                free(line);
-                line = NULL;
-                goto handle_response;
-            } else {
-                logself(DEBUG, "whole rsp hdr line: [%s]", line);
-                // XXX/TODO: expect all lower case
-                char *tmp = strchr(line, ':');
-                myassert(tmp);
-                rsp_hdrs_.push_back(line);
-                *tmp = '\0'; /* colon becomes NULL */
-                ++tmp;
-                *tmp = '\0'; /* blank space becomes NULL */
-                ++tmp;
-                rsp_hdrs_.push_back(tmp);
-                if (!strcasecmp(line, "content-length")) {
-                    body_len_ = strtol(tmp, NULL, 10);
-                    logself(DEBUG, "body content length: [%d]", body_len_);
-                } else if (!strcasecmp(line, "max-pipeline")) {
-#if 0
-                    max_pipeline_size_ = strtol(tmp, NULL, 10);
-                    logself(DEBUG, "max pipeline size supported: [%u]", max_pipeline_size_);
-#endif
-                } else if (!strcasecmp(line, "content-range")) {
-                    int first_byte_pos = 0;
-                    int last_byte_pos = 0;
-                    int full_len = 0;
-                    myassert(-1 != parseContentRange(tmp, 0, &first_byte_pos, &last_byte_pos, &full_len));
-                    if (first_byte_pos != first_byte_pos_) {
-                        logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
-                              "response first-byte-pos is %d, but we expect %d", 
-                              first_byte_pos, first_byte_pos_);
-                        myassert(0);
-                    }
-                    logself(DEBUG, "parsed first_byte_pos %d, last_byte_pos %d, full_len %d",
-                            first_byte_pos, last_byte_pos, full_len);
-                    myassert((full_len - 1) == last_byte_pos);
-                    content_range_found = true;
-                }
-                // DO NOT free line. because it's in the rsp_hdrs_;
-            }
+    case HTTP_RSP_STATE_TRAILER: {
+        /* ignore the trailer fields, up to the empty line */
+        size_t eol_len = 0;
+        const struct evbuffer_ptr eol = evbuffer_search_eol(
+            inbuf_, NULL, &eol_len, EVBUFFER_EOL_CRLF_STRICT);
+        if (eol.pos == -1) {
+            goto read_more;
         }
-        /* we read only n_to_add bytes from socket. more might be
-         * available, so go try more.
-         */
-        goto read_more;
+        myassert(0 == evbuffer_drain(inbuf_, eol.pos + eol_len));
+        if (eol.pos == 0) {
+            http_rsp_done();
+        }
+        goto handle_response;
         break;
     }
 
     case HTTP_RSP_STATE_BODY: {
-        myassert(body_len_ > 0);
+        /* the whole body, or the current chunk */
+        myassert(body_len_ >= 0);
         logself(DEBUG, "get rsp body, current body_len_ %d", body_len_);
         Request *req = active_req_queue_.front();
         while (evbuffer_get_length(inbuf_) > 0 && body_len_ > 0) {
@@ -773,21 +920,11 @@ handle_response:
             myassert(0 == evbuffer_drain(inbuf_, numconsumed));
         }
         if (body_len_ == 0) {
-            /* remove req from active queue */
-            active_req_queue_.pop();
-            req->notify_rsp_body_done();
-            body_len_ = -1;
-            http_rsp_state_ = HTTP_RSP_STATE_STATUS_LINE;
-            if (!notify_request_done_cb_.empty()) {
-                notify_request_done_cb_(this, req);
+            if (rsp_chunked_) {
+                http_rsp_state_ = HTTP_RSP_STATE_CHUNK_END;
+            } else {
+                http_rsp_done();
             }
-            /* if there's more in the submitted queue, we should be
-             * able move some into the active queue, now that we just
-             * cleared some space in the active queue
-             */
-            /* http_write_to_outbuf() takes care of enabling the
-             * write event */
-            http_write_to_outbuf();
             goto handle_response;
         }
 
@@ -806,6 +943,174 @@ done:
     return !reached_eof;
 }
 
+void
+Connection::http_rsp_done()
+{
+    Request *req = active_req_queue_.front();
+
+    /* remove req from active queue */
+    active_req_queue_.pop();
+    active_req_times_.pop();
+    ++num_rsps_;
+    last_rsp_done_ms_ = gettimeofdayMs(NULL);
+    req->notify_rsp_body_done();
+    body_len_ = -1;
+    rsp_chunked_ = false;
+    http_rsp_state_ = HTTP_RSP_STATE_HEAD;
+    if (!notify_request_done_cb_.empty()) {
+        notify_request_done_cb_(this, req);
+    }
+    /* if there's more in the submitted queue, we should be
+     * able move some into the active queue, now that we just
+     * cleared some space in the active queue
+     */
+    /* http_write_to_outbuf() takes care of enabling the
+     * write event */
+    http_write_to_outbuf();
+}
+
+size_t
+Connection::http_scan_rsp_head()
+{
+    /* resume where the previous scan stopped, in whatever chunks
+     * inbuf_ holds: every byte is looked at once, without copying
+     */
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec v[4];
+    while (rsp_head_scanned_ < evbuffer_get_length(inbuf_)) {
+        myassert(0 == evbuffer_ptr_set(inbuf_, &pos, rsp_head_scanned_,
+                                       EVBUFFER_PTR_SET));
+        const int n = evbuffer_peek(inbuf_, -1, &pos, v, ARRAY_LEN(v));
+        for (int i = 0; i < n && i < (int)ARRAY_LEN(v); ++i) {
+            const char *p = (const char *)v[i].iov_base;
+            for (size_t j = 0; j < v[i].iov_len; ++j) {
+                /* rsp_head_eol_ is how much of "\r\n\r\n" we
+                 * have matched */
+                if (p[j] == '\r') {
+                    rsp_head_eol_ = (rsp_head_eol_ == 2) ? 3 : 1;
+                } else if (p[j] == '\n'
+                           && (rsp_head_eol_ == 1 || rsp_head_eol_ == 3))
+                {
+                    ++rsp_head_eol_;
+                } else {
+                    rsp_head_eol_ = 0;
+                }
+                if (rsp_head_eol_ == 4) {
+                    const size_t head_len = rsp_head_scanned_ + j + 1;
+                    rsp_head_scanned_ = rsp_head_eol_ = 0;
+                    return head_len;
+                }
+            }
+            rsp_head_scanned_ += v[i].iov_len;
+        }
+    }
+    return 0;
+}
+
+void
+Connection::http_parse_rsp_head(const size_t head_len)
+{
+    /* the head is usually in one chunk of inbuf_, so this doesn't
+     * copy. the lines are split in place: the names and values are
+     * NUL-terminated where they are, and rsp_hdrs_ points to them
+     * until we drain the head.
+     */
+    char *head = (char *)evbuffer_pullup(inbuf_, head_len);
+    myassert(head);
+    char *const end = head + head_len;
+
+    /* the range we asked for in this response's request */
+    first_byte_pos_ = active_req_queue_.front()->get_first_byte_pos();
+
+    /* status line */
+    char *eol = (char *)memchr(head, '\r', end - head);
+    myassert(eol);
+    *eol = '\0';
+    logself(DEBUG, "got status line: [%s]", head);
+    const char *tmp = strchr(head, ' ');
+    myassert(tmp);
+    http_rsp_status_ = strtol(tmp + 1, NULL, 10);
+    if (http_rsp_status_ != 200 && http_rsp_status_ != 206) {
+        Request *req = active_req_queue_.front();
+        logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+              "req [%s] got status [%d]", req->url_.c_str(),
+              http_rsp_status_);
+        myassert(0);
+    }
+    logself(DEBUG, "status: [%d]", http_rsp_status_);
+
+    /* header lines, assumed to be "<name>:<optional spaces><value>" */
+    bool content_range_found = false;
+    rsp_hdrs_.clear();
+    for (char *line = eol + 2; line < end && *line != '\r'; line = eol + 2) {
+        eol = (char *)memchr(line, '\r', end - line);
+        myassert(eol);
+        *eol = '\0';
+        logself(DEBUG, "whole rsp hdr line: [%s]", line);
+        char *value = strchr(line, ':');
+        myassert(value);
+        *value = '\0'; /* colon becomes NULL */
+        ++value;
+        while (*value == ' ' || *value == '\t') {
+            ++value;
+        }
+        rsp_hdrs_.push_back(line);
+        rsp_hdrs_.push_back(value);
+
+        // XXX/TODO: expect all lower case
+        if (!strcasecmp(line, "content-length")) {
+            body_len_ = strtol(value, NULL, 10);
+            logself(DEBUG, "body content length: [%d]", body_len_);
+        } else if (!strcasecmp(line, "transfer-encoding")) {
+            /* "chunked" is always the last coding, and the only one
+             * we get from the webserver */
+            rsp_chunked_ = (NULL != strcasestr(value, "chunked"));
+            logself(DEBUG, "chunked: [%d]", rsp_chunked_);
+        } else if (!strcasecmp(line, "max-pipeline")) {
+            /* the server can only lower our depth */
+            const long server_max = strtol(value, NULL, 10);
+            if (server_max > 0 && server_max < max_pipeline_size_) {
+                set_max_pipeline_size(server_max);
+            }
+            logself(DEBUG, "max pipeline size supported: [%ld]", server_max);
+        } else if (!strcasecmp(line, "content-range")) {
+            int first_byte_pos = 0;
+            int last_byte_pos = 0;
+            int full_len = 0;
+            myassert(-1 != parseContentRange(value, 0, &first_byte_pos, &last_byte_pos, &full_len));
+            if (first_byte_pos != first_byte_pos_) {
+                logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+                      "response first-byte-pos is %d, but we expect %d",
+                      first_byte_pos, first_byte_pos_);
+                myassert(0);
+            }
+            logself(DEBUG, "parsed first_byte_pos %d, last_byte_pos %d, full_len %d",
+                    first_byte_pos, last_byte_pos, full_len);
+            myassert((full_len - 1) == last_byte_pos);
+            content_range_found = true;
+        }
+    }
+
+    // no more hdrs
+    if (rsp_chunked_) {
+        /* the chunk sizes override any content-length */
+        body_len_ = -1;
+    } else {
+        myassert(body_len_ >= 0);
+    }
+    if (!content_range_found && first_byte_pos_ > 0) {
+        logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+              "content-range header is missing in response.");
+        myassert(0);
+    }
+
+    rsp_hdrs_.push_back(NULL); /* null sentinel */
+    Request *req = active_req_queue_.front();
+    req->notify_rsp_meta(http_rsp_status_, &rsp_hdrs_[0]);
+    /* keep the capacity for the next response */
+    rsp_hdrs_.clear();
+}
+
 void
 Connection::on_read()
 {
@@ -835,6 +1140,27 @@ Connection::on_read()
                 rv = -1;
             }
         }
+    } else if (use_http2_) {
+        if ((rv = nghttp2_session_recv(h2sess_)) != 0) {
+            h2_session_io_failed("nghttp2_session_recv()", rv);
+            return;
+        }
+        /* e.g., SETTINGS acks and WINDOW_UPDATEs */
+        if ((rv = nghttp2_session_send(h2sess_)) != 0) {
+            h2_session_io_failed("nghttp2_session_send()", rv);
+            return;
+        }
+        if (!nghttp2_session_want_read(h2sess_)
+            && !nghttp2_session_want_write(h2sess_))
+        {
+            logself(DEBUG, "session is over, e.g., after a GOAWAY");
+            disconnect();
+            on_eof();
+            return;
+        }
+        if (nghttp2_session_want_write(h2sess_)) {
+            enable_write_to_server_();
+        }
     } else {
         if (!http_receive()) {
             on_eof();
@@ -980,6 +1306,20 @@ Connection::send_()
                 rv = -1;
             }
         }
+    } else if (use_http2_) {
+        if (nghttp2_session_want_write(h2sess_)) {
+            if ((rv = nghttp2_session_send(h2sess_)) != 0) {
+                h2_session_io_failed("nghttp2_session_send()", rv);
+                return;
+            }
+            /* after writing, there's likely need to receive */
+            ev_->set_readcb(mev_readcb);
+        }
+        /* nghttp2_session_send() stops when the socket would block,
+         * in which case it still wants to write */
+        if (!nghttp2_session_want_write(h2sess_)) {
+            disable_write_to_server_();
+        }
     } else {
         http_write_to_outbuf();
         if (evbuffer_get_length(outbuf_) > 0) {
@@ -994,8 +1334,8 @@ Connection::send_()
             const int n = evbuffer_peek(
                 outbuf_, -1, NULL, v, ARRAY_LEN(v));
             for (int i = 0; i < n; ++i) {
-                const int numwritten = write(
-                    fd_, (const uint8_t *)v[i].iov_base, v[i].iov_len);
+                const int numwritten = ev_->socket_send(
+                    (const uint8_t *)v[i].iov_base, v[i].iov_len);
                 if (numwritten == -1) {
                     myassert(errno == EWOULDBLOCK);
                     break;
@@ -1033,7 +1373,12 @@ Connection::on_socks5_proxy_readable()
         // this should be the first accept response from socks5 proxy
         logself(DEBUG, "process greeting response");
         char mem[2];
-        myassert(2 == read(fd_, mem, 2));
+        const ssize_t numread = ev_->socket_recv(mem, 2);
+        if (numread == -1 && errno == EWOULDBLOCK) {
+            // edge-triggered mode: the proxy has not replied yet
+            return;
+        }
+        myassert(2 == numread);
         myassert(0 == memcmp(mem, "\x05\x00", 2));
 
         logself(DEBUG, "transition to SOCKS5_WRITE_REQUEST_NEXT");
@@ -1048,7 +1393,11 @@ Connection::on_socks5_proxy_readable()
         // the response will still be \x01 (this might or might not be
         // specific to Tor?)
         unsigned char mem[10]; /* read 10 bytes */
-        myassert(10 == read(fd_, mem, 10));
+        const ssize_t numread = ev_->socket_recv(mem, 10);
+        if (numread == -1 && errno == EWOULDBLOCK) {
+            return;
+        }
+        myassert(10 == numread);
 #if 0
         printhex("socks proxy greeting response", mem, 4);
 #endif
@@ -1091,7 +1440,7 @@ Connection::on_socks5_proxy_writable()
         req.append((const char*)&addr, 4);
         port = htons(port);
         req.append((const char*)&port, 2);
-        myassert(write(fd_, req.c_str(), req.size()) == req.size());
+        myassert(ev_->socket_send(req.c_str(), req.size()) == req.size());
 #if 0
         printhex("i write request: ",
                  (const unsigned char*)req.c_str(), req.size());
@@ -1114,7 +1463,7 @@ Connection::spdylay_send_cb(spdylay_session *session, const uint8_t *data,
     Connection *conn = this;
 
     ssize_t retval = SPDYLAY_ERR_CALLBACK_FAILURE;
-    ssize_t numsent = send(conn->fd_, data, length, 0);
+    ssize_t numsent = conn->ev_->socket_send(data, length);
     if (numsent < 0) {
         if (errno == EWOULDBLOCK) {
             retval = SPDYLAY_ERR_WOULDBLOCK;
@@ -1148,7 +1497,7 @@ Connection::spdylay_recv_cb(spdylay_session *session, uint8_t *buf,
     }
     Connection *conn = this;
     ssize_t retval = SPDYLAY_ERR_CALLBACK_FAILURE;
-    ssize_t numread = recv(conn->fd_, buf, length, 0);
+    ssize_t numread = conn->ev_->socket_recv(buf, length);
 
     if (0 == numread) {
         logself(DEBUG, "no more data is available for reading");
@@ -1349,3 +1698,339 @@ Connection::spdylay_before_ctrl_send_cb(spdylay_session *session,
     }
     logself(DEBUG, "done");
 }
+
+void
+Connection::h2_submit_request(Request* req)
+{
+    logself(DEBUG, "begin");
+    const vector<pair<string, string> >& hdrs = req->get_headers();
+
+    string authority = req->host_;
+    if (req->port_ != 80) {
+        char port[8];
+        snprintf(port, sizeof port, ":%u", req->port_);
+        authority += port;
+    }
+    string range;
+    if (req->get_first_byte_pos() > 0) {
+        char buf[32];
+        snprintf(buf, sizeof buf, "bytes=%zu-", req->get_first_byte_pos());
+        range = buf;
+    }
+    /* http/2 header names must be lower case. reserve, so that the
+     * nv's keep pointing to valid strings */
+    vector<string> names;
+    names.reserve(hdrs.size());
+
+    vector<nghttp2_nv> nva;
+    nva.reserve(5 + hdrs.size());
+#define H2_ADD_NV(n, nlen, v, vlen)                                     \
+    do {                                                                \
+        nghttp2_nv nv = {(uint8_t*)(n), (uint8_t*)(v), (nlen), (vlen),  \
+                         NGHTTP2_NV_FLAG_NONE};                         \
+        nva.push_back(nv);                                              \
+    } while (0)
+
+    H2_ADD_NV(":method", 7, "GET", 3);
+    H2_ADD_NV(":scheme", 7, "http", 4);
+    H2_ADD_NV(":authority", 10, authority.c_str(), authority.size());
+    H2_ADD_NV(":path", 5, req->path_.c_str(), req->path_.size());
+    if (!range.empty()) {
+        H2_ADD_NV("range", 5, range.c_str(), range.size());
+    }
+    vector<pair<string, string> >::const_iterator it = hdrs.begin();
+    for (; it != hdrs.end(); ++it) {
+        string name = it->first;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "host" || name == "connection") {
+            /* ":authority" replaces "host", and connection-specific
+             * headers are not allowed */
+            continue;
+        }
+        names.push_back(name);
+        H2_ADD_NV(names.back().c_str(), names.back().size(),
+                  it->second.c_str(), it->second.size());
+    }
+#undef H2_ADD_NV
+
+    /* nghttp2_submit_request() copies the nv's. if the server's max
+     * concurrent streams is reached, the stream is queued until
+     * another one closes */
+    const int32_t sid = nghttp2_submit_request(
+        h2sess_, NULL, &nva[0], nva.size(), NULL, req);
+    myassert(sid > 0);
+    logself(DEBUG, "new stream sid: %d, req: %u", sid, req->instNum_);
+    sid2req_[sid] = req;
+    req->notify_req_about_to_send();
+
+    if (state_ == CONNECTED) {
+        /* otherwise it's enabled once connected */
+        enable_write_to_server_();
+    }
+    logself(DEBUG, "done");
+}
+
+void
+Connection::h2_session_io_failed(const char *what, const int& rv)
+{
+    disconnect();
+    if (NGHTTP2_ERR_EOF == rv) {
+        logself(DEBUG, "remote peer closed");
+        on_eof();
+    } else {
+        logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+              "%s returned \"%s\"", what, nghttp2_strerror(rv));
+        on_error();
+    }
+}
+
+ssize_t
+Connection::h2_send_cb(nghttp2_session *session, const uint8_t *data,
+                       size_t length)
+{
+    logself(DEBUG, "begin, length=%zu", length);
+    myassert(session == h2sess_);
+
+    ssize_t retval = NGHTTP2_ERR_CALLBACK_FAILURE;
+    const ssize_t numsent = ev_->socket_send(data, length);
+    if (numsent < 0) {
+        if (errno == EWOULDBLOCK) {
+            retval = NGHTTP2_ERR_WOULDBLOCK;
+        } else {
+            logWARN("error with errno %d", errno);
+        }
+    } else if (numsent == 0) {
+        logWARN("sent %zd bytes --> error", numsent);
+    } else {
+        retval = numsent;
+        cumulative_num_sent_bytes_ += numsent;
+        logself(DEBUG, "able to send %zd bytes", numsent);
+    }
+    return retval;
+}
+
+ssize_t
+Connection::h2_recv_cb(nghttp2_session *session, uint8_t *buf,
+                       size_t length)
+{
+    logself(DEBUG, "begin, length=%zu", length);
+    myassert(session == h2sess_);
+
+    ssize_t retval = NGHTTP2_ERR_CALLBACK_FAILURE;
+    const ssize_t numread = ev_->socket_recv(buf, length);
+    if (0 == numread) {
+        logself(DEBUG, "no more data is available for reading");
+        retval = NGHTTP2_ERR_EOF;
+    } else if (-1 == numread) {
+        if (errno == EWOULDBLOCK) {
+            retval = NGHTTP2_ERR_WOULDBLOCK;
+        } else {
+            logWARN("error with errno %d", errno);
+        }
+    } else {
+        logself(DEBUG, "able to read %zd bytes", numread);
+        retval = numread;
+        if (0 == cumulative_num_recv_bytes_
+            && cnx_first_recv_byte_cb_)
+        {
+            cnx_first_recv_byte_cb_(this);
+        }
+        cumulative_num_recv_bytes_ += numread;
+    }
+    return retval;
+}
+
+int
+Connection::h2_on_begin_headers_cb(nghttp2_session *session,
+                                   const nghttp2_frame *frame)
+{
+    /* headers of a PUSH_PROMISE are those of the pushed request, so
+     * they are kept under the promised stream's id */
+    if (frame->hd.type == NGHTTP2_PUSH_PROMISE) {
+        h2_hdrs_[frame->push_promise.promised_stream_id].clear();
+    } else if (frame->hd.type == NGHTTP2_HEADERS) {
+        h2_hdrs_[frame->hd.stream_id].clear();
+    }
+    return 0;
+}
+
+int
+Connection::h2_on_header_cb(nghttp2_session *session,
+                            const nghttp2_frame *frame,
+                            const uint8_t *name, size_t namelen,
+                            const uint8_t *value, size_t valuelen)
+{
+    int32_t sid = frame->hd.stream_id;
+    if (frame->hd.type == NGHTTP2_PUSH_PROMISE) {
+        sid = frame->push_promise.promised_stream_id;
+    }
+    std::vector<std::string>& hdrs = h2_hdrs_[sid];
+    hdrs.push_back(string((const char*)name, namelen));
+    hdrs.push_back(string((const char*)value, valuelen));
+    return 0;
+}
+
+int
+Connection::h2_on_frame_recv_cb(nghttp2_session *session,
+                                const nghttp2_frame *frame)
+{
+    const int32_t sid = frame->hd.stream_id;
+    switch (frame->hd.type) {
+    case NGHTTP2_HEADERS: {
+        if (frame->headers.cat != NGHTTP2_HCAT_RESPONSE
+            && frame->headers.cat != NGHTTP2_HCAT_PUSH_RESPONSE)
+        {
+            /* e.g., trailers, which we ignore */
+            break;
+        }
+        std::vector<std::string>& hdrs = h2_hdrs_[sid];
+        std::vector<char*> nv;
+        int status = 0;
+        ssize_t contentlen = -1;
+        for (size_t i = 0; i + 1 < hdrs.size(); i += 2) {
+            logself(DEBUG, "sid %d hdr name [%s] value [%s]",
+                    sid, hdrs[i].c_str(), hdrs[i+1].c_str());
+            if (hdrs[i] == ":status") {
+                status = strtol(hdrs[i+1].c_str(), NULL, 10);
+            } else if (hdrs[i] == "content-length") {
+                contentlen = strtol(hdrs[i+1].c_str(), NULL, 10);
+            }
+            nv.push_back((char*)hdrs[i].c_str());
+            nv.push_back((char*)hdrs[i+1].c_str());
+        }
+        nv.push_back(NULL); /* null sentinel */
+
+        if (inSet(psids_, sid)) {
+            logself(DEBUG, "pushed url: [%s], contentlen %zd",
+                    h2_pushed_urls_[sid].c_str(), contentlen);
+            notify_pushed_meta_(sid, h2_pushed_urls_[sid].c_str(),
+                                contentlen, (const char**)&nv[0],
+                                this, cb_data_);
+            /* from now on somebody might be waiting for it */
+            h2_pushed_urls_.erase(sid);
+        } else {
+            myassert(inMap(sid2req_, sid));
+            Request *req = sid2req_[sid];
+            if (status != 200 && status != 206) {
+                logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+                      "req [%s] got status [%d]", req->url_.c_str(),
+                      status);
+                myassert(0);
+            }
+            req->notify_rsp_meta(status, &nv[0]);
+        }
+        h2_hdrs_.erase(sid);
+
+        if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+            h2_stream_done(sid);
+        }
+        break;
+    }
+    case NGHTTP2_DATA:
+        if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+            h2_stream_done(sid);
+        }
+        break;
+    case NGHTTP2_PUSH_PROMISE: {
+        const int32_t pushsid = frame->push_promise.promised_stream_id;
+        std::vector<std::string>& hdrs = h2_hdrs_[pushsid];
+        string scheme("http"), authority, path;
+        for (size_t i = 0; i + 1 < hdrs.size(); i += 2) {
+            if (hdrs[i] == ":scheme") {
+                scheme = hdrs[i+1];
+            } else if (hdrs[i] == ":authority") {
+                authority = hdrs[i+1];
+            } else if (hdrs[i] == ":path") {
+                path = hdrs[i+1];
+            }
+        }
+        h2_pushed_urls_[pushsid] = scheme + "://" + authority + path;
+        h2_hdrs_.erase(pushsid);
+        psids_.insert(pushsid);
+        logself(DEBUG, "server-pushed stream %d, assoc stream %d: [%s]",
+                pushsid, sid, h2_pushed_urls_[pushsid].c_str());
+        break;
+    }
+    case NGHTTP2_GOAWAY:
+        logself(DEBUG, "got GOAWAY, last stream id %d",
+                frame->goaway.last_stream_id);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+int
+Connection::h2_on_data_chunk_recv_cb(nghttp2_session *session,
+                                     uint8_t flags, int32_t stream_id,
+                                     const uint8_t *data, size_t len)
+{
+    const int32_t sid = stream_id;
+    logself(DEBUG, "begin, sid %d, len %zu", sid, len);
+
+    if (inSet(psids_, sid)) {
+        notify_pushed_body_data_(sid, data, len, this, cb_data_);
+        return 0;
+    }
+
+    myassert(inMap(sid2req_, sid));
+    sid2req_[sid]->notify_rsp_body_data(data, len);
+    return 0;
+}
+
+int
+Connection::h2_on_stream_close_cb(nghttp2_session *session,
+                                  int32_t stream_id, uint32_t error_code)
+{
+    const int32_t sid = stream_id;
+    logself(DEBUG, "sid %d closed, error code %u", sid, error_code);
+    h2_hdrs_.erase(sid);
+    if (inSet(psids_, sid)) {
+        psids_.erase(sid);
+        if (inMap(h2_pushed_urls_, sid)) {
+            /* a pushed stream the server cancelled before its
+             * response: nobody is waiting for it */
+            h2_pushed_urls_.erase(sid);
+            return 0;
+        }
+        /* its response was reported, so it is failed like the
+         * requests below: the manager retries what it was waiting
+         * for */
+        logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+              "pushed stream %d closed with error \"%s\"",
+              sid, nghttp2_http2_strerror(error_code));
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    if (inMap(sid2req_, sid)) {
+        /* closed before its response is complete, e.g., refused
+         * after a GOAWAY: fail the connection so that the manager
+         * retries the requests still in sid2req_ */
+        logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+              "stream %d of req [%s] closed with error \"%s\"",
+              sid, sid2req_[sid]->url_.c_str(),
+              nghttp2_http2_strerror(error_code));
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+void
+Connection::h2_stream_done(const int32_t& sid)
+{
+    logself(DEBUG, "last data of stream %d", sid);
+    if (inSet(psids_, sid)) {
+        psids_.erase(sid);
+        h2_pushed_urls_.erase(sid);
+        notify_pushed_body_done_(sid, this, cb_data_);
+        return;
+    }
+
+    myassert(inMap(sid2req_, sid));
+    Request* req = sid2req_[sid];
+    sid2req_.erase(sid);
+    req->notify_rsp_body_done();
+    if (!notify_request_done_cb_.empty()) {
+        notify_request_done_cb_(this, req);
+    }
+}
@@ -17,18 +17,21 @@
 #include <event2/buffer.h>
 
 #include <boost/function.hpp>
+#include <boost/intrusive/list_hook.hpp>
 
 #include "myevent.hpp"
 #include "common.hpp"
 #include "request.hpp"
 
 #include <spdylay/spdylay.h>
+#include <nghttp2/nghttp2.h>
 
 #include <string>
 #include <map>
 #include <set>
 #include <queue>
 #include <deque>
+#include <vector>
 
 class Connection;
 
@@ -47,10 +50,12 @@ typedef void (*PushedBodyDoneCb)(int id, Connection* cnx, void* cb_data);
 /* this can be used for a connection towards a "server" (e.g.,
  * directly to webserver, or via a socks5 or spdy proxy).
  *
- * it can talk basic http or spdy with the "server".
+ * it can talk basic http, spdy, or http/2 (cleartext, with prior
+ * knowledge, i.e., no upgrade from http/1.1) with the "server".
  *
- * caveat: if http, chunked encoding not supported, i.e., response
- * must provide content length.
+ * if http, a response body is delimited by its content-length or by
+ * chunked transfer-encoding; either way, the body bytes are passed to
+ * the request as they arrive.
  *
  * submit requests onto this connection by calling
  * submit_request(). the request object will be notified of "meta"
@@ -77,6 +82,15 @@ public:
      *
      * if the final server addr is specified, then ssp addr must not,
      * and vice versa. (where "specified" means "non-zero.")
+     *
+     * "max_pipeline_depth": (http only) max num of requests written
+     * to the server before their responses are received. 1 means no
+     * pipelining. the server can lower it with a "max-pipeline"
+     * response header.
+     *
+     * "use_http2": multiplex all requests as streams of one http/2
+     * session. server push is accepted only if "pushed_meta_cb" is
+     * given. "use_spdy" must be false.
      */
     Connection(myevent_base *evbase,
                const in_addr_t& addr, const in_port_t& port,
@@ -86,7 +100,9 @@ public:
                PushedMetaCb pushed_meta_cb, PushedBodyDataCb pushed_body_data_cb,
                PushedBodyDoneCb pushed_body_done_cb,
                void *cb_data /* for error_cb and eof_cb */,
-               const bool& use_spdy
+               const bool& use_spdy,
+               const uint32_t& max_pipeline_depth=1,
+               const bool& use_http2=false
         );
     ~Connection();
 
@@ -104,8 +120,18 @@ public:
     bool is_idle() const;
     size_t get_queue_size() const
     {
+        if (use_http2_) {
+            return sid2req_.size();
+        }
         return submitted_req_queue_.size() + active_req_queue_.size();
     }
+    /* for the owner (i.e., ConnectionManager) to keep this connection
+     * in one of its lists without allocating. unlinks itself when the
+     * connection is destroyed.
+     */
+    typedef boost::intrusive::list_member_hook<
+        boost::intrusive::link_mode<boost::intrusive::auto_unlink> > OwnerHook;
+    OwnerHook owner_hook_;
     const size_t& get_total_num_sent_bytes() const
     {
         return cumulative_num_sent_bytes_;
@@ -118,6 +144,19 @@ public:
     std::queue<Request*> get_active_request_queue() const;
     std::deque<Request*> get_pending_request_queue() const;
 
+    /* the pipeline depth currently in use. lowering it does not
+     * affect the requests already written to the server. */
+    uint32_t get_max_pipeline_size() const { return max_pipeline_size_; }
+    void set_max_pipeline_size(const uint32_t& size);
+
+    /* head-of-line blocking: a pipelined response is "blocked" from
+     * the later of its request being written and the completion of
+     * the response ahead of it, until its first byte arrives.
+     */
+    uint32_t get_num_hol_blocked_rsps() const { return num_hol_blocked_rsps_; }
+    uint64_t get_total_hol_blocking_ms() const { return total_hol_blocking_ms_; }
+    uint64_t get_max_hol_blocking_ms() const { return max_hol_blocking_ms_; }
+
     void set_request_done_cb(ConnectionRequestDoneCb cb);
 
     /* schedule this cnx for later deletion */
@@ -157,8 +196,36 @@ public:
                                  uint8_t flags, int32_t stream_id,
                                  int32_t len);
 
+    ssize_t h2_send_cb(nghttp2_session *session, const uint8_t *data,
+                       size_t length);
+    ssize_t h2_recv_cb(nghttp2_session *session, uint8_t *buf,
+                       size_t length);
+    int h2_on_begin_headers_cb(nghttp2_session *session,
+                               const nghttp2_frame *frame);
+    int h2_on_header_cb(nghttp2_session *session,
+                        const nghttp2_frame *frame,
+                        const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen);
+    int h2_on_frame_recv_cb(nghttp2_session *session,
+                            const nghttp2_frame *frame);
+    int h2_on_data_chunk_recv_cb(nghttp2_session *session,
+                                 uint8_t flags, int32_t stream_id,
+                                 const uint8_t *data, size_t len);
+    int h2_on_stream_close_cb(nghttp2_session *session,
+                              int32_t stream_id, uint32_t error_code);
+
+    /* http/2 flow control: the receive window of each stream, and of
+     * the whole session. a small window throttles the server once
+     * that many bytes are unacknowledged, so on long-rtt paths (e.g.,
+     * tor) it limits throughput to window/rtt. set them before
+     * creating Connections.
+     */
+    static int32_t h2_stream_window_size;
+    static int32_t h2_session_window_size;
+
     const uint32_t instNum_; // monotonic id of this cnx obj
     const bool use_spdy_;
+    const bool use_http2_;
 
 private:
 
@@ -200,7 +267,19 @@ private:
                                  // buff
     // read from socket and process the read data
     bool http_receive();
+    /* length of the response head at the start of inbuf_, or 0 if
+     * it's not complete yet */
+    size_t http_scan_rsp_head();
+    void http_parse_rsp_head(const size_t head_len);
+    /* the response to the front of active_req_queue_ is complete */
+    void http_rsp_done();
     void handle_server_push_ctrl_recv(spdylay_frame *frame);
+    void set_up_h2_session();
+    void h2_submit_request(Request* req);
+    /* tell the Request (or the push callbacks) that its response is
+     * complete */
+    void h2_stream_done(const int32_t& sid);
+    void h2_session_io_failed(const char *what, const int& rv);
 
     static uint32_t nextInstNum;
     myevent_base *evbase_; // dont free
@@ -235,6 +314,17 @@ private:
     std::map<int32_t, Request*> sid2req_;
     /* set of pushed stream ids */
     std::set<int32_t> psids_;
+
+    /* for http/2-to-server support. sid2req_ and psids_ are used
+     * too, but completed streams are removed from them.
+     */
+    nghttp2_session *h2sess_;
+    /* headers received so far on each stream, as name, value, name,
+     * ... for a pushed stream, first those of its PUSH_PROMISE */
+    std::map<int32_t, std::vector<std::string> > h2_hdrs_;
+    /* url of each pushed stream, from its PUSH_PROMISE until its
+     * response is reported */
+    std::map<int32_t, std::string> h2_pushed_urls_;
     /* for http-to-server support */
 
     // perhaps take a look at libevent's evhttp
@@ -245,28 +335,50 @@ private:
      */
     std::deque<Request* > submitted_req_queue_; // dont free these ptrs
     std::queue<Request* > active_req_queue_; // dont free these ptrs
+    /* for each request in active_req_queue_: when it was written to
+     * outbuf_, and whether earlier requests were still waiting for
+     * their responses then */
+    struct ActiveReqTimes_t {
+        uint64_t written_ms;
+        bool pipelined;
+    };
+    std::queue<ActiveReqTimes_t> active_req_times_;
     struct evbuffer* inbuf_;
     struct evbuffer* outbuf_;
-    const bool do_pipeline_; /* have NOT tested pipeling feature */
-    uint32_t max_pipeline_size_; /* NOTE: currently we assume all
-                                  * servers support size 4 */
+    uint32_t max_pipeline_size_; /* max size of active_req_queue_ */
+    /* head-of-line blocking stats, see the getters */
+    uint32_t num_rsps_;
+    uint32_t num_hol_blocked_rsps_;
+    uint64_t total_hol_blocking_ms_;
+    uint64_t max_hol_blocking_ms_;
+    uint64_t last_rsp_done_ms_; /* when the last response completed */
+    size_t max_active_reqs_seen_;
+    void account_hol_blocking();
     int http_rsp_state_;
     enum {
-        HTTP_RSP_STATE_STATUS_LINE, /* waiting for a full status line */
-        HTTP_RSP_STATE_HEADERS,
-        HTTP_RSP_STATE_BODY,
+        HTTP_RSP_STATE_HEAD, /* waiting for the status line and headers */
+        HTTP_RSP_STATE_BODY, /* body, or data of the current chunk */
+        HTTP_RSP_STATE_CHUNK_SIZE, /* waiting for a chunk-size line */
+        HTTP_RSP_STATE_CHUNK_END, /* waiting for the crlf after a chunk */
+        HTTP_RSP_STATE_TRAILER, /* after the last chunk, up to the empty line */
     };
+    /* how far we've looked for the end of the head in inbuf_, and
+     * how much of "\r\n\r\n" was matched there */
+    size_t rsp_head_scanned_;
+    int rsp_head_eol_;
     int http_rsp_status_;
-    std::vector<char *> rsp_hdrs_; // DO free every _other_ one of
-                                   // these ptrs (i.e., index 0, 2, 4,
-                                   // etc)
-    size_t first_byte_pos_; // copied from the request obj. will
-                            // include a range request header only if
+    std::vector<char *> rsp_hdrs_; // name/value pairs pointing into
+                                   // inbuf_. don't free.
+    size_t first_byte_pos_; // copied from the request obj of the
+                            // response being received. its request
+                            // had a range header only if
                             // first_byte_pos_ > 0.
     ssize_t body_len_; // -1, or amount of data _left_ to read from
                        // server/deliver to user. this is of the
                        // response body only, and not of the full
-                       // entity.
+                       // entity. if chunked, this is what is left
+                       // of the current chunk.
+    bool rsp_chunked_; // the response has chunked transfer-encoding
 
     /* total num bytes sent/received on this cnx (not counting the
      * socks handshake, which is negligible) */
@@ -1,8 +1,12 @@
 
 #include "connection_manager.hpp"
+#include "dns_cache.hpp"
 
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <utility>
+#include <algorithm>
 #include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
@@ -48,28 +52,148 @@ extern ShadowCreateCallbackFunc scheduleCallback;
 
 /***************************************************/
 
+static void
+on_resolve_timer(void *ptr)
+{
+    ((ConnectionManager*)ptr)->on_resolve_timer();
+}
+
+static void
+on_pushed_meta(int id, const char* url, ssize_t contentlen,
+               const char **nv, Connection* cnx, void* cb_data)
+{
+    ((ConnectionManager*)cb_data)->on_pushed_meta(cnx, id, url, nv);
+}
+
+static void
+on_pushed_body_data(int id, const uint8_t *data, size_t len,
+                    Connection* cnx, void* cb_data)
+{
+    ((ConnectionManager*)cb_data)->on_pushed_body_data(cnx, id, data, len);
+}
+
+static void
+on_pushed_body_done(int id, Connection* cnx, void* cb_data)
+{
+    ((ConnectionManager*)cb_data)->on_pushed_body_done(cnx, id);
+}
+
+/***************************************************/
+
 ConnectionManager::ConnectionManager(myevent_base *evbase,
                                      const in_addr_t& socks5_addr, 
                                      const in_port_t& socks5_port,
                                      RequestErrorCb request_error_cb,
                                      const uint8_t max_persist_cnx_per_srv,
-                                     const uint8_t max_retries_per_resource)
+                                     const uint8_t max_retries_per_resource,
+                                     const uint8_t max_pipeline_depth,
+                                     const bool use_http2,
+                                     PushedRequestCb pushed_request_cb)
     : instNum_(nextInstNum)
     , evbase_(evbase)
     , socks5_addr_(socks5_addr), socks5_port_(socks5_port)
     , max_persist_cnx_per_srv_(max_persist_cnx_per_srv)
     , max_retries_per_resource_(max_retries_per_resource)
+    , max_pipeline_depth_(max_pipeline_depth)
+    , use_http2_(use_http2)
 
     , timestamp_recv_first_byte_(0)
     , totaltxbytes_(0), totalrxbytes_(0)
 
     , notify_req_error_(request_error_cb)
+    , notify_pushed_request_(pushed_request_cb)
+    , resolve_timer_(NULL)
 {
     ++nextInstNum;
 
     myassert(evbase_);
     myassert(request_error_cb);
     myassert(max_persist_cnx_per_srv > 0);
+    myassert(max_pipeline_depth > 0);
+
+    resolve_timer_ = new myevent_timer_t(evbase_, &::on_resolve_timer, this);
+}
+
+/***************************************************/
+
+ConnectionManager::Server::Server(const NetLoc& netloc,
+                                  const uint32_t& pipeline_depth)
+    : netloc_(netloc)
+    , pipeline_depth_(pipeline_depth)
+    , resolving_(false)
+    , conns_by_load_(NULL)
+    , num_loads_(pipeline_depth + 1)
+{
+    conns_by_load_ = new ConnectionList[num_loads_];
+}
+
+/***************************************************/
+
+ConnectionManager::Server::~Server()
+{
+    // we don't own the requests, and the connections are deleted
+    // with deleteLater(). deleting the lists unlinks them.
+    delete [] conns_by_load_;
+}
+
+/***************************************************/
+
+void
+ConnectionManager::Server::file_conn(Connection* conn)
+{
+    unfile_conn(conn);
+    const size_t load = std::min(conn->get_queue_size(), num_loads_ - 1);
+    conns_by_load_[load].push_back(*conn);
+}
+
+/***************************************************/
+
+void
+ConnectionManager::Server::unfile_conn(Connection* conn)
+{
+    if (conn->owner_hook_.is_linked()) {
+        conn->owner_hook_.unlink();
+    }
+}
+
+/***************************************************/
+
+Connection*
+ConnectionManager::Server::get_idle_conn()
+{
+    return conns_by_load_[0].empty() ? NULL : &conns_by_load_[0].front();
+}
+
+/***************************************************/
+
+Connection*
+ConnectionManager::Server::get_least_loaded_conn()
+{
+    /* the depth can only have been lowered since we were created */
+    for (size_t load = 1; load < pipeline_depth_ && load < num_loads_; ++load) {
+        if (!conns_by_load_[load].empty()) {
+            return &conns_by_load_[load].front();
+        }
+    }
+    return NULL;
+}
+
+/***************************************************/
+
+ConnectionManager::ServerKey
+ConnectionManager::get_server_key(const Request* req) const
+{
+    return ((ServerKey)req->host_id_ << 16) | req->port_;
+}
+
+/***************************************************/
+
+ConnectionManager::Server*
+ConnectionManager::get_server(const ServerKey& key)
+{
+    boost::unordered_map<ServerKey, Server*>::iterator it = servers_.find(key);
+    myassert(it != servers_.end());
+    return it->second;
 }
 
 /***************************************************/
@@ -79,73 +203,255 @@ ConnectionManager::submit_request(Request *req)
 {
     logself(DEBUG, "begin, req url [%s]", req->url_.c_str());
 
-    const NetLoc netloc(req->host_, req->port_);
-
-    logself(DEBUG, "netloc: %s:%u", netloc.first.c_str(), netloc.second);
+    logself(DEBUG, "netloc: %s:%u", req->host_.c_str(), req->port_);
 
-    if (!inMap(servers_, netloc)) {
-        servers_[netloc] = new Server();
+    const ServerKey key = get_server_key(req);
+    Server*& server = servers_[key];
+    if (!server) {
+        server = new Server(NetLoc(req->host_, req->port_),
+                            max_pipeline_depth_);
     }
-    Server* server = servers_[netloc];
     server->requests_.push_back(req);
 
     logself(DEBUG, "server queue size %u", server->requests_.size());
 
+    dispatch_requests(key, server);
+
+    logself(DEBUG, "done");
+    return;
+}
+
+/***************************************************/
+
+void
+ConnectionManager::dispatch_requests(const ServerKey& key, Server* server)
+{
+    list<Request*>& requests = server->requests_;
+
+    while (!requests.empty()) {
+        Connection* conn = pick_conn(key, server);
+        if (!conn) {
+            logself(DEBUG, "%u requests wait", requests.size());
+            break;
+        }
+
+        Request* reqtosubmit = requests.front();
+        logself(DEBUG, "submit request [%s] on conn instNum_ %u",
+            reqtosubmit->url_.c_str(), conn->instNum_);
+        conn->submit_request(reqtosubmit);
+        requests.pop_front();
+        server->file_conn(conn);
+    }
+}
+
+/***************************************************/
+
+Connection*
+ConnectionManager::pick_conn(const ServerKey& key, Server* server)
+{
     Connection* conn = NULL;
     list<Connection*>& conns = server->connections_;
 
+    if (use_http2_ && !conns.empty()) {
+        // a single connection multiplexes all the requests
+        myassert(conns.size() == 1);
+        return conns.front();
+    }
+
     // first, is there a connection with an empty queue
-    BOOST_FOREACH(Connection* c, conns) {
-        if (c->get_queue_size() == 0) {
-            conn = c;
-            logself(DEBUG, "conn %d has empty queue -> use it", c->instNum_);
-            goto done;
-        }
+    conn = server->get_idle_conn();
+    if (conn) {
+        logself(DEBUG, "conn %d has empty queue -> use it", conn->instNum_);
+        return conn;
     }
 
     logself(DEBUG, "reaching here means no idle connection");
-    myassert(!conn); // make sure conn IS NULL
 
     logself(DEBUG, "there are %u connections to this netloc", conns.size());
 
     if (conns.size() < max_persist_cnx_per_srv_) {
-        logself(DEBUG, " --> create a new connection");
-        conn = new Connection(
-            evbase_,
-            getaddr(netloc.first.c_str()), netloc.second,
-            socks5_addr_, socks5_port_,
-            0, 0,
-            boost::bind(&ConnectionManager::cnx_error_cb, this, _1, netloc),
-            boost::bind(&ConnectionManager::cnx_eof_cb, this, _1, netloc),
-            NULL, NULL, NULL,
-            this,
-            false
-            );
-        myassert(conn);
-        logself(DEBUG, " ... with instNum_ %u", conn->instNum_);
-        conn->set_request_done_cb(
-            boost::bind(&ConnectionManager::cnx_request_done_cb, this, _1, _2, netloc));
-        conn->set_first_recv_byte_cb(
-            boost::bind(&ConnectionManager::cnx_first_recv_byte_cb, this, _1));
-        conns.push_back(conn);
-        goto done;
-    } else {
-        logself(DEBUG,
-                "reached max persist cnx per srv -> do nothing now");
+        in_addr_t addr = 0;
+        switch (DnsCache::lookup(server->netloc_.first, &addr)) {
+        case DnsCache::DNS_FOUND: {
+            logself(DEBUG, " --> create a new connection");
+            /* the connection advertises server push only if it has
+             * somewhere to deliver the pushed responses */
+            const bool push = use_http2_ && notify_pushed_request_;
+            conn = new Connection(
+                evbase_,
+                addr, server->netloc_.second,
+                socks5_addr_, socks5_port_,
+                0, 0,
+                boost::bind(&ConnectionManager::cnx_error_cb, this, _1, key),
+                boost::bind(&ConnectionManager::cnx_eof_cb, this, _1, key),
+                push ? &::on_pushed_meta : NULL,
+                push ? &::on_pushed_body_data : NULL,
+                push ? &::on_pushed_body_done : NULL,
+                this,
+                false,
+                server->pipeline_depth_,
+                use_http2_
+                );
+            myassert(conn);
+            logself(DEBUG, " ... with instNum_ %u", conn->instNum_);
+            conn->set_request_done_cb(
+                boost::bind(&ConnectionManager::cnx_request_done_cb, this, _1, _2, key));
+            conn->set_first_recv_byte_cb(
+                boost::bind(&ConnectionManager::cnx_first_recv_byte_cb, this, _1));
+            conns.push_back(conn);
+            return conn;
+        }
+
+        case DnsCache::DNS_UNKNOWN:
+            /* the existing connections, if any, can still take
+             * requests meanwhile */
+            if (!server->resolving_) {
+                logself(DEBUG, " --> resolve [%s] first",
+                        server->netloc_.first.c_str());
+                server->resolving_ = true;
+                resolving_servers_.push_back(key);
+                DnsCache::start_resolve(server->netloc_.first);
+                if (!resolve_timer_->is_pending()) {
+                    resolve_timer_->start(0);
+                }
+            }
+            break;
+
+        case DnsCache::DNS_NOT_FOUND:
+            if (conns.empty()) {
+                fail_requests(server);
+                return NULL;
+            }
+            break;
+        }
     }
 
-done:
+    // all connections are busy: pipeline on the least loaded one
+    conn = server->get_least_loaded_conn();
     if (conn) {
-        myassert(server->requests_.size() > 0);
+        logself(DEBUG, "pipeline on conn %d, queue size %zu",
+                conn->instNum_, conn->get_queue_size());
+        myassert(conn->get_queue_size() < server->pipeline_depth_);
+        return conn;
+    }
 
-        Request* reqtosubmit = server->requests_.front();
-        logself(DEBUG, "submit request [%s] on conn instNum_ %u",
-            reqtosubmit->url_.c_str(), conn->instNum_);
-        conn->submit_request(reqtosubmit);
-        server->requests_.pop_front();
+    logself(DEBUG,
+            "reached max persist cnx per srv and pipeline depth -> do nothing now");
+    return NULL;
+}
+
+/***************************************************/
+
+void
+ConnectionManager::fail_requests(Server* server)
+{
+    logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+          "no address for %s -> failing its %zu requests",
+          server->netloc_.first.c_str(), server->requests_.size());
+    /* the callback might submit requests to this server again */
+    list<Request*> requests;
+    requests.swap(server->requests_);
+    BOOST_FOREACH(Request* req, requests) {
+        notify_req_error_(req);
+    }
+}
+
+/***************************************************/
+
+void
+ConnectionManager::on_resolve_timer()
+{
+    logself(DEBUG, "begin");
+
+    const bool still_resolving = DnsCache::poll();
+
+    /* dispatching can fail requests, and the callback reset() us */
+    list<ServerKey> resolving;
+    resolving.swap(resolving_servers_);
+    BOOST_FOREACH(const ServerKey& key, resolving) {
+        boost::unordered_map<ServerKey, Server*>::iterator it =
+            servers_.find(key);
+        if (it == servers_.end()) {
+            continue;
+        }
+        Server* server = it->second;
+        in_addr_t addr = 0;
+        if (DnsCache::DNS_UNKNOWN == DnsCache::lookup(server->netloc_.first, &addr)) {
+            resolving_servers_.push_back(key);
+            continue;
+        }
+        server->resolving_ = false;
+        dispatch_requests(key, server);
+    }
+
+    if (!resolving_servers_.empty() && !resolve_timer_->is_pending()) {
+        resolve_timer_->start(still_resolving ? DNS_CACHE_POLL_INTERVAL_MS : 0);
     }
     logself(DEBUG, "done");
-    return;
+}
+
+/***************************************************/
+
+void
+ConnectionManager::on_pushed_meta(Connection* conn, const int& id,
+                                  const char* url, const char** nv)
+{
+    logself(DEBUG, "begin, cnx %u pushed stream %d: [%s]",
+            conn->instNum_, id, url);
+
+    int status = 0;
+    for (size_t i = 0; nv[i]; i += 2) {
+        if (!strcmp(nv[i], ":status")) {
+            status = strtol(nv[i+1], NULL, 10);
+        }
+    }
+    if (status != 200) {
+        logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+              "pushed [%s] has status [%d] -> ignore it", url, status);
+        return;
+    }
+
+    Request* req = notify_pushed_request_(url);
+    if (!req) {
+        logself(DEBUG, "not wanted -> ignore it");
+        return;
+    }
+    req->conn = conn;
+    pushed_requests_[PushKey(conn, id)] = req;
+    req->notify_rsp_meta(status, (char**)nv);
+
+    logself(DEBUG, "done");
+}
+
+/***************************************************/
+
+void
+ConnectionManager::on_pushed_body_data(Connection* conn, const int& id,
+                                       const uint8_t *data,
+                                       const size_t& len)
+{
+    map<PushKey, Request*>::iterator it =
+        pushed_requests_.find(PushKey(conn, id));
+    if (it != pushed_requests_.end()) {
+        it->second->notify_rsp_body_data(data, len);
+    }
+}
+
+/***************************************************/
+
+void
+ConnectionManager::on_pushed_body_done(Connection* conn, const int& id)
+{
+    map<PushKey, Request*>::iterator it =
+        pushed_requests_.find(PushKey(conn, id));
+    if (it == pushed_requests_.end()) {
+        return;
+    }
+    logself(DEBUG, "cnx %u pushed stream %d is done", conn->instNum_, id);
+    /* the callback might reset() us */
+    Request* req = it->second;
+    pushed_requests_.erase(it);
+    req->notify_rsp_body_done();
 }
 
 /***************************************************/
@@ -170,7 +476,7 @@ ConnectionManager::cnx_first_recv_byte_cb(Connection* conn)
 void
 ConnectionManager::cnx_request_done_cb(Connection* conn,
                                        const Request* req,
-                                       const NetLoc& netloc)
+                                       const ServerKey& key)
 {
     logself(DEBUG, "begin, req url [%s]", req->url_.c_str());
 
@@ -180,22 +486,36 @@ ConnectionManager::cnx_request_done_cb(Connection* conn,
 
     Request* reqtosubmit = NULL;
 
-    Server* server = servers_[netloc];
-    myassert(server);
+    Server* server = get_server(key);
+
+    /* the server might have lowered the depth with a "max-pipeline"
+     * header */
+    if (conn->get_max_pipeline_size() < server->pipeline_depth_) {
+        logself(DEBUG, "server pipeline depth %u -> %u",
+                server->pipeline_depth_, conn->get_max_pipeline_size());
+        server->pipeline_depth_ = conn->get_max_pipeline_size();
+    }
 
     list<Request*>& requests = server->requests_;
     logself(DEBUG, "%u waiting requests", requests.size());
 
     if (requests.empty()) {
         logself(DEBUG, "  --> do nothing");
+        server->file_conn(conn);
         goto done;
     }
 
-    reqtosubmit = requests.front();
-    logself(DEBUG, "submit request [%s] on conn instNum_ %u",
-            reqtosubmit->url_.c_str(), conn->instNum_);
-    conn->submit_request(reqtosubmit);
-    requests.pop_front();
+    // fill the conn's pipeline back up
+    while (!requests.empty()
+           && conn->get_queue_size() < server->pipeline_depth_)
+    {
+        reqtosubmit = requests.front();
+        logself(DEBUG, "submit request [%s] on conn instNum_ %u",
+                reqtosubmit->url_.c_str(), conn->instNum_);
+        conn->submit_request(reqtosubmit);
+        requests.pop_front();
+    }
+    server->file_conn(conn);
 
 done:
     logself(DEBUG, "done");
@@ -206,41 +526,77 @@ done:
 
 void
 ConnectionManager::cnx_error_cb(Connection* conn,
-                                const NetLoc& netloc)
+                                const ServerKey& key)
 {
     logfn(SHADOW_LOG_LEVEL_WARNING, __func__, "connection error");
-    handle_unusable_conn(conn, netloc);
+    handle_unusable_conn(conn, key);
 }
 
 /***************************************************/
 
 void
 ConnectionManager::cnx_eof_cb(Connection* conn,
-                              const NetLoc& netloc)
+                              const ServerKey& key)
 {
     logfn(SHADOW_LOG_LEVEL_WARNING, __func__, "connection eof");
-    handle_unusable_conn(conn, netloc);
+    handle_unusable_conn(conn, key);
 }
 
 /***************************************************/
 
 void
 ConnectionManager::handle_unusable_conn(Connection *conn,
-                                        const NetLoc& netloc)
+                                        const ServerKey& key)
 {
     logself(DEBUG, "begin, cnx: %d", conn->instNum_);
 
-    // we should mark any requests being handled by this connection as
-    // error. for now, we don't attempt to request elsewhere.
+    /* a server closing a connection with several requests in flight
+     * most likely doesn't handle pipelining: stop pipelining to it,
+     * on the connections that are still open too.
+     */
+    Server* server = get_server(key);
+    const NetLoc& netloc = server->netloc_;
+    if (conn->get_active_request_queue().size() > 1
+        && server->pipeline_depth_ > 1)
+    {
+        logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+              "%s:%u closed cnx %d with %zu requests in flight "
+              "-> no longer pipelining to it",
+              netloc.first.c_str(), netloc.second, conn->instNum_,
+              conn->get_active_request_queue().size());
+        server->pipeline_depth_ = 1;
+        BOOST_FOREACH(Connection* c, server->connections_) {
+            c->set_max_pipeline_size(1);
+        }
+    }
 
-    release_conn(conn, netloc);
+    release_conn(conn, key);
 
     /* release_conn() only removes the conn from the list. it does not
      * yet delete the conn object. so we can still get its request
      * queues.
+     *
+     * the requests written to the server are retried. those not yet
+     * written were never seen by the server, so they are simply
+     * submitted again.
      */
-    myassert(conn->get_pending_request_queue().empty());
     retry_requests(conn->get_active_request_queue());
+    BOOST_FOREACH(Request* req, conn->get_pending_request_queue()) {
+        this->submit_request(req);
+    }
+
+    /* the responses it was pushing are retried too, as requests */
+    queue<Request*> pushed;
+    map<PushKey, Request*>::iterator it = pushed_requests_.begin();
+    while (it != pushed_requests_.end()) {
+        if (it->first.first == conn) {
+            pushed.push(it->second);
+            pushed_requests_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    retry_requests(pushed);
 
     logself(DEBUG, "done");
 }
@@ -295,11 +651,11 @@ ConnectionManager::get_total_bytes(size_t& tx, size_t& rx)
     tx = totaltxbytes_;
     rx = totalrxbytes_;
 
-    pair<NetLoc, Server*> kv_pair;
+    pair<ServerKey, Server*> kv_pair;
     BOOST_FOREACH(kv_pair, servers_) {
-        logself(DEBUG, "server %s:%u", 
-                kv_pair.first.first.c_str(), kv_pair.first.second);
         Server* server = kv_pair.second;
+        logself(DEBUG, "server %s:%u",
+                server->netloc_.first.c_str(), server->netloc_.second);
         BOOST_FOREACH(Connection *c, server->connections_) {
             tx += c->get_total_num_sent_bytes();
             rx += c->get_total_num_recv_bytes();
@@ -315,16 +671,20 @@ void
 ConnectionManager::reset()
 {
     // we don't touch the Request* pointers.
-    pair<NetLoc, Server*> kv_pair;
+    pair<ServerKey, Server*> kv_pair;
     BOOST_FOREACH(kv_pair, servers_) {
-        logself(DEBUG, "clearing server [%s]:%u", 
-                kv_pair.first.first.c_str(), kv_pair.first.second);
         Server* server = kv_pair.second;
+        logself(DEBUG, "clearing server [%s]:%u",
+                server->netloc_.first.c_str(), server->netloc_.second);
         BOOST_FOREACH(Connection *c, server->connections_) {
             c->deleteLater(scheduleCallback);
         }
+        delete server;
     }
     servers_.clear();
+    pushed_requests_.clear();
+    resolve_timer_->cancel();
+    resolving_servers_.clear();
 
     timestamp_recv_first_byte_ = 0;
     totaltxbytes_ = totalrxbytes_ = 0;
@@ -350,7 +710,7 @@ ConnectionManager::deleteLater(ShadowCreateCallbackFunc scheduleCallback)
 
 void
 ConnectionManager::release_conn(Connection *conn,
-                                const NetLoc& netloc)
+                                const ServerKey& key)
 {
     logself(DEBUG, "begin, releasing cnx %d", conn->instNum_);
 
@@ -360,18 +720,14 @@ ConnectionManager::release_conn(Connection *conn,
     conn->deleteLater(scheduleCallback);
 
     // remove it from active connections
-    myassert(inMap(servers_, netloc));
-    list<Connection*>& conns = servers_[netloc]->connections_;
+    Server* server = get_server(key);
+    server->unfile_conn(conn);
+    list<Connection*>& conns = server->connections_;
 
     list<Connection*>::iterator finditer =
         std::find(conns.begin(), conns.end(), conn);
     myassert(finditer != conns.end());
     conns.erase(finditer);
-    if (conns.size() == 0) {
-        logself(DEBUG,
-                "list is now empty --> remove this list from map");
-        servers_.erase(netloc);
-    }
 
     totaltxbytes_ += conn->get_total_num_sent_bytes();
     totalrxbytes_ += conn->get_total_num_recv_bytes();
@@ -387,4 +743,5 @@ ConnectionManager::release_conn(Connection *conn,
 ConnectionManager::~ConnectionManager()
 {
     reset();
+    delete resolve_timer_;
 }
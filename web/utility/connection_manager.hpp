@@ -7,6 +7,8 @@
 #include <utility>
 
 #include <boost/function.hpp>
+#include <boost/intrusive/list.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <shd-library.h>
 
@@ -20,8 +22,23 @@ class ConnectionManager
 public:
 
     typedef boost::function<void(Request*)> RequestErrorCb;
+    typedef boost::function<Request*(const std::string& url)> PushedRequestCb;
 
     /* "request_error_cb": will be called with the failed Request.
+     *
+     * "max_pipeline_depth": max num of requests in flight on one
+     * connection. requests are pipelined only once a server has
+     * "max_persist_cnx_per_srv" connections. 1 means no pipelining.
+     *
+     * "use_http2": use a single http/2 connection per server, on
+     * which all its requests are multiplexed. the two above are then
+     * not used.
+     *
+     * "pushed_request_cb": (http/2 only) if given, the servers may
+     * push responses. it is called with the url of each pushed
+     * response, and returns the Request to deliver the response to,
+     * or NULL to ignore it. the Request is then handled as if it had
+     * been submitted, e.g., it is requested again if the push fails.
      *
      * Do NOT destroy the ConnectionManager object within the
      * "request_error_cb" stack.
@@ -30,12 +47,25 @@ public:
                       const in_addr_t& socks5_addr, const in_port_t& socks5_port,
                       RequestErrorCb request_error_cb,
                       const uint8_t max_persist_cnx_per_srv=8,
-                      const uint8_t max_retries_per_resource=2);
+                      const uint8_t max_retries_per_resource=2,
+                      const uint8_t max_pipeline_depth=1,
+                      const bool use_http2=false,
+                      PushedRequestCb pushed_request_cb=PushedRequestCb());
     ~ConnectionManager();
 
     void submit_request(Request *req);
     void reset();
 
+    /* for our timer */
+    void on_resolve_timer();
+
+    /* for the responses pushed on our connections */
+    void on_pushed_meta(Connection*, const int& id, const char* url,
+                        const char** nv);
+    void on_pushed_body_data(Connection*, const int& id,
+                             const uint8_t *data, const size_t& len);
+    void on_pushed_body_done(Connection*, const int& id);
+
     uint64_t get_timestamp_recv_first_byte() const { return timestamp_recv_first_byte_; }
     void get_total_bytes(size_t& tx, size_t& rx);
 
@@ -52,40 +82,108 @@ private:
     ConnectionManager(ConnectionManager const&);
     void operator=(ConnectionManager const&);
 
+    /* a ServerKey is the Request's host_id_ and port, so finding the
+     * server of a request doesn't hash its hostname */
+    typedef uint64_t ServerKey;
+    ServerKey get_server_key(const Request* req) const;
+
     /* to receive notification from Connection object. */
     void cnx_first_recv_byte_cb(Connection*);
-    void cnx_error_cb(Connection*, const NetLoc&);
-    void cnx_eof_cb(Connection*, const NetLoc&);
-    void cnx_request_done_cb(Connection*, const Request*, const NetLoc&);
+    void cnx_error_cb(Connection*, const ServerKey&);
+    void cnx_eof_cb(Connection*, const ServerKey&);
+    void cnx_request_done_cb(Connection*, const Request*, const ServerKey&);
 
     bool retry_requests(std::queue<Request*> requests);
-    void handle_unusable_conn(Connection*, const NetLoc&);
-    void release_conn(Connection*, const NetLoc&);
+    void handle_unusable_conn(Connection*, const ServerKey&);
+    void release_conn(Connection*, const ServerKey&);
+
+    typedef boost::intrusive::list<
+        Connection,
+        boost::intrusive::member_hook<
+            Connection, Connection::OwnerHook, &Connection::owner_hook_>,
+        boost::intrusive::constant_time_size<false> > ConnectionList;
 
     struct Server
     {
     public:
+        Server(const NetLoc& netloc, const uint32_t& pipeline_depth);
         ~Server();
 
+        /* file the connection by its current queue size, or take it
+         * out. must be called whenever we change its queue size */
+        void file_conn(Connection*);
+        void unfile_conn(Connection*);
+        /* NULL if none has an empty queue */
+        Connection* get_idle_conn();
+        /* the connection with the fewest requests, if it has fewer
+         * than pipeline_depth_, else NULL */
+        Connection* get_least_loaded_conn();
+
+        const NetLoc netloc_;
         std::list<Request*> requests_;
         std::list<Connection*> connections_;
+        /* starts at max_pipeline_depth_, lowered by the server's
+         * "max-pipeline" header, or to 1 if the server closes a
+         * connection with several requests in flight */
+        uint32_t pipeline_depth_;
+        /* its hostname is not in the DnsCache: waiting for
+         * on_resolve_timer() to get it */
+        bool resolving_;
+
+    private:
+        Server(Server const&);
+        void operator=(Server const&);
+
+        /* conns_by_load_[n] has the connections_ with n requests
+         * queued, the last one those with num_loads_ - 1 or more; so
+         * conns_by_load_[0] is the idle list, and picking a
+         * connection costs at most pipeline_depth_ steps, however
+         * many connections there are.
+         */
+        ConnectionList* conns_by_load_;
+        const size_t num_loads_;
     };
+    Server* get_server(const ServerKey&);
+
+    /* submit the server's waiting requests while a connection can
+     * take them */
+    void dispatch_requests(const ServerKey&, Server*);
+    /* the connection for the server's next request, or NULL if it
+     * has to wait. a new connection is only created once the
+     * hostname is resolved. */
+    Connection* pick_conn(const ServerKey&, Server*);
+    /* the server's hostname does not resolve */
+    void fail_requests(Server*);
 
     myevent_base *evbase_; // dont free
     const in_addr_t socks5_addr_;
     const in_port_t socks5_port_;
     uint8_t max_persist_cnx_per_srv_;
     uint8_t max_retries_per_resource_;
+    uint8_t max_pipeline_depth_;
+    const bool use_http2_;
 
     uint64_t timestamp_recv_first_byte_;
     size_t totaltxbytes_;
     size_t totalrxbytes_;
 
     RequestErrorCb notify_req_error_;
+    PushedRequestCb notify_pushed_request_;
+
+    /* the Requests being delivered pushed responses, by connection
+     * and stream id */
+    typedef std::pair<Connection*, int> PushKey;
+    std::map<PushKey, Request*> pushed_requests_;
+
+    /* resolves, from the event loop, the hostnames of the servers in
+     * resolving_servers_ */
+    myevent_timer_t* resolve_timer_;
+    std::list<ServerKey> resolving_servers_;
 
-    /* map key is "[hostname, port]" pair.
+    /* a Server stays in the map (without connections) until reset(),
+     * so that what we learned about its pipelining is kept.
      */
-    std::map<NetLoc, Server*> servers_;
+    boost::unordered_map<ServerKey, Server*> servers_;
 };
 
 #endif /* CONNECTION_MANAGER_HPP */
@@ -0,0 +1,174 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <boost/unordered_map.hpp>
+
+#include <shd-library.h>
+
+#include "dns_cache.hpp"
+#include "common.hpp"
+
+using std::string;
+
+extern ShadowLogFunc logfn;
+
+namespace {
+
+struct Entry
+{
+    in_addr_t addr; /* network order */
+    bool found;
+    uint64_t expires_ms;
+};
+
+boost::unordered_map<string, Entry> entries;
+/* when poll() next sweeps the expired entries */
+uint64_t next_sweep_ms = 0;
+
+#ifdef DNS_CACHE_ASYNC_GAI
+struct Pending
+{
+    struct gaicb cb;
+    struct addrinfo hints;
+};
+/* the keys are stable, so the gaicbs point to them */
+std::map<string, Pending*> pending;
+#else
+std::set<string> pending;
+#endif
+
+void
+add_entry(const string& hostname, const struct addrinfo *info)
+{
+    Entry& entry = entries[hostname];
+    const uint64_t now_ms = gettimeofdayMs(NULL);
+    entry.found = (info != NULL);
+    if (entry.found) {
+        entry.addr = ((const struct sockaddr_in*)(info->ai_addr))->sin_addr.s_addr;
+        entry.expires_ms = now_ms + (DNS_CACHE_TTL_SECS * 1000);
+        logDEBUG("[%s] is %s", hostname.c_str(),
+                 inet_ntoa(*(const struct in_addr*)&entry.addr));
+    } else {
+        entry.addr = htonl(INADDR_NONE);
+        entry.expires_ms = now_ms + (DNS_CACHE_NEGATIVE_TTL_SECS * 1000);
+        logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+              "cannot resolve [%s]", hostname.c_str());
+    }
+}
+
+void
+sweep_entries(const uint64_t& now_ms)
+{
+    boost::unordered_map<string, Entry>::iterator it = entries.begin();
+    while (it != entries.end()) {
+        if (it->second.expires_ms <= now_ms) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+} // namespace
+
+DnsCache::Result
+DnsCache::lookup(const string& hostname, in_addr_t* addr)
+{
+    /* same as getaddr(): these never go to the resolver */
+    if (getaddr_literal(hostname.c_str(), addr)) {
+        return (*addr == htonl(INADDR_NONE)) ? DNS_NOT_FOUND : DNS_FOUND;
+    }
+
+    boost::unordered_map<string, Entry>::iterator it =
+        entries.find(hostname);
+    if (it == entries.end()) {
+        return DNS_UNKNOWN;
+    }
+    if (it->second.expires_ms <= gettimeofdayMs(NULL)) {
+        entries.erase(it);
+        return DNS_UNKNOWN;
+    }
+    *addr = it->second.addr;
+    return it->second.found ? DNS_FOUND : DNS_NOT_FOUND;
+}
+
+void
+DnsCache::start_resolve(const string& hostname)
+{
+    if (pending.find(hostname) != pending.end()) {
+        return;
+    }
+    logDEBUG("resolving [%s]", hostname.c_str());
+
+#ifdef DNS_CACHE_ASYNC_GAI
+    std::map<string, Pending*>::iterator it =
+        pending.insert(std::make_pair(hostname, new Pending())).first;
+    Pending* p = it->second;
+    memset(p, 0, sizeof *p);
+    p->hints.ai_family = AF_INET;
+    p->cb.ar_name = it->first.c_str();
+    p->cb.ar_request = &p->hints;
+    struct gaicb* list[] = {&p->cb};
+    if (getaddrinfo_a(GAI_NOWAIT, list, 1, NULL)) {
+        /* couldn't even start: a failure */
+        add_entry(hostname, NULL);
+        delete p;
+        pending.erase(it);
+    }
+#else
+    pending.insert(hostname);
+#endif
+}
+
+bool
+DnsCache::poll()
+{
+    /* every answer lives at least DNS_CACHE_NEGATIVE_TTL_SECS, so
+     * sweeping more often would mostly find nothing */
+    const uint64_t now_ms = gettimeofdayMs(NULL);
+    if (now_ms >= next_sweep_ms) {
+        sweep_entries(now_ms);
+        next_sweep_ms = now_ms + (DNS_CACHE_NEGATIVE_TTL_SECS * 1000);
+    }
+
+#ifdef DNS_CACHE_ASYNC_GAI
+    std::map<string, Pending*>::iterator it = pending.begin();
+    while (it != pending.end()) {
+        Pending* p = it->second;
+        const int rv = gai_error(&p->cb);
+        if (rv == EAI_INPROGRESS) {
+            ++it;
+            continue;
+        }
+        add_entry(it->first, rv ? NULL : p->cb.ar_result);
+        if (p->cb.ar_result) {
+            freeaddrinfo(p->cb.ar_result);
+        }
+        delete p;
+        pending.erase(it++);
+    }
+#else
+    std::set<string>::const_iterator it = pending.begin();
+    for (; it != pending.end(); ++it) {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        struct addrinfo *info = NULL;
+        if (getaddrinfo(it->c_str(), NULL, &hints, &info)) {
+            info = NULL;
+        }
+        add_entry(*it, info);
+        if (info) {
+            freeaddrinfo(info);
+        }
+    }
+    pending.clear();
+#endif
+    return !pending.empty();
+}
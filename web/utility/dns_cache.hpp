@@ -0,0 +1,64 @@
+#ifndef DNS_CACHE_HPP
+#define DNS_CACHE_HPP
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <string>
+
+/* process-wide cache of hostname -> ipv4 address, shared by all the
+ * connections (and connection managers) of the process.
+ *
+ * getaddrinfo() doesn't tell the ttl of an answer, so every answer is
+ * kept DNS_CACHE_TTL_SECS; failures ("negative" answers) are kept
+ * DNS_CACHE_NEGATIVE_TTL_SECS, so that a bad hostname isn't resolved
+ * again for every request to it. expired answers are dropped when
+ * they are looked up, and swept by poll() (where the cache grows),
+ * so the names that are not used anymore don't pile up.
+ *
+ * the lookups never block: a hostname that is not in the cache is
+ * queued with start_resolve(), and resolved by the next poll(). so
+ * the owner of the event loop calls poll() from a timer, off the
+ * stack of whoever needed the address. by default, poll() resolves
+ * the queued names with getaddrinfo() (which, inside shadow, answers
+ * right away from the simulated dns). built with DNS_CACHE_ASYNC_GAI,
+ * the names are resolved in the background with glibc's
+ * getaddrinfo_a(), and poll() only collects the answers that are in;
+ * shadow doesn't support its helper threads, though.
+ */
+
+#define DNS_CACHE_TTL_SECS (300)
+#define DNS_CACHE_NEGATIVE_TTL_SECS (30)
+/* how often to poll() while names are being resolved */
+#define DNS_CACHE_POLL_INTERVAL_MS (5)
+
+class DnsCache
+{
+public:
+    enum Result {
+        DNS_FOUND,
+        DNS_NOT_FOUND, /* cached failure */
+        DNS_UNKNOWN, /* not cached, or expired */
+    };
+
+    /* the cached answer for "hostname", if it's still fresh. the
+     * names getaddr_literal() knows are answered without the cache:
+     * an ip address string is always found, as itself, and so is
+     * "localhost"; "none" and "" are never found.
+     */
+    static Result lookup(const std::string& hostname, in_addr_t* addr);
+
+    /* queue "hostname" to be resolved, unless it already is */
+    static void start_resolve(const std::string& hostname);
+
+    /* move the answers that are in into the cache, and drop the
+     * expired ones. returns true if some names are still being
+     * resolved.
+     */
+    static bool poll();
+
+private:
+    DnsCache();
+};
+
+#endif /* DNS_CACHE_HPP */
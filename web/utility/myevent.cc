@@ -4,6 +4,11 @@
 #include <strings.h>
 #include "myassert.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <algorithm>
+#include <map>
 
 #include "common.hpp"
 #include "myevent.hpp"
@@ -23,73 +28,407 @@
 #endif
 
 
+ShadowCreateCallbackFunc myevent_base::shadow_create_callback = NULL;
+
+/* the bases alive, by id (see on_shadow_timer()). ids are never
+ * reused, so a stale callback can't reach a newer base either */
+static std::map<uint32_t, myevent_base*> g_live_bases;
+static uint32_t g_next_base_id = 1;
+
 myevent_base::myevent_base(ShadowLogFunc log)
-    : epfd_(-1), log_(log)
+    : epfd_(-1), handling_(false), edge_triggered_(false)
+    , wakeup_pending_(false), timer_now_ms_(gettimeofdayMs(NULL))
+    , num_timers_(0), timerfd_(-1), timer_armed_ms_(0)
+    , id_(g_next_base_id++), log_(log)
 {
+    g_live_bases[id_] = this;
+
     epfd_ = epoll_create(1);
     myassert(epfd_ != -1);
+    wakefds_[0] = wakefds_[1] = -1;
     mylogDEBUG("epfd %d", epfd_);
+
+    for (int level = 0; level < MEV_TIMER_LEVELS; ++level) {
+        for (int i = 0; i < MEV_TIMER_SLOTS; ++i) {
+            mev_timer_link_t *slot = &timer_wheel_[level][i];
+            slot->prev_ = slot->next_ = slot;
+        }
+    }
+
+    if (!shadow_create_callback) {
+        timerfd_ = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+        myassert(timerfd_ != -1);
+        struct epoll_event ev = {0, 0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &timerfd_;
+        myassert(0 == epoll_ctl(epfd_, EPOLL_CTL_ADD, timerfd_, &ev));
+    }
 }
 
 myevent_base::~myevent_base()
 {
+    g_live_bases.erase(id_);
     close(epfd_);
     mylogDEBUG("closing epfd %d", epfd_);
-    fd2mev_.clear();
+    if (wakefds_[0] != -1) {
+        close(wakefds_[0]);
+        close(wakefds_[1]);
+    }
+    if (timerfd_ != -1) {
+        close(timerfd_);
+    }
+    /* the timers still pending won't fire; leave them unlinked so
+     * that destroying them later is fine. (inside shadow, the pending
+     * shadow callback finds the base gone, and does nothing.)
+     */
+    for (int level = 0; level < MEV_TIMER_LEVELS; ++level) {
+        for (int i = 0; i < MEV_TIMER_SLOTS; ++i) {
+            mev_timer_link_t *slot = &timer_wheel_[level][i];
+            while (slot->next_ != slot) {
+                mev_timer_link_t *link = slot->next_;
+                slot->next_ = link->next_;
+                link->prev_ = link->next_ = NULL;
+            }
+        }
+    }
 }
 
-int
-myevent_base::loop_nonblock()
+void
+myevent_base::set_edge_triggered(const bool edge_triggered)
 {
-    /* collect the events that are ready */
-    struct epoll_event epevs[32];
-    const int nfds = epoll_wait(epfd_, epevs, 32, 0);
-    myassert(nfds != -1);
-
-    /* activate correct component for every socket thats ready */
-    for(int i = 0; i < nfds; i++) {
-        const int d = epevs[i].data.fd;
-        //if (inMap(fd2mev_, d)) {
-        /* XXX/we expect that the common case is that d is in the map,
-         * so to avoid looking up twice, let's look up once, and check
-         * for NULL result. how much will this help? dont know.
-         */
-        myevent_socket_t* mev = fd2mev_[d];
-        if (mev) {
-            mev->trigger(epevs[i].events);
+    myassert(ready_.empty());
+    if (edge_triggered == edge_triggered_) {
+        return;
+    }
+    edge_triggered_ = edge_triggered;
+    if (edge_triggered_ && wakefds_[0] == -1) {
+        myassert(0 == pipe(wakefds_));
+        for (int i = 0; i < 2; ++i) {
+            myassert(0 == fcntl(wakefds_[i], F_SETFL,
+                                fcntl(wakefds_[i], F_GETFL) | O_NONBLOCK));
         }
+        /* the wakeup pipe is the only event without a socket */
+        struct epoll_event ev = {0, 0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        myassert(0 == epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefds_[0], &ev));
     }
-    return 0;
+    mylogDEBUG("edge-triggered: %d", edge_triggered_);
+}
+
+int
+myevent_base::loop_nonblock()
+{
+    return handle_events(0);
 }
 
 int
 myevent_base::dispatch()
 {
-    /* collect the events that are ready */
+    /* don't block if some sockets are ready already */
+    return handle_events(ready_.empty() ? -1 : 0);
+}
+
+bool
+myevent_base::is_deleted(myevent_socket_t* mev) const
+{
+    return !deleted_.empty() &&
+        std::find(deleted_.begin(), deleted_.end(), mev) != deleted_.end();
+}
+
+int
+myevent_base::handle_events(int timeout)
+{
     struct epoll_event epevs[32];
-    const int nfds = epoll_wait(epfd_, epevs, 32, -1);
-    myassert(nfds != -1);
-
-    /* activate correct component for every socket thats ready */
-    for(int i = 0; i < nfds; i++) {
-        const int d = epevs[i].data.fd;
-        //if (inMap(fd2mev_, d)) {
-        /* XXX/we expect that the common case is that d is in the map,
-         * so to avoid looking up twice, let's look up once, and check
-         * for NULL result. how much will this help? dont know.
-         */
-        myevent_socket_t* mev = fd2mev_[d];
-        if (mev) {
-            mev->trigger(epevs[i].events);
+    int nfds = 0;
+
+    handling_ = true;
+    do {
+        /* collect the events that are ready */
+        nfds = epoll_wait(epfd_, epevs, ARRAY_LEN(epevs), timeout);
+        myassert(nfds != -1);
+
+        /* activate correct component for every socket thats ready */
+        for(int i = 0; i < nfds; i++) {
+            myevent_socket_t* mev = (myevent_socket_t*)epevs[i].data.ptr;
+            if (!mev) {
+                char buf[64];
+                while (read(wakefds_[0], buf, sizeof buf) > 0) {}
+                wakeup_pending_ = false;
+                continue;
+            } else if (epevs[i].data.ptr == &timerfd_) {
+                /* the timers run below */
+                uint64_t expirations;
+                (void)read(timerfd_, &expirations, sizeof expirations);
+                timer_armed_ms_ = 0;
+                continue;
+            }
+            /* a callback of this batch may have deleted the socket */
+            if (is_deleted(mev)) {
+                continue;
+            }
+            if (edge_triggered_) {
+                /* just take note; the callbacks run in handle_ready() */
+                mev->ready_ |= epevs[i].events & (EPOLLIN | EPOLLOUT);
+                mev->pending_ |= epevs[i].events & ~(EPOLLIN | EPOLLOUT);
+                make_ready(mev);
+            } else {
+                mev->trigger(epevs[i].events);
+            }
         }
+        timeout = 0;
+        /* a full batch: there might be more edges waiting */
+    } while (edge_triggered_ && nfds == (int)ARRAY_LEN(epevs));
+
+    /* before the ready sockets: they also run what the timers
+     * enabled */
+    run_timers(gettimeofdayMs(NULL));
+
+    if (edge_triggered_) {
+        handle_ready();
     }
+    handling_ = false;
+    deleted_.clear();
+    arm_timer();
     return 0;
 }
 
+void
+myevent_base::add_timer(myevent_timer_t* timer)
+{
+    /* the timers already expired fire at the next tick */
+    const uint64_t expires = std::max(timer->expires_ms_, timer_now_ms_);
+    const uint64_t delta = expires - timer_now_ms_;
+
+    int level = 0;
+    while (level < (MEV_TIMER_LEVELS - 1)
+           && delta >= ((uint64_t)1 << ((level + 1) * MEV_TIMER_SLOT_BITS)))
+    {
+        ++level;
+    }
+    /* beyond the last level: wait in its farthest slot, and cascade
+     * into it again */
+    const uint64_t ticks =
+        std::min(delta, ((uint64_t)1 << (MEV_TIMER_LEVELS * MEV_TIMER_SLOT_BITS)) - 1);
+    const int i = ((timer_now_ms_ + ticks) >> (level * MEV_TIMER_SLOT_BITS))
+        & (MEV_TIMER_SLOTS - 1);
+
+    mev_timer_link_t *slot = &timer_wheel_[level][i];
+    timer->prev_ = slot->prev_;
+    timer->next_ = slot;
+    slot->prev_->next_ = timer;
+    slot->prev_ = timer;
+}
+
+void
+myevent_base::run_timers(const uint64_t now_ms)
+{
+    if (0 == num_timers_) {
+        timer_now_ms_ = std::max(timer_now_ms_, now_ms);
+        return;
+    }
+
+    while (timer_now_ms_ <= now_ms && num_timers_ > 0) {
+        const int i = timer_now_ms_ & (MEV_TIMER_SLOTS - 1);
+        if (0 == i) {
+            /* level 0 wrapped around: move the timers of the next
+             * slot of each upper level down, up to the level that
+             * didn't wrap */
+            for (int level = 1; level < MEV_TIMER_LEVELS; ++level) {
+                const int j = (timer_now_ms_ >> (level * MEV_TIMER_SLOT_BITS))
+                    & (MEV_TIMER_SLOTS - 1);
+                mev_timer_link_t *slot = &timer_wheel_[level][j];
+                while (slot->next_ != slot) {
+                    myevent_timer_t *timer = (myevent_timer_t*)slot->next_;
+                    slot->next_ = timer->next_;
+                    timer->next_->prev_ = slot;
+                    add_timer(timer);
+                }
+                if (j != 0) {
+                    break;
+                }
+            }
+        }
+
+        /* take the expired timers out of the wheel before running
+         * them: a callback may cancel or restart any timer */
+        mev_timer_link_t expired;
+        mev_timer_link_t *slot = &timer_wheel_[0][i];
+        if (slot->next_ == slot) {
+            /* nothing fires at this tick: skip the ticks where no
+             * timer fires or cascades either, rather than visiting
+             * every empty slot of a long idle gap */
+            timer_now_ms_ = std::min(
+                std::max(next_timer_expiry(), timer_now_ms_ + 1), now_ms + 1);
+            continue;
+        }
+        expired.next_ = slot->next_;
+        expired.prev_ = slot->prev_;
+        expired.next_->prev_ = &expired;
+        expired.prev_->next_ = &expired;
+        slot->prev_ = slot->next_ = slot;
+        ++timer_now_ms_;
+
+        while (expired.next_ != &expired) {
+            myevent_timer_t *timer = (myevent_timer_t*)expired.next_;
+            timer->cancel();
+            mylogDEBUG("timer %p fired", timer);
+            timer->cb_(timer->user_data_);
+        }
+    }
+    timer_now_ms_ = std::max(timer_now_ms_, now_ms);
+}
+
+uint64_t
+myevent_base::next_timer_expiry() const
+{
+    if (0 == num_timers_) {
+        return 0;
+    }
+    /* level 0 has the exact expiry. the upper levels only tell when
+     * their first non-empty slot cascades: wake up then, and look
+     * again */
+    uint64_t next = 0;
+    for (int k = 0; k < MEV_TIMER_SLOTS; ++k) {
+        const mev_timer_link_t *slot =
+            &timer_wheel_[0][(timer_now_ms_ + k) & (MEV_TIMER_SLOTS - 1)];
+        if (slot->next_ != slot) {
+            next = timer_now_ms_ + k;
+            break;
+        }
+    }
+    for (int level = 1; level < MEV_TIMER_LEVELS; ++level) {
+        const int shift = level * MEV_TIMER_SLOT_BITS;
+        /* on a boundary, the current slot has yet to cascade */
+        const int first =
+            (timer_now_ms_ & (((uint64_t)1 << shift) - 1)) ? 1 : 0;
+        for (int k = first; k < first + MEV_TIMER_SLOTS; ++k) {
+            const uint64_t when = ((timer_now_ms_ >> shift) + k) << shift;
+            if (next && when >= next) {
+                break;
+            }
+            const mev_timer_link_t *slot =
+                &timer_wheel_[level][(when >> shift) & (MEV_TIMER_SLOTS - 1)];
+            if (slot->next_ != slot) {
+                next = when;
+                break;
+            }
+        }
+    }
+    myassert(next);
+    return next;
+}
+
+void
+myevent_base::arm_timer()
+{
+    const uint64_t next = next_timer_expiry();
+
+    if (shadow_create_callback) {
+        /* shadow can't cancel a callback: only schedule one if none
+         * would fire early enough. the callbacks that fire too late
+         * or for nothing are harmless */
+        if (!next || (timer_armed_ms_ && timer_armed_ms_ <= next)) {
+            return;
+        }
+        const uint64_t now = gettimeofdayMs(NULL);
+        timer_armed_ms_ = next;
+        shadow_create_callback(
+            &myevent_base::on_shadow_timer, (void*)(uintptr_t)id_,
+            (next > now) ? (unsigned int)(next - now) : 0);
+    } else {
+        if (next == timer_armed_ms_) {
+            return;
+        }
+        struct itimerspec its;
+        bzero(&its, sizeof(its));
+        if (next) {
+            its.it_value.tv_sec = next / 1000;
+            its.it_value.tv_nsec = (next % 1000) * 1000000;
+        }
+        myassert(0 == timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &its, NULL));
+        timer_armed_ms_ = next;
+    }
+    mylogDEBUG("timer armed for %lu", next);
+}
+
+void
+myevent_base::on_shadow_timer(void *ptr)
+{
+    std::map<uint32_t, myevent_base*>::const_iterator it =
+        g_live_bases.find((uint32_t)(uintptr_t)ptr);
+    if (it == g_live_bases.end()) {
+        /* the base was freed after scheduling us */
+        return;
+    }
+    myevent_base *evbase = it->second;
+    if (evbase->timer_armed_ms_ <= gettimeofdayMs(NULL)) {
+        /* the earliest callback: the later ones, if any, are
+         * forgotten */
+        evbase->timer_armed_ms_ = 0;
+    }
+    evbase->handle_events(0);
+}
+
+void
+myevent_base::handle_ready()
+{
+    /* run the ready sockets in rounds until none is ready: a socket
+     * stays in the list while its callbacks want an event it is
+     * ready for, i.e., until they read/write everything they can or
+     * disable themselves. the sockets that become ready meanwhile
+     * (e.g., a callback enables writing on another connection) are
+     * appended and run in this same pass.
+     */
+    while (!ready_.empty()) {
+        myevent_socket_t* mev = ready_.front();
+        ready_.pop_front();
+        mev->queued_ = false;
+
+        const uint32_t what = mev->pending_ | (mev->ready_ & mev->wanted());
+        mev->pending_ = 0;
+        /* a callback run before may have closed it */
+        if (!what || !mev->is_active()) {
+            continue;
+        }
+        mev->trigger(what);
+
+        if (!is_deleted(mev) && (mev->ready_ & mev->wanted())) {
+            make_ready(mev);
+        }
+    }
+}
+
+void
+myevent_base::make_ready(myevent_socket_t* mev)
+{
+    /* not connected yet, or closed already: nothing to trigger */
+    if (mev->queued_ || !mev->is_active()) {
+        return;
+    }
+    mev->queued_ = true;
+    ready_.push_back(mev);
+    if (!handling_ && !wakeup_pending_) {
+        /* dispatch() might be blocked in epoll_wait() */
+        myassert(1 == write(wakefds_[1], "w", 1));
+        wakeup_pending_ = true;
+    }
+}
+
 int
-myevent_base::mod_event(const int& fd, const uint32_t& what)
+myevent_base::mod_event(myevent_socket_t* mev, const uint32_t& what)
 {
-    //myassert( inMap(fd2mev_, fd));
+    const int fd = mev->get_fd();
+
+    if (edge_triggered_) {
+        /* registered for everything already: no syscall */
+        mev->interest_ = what;
+        if (mev->ready_ & what) {
+            make_ready(mev);
+        }
+        mylogDEBUG("modify interest. fd = %d, what = %X", fd, what);
+        return 0;
+    }
 
     if (! (what & (EPOLLIN | EPOLLOUT))) {
         if (log_) {
@@ -101,7 +440,7 @@ myevent_base::mod_event(const int& fd, const uint32_t& what)
     struct epoll_event ev;
     bzero(&ev, sizeof(ev));
     ev.events = what;
-    ev.data.fd = fd;
+    ev.data.ptr = mev;
 
     const int rv = epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev);
     if (rv) {
@@ -112,43 +451,94 @@ myevent_base::mod_event(const int& fd, const uint32_t& what)
         myassert(0);
     }
     mylogDEBUG("modify event. fd = %d, what = %X, result = %d",
-               ev.data.fd, ev.events, rv);
+               fd, ev.events, rv);
     return rv;
 }
 
 void
-myevent_base::del_event(const int& fd)
+myevent_base::del_event(myevent_socket_t* mev)
 {
-    /* we trip this assert at the end of simulations, so just hack for
-     * now and be lenient */
-    // myassert(inMap(fd2mev_, fd));
-    const int rv = epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL);
-    //if (inMap(fd2mev_, fd)) {
+    /* the socket may not be monitored (e.g., connect error), so be
+     * lenient about epoll_ctl failing */
+    const int rv = epoll_ctl(epfd_, EPOLL_CTL_DEL, mev->get_fd(), NULL);
 
-    /* std::map allows erase of non-existing key */
-    fd2mev_.erase(fd);
-    //}
+    if (mev->queued_) {
+        ready_.erase(std::find(ready_.begin(), ready_.end(), mev));
+        mev->queued_ = false;
+    }
+    if (handling_) {
+        deleted_.push_back(mev);
+    }
 }
 
 int
 myevent_base::add_event(myevent_socket_t* mev, const uint32_t& what)
 {
     const int fd = mev->get_fd();
-    myassert(! inMap(fd2mev_, fd));
-    fd2mev_[fd] = mev;
 
     myassert(what & (EPOLLIN | EPOLLOUT));
     
+    /* a new socket may live where a deleted one did */
+    std::vector<myevent_socket_t*>::iterator it =
+        std::find(deleted_.begin(), deleted_.end(), mev);
+    if (it != deleted_.end()) {
+        deleted_.erase(it);
+    }
+
     struct epoll_event ev = {0, 0};
     ev.events = what;
-    ev.data.fd = fd;
+    ev.data.ptr = mev;
+    if (edge_triggered_) {
+        /* the edges of both directions are always reported; the
+         * interest is only checked when dispatching
+         */
+        mev->interest_ = what;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    }
 
     const int rv = epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
     mylogDEBUG("add event. fd = %d, what = %X, result = %d",
-               ev.data.fd, ev.events, rv);
+               fd, ev.events, rv);
     return rv;
 }
 
+myevent_timer_t::myevent_timer_t(myevent_base *evbase, mev_timer_cb cb,
+                                 void *user_data)
+    : evbase_(evbase), cb_(cb), user_data_(user_data), expires_ms_(0)
+{
+    myassert(cb_);
+}
+
+myevent_timer_t::~myevent_timer_t()
+{
+    cancel();
+}
+
+void
+myevent_timer_t::start(const uint32_t delay_ms)
+{
+    cancel();
+    expires_ms_ = gettimeofdayMs(NULL) + delay_ms;
+    evbase_->add_timer(this);
+    ++evbase_->num_timers_;
+    if (!evbase_->handling_) {
+        /* while handling, the base re-arms when done */
+        evbase_->arm_timer();
+    }
+}
+
+void
+myevent_timer_t::cancel()
+{
+    if (!is_pending()) {
+        return;
+    }
+    prev_->next_ = next_;
+    next_->prev_ = prev_;
+    prev_ = next_ = NULL;
+    --evbase_->num_timers_;
+}
+
 myevent_socket_t::myevent_socket_t(
     myevent_base *evbase, const int fd, mev_data_cb readcb,
     mev_data_cb writecb, mev_event_cb eventcb,
@@ -156,6 +546,7 @@ myevent_socket_t::myevent_socket_t(
     : evbase_(evbase), fd_(fd), close_fd_(true)
     , readcb_(readcb), writecb_(writecb), eventcb_(eventcb)
     , user_data_(user_data), state_(MEV_STATE_INIT), log_(NULL)
+    , interest_(0), ready_(0), pending_(0), queued_(false)
 {
     myassert(fd_ >= 0);
     mylogDEBUG("new socket event: fd is %d", fd);
@@ -231,7 +622,7 @@ myevent_socket_t::~myevent_socket_t()
 {
     mylogDEBUG("begin destructor");
     mylogDEBUG("tell evbase_ to forget about me, fd %d", fd_);
-    evbase_->del_event(fd_);
+    evbase_->del_event(this);
     if (close_fd_) {
         mylogDEBUG("closing fd %d", fd_);
         if (fd_ != -1) {
@@ -243,6 +634,42 @@ myevent_socket_t::~myevent_socket_t()
     fd_ = -1;
 }
 
+ssize_t
+myevent_socket_t::socket_recv(void *buf, size_t len)
+{
+    const ssize_t rv = recv(fd_, buf, len, 0);
+    if (rv < (ssize_t)len) {
+        /* EWOULDBLOCK, or a short read: assume there is no more for
+         * now. on EOF or error, there is nothing more to read
+         * either
+         */
+        ready_ &= ~EPOLLIN;
+    }
+    return rv;
+}
+
+ssize_t
+myevent_socket_t::socket_send(const void *buf, size_t len)
+{
+    const ssize_t rv = send(fd_, buf, len, 0);
+    if (rv < (ssize_t)len) {
+        ready_ &= ~EPOLLOUT;
+    }
+    return rv;
+}
+
+uint32_t
+myevent_socket_t::wanted() const
+{
+    /* a callback must be there to consume the readiness, except
+     * that "connected" is a pollout that goes to the eventcb
+     */
+    uint32_t what = 0;
+    what |= readcb_ ? EPOLLIN : 0;
+    what |= (writecb_ || state_ == MEV_STATE_CONNECTING) ? EPOLLOUT : 0;
+    return what & interest_;
+}
+
 int
 myevent_socket_t::trigger(const short what)
 {
@@ -329,5 +756,5 @@ myevent_socket_t::setcb(mev_data_cb readcb, mev_data_cb writecb,
     if (writecb_) {
         myassert((what & EPOLLOUT));
     }
-    myassert(0 == evbase_->mod_event(fd_, what));
+    myassert(0 == evbase_->mod_event(this, what));
 }
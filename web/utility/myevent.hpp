@@ -7,11 +7,14 @@
  */
 
 #include <sys/epoll.h>
-#include <map>
+#include <sys/types.h>
+#include <deque>
+#include <vector>
 #include <shd-library.h>
 
 typedef void (*mev_data_cb)(int fd, void *user_data);
 typedef void (*mev_event_cb)(int fd, short what, void *user_data);
+typedef void (*mev_timer_cb)(void *user_data);
 
 
 class myevent_base;
@@ -63,7 +66,19 @@ public:
     void set_connected() { state_ = MEV_STATE_CONNECTED; }
     void set_logfn(ShadowLogFunc log) { log_ = log; }
 
+    /* read/write the socket. in edge-triggered mode (see
+     * myevent_base), the socket stays readable/writable until one of
+     * these does less than asked, so the users should do their I/O
+     * with these. if some other call (e.g., accept(2)) says
+     * EWOULDBLOCK, tell us with set_would_block(EPOLLIN and/or
+     * EPOLLOUT).
+     */
+    ssize_t socket_recv(void *buf, size_t len);
+    ssize_t socket_send(const void *buf, size_t len);
+    void set_would_block(const uint32_t what) { ready_ &= ~what; }
+
 private:
+    friend class myevent_base;
 
     typedef enum {
         MEV_STATE_INIT = 0,
@@ -82,6 +97,54 @@ private:
     void *user_data_;
     mev_state_t state_;
     ShadowLogFunc log_;
+
+    /* edge-triggered mode only */
+    uint32_t interest_; // EPOLLIN/EPOLLOUT the callbacks want
+    uint32_t ready_; // EPOLLIN/EPOLLOUT the socket can do without blocking
+    uint32_t pending_; // other events (error, hang up) not yet triggered
+    bool queued_; // in the base's ready list
+
+    uint32_t wanted() const;
+    /* connecting or connected: the states trigger() accepts */
+    bool is_active() const {
+        return state_ == MEV_STATE_CONNECTING || state_ == MEV_STATE_CONNECTED;
+    }
+};
+
+/* links a timer into a slot of the timer wheel; the slots are
+ * sentinels of circular lists.
+ */
+struct mev_timer_link_t
+{
+    mev_timer_link_t() : prev_(NULL), next_(NULL) {}
+    mev_timer_link_t *prev_;
+    mev_timer_link_t *next_;
+};
+
+/* a timer of a myevent_base. start() (or restart) and cancel() are
+ * O(1) and can be called any number of times, including from the
+ * timer's own callback. the callback runs from the base's event loop,
+ * i.e., loop_nonblock()/dispatch() or the base's shadow callback. so
+ * an object with timeouts can keep its timers as members, and it
+ * doesn't need to guard against stale timers: cancel them.
+ */
+class myevent_timer_t : private mev_timer_link_t
+{
+public:
+    myevent_timer_t(myevent_base *evbase, mev_timer_cb cb, void *user_data);
+    ~myevent_timer_t(); // cancels the timer
+
+    void start(const uint32_t delay_ms); // fire once, in delay_ms
+    void cancel();
+    bool is_pending() const { return next_ != NULL; }
+
+private:
+    friend class myevent_base;
+
+    myevent_base *evbase_;
+    mev_timer_cb cb_;
+    void *user_data_;
+    uint64_t expires_ms_;
 };
 
 class myevent_base
@@ -90,6 +153,19 @@ public:
     myevent_base(ShadowLogFunc log);
     ~myevent_base();
 
+    /* in edge-triggered mode, the sockets are registered once for
+     * both EPOLLIN and EPOLLOUT (with EPOLLET), and we remember which
+     * of them are readable/writable. enabling or disabling a callback
+     * (set_readcb(), etc.) then costs no epoll_ctl(), and the sockets
+     * that are ready are dispatched until they would block or their
+     * callbacks are disabled.
+     *
+     * must be set before any socket is added. off by default:
+     * shadow's epoll might not support edge-triggering.
+     */
+    void set_edge_triggered(const bool edge_triggered);
+    bool is_edge_triggered() const { return edge_triggered_; }
+
     /* the event base will not free the event. it's up to the user to
      * free the event. user should use del_event() to make the event
      * base no longer keeping track of the event.
@@ -97,16 +173,75 @@ public:
     int add_event(myevent_socket_t* mev, const uint32_t& what);
 
 
-    int mod_event(const int& fd, const uint32_t& what);
-    void del_event(const int& fd);
+    int mod_event(myevent_socket_t* mev, const uint32_t& what);
+    void del_event(myevent_socket_t* mev);
 
     int loop_nonblock();
     int dispatch();
     void set_logfn(ShadowLogFunc log) { log_ = log; }
 
+    /* inside shadow, the timers are driven by a single pending shadow
+     * callback, scheduled with this function. the plugin sets it
+     * (shadowlib's createCallback) at init, before creating any
+     * base. when it's NULL, e.g., in the standalone executables, the
+     * base arms a timerfd instead.
+     */
+    static ShadowCreateCallbackFunc shadow_create_callback;
+
 private:
+    friend class myevent_timer_t;
+
+    int handle_events(int timeout);
+    void handle_ready();
+    void make_ready(myevent_socket_t* mev);
+    bool is_deleted(myevent_socket_t* mev) const;
+
+    void add_timer(myevent_timer_t* timer);
+    void run_timers(const uint64_t now_ms);
+    uint64_t next_timer_expiry() const;
+    void arm_timer();
+    static void on_shadow_timer(void *ptr);
+
     int epfd_;
-    std::map<int, myevent_socket_t* > fd2mev_;
+    /* the epoll events carry the myevent_socket_t* (data.ptr), so
+     * dispatching an event needs no lookup. the sockets deleted by
+     * the callbacks while we handle a batch of events are remembered
+     * until the end of the batch, so that their pending events are
+     * dropped instead of triggering freed sockets.
+     */
+    bool handling_;
+    std::vector<myevent_socket_t*> deleted_;
+
+    /* edge-triggered mode: the sockets that have a ready event their
+     * callbacks want, in the order they became ready. when one
+     * becomes ready outside of handle_events() (e.g., a timer
+     * callback enables writing), we write to the wakeup pipe so that
+     * a blocked dispatch() returns.
+     */
+    bool edge_triggered_;
+    std::deque<myevent_socket_t*> ready_;
+    int wakefds_[2];
+    bool wakeup_pending_;
+
+    /* hierarchical timer wheel with 1 ms ticks: level L has 64 slots
+     * of 64^L ticks, so the 5 levels cover 2^30 ms (12 days; later
+     * timers wait in the last level). a timer is in the lowest level
+     * whose range reaches its expiry, and moves down a level
+     * ("cascades") when the lower level wraps around, so that adding
+     * and cancelling are O(1).
+     */
+    enum { MEV_TIMER_LEVELS = 5, MEV_TIMER_SLOT_BITS = 6,
+           MEV_TIMER_SLOTS = (1 << MEV_TIMER_SLOT_BITS) };
+    mev_timer_link_t timer_wheel_[MEV_TIMER_LEVELS][MEV_TIMER_SLOTS];
+    uint64_t timer_now_ms_; // next tick to process
+    uint32_t num_timers_;
+    int timerfd_; // outside shadow
+    /* expiry that the timerfd, or the earliest pending shadow
+     * callback, is armed for (0: none) */
+    uint64_t timer_armed_ms_;
+    /* the shadow callbacks carry this id instead of the base: they
+     * can't be cancelled, and may fire after the base is freed */
+    uint32_t id_;
     ShadowLogFunc log_;
 };
 
@@ -4,6 +4,8 @@
 #include <time.h>
 #include <shd-library.h>
 
+#include <boost/unordered_map.hpp>
+
 #include "request.hpp"
 #include "common.hpp"
 
@@ -38,6 +40,22 @@ extern ShadowLogFunc logfn;
 
 uint32_t Request::nextInstNum = 0;
 
+/* the ids of the hostnames seen by the process */
+static boost::unordered_map<string, uint32_t> host_ids;
+
+uint32_t
+Request::intern_host(const string& host)
+{
+    boost::unordered_map<string, uint32_t>::const_iterator it =
+        host_ids.find(host);
+    if (it == host_ids.end()) {
+        const uint32_t id = host_ids.size();
+        it = host_ids.insert(std::make_pair(host, id)).first;
+        logDEBUG("host [%s] is id %u", host.c_str(), id);
+    }
+    return it->second;
+}
+
 Request::Request(
     const string& path, const string& host, const uint16_t& port, const string& url,
     RequestAboutToSendCb req_about_to_send_cb,
@@ -46,6 +64,7 @@ Request::Request(
     )
     : instNum_(nextInstNum)
     , path_(path), host_(host), port_(port), url_(url)
+    , host_id_(intern_host(host))
     , req_about_to_send_cb_(req_about_to_send_cb)
     , rsp_meta_cb_(rsp_meta_cb), rsp_body_data_cb_(rsp_body_data_cb)
     , rsp_body_done_cb_(rsp_body_done_cb)
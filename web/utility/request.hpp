@@ -69,6 +69,10 @@ public:
     const std::string host_; /* for host header */
     const uint16_t port_;
     const std::string url_;
+    /* host_ interned: the same for all the Requests to a hostname,
+     * so that they can be told apart by server without hashing
+     * host_ again */
+    const uint32_t host_id_;
     /* the cnx handling this req. currently Request class is not doing
      * anything with this pointer; it's here only for convenience of
      * other code */
@@ -77,6 +81,8 @@ public:
 private:
     static uint32_t nextInstNum;
 
+    static uint32_t intern_host(const std::string& host);
+
     std::vector<std::pair<std::string, std::string> > headers_;
 
     RequestAboutToSendCb req_about_to_send_cb_;
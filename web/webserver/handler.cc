@@ -104,6 +104,86 @@ delete_handler(void* ptr)
     delete ((Handler*)ptr);
 }
 
+const char*
+content_type_of(const char *abspath)
+{
+    const char *dot = strrchr(abspath, '.');
+    if (!dot || dot == abspath) {
+        return "unknown";
+    }
+    ++dot;
+    if (!strcmp(dot, "html")) {
+        return "text/html";
+    }
+    return "unknown";
+}
+
+/* "/generated/<N>[.ext]" is not a file: it is N bytes made up while
+ * they are sent, like a dynamic page whose length the server does
+ * not know before it is done. http/1.1 sends them chunked.
+ */
+bool
+generated_length_of(const string& path, size_t *length)
+{
+    static const char prefix[] = "/generated/";
+    if (path.compare(0, sizeof prefix - 1, prefix)) {
+        return false;
+    }
+    const char *digits = path.c_str() + sizeof prefix - 1;
+    char *endptr = NULL;
+    const long len = strtol(digits, &endptr, 10);
+    if (endptr == digits || len <= 0) {
+        return false;
+    }
+    *length = len;
+    return true;
+}
+
+/* the bytes at [offset, offset + len) of a generated body: always the
+ * same, so that a range request resumes it */
+void
+fill_generated(uint8_t *buf, const size_t len, const size_t offset)
+{
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = 'a' + ((offset + i) % 26);
+    }
+}
+
+int
+h2_on_header_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                const uint8_t *name, size_t namelen,
+                const uint8_t *value, size_t valuelen,
+                uint8_t flags, void *user_data)
+{
+    Handler *h = (Handler*)(user_data);
+    return h->h2_on_header_cb(frame, name, namelen, value, valuelen);
+}
+
+int
+h2_on_frame_recv_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                    void *user_data)
+{
+    Handler *h = (Handler*)(user_data);
+    return h->h2_on_frame_recv_cb(frame);
+}
+
+int
+h2_on_stream_close_cb(nghttp2_session *session, int32_t stream_id,
+                      uint32_t error_code, void *user_data)
+{
+    Handler *h = (Handler*)(user_data);
+    return h->h2_on_stream_close_cb(stream_id, error_code);
+}
+
+ssize_t
+h2_read_file_cb(nghttp2_session *session, int32_t stream_id,
+                uint8_t *buf, size_t length, uint32_t *data_flags,
+                nghttp2_data_source *source, void *user_data)
+{
+    Handler *h = (Handler*)(user_data);
+    return h->h2_read_file_cb(stream_id, buf, length, data_flags, source);
+}
+
 } // namespace
 
 void
@@ -149,6 +229,18 @@ Handler::~Handler()
         active_fd_ = -1;
     }
 
+    std::map<int32_t, H2Stream>::iterator it = h2_streams_.begin();
+    for (; it != h2_streams_.end(); ++it) {
+        if (it->second.fd != -1) {
+            close(it->second.fd);
+        }
+    }
+    h2_streams_.clear();
+    if (h2sess_) {
+        nghttp2_session_del(h2sess_);
+        h2sess_ = NULL;
+    }
+
     if (cliSideSock_ev_) {
         cliSideSock_ev_->set_close_fd(false);
         delete cliSideSock_ev_;
@@ -216,7 +308,8 @@ read_more:
         if (len > n_to_add) {/* Don't write more than n_to_add bytes. */
             len = n_to_add;
         }
-        const ssize_t numread = recv(cliSideSock_, v[i].iov_base, len, 0);
+        const ssize_t numread = cliSideSock_ev_->socket_recv(
+            v[i].iov_base, len);
         if (numread == 0) {
             logself(DEBUG, "cnx is closed");
             /* since we only support GET requests, if the cnx has
@@ -292,6 +385,14 @@ Handler::process_inbuf_()
         goto done;
     }
 
+    if (protocol_ == PROTOCOL_UNKNOWN && !detect_protocol_()) {
+        want_more_data = true;
+        goto done;
+    }
+    if (protocol_ == PROTOCOL_HTTP2) {
+        return process_h2_inbuf_();
+    }
+
 extract_request:
     line = NULL;
     switch (http_req_state_) {
@@ -418,6 +519,11 @@ Handler::send_to_client()
 
     logself(DEBUG, "begin");
 
+    if (protocol_ == PROTOCOL_HTTP2) {
+        send_h2_to_client_();
+        return;
+    }
+
     /* set this when socket send/write() returns either EWOULDBLOCK or
      * an amount less than we asked it to.
      */
@@ -488,24 +594,30 @@ add_more:
                     abspath.c_str(), first_byte_pos);
 
             /* find out file size */
-            struct stat sb;
-            if (0 != stat(abspath.c_str(), &sb)) {
-                logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
-                      "cannot access file [%s], errno str [%s]",
-                      abspath.c_str(), strerror(errno));
-                myassert(0);
+            size_t full_len = 0;
+            rsp_chunked_ = generated_length_of(
+                submitted_req_queue_.front().path, &full_len);
+            if (!rsp_chunked_) {
+                struct stat sb;
+                if (0 != stat(abspath.c_str(), &sb)) {
+                    logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+                          "cannot access file [%s], errno str [%s]",
+                          abspath.c_str(), strerror(errno));
+                    myassert(0);
+                }
+                full_len = sb.st_size;
             }
 
-            myassert(sb.st_size > 0);
+            myassert(full_len > 0);
 
-            if (! (first_byte_pos < sb.st_size)) {
+            if (! (first_byte_pos < (ssize_t)full_len)) {
                 logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
                       "invalid first_byte_pos %d for %s; file size is %zu.",
-                      first_byte_pos, abspath.c_str(), sb.st_size);
+                      first_byte_pos, abspath.c_str(), full_len);
                 myassert(0);
             }
 
-            size_t content_length = sb.st_size;
+            size_t content_length = full_len;
             int last_byte_pos = -1;
             uint32_t resp_status = 200;
 
@@ -513,32 +625,32 @@ add_more:
                 resp_status = 206;
                 content_length -= first_byte_pos;
                 last_byte_pos = first_byte_pos + content_length - 1;
-                myassert(last_byte_pos == (sb.st_size - 1));
+                myassert(last_byte_pos == (full_len - 1));
                 myassert(last_byte_pos >= first_byte_pos);
             }
 
-            /* determine content type */
-            const char *content_type = NULL;
-            const char *abspath_cstr = abspath.c_str(); 
-            const char *dot = strrchr(abspath_cstr, '.');
-            if (!dot || dot == abspath_cstr) {
-                content_type = "unknown";
-            } else {
-                ++dot;
-                if (!strcmp(dot, "html")) {
-                    content_type = "text/html";
-                } else {
-                    content_type = "unknown";
-                }
-            }
+            const char *content_type = content_type_of(abspath.c_str());
 
-            logself(DEBUG, "content len [%zu], type [%s]",
-                    content_length, content_type);
+            logself(DEBUG, "content len [%zu], type [%s], chunked %d",
+                    content_length, content_type, rsp_chunked_);
 
-            int r = evbuffer_add_printf(
-                outbuf_,
-                "HTTP/1.1 %u OK\r\nContent-Length: %ld\r\nContent-Type: %s\r\n",
-                resp_status, content_length, content_type);
+            /* tell the client how deep it may pipeline: we don't read
+             * its extra requests until the queued ones are answered, so
+             * they would only wait in the socket */
+            int r = 0;
+            if (rsp_chunked_) {
+                r = evbuffer_add_printf(
+                    outbuf_,
+                    "HTTP/1.1 %u OK\r\nTransfer-Encoding: chunked\r\nContent-Type: %s\r\nmax-pipeline: %d\r\n",
+                    resp_status, content_type,
+                    MAX_PIPELINE_REQS);
+            } else {
+                r = evbuffer_add_printf(
+                    outbuf_,
+                    "HTTP/1.1 %u OK\r\nContent-Length: %ld\r\nContent-Type: %s\r\nmax-pipeline: %d\r\n",
+                    resp_status, content_length, content_type,
+                    MAX_PIPELINE_REQS);
+            }
             myassert(0 < r);
 #ifdef TEST_BYTE_RANGE
             numRespMetaBytes_ += r;
@@ -557,12 +669,12 @@ add_more:
                 r = evbuffer_add_printf(
                     outbuf_,
                     "Content-Range: bytes %d-%d/%zu\r\n",
-                    bad_first_byte_pos, last_byte_pos, sb.st_size);
+                    bad_first_byte_pos, last_byte_pos, full_len);
 #else
                 r = evbuffer_add_printf(
                     outbuf_,
                     "Content-Range: bytes %d-%d/%zu\r\n",
-                    first_byte_pos, last_byte_pos, sb.st_size);
+                    first_byte_pos, last_byte_pos, full_len);
 #endif
                 myassert(0 < r);
 
@@ -580,12 +692,14 @@ add_more:
             http_rsp_state_ = HTTP_RSP_STATE_BODY;
 
             myassert(-1 == active_fd_);
-            active_fd_ = open(abspath.c_str(), O_RDONLY);
-            myassert(-1 != active_fd_);
+            if (!rsp_chunked_) {
+                active_fd_ = open(abspath.c_str(), O_RDONLY);
+                myassert(-1 != active_fd_);
 
-            if (first_byte_pos > 0) {
-                myassert(
-                    first_byte_pos == lseek(active_fd_, first_byte_pos, SEEK_SET));
+                if (first_byte_pos > 0) {
+                    myassert(
+                        first_byte_pos == lseek(active_fd_, first_byte_pos, SEEK_SET));
+                }
             }
 
             numRespBodyBytesExpectedToSend_ = content_length;
@@ -602,49 +716,53 @@ add_more:
             static const size_t n_to_add = 4096 * ARRAY_LEN(v);
             bool done_with_current_file = false;
 
-            n = evbuffer_reserve_space(outbuf_, n_to_add, v, ARRAY_LEN(v));
-            myassert(n>0);
+            if (rsp_chunked_) {
+                done_with_current_file = add_generated_chunk_();
+            } else {
+                n = evbuffer_reserve_space(outbuf_, n_to_add, v, ARRAY_LEN(v));
+                myassert(n>0);
 
-            for (i=0; i<n && n_to_add > 0; ++i) {
-                size_t len = v[i].iov_len;
-                if (len > n_to_add) {/* Don't write more than n_to_add bytes. */
-                    len = n_to_add;
-                }
-                const int numread = read(active_fd_, v[i].iov_base, len);
-                if (numread == 0) {
-                    logself(DEBUG, "reached end-of-file");
-                    done_with_current_file = true;
-                    break;
-                } else if (numread == -1) {
-                    logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
-                          "error reading [%s]: \"%s\"",
-                          submitted_req_queue_.front().path.c_str(), strerror(errno));
-                    myassert(0);
-                } else {
-                    myassert(numread > 0);
-                    logself(DEBUG, "read %zd bytes", numread);
-                    numBodyBytesRead_ += numread;
-                    logself(DEBUG, "new numBodyBytesRead_ %zu",
-                            numBodyBytesRead_);
-                    ++num_to_commit;
-                    /* Set iov_len to the number of bytes we actually wrote,
-                       so we don't commit too much. */
-                    v[i].iov_len = numread;
-                    if (numread < len) {
-                        logself(DEBUG, "read less than wanted: done with file");
-                        myassert(numRespBodyBytesExpectedToSend_ == numBodyBytesRead_);
+                for (i=0; i<n && n_to_add > 0; ++i) {
+                    size_t len = v[i].iov_len;
+                    if (len > n_to_add) {/* Don't write more than n_to_add bytes. */
+                        len = n_to_add;
+                    }
+                    const int numread = read(active_fd_, v[i].iov_base, len);
+                    if (numread == 0) {
+                        logself(DEBUG, "reached end-of-file");
                         done_with_current_file = true;
                         break;
+                    } else if (numread == -1) {
+                        logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+                              "error reading [%s]: \"%s\"",
+                              submitted_req_queue_.front().path.c_str(), strerror(errno));
+                        myassert(0);
                     } else {
-                        myassert(len == numread);
+                        myassert(numread > 0);
+                        logself(DEBUG, "read %zd bytes", numread);
+                        numBodyBytesRead_ += numread;
+                        logself(DEBUG, "new numBodyBytesRead_ %zu",
+                                numBodyBytesRead_);
+                        ++num_to_commit;
+                        /* Set iov_len to the number of bytes we actually wrote,
+                           so we don't commit too much. */
+                        v[i].iov_len = numread;
+                        if (numread < len) {
+                            logself(DEBUG, "read less than wanted: done with file");
+                            myassert(numRespBodyBytesExpectedToSend_ == numBodyBytesRead_);
+                            done_with_current_file = true;
+                            break;
+                        } else {
+                            myassert(len == numread);
+                        }
                     }
                 }
-            }
 
-            if (num_to_commit) {
-                /* We commit the space here. */
-                if (evbuffer_commit_space(outbuf_, v, num_to_commit) < 0) {
-                    myassert(0);
+                if (num_to_commit) {
+                    /* We commit the space here. */
+                    if (evbuffer_commit_space(outbuf_, v, num_to_commit) < 0) {
+                        myassert(0);
+                    }
                 }
             }
             logself(DEBUG, "num bytes available in outbuf: %d",
@@ -653,8 +771,11 @@ add_more:
             if (done_with_current_file) {
                 logself(DEBUG, "done processing req for [%s]",
                         submitted_req_queue_.front().path.c_str());
-                close(active_fd_);
-                active_fd_ = -1;
+                if (active_fd_ != -1) {
+                    close(active_fd_);
+                    active_fd_ = -1;
+                }
+                rsp_chunked_ = false;
                 numRespBytesSent_ = numBodyBytesRead_ = numRespBodyBytesExpectedToSend_ = 0;
 #ifdef TEST_BYTE_RANGE
                 numRespMetaBytes_ = 0;
@@ -690,8 +811,8 @@ send_more:
         const int n = evbuffer_peek(outbuf_, -1, NULL, v, ARRAY_LEN(v));
 
         for (int i = 0; i < n; ++i) {
-            const int numwritten = write(
-                cliSideSock_, (const uint8_t *)v[i].iov_base, v[i].iov_len);
+            const int numwritten = cliSideSock_ev_->socket_send(
+                (const uint8_t *)v[i].iov_base, v[i].iov_len);
             if (numwritten == -1) {
                 if (errno == EWOULDBLOCK) {
                     send_would_block = true;
@@ -750,6 +871,47 @@ done:
 #undef READ_HIGH_WATER_MARK
 }
 
+bool
+Handler::add_generated_chunk_()
+{
+    /* one chunk per call, of what we'd otherwise read from a file at
+     * once. returns true once the last chunk is in outbuf_ */
+    static const size_t max_chunk_len = 4096 * 2;
+    const size_t len = std::min(
+        max_chunk_len,
+        numRespBodyBytesExpectedToSend_ - numBodyBytesRead_);
+    const int& first_byte_pos = submitted_req_queue_.front().first_byte_pos;
+    const size_t offset =
+        ((first_byte_pos > 0) ? first_byte_pos : 0) + numBodyBytesRead_;
+
+    if (len > 0) {
+        myassert(0 < evbuffer_add_printf(outbuf_, "%zx\r\n", len));
+        struct evbuffer_iovec v[2];
+        const int n = evbuffer_reserve_space(outbuf_, len, v, ARRAY_LEN(v));
+        myassert(n > 0);
+        size_t filled = 0;
+        int i = 0;
+        for (; i < n && filled < len; ++i) {
+            v[i].iov_len = std::min(v[i].iov_len, len - filled);
+            fill_generated((uint8_t *)v[i].iov_base, v[i].iov_len,
+                           offset + filled);
+            filled += v[i].iov_len;
+        }
+        myassert(filled == len);
+        myassert(0 == evbuffer_commit_space(outbuf_, v, i));
+        myassert(0 == evbuffer_add(outbuf_, "\r\n", 2));
+        numBodyBytesRead_ += len;
+        logself(DEBUG, "added a chunk of %zu bytes", len);
+    }
+
+    if (numBodyBytesRead_ < numRespBodyBytesExpectedToSend_) {
+        return false;
+    }
+    /* the last chunk, and no trailer */
+    myassert(0 == evbuffer_add(outbuf_, "0\r\n\r\n", 5));
+    return true;
+}
+
 void
 Handler::deleteLater()
 {
@@ -779,7 +941,8 @@ Handler::Handler(myevent_base* evbase, const string& docroot,
     , inbuf_(NULL), outbuf_(NULL)
     , http_req_state_(HTTP_REQ_STATE_REQ_LINE)
     , http_rsp_state_(HTTP_RSP_STATE_META)
-    , active_fd_(-1)
+    , active_fd_(-1), rsp_chunked_(false)
+    , protocol_(PROTOCOL_UNKNOWN), h2sess_(NULL)
     , peer_port_(0)
     , numRespBodyBytesExpectedToSend_(0), numBodyBytesRead_(0), numRespBytesSent_(0)
 #ifdef TEST_BYTE_RANGE
@@ -812,3 +975,319 @@ Handler::Handler(myevent_base* evbase, const string& docroot,
 
     logself(DEBUG, "done");
 }
+
+bool
+Handler::detect_protocol_()
+{
+    /* compare what we have so far with the preface */
+    const size_t len = std::min(evbuffer_get_length(inbuf_),
+                                (size_t)NGHTTP2_CLIENT_MAGIC_LEN);
+    const unsigned char *data = evbuffer_pullup(inbuf_, len);
+    myassert(data);
+    if (memcmp(data, NGHTTP2_CLIENT_MAGIC, len)) {
+        logself(DEBUG, "http/1.1 client");
+        protocol_ = PROTOCOL_HTTP1;
+        return true;
+    }
+    if (len < NGHTTP2_CLIENT_MAGIC_LEN) {
+        return false;
+    }
+    logself(DEBUG, "http/2 client");
+    protocol_ = PROTOCOL_HTTP2;
+    set_up_h2_session_();
+    return true;
+}
+
+void
+Handler::set_up_h2_session_()
+{
+    nghttp2_session_callbacks *callbacks = NULL;
+    myassert(0 == nghttp2_session_callbacks_new(&callbacks));
+    nghttp2_session_callbacks_set_on_header_callback(
+        callbacks, ::h2_on_header_cb);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(
+        callbacks, ::h2_on_frame_recv_cb);
+    nghttp2_session_callbacks_set_on_stream_close_callback(
+        callbacks, ::h2_on_stream_close_cb);
+
+    /* the preface is still in inbuf_: the session checks it */
+    const int r = nghttp2_session_server_new(&h2sess_, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+    myassert(0 == r);
+
+    nghttp2_settings_entry entry[1];
+    entry[0].settings_id = NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    entry[0].value = 100;
+    myassert(0 == nghttp2_submit_settings(
+                 h2sess_, NGHTTP2_FLAG_NONE, entry, ARRAY_LEN(entry)));
+    enable_write_to_client_();
+}
+
+bool
+Handler::process_h2_inbuf_()
+{
+    /* the session copies what it needs, so hand it inbuf_'s chunks
+     * as they are */
+    struct evbuffer_iovec v[8];
+    while (evbuffer_get_length(inbuf_) > 0) {
+        const int n = evbuffer_peek(inbuf_, -1, NULL, v, ARRAY_LEN(v));
+        size_t numconsumed = 0;
+        for (int i = 0; i < n && i < (int)ARRAY_LEN(v); ++i) {
+            const ssize_t rv = nghttp2_session_mem_recv(
+                h2sess_, (const uint8_t *)v[i].iov_base, v[i].iov_len);
+            if (rv < 0) {
+                logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+                      "nghttp2_session_mem_recv() returned \"%s\"",
+                      nghttp2_strerror(rv));
+                on_client_sock_error();
+                return false;
+            }
+            myassert((size_t)rv == v[i].iov_len);
+            numconsumed += rv;
+        }
+        myassert(0 == evbuffer_drain(inbuf_, numconsumed));
+    }
+
+    /* responses, SETTINGS acks, WINDOW_UPDATEs, ... */
+    if (nghttp2_session_want_write(h2sess_)) {
+        enable_write_to_client_();
+    }
+    enable_read_from_client_();
+    return true;
+}
+
+void
+Handler::send_h2_to_client_()
+{
+#define H2_HIGH_WATER_MARK (64*1024)
+    logself(DEBUG, "begin");
+    bool send_would_block = false;
+
+    while (!send_would_block) {
+        /* serialize frames (reading the files for DATA frames) until
+         * we have enough to send */
+        while (evbuffer_get_length(outbuf_) < H2_HIGH_WATER_MARK) {
+            const uint8_t *data = NULL;
+            const ssize_t len = nghttp2_session_mem_send(h2sess_, &data);
+            if (len < 0) {
+                logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+                      "nghttp2_session_mem_send() returned \"%s\"",
+                      nghttp2_strerror(len));
+                on_client_sock_error();
+                return;
+            } else if (len == 0) {
+                break;
+            }
+            myassert(0 == evbuffer_add(outbuf_, data, len));
+        }
+        if (evbuffer_get_length(outbuf_) == 0) {
+            break;
+        }
+
+        struct evbuffer_iovec v[2];
+        int numdrained = 0;
+        const int n = evbuffer_peek(outbuf_, -1, NULL, v, ARRAY_LEN(v));
+        for (int i = 0; i < n && i < (int)ARRAY_LEN(v); ++i) {
+            const ssize_t numwritten = cliSideSock_ev_->socket_send(
+                (const uint8_t *)v[i].iov_base, v[i].iov_len);
+            if (numwritten == -1) {
+                if (errno != EWOULDBLOCK) {
+                    logfn(SHADOW_LOG_LEVEL_WARNING, __func__,
+                          "send() returned \"%s\"", strerror(errno));
+                    on_client_sock_error();
+                    return;
+                }
+                send_would_block = true;
+                break;
+            }
+            logself(DEBUG, "able to write %zd bytes", numwritten);
+            numdrained += numwritten;
+            if ((size_t)numwritten != v[i].iov_len) {
+                send_would_block = true;
+                break;
+            }
+        }
+        myassert(0 == evbuffer_drain(outbuf_, numdrained));
+    }
+
+    if (evbuffer_get_length(outbuf_) == 0
+        && !nghttp2_session_want_write(h2sess_))
+    {
+        /* nothing to send until the client sends something, e.g., a
+         * request or a WINDOW_UPDATE */
+        disable_write_to_client_();
+        if (!nghttp2_session_want_read(h2sess_)) {
+            logself(DEBUG, "session is over");
+            on_client_sock_eof();
+        }
+    }
+    logself(DEBUG, "done");
+#undef H2_HIGH_WATER_MARK
+}
+
+int
+Handler::h2_on_header_cb(const nghttp2_frame *frame,
+                         const uint8_t *name, size_t namelen,
+                         const uint8_t *value, size_t valuelen)
+{
+    if (frame->hd.type != NGHTTP2_HEADERS
+        || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+    {
+        return 0;
+    }
+    H2Stream& stream = h2_streams_[frame->hd.stream_id];
+    const string hdrname((const char*)name, namelen);
+    const string hdrvalue((const char*)value, valuelen);
+    if (hdrname == ":path") {
+        stream.path = hdrvalue;
+    } else if (hdrname == "range") {
+        int first_byte_pos = -1;
+        int last_byte_pos = -1;
+        myassert(-1 != parseRange(hdrvalue.c_str(), 0,
+                                  &first_byte_pos, &last_byte_pos));
+        myassert(last_byte_pos == -1); // not yet supporting last_byte_pos
+        myassert(first_byte_pos >= 0);
+        stream.first_byte_pos = first_byte_pos;
+    }
+    return 0;
+}
+
+int
+Handler::h2_on_frame_recv_cb(const nghttp2_frame *frame)
+{
+    /* we only serve GETs, so a request is complete with its HEADERS
+     * frame */
+    if ((frame->hd.type == NGHTTP2_HEADERS
+         || frame->hd.type == NGHTTP2_DATA)
+        && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+        && inMap(h2_streams_, frame->hd.stream_id))
+    {
+        h2_submit_response_(frame->hd.stream_id);
+    }
+    return 0;
+}
+
+int
+Handler::h2_on_stream_close_cb(int32_t stream_id, uint32_t error_code)
+{
+    logself(DEBUG, "stream %d closed, error code %u", stream_id, error_code);
+    std::map<int32_t, H2Stream>::iterator it = h2_streams_.find(stream_id);
+    if (it != h2_streams_.end()) {
+        if (it->second.fd != -1) {
+            close(it->second.fd);
+        }
+        h2_streams_.erase(it);
+    }
+    return 0;
+}
+
+void
+Handler::h2_submit_response_(const int32_t& sid)
+{
+    H2Stream& stream = h2_streams_[sid];
+    const string abspath = docroot_ + stream.path;
+    const int& first_byte_pos = stream.first_byte_pos;
+    logself(DEBUG, "sid %d abs path: [%s], first_byte_pos %d",
+            sid, abspath.c_str(), first_byte_pos);
+
+    size_t full_len = 0;
+    const bool generated = generated_length_of(stream.path, &full_len);
+    if (!generated) {
+        struct stat sb;
+        if (0 != stat(abspath.c_str(), &sb)) {
+            logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+                  "cannot access file [%s], errno str [%s]",
+                  abspath.c_str(), strerror(errno));
+            myassert(0);
+        }
+        full_len = sb.st_size;
+    }
+    myassert(full_len > 0);
+    if (! (first_byte_pos < (ssize_t)full_len)) {
+        logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+              "invalid first_byte_pos %d for %s; file size is %zu.",
+              first_byte_pos, abspath.c_str(), full_len);
+        myassert(0);
+    }
+
+    size_t content_length = full_len;
+    const char *status = "200";
+    string content_range;
+    if (first_byte_pos >= 0) {
+        status = "206";
+        content_length -= first_byte_pos;
+        char buf[64];
+        snprintf(buf, sizeof buf, "bytes %d-%zu/%zu", first_byte_pos,
+                 full_len - 1, full_len);
+        content_range = buf;
+    }
+    const string content_length_str = lexical_cast<string>(content_length);
+    const char *content_type = content_type_of(abspath.c_str());
+
+    if (generated) {
+        /* streamed: END_STREAM, not content-length, ends the body */
+        stream.offset = (first_byte_pos > 0) ? first_byte_pos : 0;
+    } else {
+        stream.fd = open(abspath.c_str(), O_RDONLY);
+        myassert(-1 != stream.fd);
+        if (first_byte_pos > 0) {
+            myassert(first_byte_pos == lseek(stream.fd, first_byte_pos, SEEK_SET));
+        }
+    }
+    stream.remaining = content_length;
+
+    nghttp2_nv nva[4];
+    size_t nvlen = 0;
+#define H2_SET_NV(n, v, vlen)                                           \
+    do {                                                                \
+        nghttp2_nv nv = {(uint8_t*)(n), (uint8_t*)(v), strlen(n), (vlen), \
+                         NGHTTP2_NV_FLAG_NONE};                         \
+        nva[nvlen++] = nv;                                              \
+    } while (0)
+    H2_SET_NV(":status", status, 3);
+    if (!generated) {
+        H2_SET_NV("content-length", content_length_str.c_str(),
+                  content_length_str.size());
+    }
+    H2_SET_NV("content-type", content_type, strlen(content_type));
+    if (!content_range.empty()) {
+        H2_SET_NV("content-range", content_range.c_str(),
+                  content_range.size());
+    }
+#undef H2_SET_NV
+
+    nghttp2_data_provider data_prd;
+    data_prd.source.fd = stream.fd;
+    data_prd.read_callback = ::h2_read_file_cb;
+    myassert(0 == nghttp2_submit_response(h2sess_, sid, nva, nvlen,
+                                          &data_prd));
+    enable_write_to_client_();
+}
+
+ssize_t
+Handler::h2_read_file_cb(int32_t stream_id, uint8_t *buf, size_t length,
+                         uint32_t *data_flags, nghttp2_data_source *source)
+{
+    H2Stream& stream = h2_streams_[stream_id];
+    const size_t len = std::min(length, stream.remaining);
+    ssize_t numread = len;
+    if (source->fd == -1) {
+        fill_generated(buf, len, stream.offset);
+        stream.offset += len;
+    } else {
+        numread = read(source->fd, buf, len);
+    }
+    if (numread < 0 || (numread == 0 && len > 0)) {
+        logfn(SHADOW_LOG_LEVEL_ERROR, __func__,
+              "error reading [%s]: \"%s\"", stream.path.c_str(),
+              strerror(errno));
+        /* resets the stream */
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+    stream.remaining -= numread;
+    if (stream.remaining == 0) {
+        logself(DEBUG, "done reading [%s]", stream.path.c_str());
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return numread;
+}
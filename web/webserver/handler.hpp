@@ -20,6 +20,8 @@
 
 #include "myevent.hpp"
 
+#include <nghttp2/nghttp2.h>
+
 #include <map>
 #include <list>
 #include <string>
@@ -38,6 +40,16 @@ public:
     void on_client_sock_eof();
     void on_client_sock_error();
 
+    /* http/2 session callbacks */
+    int h2_on_header_cb(const nghttp2_frame *frame,
+                        const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen);
+    int h2_on_frame_recv_cb(const nghttp2_frame *frame);
+    int h2_on_stream_close_cb(int32_t stream_id, uint32_t error_code);
+    ssize_t h2_read_file_cb(int32_t stream_id, uint8_t *buf, size_t length,
+                            uint32_t *data_flags,
+                            nghttp2_data_source *source);
+
     const uint32_t instNum_; // monotonic id of this handler
 
 private:
@@ -87,6 +99,11 @@ private:
     std::queue<RequestInfo> submitted_req_queue_;
     int active_fd_; /* of the file requested, actively being served,
                      * or -1 */
+    bool rsp_chunked_; /* the active response is generated, and sent
+                        * chunked */
+    /* adds the next chunk of the active generated response to
+     * outbuf_; true once the whole body is in */
+    bool add_generated_chunk_();
 
     /* use a flag to avoid unnecessarily -- though not affecting
      * correctness -- calling the event's methods()
@@ -106,6 +123,37 @@ private:
      */
     bool process_inbuf_();
 
+    /* a client that starts with the http/2 connection preface gets
+     * an http/2 session (prior knowledge, no upgrade); any other one
+     * is served http/1.1.
+     */
+    enum {
+        PROTOCOL_UNKNOWN,
+        PROTOCOL_HTTP1,
+        PROTOCOL_HTTP2,
+    };
+    int protocol_;
+    /* returns false if more bytes are needed to tell */
+    bool detect_protocol_();
+
+    nghttp2_session* h2sess_;
+    class H2Stream
+    {
+    public:
+        H2Stream() : first_byte_pos(-1), fd(-1), remaining(0), offset(0) {}
+
+        std::string path;
+        int first_byte_pos; /* -1 means no range header */
+        int fd; /* of the file being served, or -1 if generated */
+        size_t remaining; /* body bytes not yet read from fd */
+        size_t offset; /* if generated, of the next body byte */
+    };
+    std::map<int32_t, H2Stream> h2_streams_;
+    void set_up_h2_session_();
+    bool process_h2_inbuf_();
+    void send_h2_to_client_();
+    void h2_submit_response_(const int32_t& sid);
+
     uint16_t peer_port_;
 
     /* for debugging / asserting, for the current active response */
@@ -40,6 +40,8 @@ extern "C" void __shadow_plugin_init__(ShadowFunctionTable* shadowlibFuncs) {
     /* save the shadow functions we will use since it will be the same for all nodes */
     logfn = shadowlibFuncs->log;
     scheduleCallback = shadowlibFuncs->createCallback;
+    /* the event bases' timers fire from a shadow callback */
+    myevent_base::shadow_create_callback = shadowlibFuncs->createCallback;
 
     /*
      * tell shadow which of our functions it can use to notify our plugin,
@@ -79,6 +79,9 @@ webserver_t::on_readable()
 	gint sockd = accept(listenfd_, NULL, NULL);
 	if(sockd < 0) {
 		myassert(errno == EWOULDBLOCK);
+        /* in edge-triggered mode we get called until the backlog
+         * is empty */
+        listenev_->set_would_block(EPOLLIN);
 	} else {
         /* instantiate and forget: handler will know to delete
          * itself */
@@ -139,7 +142,7 @@ webserver_t::start(int argc, char *argv[])
     }
 #endif
 
-    myassert(argc == 2 || argc == 3);
+    myassert(argc >= 2 && argc <= 4);
 
     char *expandedpath = expandPath(argv[1]);
 
@@ -151,10 +154,16 @@ webserver_t::start(int argc, char *argv[])
 
     logself(DEBUG, "docroot [%s]", docroot_.c_str());
 
-    if (argc == 3) {
+    if (argc >= 3) {
         listenport = strtol(argv[2], NULL, 10);
     }
 
+    bool edge_triggered = false;
+    if (argc == 4) {
+        myassert(!strcmp(argv[3], "edge-triggered"));
+        edge_triggered = true;
+    }
+
     // it seems the log statement will be reported by valgrind as
     // "possibly lost"
     logself(DEBUG, "listen port [%d]", listenport);
@@ -185,6 +194,7 @@ webserver_t::start(int argc, char *argv[])
 
     evbase_ = new myevent_base(logfn);
     myassert(evbase_);
+    evbase_->set_edge_triggered(edge_triggered);
 
     /* new cnx is notified as readable event */
     listenev_ = new myevent_socket_t(